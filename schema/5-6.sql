@@ -0,0 +1,13 @@
+-- Migration from version 5 - 6 of classifier database.
+--
+-- Adds entries.num_tokens, the number of distinct tokens an entry has, so
+-- items with too few tokens can be skipped when loading the item cache
+-- without reading their token blobs. Existing entries are left with a null
+-- count, the classifier fills them in from token.entry_tokens in the background.
+begin;
+
+ALTER TABLE entries ADD COLUMN num_tokens integer;
+
+PRAGMA user_version = 6;
+
+commit;
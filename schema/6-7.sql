@@ -0,0 +1,13 @@
+-- Migration from version 6 - 7 of classifier database.
+--
+-- Adds entries.content_hash, a hash of the entry's atom XML, so an entry that
+-- is posted again unchanged can be recognized without rewriting its atom or
+-- tokenizing it again. Existing entries are left with a null hash and are
+-- written as usual the next time they are posted.
+begin;
+
+ALTER TABLE entries ADD COLUMN content_hash integer;
+
+PRAGMA user_version = 7;
+
+commit;
@@ -20,142 +20,263 @@
 
 // contact@winnowtag.org
 
+/* Compares the memory use and token iteration speed of items loaded into
+ * the packed item arena with the same items stored one Judy array per item,
+ * then times selecting and combining clues for each item.
+ *
+ * Usage: cls_bench <item_cache> [days] [passes]
+ */
+
+#include <config.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
-#include <pthread.h>
+#include <Judy.h>
 #include "item_cache.h"
-#include "tag.h"
 #include "classifier.h"
+#include "clue.h"
+#include "misc.h"
+
+typedef struct ITEM_LIST {
+  const Item **items;
+  int size;
+  int capacity;
+} ItemList;
 
-void *do_classification(void *nothing);
-Pool *random_background;
-TagList *tags;
-int num_tags;
-int current_tag;
-int threads_that_did_work = 0;
-double training = 0;
-double precomputing = 0;
-double classification = 0;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-
-double now() {
+static double now() {
   struct timeval t;
   gettimeofday(&t, NULL);
   return t.tv_sec + (t.tv_usec / 1000000.0);
 }
 
+static int collect_item(const Item *item, void *memo) {
+  ItemList *list = (ItemList*) memo;
+
+  if (list->size == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 1024;
+    list->items = realloc(list->items, list->capacity * sizeof(Item*));
+    if (!list->items) {
+      fprintf(stderr, "Could not allocate item list\n");
+      return CLASSIFIER_FAIL;
+    }
+  }
+
+  list->items[list->size++] = item;
+  return CLASSIFIER_OK;
+}
+
+/* Copies a loaded item into a standalone, Judy backed, item. */
+static Item * copy_item(const Item *item, Word_t *judy_bytes) {
+  int token_id = 0;
+  int position = 0;
+  short frequency = 0;
+  Pvoid_t judy = NULL;
+  PWord_t value;
+  Word_t bytes;
+  Item *copy = create_item(item_get_id(item), -1, item_get_time(item));
+
+  while (item_next_token_from(item, &position, &token_id, &frequency)) {
+    item_add_token(copy, token_id, frequency);
+    /* Build an identical array here since the copy's is private to the item cache. */
+    JLI(value, judy, token_id);
+    *value = frequency;
+  }
+
+  JLMU(bytes, judy);
+  *judy_bytes += bytes;
+  JLFA(bytes, judy);
+
+  return copy;
+}
+
+/* Walks every token of every item, returning a checksum so the loop isn't optimized away. */
+static long iterate_tokens(const Item **items, int size, int passes) {
+  long checksum = 0;
+  int i, pass;
+
+  for (pass = 0; pass < passes; pass++) {
+    for (i = 0; i < size; i++) {
+      int token_id = 0;
+      int position = 0;
+      short frequency = 0;
+
+      while (item_next_token_from(items[i], &position, &token_id, &frequency)) {
+        checksum += frequency;
+      }
+    }
+  }
+
+  return checksum;
+}
+
+/* Looks up the frequency of every token in each item. */
+static long lookup_tokens(const Item **items, int size, int passes) {
+  long checksum = 0;
+  int i, pass;
+
+  for (pass = 0; pass < passes; pass++) {
+    for (i = 0; i < size; i++) {
+      int token_id = 0;
+      int position = 0;
+      short frequency = 0;
+
+      while (item_next_token_from(items[i], &position, &token_id, &frequency)) {
+        checksum += item_get_token_frequency(items[i], token_id);
+      }
+    }
+  }
+
+  return checksum;
+}
+
+/* Builds a frozen clue list with a pseudo-random probability for every token in the items. */
+static ClueList * random_clues(const Item **items, int size) {
+  ClueList *clues = new_clue_list();
+  int i;
+
+  srand(1);
+  for (i = 0; i < size; i++) {
+    int token_id = 0;
+    int position = 0;
+    short frequency = 0;
+
+    while (item_next_token_from(items[i], &position, &token_id, &frequency)) {
+      if (NULL == get_clue(clues, token_id)) {
+        add_clue(clues, token_id, (1 + rand() % 999) / 1000.0);
+      }
+    }
+  }
+
+  freeze_clue_list(clues);
+  return clues;
+}
+
+/* Selects every item's clues sorted by strength, as select_clues returns them. */
+static double sort_clues(const ClueList *clues, const Item **items, int size, int passes) {
+  double checksum = 0.0;
+  int i, pass, num_clues;
+
+  for (pass = 0; pass < passes; pass++) {
+    for (i = 0; i < size; i++) {
+      const Clue **selected_clues = select_clues(clues, items[i], &num_clues);
+      if (num_clues > 0) {
+        checksum += clue_probability(selected_clues[num_clues - 1]);
+      }
+      free(selected_clues);
+    }
+  }
+
+  return checksum;
+}
+
+/* Classifies every item, which only selects the strongest clues without sorting them. */
+static double classify_items(const ClueList *clues, const Item **items, int size, int passes) {
+  double checksum = 0.0;
+  int i, pass;
+
+  for (pass = 0; pass < passes; pass++) {
+    for (i = 0; i < size; i++) {
+      checksum += naive_bayes_classify(clues, items[i]);
+    }
+  }
+
+  return checksum;
+}
+
 int main(int argc, char ** argv) {
-//  int i;
-//  int num_threads = 1;
-//  if (argc == 2) {
-//    int new_num_threads;
-//    if (1 == sscanf(argv[1], "%d", &new_num_threads)) {
-//      printf("Using %d threads\n", new_num_threads);
-//      num_threads = new_num_threads;
-//    }
-//  }
-//  
-//  is = create_file_item_source("corpus");
-//  random_background = create_random_background_from_file(is, "corpus/random_background.txt");
-//  printf("About to load samples - this could take a while.\n");
-//  samples = load_samples(is, "corpus/samples.txt");
-//  const int sample_size = sample_size(samples);
-//  printf("Finished loading %d samples.\n", sample_size);
-// 
-//  tags = load_tags_from_file("corpus", "jedharris");
-//  num_tags = tags->size;
-//  current_tag = 1;
-//  printf("Loaded %d tags\n", num_tags);
-// 
-//  double start = now();
-//  pthread_t threads[num_threads];
-//  for (i = 0; i < num_threads; i++) {
-//    pthread_create(&threads[i], NULL, do_classification, NULL);
-//  }
-//  
-//  for (i = 0; i < num_threads; i++) {
-//    pthread_join(threads[i], NULL);
-//  }
-//  double end = now();
-//  
-//  printf("Total (includes thread creation and memory management):\n");
-//  printf("                %.2f s, %7.0f classifications / second\n",
-//        end - start,  (sample_size * num_tags) / (end - start));
-//  
-//  training = training / threads_that_did_work;
-//  precomputing = precomputing / threads_that_did_work;
-//  classification = classification / threads_that_did_work;    
-//  
-//  printf("Training:       %.2f s, %7.1f    tags trained / second\n", 
-//    training, (float)num_tags / (training));
-//  printf("Precomputing:   %.2f s, %7.1f precomputations / second\n",
-//    precomputing, (float)num_tags / (precomputing));
-//  printf("Classification: %.2f s, %7.0f classifications / second\n", 
-//    classification, 
-//    ((float)sample_size * num_tags) / (classification));
-//  
-//  free_taglist(tags);
-//  free_pool(random_background);
-//  Item **items = sample_items(samples);
-//  
-//  for (i = 0; i < sample_size; i++) {
-//    free_item(items[i]);
-//  }
-//  free_samples(samples);
-//  free_item_source(is);
-
-  return 0;
+  ItemCacheOptions options = {60, 30, 0};
+  ItemCache *item_cache;
+  ItemList packed = {NULL, 0, 0};
+  int passes = 10;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: cls_bench <item_cache> [days] [passes]\n");
+    return EXIT_FAILURE;
+  }
+
+  if (argc > 2) options.load_items_since = atoi(argv[2]);
+  if (argc > 3) passes = atoi(argv[3]);
+
+  if (CLASSIFIER_OK != item_cache_create(&item_cache, argv[1], &options)) {
+    fprintf(stderr, "Error opening item cache at %s: %s\n", argv[1], item_cache_errmsg(item_cache));
+    return EXIT_FAILURE;
+  }
+
+  double start = now();
+  item_cache_load(item_cache);
+  printf("Loaded %i items in %.3fs\n", item_cache_cached_size(item_cache), now() - start);
+
+  item_cache_each_item(item_cache, collect_item, &packed);
+
+  long num_tokens = 0;
+  long id_bytes = 0;
+  Word_t judy_bytes = 0;
+  const Item **judy = malloc(packed.size * sizeof(Item*));
+
+  if (packed.size && !judy) {
+    fprintf(stderr, "Could not allocate item list\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < packed.size; i++) {
+    num_tokens += item_get_num_tokens(packed.items[i]);
+    id_bytes += strlen((char*) item_get_id(packed.items[i])) + 1;
+    judy[i] = copy_item(packed.items[i], &judy_bytes);
+  }
+
+  printf("\n%i items, %li distinct item tokens, %li bytes of ids\n", packed.size, num_tokens, id_bytes);
+  printf("Token storage:\n");
+  printf("  packed: %12li bytes (%.2f bytes/token)\n", num_tokens * 6, num_tokens ? 6.0 : 0.0);
+  printf("  judy:   %12lu bytes (%.2f bytes/token) + %i item mallocs and id strdups\n",
+         (unsigned long) judy_bytes, num_tokens ? (double) judy_bytes / num_tokens : 0.0, packed.size);
+
+  printf("\nToken iteration over %i passes:\n", passes);
+  start = now();
+  long packed_sum = iterate_tokens(packed.items, packed.size, passes);
+  double packed_time = now() - start;
+  start = now();
+  long judy_sum = iterate_tokens(judy, packed.size, passes);
+  double judy_time = now() - start;
+  printf("  packed: %.3fs\n  judy:   %.3fs\n", packed_time, judy_time);
+
+  printf("\nToken frequency lookup over %i passes:\n", passes);
+  start = now();
+  packed_sum += lookup_tokens(packed.items, packed.size, passes);
+  packed_time = now() - start;
+  start = now();
+  judy_sum += lookup_tokens(judy, packed.size, passes);
+  judy_time = now() - start;
+  printf("  packed: %.3fs\n  judy:   %.3fs\n", packed_time, judy_time);
+
+  if (packed_sum != judy_sum) {
+    fprintf(stderr, "\nChecksums differ: packed = %li, judy = %li\n", packed_sum, judy_sum);
+  }
+
+  ClueList *clues = random_clues(packed.items, packed.size);
+  long calls = (long) packed.size * passes;
+
+  printf("\nClue selection for %i clues over %i passes:\n", clues->size, passes);
+  start = now();
+  double sort_sum = sort_clues(clues, packed.items, packed.size, passes);
+  double sort_time = now() - start;
+  start = now();
+  double classify_sum = classify_items(clues, packed.items, packed.size, passes);
+  double classify_time = now() - start;
+  printf("  select_clues (sorted):         %.3fs (%.2f us/item)\n", sort_time, calls ? sort_time * 1000000 / calls : 0.0);
+  printf("  naive_bayes_classify (top-k):  %.3fs (%.2f us/item)\n", classify_time, calls ? classify_time * 1000000 / calls : 0.0);
+  printf("  checksums: %f %f\n", sort_sum, classify_sum);
+  free_clue_list(clues);
+
+  for (i = 0; i < packed.size; i++) {
+    free_item((Item*) judy[i]);
+  }
+
+  free(judy);
+  free(packed.items);
+  free_item_cache(item_cache);
+
+  return packed_sum == judy_sum ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-//
-//void *do_classification(void *nothing) {
-//  int did_work = 0;
-//  double _training = 0;
-//  float _precomputing = 0;
-//  float _classification = 0;
-//  
-//  while (current_tag < num_tags) {
-//    did_work = 1;
-//    pthread_mutex_lock(&mutex);
-//    const Tag *tag = tags->tags[current_tag];
-//    current_tag++;
-//    pthread_mutex_unlock(&mutex);
-//    
-//    double train_start = now();
-//    TrainedClassifier *trained = train(tag, is);
-//    double train_end = now();
-//    _training += (train_end - train_start);
-//    
-//    Classifier *classifier = precompute(trained, random_background);
-//    double precompute_end = now();
-//    _precomputing += (precompute_end - train_end);
-//    
-//    Item **items = sample_items(samples);
-//    const int sample_size = sample_size(samples);
-//    int i;
-//
-//    double cls_start = now();
-//    for (i = 0; i < sample_size; i++) {
-//      Tagging *tagging = classify(classifier, items[i]);
-//      //fprintf(stderr, "%s,%i,%.9f\n", tagging->tag_name, item_get_id(items[i]), tagging->strength);    
-//      free(tagging);
-//    }
-//    double cls_end = now();
-//    _classification += (cls_end - cls_start);
-//  
-//    free_classifier(classifier);  
-//    tc_free(trained);
-//  }
-//  
-//  if (did_work) {
-//    pthread_mutex_lock(&mutex);
-//      threads_that_did_work++;
-//      training += _training;
-//      precomputing += _precomputing;
-//      classification += _classification;    
-//    pthread_mutex_unlock(&mutex);
-//  }
-//  
-//  return 0;
-//}
@@ -41,6 +41,10 @@
 #include <libxml/xmlerror.h>
 
 #define CLASSIFIER_REQUEUE 4
+/* How long a job waits for a tagger that is checked out by another job before failing */
+#define CHECKED_OUT_RETRY_SECONDS (60 * 10)
+/* Microseconds to wait before requeuing a job whose tagger is checked out */
+#define CHECKED_OUT_RETRY_PAUSE 100000
 #define INIT_MUTEX(mutex) \
   mutex = calloc(1, sizeof(pthread_mutex_t)); \
   if (!mutex) MALLOC_ERR();              \
@@ -152,6 +156,7 @@ static ClassificationJob * create_classification_job(const char * tag_url) {
     job->items_classified = 0;
     job->auto_cleanup     = false;
     job->first_time_tried = -1;
+    job->next_in_batch    = NULL;
     NOW(job->created_at);
   }
 
@@ -231,20 +236,16 @@ struct JobStuff {
 static int classify_item_cb(const Item *item, void *memo) {
   struct JobStuff *stuff = (struct JobStuff*) memo;
   int rc = CLASSIFIER_OK;
+  double probability;
 
-  if (stuff->job->item_scope == ITEM_SCOPE_NEW && item_get_time(item) < stuff->tagger->last_classified) {
-    rc = CLASSIFIER_FAIL;
-  } else {
-    stuff->job->items_classified++;
-    double probability;
-    if (TAGGER_OK == classify_item(stuff->tagger, item, &probability)) {
-      if (probability >= stuff->threshold) {
-        arr_add(stuff->taggings, create_tagging(item_get_id(item), probability));
-      }
-    } else {
-      error("Error classifying item");
-      rc = CLASSIFIER_FAIL;
+  stuff->job->items_classified++;
+  if (TAGGER_OK == classify_item(stuff->tagger, item, &probability)) {
+    if (probability >= stuff->threshold) {
+      arr_add(stuff->taggings, create_tagging(item_get_id(item), probability));
     }
+  } else {
+    error("Error classifying item");
+    rc = CLASSIFIER_FAIL;
   }
 
   stuff->job->progress += stuff->job->progress_increment;
@@ -271,7 +272,7 @@ static int handle_checked_out(ClassificationJob *job) {
 	return CLASSIFIER_FAIL;
 }
 
-static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache) {
+static void start_classification(struct JobStuff *job_stuff, ItemCache *item_cache) {
 	NOW(job_stuff->job->trained_at);
 
 	job_stuff->job->state = CJOB_STATE_CLASSIFYING;
@@ -279,9 +280,11 @@ static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache)
 	job_stuff->job->progress_increment = 60.0 / item_cache_cached_size(item_cache);
 
 	job_stuff->taggings = create_array(1000);
-	item_cache_each_item(item_cache, &classify_item_cb, job_stuff);
+}
+
+static void finish_classification(struct JobStuff *job_stuff, time_t classified_at) {
 	NOW(job_stuff->job->classified_at);
-	job_stuff->tagger->last_classified = time(NULL);
+	job_stuff->tagger->last_classified = classified_at;
 
 	/* Save the results */
 	job_stuff->job->state = CJOB_STATE_INSERTING;
@@ -297,22 +300,40 @@ static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache)
 	NOW(job_stuff->job->completed_at);
 	job_stuff->job->progress = 100.0;
 	job_stuff->job->state = CJOB_STATE_COMPLETE;
-
-	return CLASSIFIER_OK;
 }
 
-static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache, TaggerCache * tagger_cache, ClassificationEngineOptions * opts) {
-  int rc = CLASSIFIER_OK;
-  struct JobStuff job_stuff;
-  job_stuff.job = job;
-  job_stuff.threshold = opts->positive_threshold;
-  job_stuff.credentials = opts->credentials;
-  job_stuff.taggings = NULL;
+static int do_classification(struct JobStuff *job_stuff, ItemCache *item_cache) {
+	start_classification(job_stuff, item_cache);
 
-  /* If the job is cancelled bail out before doing anything */
-  if (job->state == CJOB_STATE_CANCELLED) return CLASSIFIER_OK;
+	if (job_stuff->job->item_scope == ITEM_SCOPE_NEW) {
+		/* Only items on or after the last classification, found by seeking instead of scanning */
+		item_cache_each_item_since(item_cache, job_stuff->tagger->last_classified, &classify_item_cb, job_stuff);
+	} else {
+		item_cache_each_item(item_cache, &classify_item_cb, job_stuff);
+	}
 
-  NOW(job->started_at);
+	finish_classification(job_stuff, time(NULL));
+
+	return CLASSIFIER_OK;
+}
+
+/* Starts a job and checks out its tagger.
+ *
+ * If fetch is false the tagger is only taken from the tagger cache, without
+ * checking for a newer tag document, and the job's start time is left alone.
+ *
+ * Returns the result of get_tagger, if it isn't TAGGER_OK the job has been
+ * marked as failed.
+ */
+static int checkout_job_tagger(struct JobStuff *job_stuff, TaggerCache * tagger_cache, ClassificationEngineOptions * opts, int fetch) {
+  ClassificationJob *job = job_stuff->job;
+  job_stuff->threshold = opts->positive_threshold;
+  job_stuff->credentials = opts->credentials;
+  job_stuff->taggings = NULL;
+
+  if (fetch) {
+    NOW(job->started_at);
+  }
   job->state = CJOB_STATE_TRAINING;
 
   /* Clear the error message if it exists */
@@ -323,30 +344,202 @@ static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache
   }
 
   /* Try and get the tagger from the tagger_cache */
-  job_stuff.tagger = NULL;
-  int cache_rc = get_tagger(tagger_cache, job->tag_url, &(job_stuff.tagger), &job->errmsg);
+  job_stuff->tagger = NULL;
+  int cache_rc;
+  if (fetch) {
+    cache_rc = get_tagger(tagger_cache, job->tag_url, &(job_stuff->tagger), &job->errmsg);
+  } else {
+    cache_rc = get_tagger_without_fetching(tagger_cache, job->tag_url, &(job_stuff->tagger), &job->errmsg);
+  }
   debug("return from get_tagger with %i", cache_rc);
 
   switch (cache_rc) {
     case TAGGER_OK:
-      rc = do_classification(&job_stuff, item_cache);
-      release_tagger(tagger_cache, job_stuff.tagger);
       break;
     case TAG_NOT_FOUND:
-      rc = handle_not_found(job);
+      handle_not_found(job);
       break;
     case TAGGER_CHECKED_OUT:
-      rc = handle_checked_out(job);
+      handle_checked_out(job);
       break;
     default:
-    	rc = CLASSIFIER_FAIL;
     	fatal("Got unknown value from get_tagger: %i", cache_rc);
     	break;
   }
 
+  return cache_rc;
+}
+
+/* Puts a job whose tagger is checked out by another job back to waiting.
+ *
+ * A batch of classify new items jobs holds its taggers for a whole pass over
+ * the new items, so instead of failing straight away the job is tried again
+ * until it has been waiting CHECKED_OUT_RETRY_SECONDS.
+ *
+ * Returns true if the job should be requeued.
+ */
+static int retry_checked_out_job(ClassificationJob * job) {
+  time_t now = time(NULL);
+
+  if (job->first_time_tried < 0) {
+    job->first_time_tried = now;
+  }
+
+  if (now - job->first_time_tried < CHECKED_OUT_RETRY_SECONDS) {
+    job->state = CJOB_STATE_WAITING;
+    job->error = CJOB_ERROR_NO_ERROR;
+    return true;
+  }
+
+  return false;
+}
+
+static int run_classifcation_job(ClassificationJob * job, ItemCache * item_cache, TaggerCache * tagger_cache, ClassificationEngineOptions * opts) {
+  int rc = CLASSIFIER_FAIL;
+  struct JobStuff job_stuff;
+  job_stuff.job = job;
+
+  /* If the job is cancelled bail out before doing anything */
+  if (job->state == CJOB_STATE_CANCELLED) return CLASSIFIER_OK;
+
+  int cache_rc = checkout_job_tagger(&job_stuff, tagger_cache, opts, true);
+
+  if (TAGGER_OK == cache_rc) {
+    rc = do_classification(&job_stuff, item_cache);
+    release_tagger(tagger_cache, job_stuff.tagger);
+  } else if (TAGGER_CHECKED_OUT == cache_rc && retry_checked_out_job(job)) {
+    rc = CLASSIFIER_REQUEUE;
+  }
+
   return rc;
 }
 
+/* A batch of classify new items jobs being run together.
+ *
+ * The jobs are sorted by when their tagger was last classified, so as items are
+ * visited, newest first, the taggers that still need each item are always the first
+ * num_active of them.
+ */
+struct BatchStuff {
+  struct JobStuff *jobs;
+  Tagger **taggers;
+  double *probabilities;
+  int num_jobs;
+  int num_active;
+};
+
+static int compare_last_classified(const void *a, const void *b) {
+  time_t a_time = ((const struct JobStuff*) a)->tagger->last_classified;
+  time_t b_time = ((const struct JobStuff*) b)->tagger->last_classified;
+  return (a_time > b_time) - (a_time < b_time);
+}
+
+static int classify_item_with_batch_cb(const Item *item, void *memo) {
+  struct BatchStuff *batch = (struct BatchStuff*) memo;
+  int rc = CLASSIFIER_OK;
+  int i;
+
+  while (batch->num_active > 0 && item_get_time(item) < batch->taggers[batch->num_active - 1]->last_classified) {
+    batch->num_active--;
+  }
+
+  if (TAGGER_OK != classify_item_with_taggers(batch->taggers, batch->num_active, item, batch->probabilities)) {
+    error("Error classifying item");
+    rc = CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; i < batch->num_active; i++) {
+    struct JobStuff *stuff = &batch->jobs[i];
+
+    stuff->job->items_classified++;
+    if (batch->probabilities[i] >= stuff->threshold) {
+      arr_add(stuff->taggings, create_tagging(item_get_id(item), batch->probabilities[i]));
+    }
+
+    stuff->job->progress += stuff->job->progress_increment;
+  }
+
+  return rc;
+}
+
+/* Runs a batch of classify new items jobs, chained through next_in_batch.
+ *
+ * This does the same as running each job on its own, except that the new items
+ * are visited once for all the jobs and each item is classified with all their
+ * taggers at once by classify_item_with_taggers. Cancelled jobs are skipped.
+ *
+ * Each tagger is fetched and trained, and released again, before any of them
+ * are checked out for the pass, so the pass only holds the taggers while it is
+ * classifying. A job whose tagger is checked out by another job is left out of
+ * the pass and put back to waiting, see retry_checked_out_job, the caller
+ * requeues it to be run on its own.
+ */
+static void run_classification_batch(ClassificationJob * batch_head, ItemCache * item_cache, TaggerCache * tagger_cache, ClassificationEngineOptions * opts) {
+  struct BatchStuff batch;
+  ClassificationJob *job;
+  int i, fetched = 0, size = 0;
+
+  for (job = batch_head; job; job = job->next_in_batch) {
+    size++;
+  }
+
+  batch.num_jobs = 0;
+  batch.jobs = calloc(size, sizeof(struct JobStuff));
+  batch.taggers = calloc(size, sizeof(Tagger*));
+  batch.probabilities = calloc(size, sizeof(double));
+
+  if (!batch.jobs || !batch.taggers || !batch.probabilities) {
+    fatal("Could not allocate a batch of %i classification jobs", size);
+  } else {
+    for (job = batch_head; job; job = job->next_in_batch) {
+      if (job->state != CJOB_STATE_CANCELLED) {
+        struct JobStuff *stuff = &batch.jobs[fetched];
+        stuff->job = job;
+
+        int cache_rc = checkout_job_tagger(stuff, tagger_cache, opts, true);
+
+        if (TAGGER_OK == cache_rc) {
+          release_tagger(tagger_cache, stuff->tagger);
+          fetched++;
+        } else if (TAGGER_CHECKED_OUT == cache_rc) {
+          retry_checked_out_job(job);
+        }
+      }
+    }
+
+    for (i = 0; i < fetched; i++) {
+      int cache_rc = checkout_job_tagger(&batch.jobs[i], tagger_cache, opts, false);
+
+      if (TAGGER_OK == cache_rc) {
+        start_classification(&batch.jobs[i], item_cache);
+        batch.jobs[batch.num_jobs++] = batch.jobs[i];
+      } else if (TAGGER_CHECKED_OUT == cache_rc) {
+        retry_checked_out_job(batch.jobs[i].job);
+      }
+    }
+
+    if (batch.num_jobs > 0) {
+      qsort(batch.jobs, batch.num_jobs, sizeof(struct JobStuff), compare_last_classified);
+      for (i = 0; i < batch.num_jobs; i++) {
+        batch.taggers[i] = batch.jobs[i].tagger;
+      }
+
+      batch.num_active = batch.num_jobs;
+      item_cache_each_item_since(item_cache, batch.taggers[0]->last_classified, &classify_item_with_batch_cb, &batch);
+
+      time_t classified_at = time(NULL);
+      for (i = 0; i < batch.num_jobs; i++) {
+        finish_classification(&batch.jobs[i], classified_at);
+        release_tagger(tagger_cache, batch.jobs[i].tagger);
+      }
+    }
+  }
+
+  free(batch.jobs);
+  free(batch.taggers);
+  free(batch.probabilities);
+}
+
 /* Creates but doesn't start a classification engine.
  *
  * This verifies that the classifiation engine has a valid item source,
@@ -447,7 +640,7 @@ void free_classification_engine(ClassificationEngine *engine) {
  * Functions for adding, fetching and removing classification jobs.
  */
 
-static int _add_classification_job(ClassificationEngine *engine, ClassificationJob *job) {
+static int _register_classification_job(ClassificationEngine *engine, ClassificationJob *job) {
   int failure = true;
   PWord_t job_pointer;
 
@@ -463,8 +656,12 @@ static int _add_classification_job(ClassificationEngine *engine, ClassificationJ
     fatal("Error malloc'ing Judy array entry for classification job");
   }
 
-  q_enqueue(engine->classification_job_queue, job);
+  return failure;
+}
 
+static int _add_classification_job(ClassificationEngine *engine, ClassificationJob *job) {
+  int failure = _register_classification_job(engine, job);
+  q_enqueue(engine->classification_job_queue, job);
   return failure;
 }
 
@@ -485,12 +682,20 @@ ClassificationJob * ce_add_classification_job(ClassificationEngine * engine, con
   return job;
 }
 
+static ClassificationJob * create_classify_new_items_job(const char * tag_url) {
+  ClassificationJob *job = create_classification_job(tag_url);
+  if (job) {
+    job->item_scope = ITEM_SCOPE_NEW;
+    job->auto_cleanup = true;
+  }
+
+  return job;
+}
+
 ClassificationJob * ce_add_classify_new_items_job_for_tag(ClassificationEngine * engine, const char * tag_url) {
   ClassificationJob *job = NULL;
   if (engine) {
-    job = create_classification_job(tag_url);
-    job->item_scope = ITEM_SCOPE_NEW;
-    job->auto_cleanup = true;
+    job = create_classify_new_items_job(tag_url);
 
     if (_add_classification_job(engine, job)) {
       free_classification_job(job);
@@ -748,6 +953,84 @@ static int wait_if_suspended(ClassificationEngine * ce) {
   return exit;
 }
 
+/* Records and cleans up each job in a batch after it has been run. */
+static void finish_classification_batch(ClassificationEngine * ce, ClassificationJob * batch_head) {
+  ClassificationJob *job = batch_head;
+
+  while (job) {
+    ClassificationJob *next = job->next_in_batch;
+    job->next_in_batch = NULL;
+
+    if (CJOB_STATE_CANCELLED == job->state) {
+      job->state = CJOB_STATE_COMPLETE;
+      ce_remove_classification_job(ce, job, true);
+      free_classification_job(job);
+    } else {
+      ce_record_classification_job_timings(ce, job);
+      if (job->auto_cleanup) {
+        ce_remove_classification_job(ce, job, true);
+        free_classification_job(job);
+      }
+    }
+
+    job = next;
+  }
+}
+
+/* Takes the jobs a batch left waiting for a checked out tagger out of the batch
+ * and requeues each of them to be run on its own, like run_classifcation_job's
+ * CLASSIFIER_REQUEUE.
+ *
+ * Returns the head of what is left of the batch.
+ */
+static ClassificationJob * requeue_waiting_batch_jobs(ClassificationEngine * ce, ClassificationJob * batch_head) {
+  ClassificationJob *head = NULL, *tail = NULL, *waiting = NULL, *job = batch_head;
+
+  while (job) {
+    ClassificationJob *next = job->next_in_batch;
+    job->next_in_batch = NULL;
+
+    if (CJOB_STATE_WAITING == job->state) {
+      job->next_in_batch = waiting;
+      waiting = job;
+    } else if (tail) {
+      tail->next_in_batch = job;
+      tail = job;
+    } else {
+      head = tail = job;
+    }
+
+    job = next;
+  }
+
+  if (waiting) {
+    debug("Requeuing jobs left waiting by a batch");
+    /* Give whoever has the taggers a chance to release them before they are tried again */
+    usleep(CHECKED_OUT_RETRY_PAUSE);
+  }
+
+  while (waiting) {
+    job = waiting;
+    waiting = job->next_in_batch;
+    job->next_in_batch = NULL;
+    q_enqueue(ce->classification_job_queue, job);
+  }
+
+  return head;
+}
+
+/* Runs a batch of jobs chained through next_in_batch and then records and cleans them up.
+ *
+ * This is what a worker does with a batch it takes off the queue. Jobs whose
+ * tagger was checked out by another job are requeued instead.
+ */
+void ce_run_classification_batch(ClassificationEngine * ce, ClassificationJob * batch_head) {
+  if (ce && batch_head) {
+    run_classification_batch(batch_head, ce->item_cache, ce->tagger_cache, ce->options);
+    finish_classification_batch(ce, requeue_waiting_batch_jobs(ce, batch_head));
+  }
+}
+
 /* This is the function for classificaiton work threads.
  *
  * Each worker shares the ItemSource, Random Background and Queues of
@@ -772,6 +1055,11 @@ void *classification_worker_func(void *engine_vp) {
     if (job && ce->is_running) {
       debug("%i got job off queue: %s", pthread_self(), job->id);
 
+      if (job->next_in_batch) {
+        ce_run_classification_batch(ce, job);
+        continue;
+      }
+
       /* Only proceed if the job is not cancelled */
       NEXT_IF_CANCELLED(ce, job);
 
@@ -779,6 +1067,8 @@ void *classification_worker_func(void *engine_vp) {
 
       if (rc == CLASSIFIER_REQUEUE) {
         debug("Requeuing job");
+        /* Give whoever has the tagger a chance to release it before it is tried again */
+        usleep(CHECKED_OUT_RETRY_PAUSE);
         q_enqueue(job_queue, job);
       } else {
         ce_record_classification_job_timings(ce, job);
@@ -832,6 +1122,62 @@ void * purge_old_jobs_thread(void *engine_vp) {
   return EXIT_SUCCESS;
 }
 
+/* Creates and queues a classify new items job for each of the tag urls.
+ *
+ * The jobs are queued in batches, chained through next_in_batch, so each worker
+ * classifies the new items with a batch of taggers in one pass instead of one
+ * pass per tagger. There are enough batches to keep every worker busy, the last
+ * batch gets whatever is left over.
+ *
+ * Returns the number of batches queued.
+ */
+int ce_add_classify_new_items_jobs(ClassificationEngine * ce, const Array * tag_urls) {
+  ClassificationJob *batch_head = NULL, *batch_tail = NULL;
+  int i, batched = 0, batches = 0;
+
+  if (!ce || !tag_urls) {
+    return 0;
+  }
+
+  int workers = MAX(1, ce->options->worker_threads);
+  int batch_size = MIN(CLASSIFY_MANY_BATCH_SIZE, MAX(1, (tag_urls->size + workers - 1) / workers));
+
+  for (i = 0; i < tag_urls->size; i++) {
+    ClassificationJob *job = create_classify_new_items_job((char *) tag_urls->elements[i]);
+
+    if (NULL == job) {
+      fatal("Could not create classify new items job for %s", (char *) tag_urls->elements[i]);
+      continue;
+    } else if (_register_classification_job(ce, job)) {
+      free_classification_job(job);
+      continue;
+    }
+
+    if (batch_tail) {
+      batch_tail->next_in_batch = job;
+    } else {
+      batch_head = job;
+    }
+    batch_tail = job;
+
+    if (++batched == batch_size) {
+      q_enqueue(ce->classification_job_queue, batch_head);
+      batch_head = batch_tail = NULL;
+      batched = 0;
+      batches++;
+    }
+  }
+
+  if (batch_head) {
+    q_enqueue(ce->classification_job_queue, batch_head);
+    batches++;
+  }
+
+  info("Created %i classify new items jobs in %i batches", tag_urls->size, batches);
+  return batches;
+}
+
+/* Creates a classify new items job for every tag. */
 static void create_classify_new_item_jobs_for_all_tags(ClassificationEngine *ce) {
   if (ce) {
     Array *tag_urls;
@@ -839,13 +1185,7 @@ static void create_classify_new_item_jobs_for_all_tags(ClassificationEngine *ce)
     int rc = fetch_tags(ce->tagger_cache, &tag_urls, &errmsg);
 
     if (rc == TAG_INDEX_OK) {
-      int i;
-
-      for (i = 0; i < tag_urls->size; i++) {
-       ce_add_classify_new_items_job_for_tag(ce, (char *) tag_urls->elements[i]);
-      }
-
-      info("Created %i classify new items jobs", tag_urls->size);
+      ce_add_classify_new_items_jobs(ce, tag_urls);
     } else {
       error("Could not fetch tag urls: %s", errmsg);
       free(errmsg);
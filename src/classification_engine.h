@@ -79,6 +79,8 @@ typedef struct CLASSIFICATION_JOB {
   struct timeval classified_at;
   struct timeval completed_at;
   time_t first_time_tried;
+  /* The next job in a batch of jobs run together, only the first is queued */
+  struct CLASSIFICATION_JOB *next_in_batch;
 } ClassificationJob;
 
 extern ClassificationEngine * create_classification_engine(ItemCache *item_cache, TaggerCache *tagger_cache, ClassificationEngineOptions *options);
@@ -103,4 +105,8 @@ extern const char *           cjob_state_msg(const ClassificationJob * job);
 extern void                   cjob_cancel(ClassificationJob *job);
 
 extern void                   free_classification_job(ClassificationJob * job);
+
+/* Only in the header for testing. */
+extern int                    ce_add_classify_new_items_jobs(ClassificationEngine *engine, const Array *tag_urls);
+extern void                   ce_run_classification_batch(ClassificationEngine *engine, ClassificationJob *batch_head);
 #endif /*CLASSIFICATION_ENGINE_H_*/
@@ -22,13 +22,12 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 #include "classifier.h"
 #include "logging.h"
 #include "misc.h"
 #include "clue.h"
 
-#define TINY_VAL_D 1e-200
-
 /******************************************************************************************
  * The Peerworks implementation of a Bayesian Classifier.
  * 
@@ -374,47 +373,242 @@ double chi2Q(double x2, int v) {
 }
 
 /** Used by qsort to sort clues in order of strength.
+ *
+ *  Clues of equal strength are kept in token order.
  */
 static int compare_clues(const void *clue1_p, const void *clue2_p) {
-  Clue *clue1 = *((Clue**)clue1_p);
-  Clue *clue2 = *((Clue**)clue2_p);
-  double strength_1 = clue_strength(clue1);
-  double strength_2 = clue_strength(clue2);
+  const Clue *clue1 = (const Clue*) clue1_p;
+  const Clue *clue2 = (const Clue*) clue2_p;
+  double strength_1 = clue1->strength;
+  double strength_2 = clue2->strength;
   
   if (strength_1 < strength_2) {
     return 1;
   } else if (strength_2 < strength_1) {
     return -1;
   } else {
-    return 0;
+    return clue1->token_id - clue2->token_id;
+  }
+}
+
+/* The same order as compare_clues, without the call through qsort. */
+static inline int clue_is_stronger(const Clue *clue1, const Clue *clue2) {
+  return clue1->strength > clue2->strength ||
+         (clue1->strength == clue2->strength && clue1->token_id < clue2->token_id);
+}
+
+static inline void swap_clues(Clue *clues, int i, int j) {
+  Clue clue = clues[i];
+  clues[i] = clues[j];
+  clues[j] = clue;
+}
+
+/** Moves the k strongest clues to the front of the array, in no particular order.
+ *
+ *  Only the strongest max_clues clues of an item are used and they are combined
+ *  in a way that doesn't depend on their order, so there is no need to sort them
+ *  all. This is quickselect with a median of three pivot. If the range stops
+ *  shrinking quickly, which needs pathological strengths, what is left is sorted.
+ */
+static void select_strongest_clues(Clue *clues, int num_clues, int k) {
+  int left = 0, right = num_clues - 1;
+  int depth_limit = 64;
+  
+  if (k <= 0 || k >= num_clues) {
+    return;
+  }
+  
+  while (left < right) {
+    if (0 == depth_limit--) {
+      qsort(clues + left, right - left + 1, sizeof(Clue), compare_clues);
+      return;
+    }
+    
+    int middle = left + ((right - left) >> 1);
+    if (clue_is_stronger(&clues[middle], &clues[left]))  swap_clues(clues, middle, left);
+    if (clue_is_stronger(&clues[right], &clues[left]))   swap_clues(clues, right, left);
+    if (clue_is_stronger(&clues[right], &clues[middle])) swap_clues(clues, right, middle);
+    
+    Clue pivot = clues[middle];
+    int i = left, j = right;
+    
+    while (i <= j) {
+      while (clue_is_stronger(&clues[i], &pivot)) i++;
+      while (clue_is_stronger(&pivot, &clues[j])) j--;
+      if (i <= j) {
+        swap_clues(clues, i++, j--);
+      }
+    }
+    
+    // Everything up to j is at least as strong as the pivot and everything from i
+    // is no stronger, so carry on in whichever side holds the k'th strongest clue.
+    if (k - 1 <= j) {
+      right = j;
+    } else if (k - 1 >= i) {
+      left = i;
+    } else {
+      break;
+    }
+  }
+}
+
+/* Each thread that classifies items keeps the buffers it selects clues into
+ * between items, so classifying an item doesn't need to allocate anything
+ * once the buffers are as big as the largest item.
+ */
+typedef struct CLUE_BUFFER {
+  /* The number of tokens there is room for */
+  int capacity;
+  Clue *clues;
+  /* Room for capacity token ids followed by capacity positions of their clues */
+  uint32_t *scratch;
+} ClueBuffer;
+
+static pthread_key_t clue_buffer_key;
+static pthread_once_t clue_buffer_key_once = PTHREAD_ONCE_INIT;
+
+static void free_clue_buffer(void *memo) {
+  ClueBuffer *buffer = (ClueBuffer*) memo;
+  
+  if (buffer) {
+    free(buffer->clues);
+    free(buffer->scratch);
+    free(buffer);
+  }
+}
+
+static void create_clue_buffer_key(void) {
+  if (pthread_key_create(&clue_buffer_key, free_clue_buffer)) {
+    fatal("Could not create the clue buffer key");
+  }
+}
+
+/* Gets this thread's clue buffer, making sure it has room for num_tokens tokens. */
+static ClueBuffer * get_clue_buffer(int num_tokens) {
+  pthread_once(&clue_buffer_key_once, create_clue_buffer_key);
+  ClueBuffer *buffer = pthread_getspecific(clue_buffer_key);
+  
+  if (NULL == buffer) {
+    if (NULL == (buffer = calloc(1, sizeof(ClueBuffer))) || pthread_setspecific(clue_buffer_key, buffer)) {
+      fatal("Could not allocate clue buffer");
+      free(buffer);
+      return NULL;
+    }
+  }
+  
+  if (buffer->capacity < num_tokens) {
+    int capacity = MAX(num_tokens, MAX(256, buffer->capacity * 2));
+    Clue *clues = realloc(buffer->clues, capacity * sizeof(Clue));
+    
+    if (clues) {
+      buffer->clues = clues;
+    }
+    
+    uint32_t *scratch = realloc(buffer->scratch, capacity * (sizeof(uint32_t) + sizeof(int)));
+    
+    if (scratch) {
+      buffer->scratch = scratch;
+    }
+    
+    if (!clues || !scratch) {
+      fatal("Could not grow clue buffer to %i tokens", capacity);
+      return NULL;
+    }
+    
+    buffer->capacity = capacity;
+  }
+  
+  return buffer;
+}
+
+/* Gets the item's token ids, reading them into the buffer's scratch space if they
+ * aren't already in an array. Token 0 is left out since item_next_token never returns it.
+ */
+static const uint32_t * item_token_ids(const Item *item, ClueBuffer *buffer, int *num_tokens) {
+  const uint32_t *token_ids = item_get_token_ids(item, buffer->scratch);
+  
+  *num_tokens = item_get_num_tokens(item);
+  if (*num_tokens > 0 && 0 == token_ids[0]) {
+    token_ids++;
+    (*num_tokens)--;
+  }
+  
+  return token_ids;
+}
+
+/** Copies the clues for the tokens that are strong enough to use into selected_clues.
+ *
+ *  selected_clues must have room for one clue per token, they are copied in token order.
+ *  positions must have room for one position per token.
+ *  Returns the number of clues copied.
+ */
+static int gather_clues(const ClueList * clues, const uint32_t *token_ids, int num_tokens, Clue *selected_clues, int *positions) {
+  int i = 0;
+  int j;
+  
+  if (clue_list_frozen(clues)) {
+    int matches = clue_list_intersect(clues, token_ids, num_tokens, positions);
+    
+    for (j = 0; j < matches; j++) {
+      int position = positions[j];
+      
+      if (MIN_PROB_STRENGTH <= clues->strengths[position]) {
+        selected_clues[i].token_id = clues->token_ids[position];
+        selected_clues[i].probability = clues->probabilities[position];
+        selected_clues[i].strength = clues->strengths[position];
+        selected_clues[i].log_probability = clues->log_probabilities[position];
+        selected_clues[i].log_complement = clues->log_complements[position];
+        i++;
+      }
+    }
+  } else {
+    for (j = 0; j < num_tokens; j++) {
+      const Clue *clue = get_clue(clues, token_ids[j]);
+      if (NULL != clue && MIN_PROB_STRENGTH <= clue_strength(clue)) {      
+        selected_clues[i++] = *clue;
+      }
+    }
   }
+  
+  return i;
 }
 
 /** Selects the clues from a classifier to use when classifying an item.
+ *
+ *  The selected clues are sorted in order of strength. The returned array
+ *  points to copies of the clues which are allocated along with it, so the
+ *  caller frees it all with a single free.
  */
 const Clue ** select_clues(const ClueList * clues, const Item *item, int *num_clues) {
-  int i = 0;
+  int i;
   int num_item_tokens = item_get_num_tokens(item);
   int max_clues = MAX(MAX_DISCRIMINATORS, MAX_CLUES_RATIO * num_item_tokens);
+  ClueBuffer *buffer = get_clue_buffer(num_item_tokens);
   
   // This is an array that can hold the maximum number of clues
-  // which is one per item token. Use calloc so it is effectively
-  // NULL terminating the array. This will just hold pointers to
-  // the actual clues that are stored in the classifier.
-  const Clue **selected_clues = calloc(num_item_tokens, sizeof(Clue*));
-  
-  int token_id = 0;
-  short token_frequency = 0;
-  
-  while (item_next_token(item, &token_id, &token_frequency)) {
-    const Clue *clue = get_clue(clues, token_id);
-    if (NULL != clue && MIN_PROB_STRENGTH <= clue_strength(clue)) {      
-      selected_clues[i++] = clue;
-    }
+  // which is one per item token, followed by room for the clues
+  // themselves. Use calloc so it is effectively NULL terminating
+  // the array.
+  const Clue **selected_clues = calloc(num_item_tokens, sizeof(Clue*) + sizeof(Clue));
+  
+  if (NULL == selected_clues || NULL == buffer) {
+    *num_clues = 0;
+    return selected_clues;
+  }
+  
+  Clue *copies = (Clue*) (selected_clues + num_item_tokens);
+  int num_tokens;
+  const uint32_t *token_ids = item_token_ids(item, buffer, &num_tokens);
+  int selected = gather_clues(clues, token_ids, num_tokens, copies, (int*) (buffer->scratch + buffer->capacity));
+  
+  *num_clues = MIN(selected, max_clues);
+  select_strongest_clues(copies, selected, *num_clues);
+  qsort(copies, *num_clues, sizeof(Clue), compare_clues);
+  
+  for (i = 0; i < selected; i++) {
+    selected_clues[i] = &copies[i];
   }
   
-  qsort(selected_clues, i, sizeof(Clue*), compare_clues); 
-  *num_clues = MIN(i, max_clues);
   return selected_clues;
 }
 
@@ -427,37 +621,53 @@ const Clue ** select_clues(const ClueList * clues, const Item *item, int *num_cl
  *
  * This method will follow the algorithm pretty closely, for detail see
  * http://spambayes.cvs.sourceforge.net/spambayes/spambayes/spambayes/classifier.py?revision=1.31&view=markup
+ *
+ * SpamBayes multiplies the probabilities and watches for underflow, here each clue carries
+ * log(p) and log(1 - p), computed once when the tagger is precomputed, so the products are
+ * two sums with no branches. The logs are summed in four interleaved partial sums so the
+ * additions aren't one long dependency chain. The result differs from multiplying the
+ * probabilities only by rounding, by less than CHI2_COMBINE_TOLERANCE.
  */
-static double chi2_combine(const Clue **clues, int num_clues) {
+static double chi2_combine(const Clue *clues, int num_clues) {
   // Now we can combine all token scores into an item score
-  double h, s;
-  int hExp, sExp, i;
-  h = s = 1.0;
-  hExp = sExp = 0;
+  double h[4] = {0.0, 0.0, 0.0, 0.0};
+  double s[4] = {0.0, 0.0, 0.0, 0.0};
+  double ham, spam;
+  int i, j;
 
-  for (i = 0; i < num_clues; i++) {
-    s *= (1.0 - clue_probability(clues[i]));
-    h *= clue_probability(clues[i]);
-  
-    // Check for underflow
-    if (s < TINY_VAL_D) {
-      int e = 0;
-      s = frexp(s, &e);
-      sExp += e;
+  for (i = 0; i + 4 <= num_clues; i += 4) {
+    for (j = 0; j < 4; j++) {
+      s[j] += clues[i + j].log_complement;
+      h[j] += clues[i + j].log_probability;
     }
+  }
   
-    if (h < TINY_VAL_D) {
-      int e = 0;
-      h = frexp(h, &e);
-      hExp += e;
-    }
+  for (j = 0; i < num_clues; i++, j++) {
+    s[j] += clues[i].log_complement;
+    h[j] += clues[i].log_probability;
   }
 
-  s = log(s) + sExp * M_LN2;
-  h = log(h) + hExp * M_LN2;
-  s = 1.0 - chi2Q(-2.0 * s, num_clues * 2);
-  h = 1.0 - chi2Q(-2.0 * h, num_clues * 2);
-  return (s - h + 1.0) / 2.0;
+  spam = (s[0] + s[1]) + (s[2] + s[3]);
+  ham = (h[0] + h[1]) + (h[2] + h[3]);
+  spam = 1.0 - chi2Q(-2.0 * spam, num_clues * 2);
+  ham = 1.0 - chi2Q(-2.0 * ham, num_clues * 2);
+  return (spam - ham + 1.0) / 2.0;
+}
+
+/* Classifies a list of token ids using the strongest max_clues of their clues. */
+static double classify_token_ids(const ClueList *clues, const uint32_t *token_ids, int num_tokens, int max_clues, ClueBuffer *buffer) {
+  double prob = 0.5;
+  int num_selected = gather_clues(clues, token_ids, num_tokens, buffer->clues, (int*) (buffer->scratch + buffer->capacity));
+  int num_clues = MIN(num_selected, max_clues);
+  
+  // Only the strongest clues are used, when there are more than that.
+  select_strongest_clues(buffer->clues, num_selected, num_clues);
+    
+  if (num_clues > 0) {
+    prob = chi2_combine(buffer->clues, num_clues);    
+  }
+  
+  return prob;
 }
 
 /*****************************************************************************
@@ -506,15 +716,55 @@ double naive_bayes_classify(const ClueList *clues, const Item * item) {
     return 0.5;
   }
   
-  double prob = 0.5;
-  int num_clues;
-  const Clue **selected_clues = select_clues(clues, item, &num_clues);
-    
-  if (num_clues > 0) {
-    prob = chi2_combine(selected_clues, num_clues);    
+  int num_tokens;
+  int num_item_tokens = item_get_num_tokens(item);
+  int max_clues = MAX(MAX_DISCRIMINATORS, MAX_CLUES_RATIO * num_item_tokens);
+  ClueBuffer *buffer = get_clue_buffer(num_item_tokens);
+  
+  if (NULL == buffer) {
+    return 0.5;
   }
   
-  free(selected_clues);
-    
-  return prob;
+  const uint32_t *token_ids = item_token_ids(item, buffer, &num_tokens);
+  return classify_token_ids(clues, token_ids, num_tokens, max_clues, buffer);
+}
+
+/** Classifies the item using each of the given ClueLists.
+ *
+ *  probabilities[i] is set to what naive_bayes_classify(clue_lists[i], item) returns,
+ *  but the item's token ids are only read once for all the lists and stay in the
+ *  cache while they are matched against each list's clues. This is much cheaper than
+ *  classifying the item separately for each tagger when there are many taggers.
+ *
+ * Returns CLASSIFIER_OK or CLASSIFIER_FAIL if any of the arguments are NULL.
+ */
+int naive_bayes_classify_many(const ClueList **clue_lists, int num_lists, const Item *item, double *probabilities) {
+  int i;
+  
+  if (NULL == clue_lists || NULL == item || NULL == probabilities) {
+    fatal("classify_many received NULL classifiers(%x), item(%x) or probabilities(%x)", clue_lists, item, probabilities);
+    return CLASSIFIER_FAIL;
+  }
+  
+  int num_tokens;
+  int num_item_tokens = item_get_num_tokens(item);
+  int max_clues = MAX(MAX_DISCRIMINATORS, MAX_CLUES_RATIO * num_item_tokens);
+  ClueBuffer *buffer = get_clue_buffer(num_item_tokens);
+  
+  if (NULL == buffer) {
+    return CLASSIFIER_FAIL;
+  }
+  
+  const uint32_t *token_ids = item_token_ids(item, buffer, &num_tokens);
+  
+  for (i = 0; i < num_lists; i++) {
+    if (NULL == clue_lists[i]) {
+      error("classify_many received a NULL classifier at %i", i);
+      probabilities[i] = 0.5;
+    } else {
+      probabilities[i] = classify_token_ids(clue_lists[i], token_ids, num_tokens, max_clues, buffer);
+    }
+  }
+  
+  return CLASSIFIER_OK;
 }
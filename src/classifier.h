@@ -64,6 +64,11 @@
 // 
 #define MAX_CLUES_RATIO 0.5
 
+// Clue probabilities are combined by summing their logs rather than multiplying
+// them. Item probabilities differ from those the products give by less than this.
+//
+#define CHI2_COMBINE_TOLERANCE 1e-9
+
 /* Represents a token in a pool for the purpose of calculating it's probability. */
 typedef struct PROB_TOKEN {
   /* The number of occurences of the token in the pool */
@@ -73,6 +78,7 @@ typedef struct PROB_TOKEN {
 } ProbToken;
 
 extern double naive_bayes_classify    (const ClueList *clues, const Item *item);
+extern int    naive_bayes_classify_many (const ClueList **clue_lists, int num_lists, const Item *item, double *probabilities);
 extern double naive_bayes_probability (const Pool * positive_pool, const Pool * negative_pool, const Pool * random_bg, int token_id, double bias);
 
 /** Only in header for testing - shouldn't actual use it */
@@ -24,6 +24,7 @@
 #include <math.h>
 #include "clue.h"
 #include "logging.h"
+#include "misc.h"
 
 Clue * new_clue(int token_id, double probability) {
   Clue *clue = malloc(sizeof(struct CLUE));
@@ -31,6 +32,8 @@ Clue * new_clue(int token_id, double probability) {
     clue->token_id = token_id;
     clue->probability = probability;
     clue->strength = fabs(0.5 - probability);
+    clue->log_probability = log(probability);
+    clue->log_complement = log1p(-probability);
   }
   return clue;
 }
@@ -51,10 +54,14 @@ ClueList * new_clue_list(void) {
   return clues;
 }
 
+/** Adds a clue to a list that isn't frozen yet.
+ */
 Clue * add_clue(ClueList * clues, int token_id, double probability) {
   Clue * clue = NULL;
   
-  if (clues) {
+  if (clues && clue_list_frozen(clues)) {
+    error("Can't add a clue to a frozen clue list");
+  } else if (clues) {
     // Check if it exists
     clue = get_clue(clues, token_id);
     if (clue == NULL) {
@@ -77,6 +84,8 @@ Clue * add_clue(ClueList * clues, int token_id, double probability) {
   return clue;
 }
 
+/** Gets a clue from a list that isn't frozen yet, frozen lists are searched with clue_list_lower_bound.
+ */
 Clue * get_clue(const ClueList * clues, int token_id) {
   Clue * clue = NULL;
   
@@ -91,8 +100,245 @@ Clue * get_clue(const ClueList * clues, int token_id) {
   return clue;
 }
 
+/** Freezes the clue list into sorted arrays of token ids, probabilities, strengths and logs.
+ *
+ *  A precomputed tagger's clues never change and are looked up once for every token
+ *  of every item it classifies, so they are copied out of the Judy array and the
+ *  separately allocated Clues into contiguous arrays which are searched by
+ *  clue_list_lower_bound. Clues can't be added or fetched with get_clue afterwards.
+ */
+int freeze_clue_list(ClueList * clues) {
+  int rc = CLASSIFIER_OK;
+  
+  if (clues && !clue_list_frozen(clues)) {
+    /* Allocate at least one of each so a frozen list never has NULL arrays */
+    int capacity = clues->size > 0 ? clues->size : 1;
+    int *token_ids = malloc(capacity * sizeof(int));
+    double *probabilities = malloc(capacity * sizeof(double));
+    double *strengths = malloc(capacity * sizeof(double));
+    double *log_probabilities = malloc(capacity * sizeof(double));
+    double *log_complements = malloc(capacity * sizeof(double));
+    
+    if (!token_ids || !probabilities || !strengths || !log_probabilities || !log_complements) {
+      fatal("Could not allocate frozen clue list of %i clues", clues->size);
+      free(token_ids);
+      free(probabilities);
+      free(strengths);
+      free(log_probabilities);
+      free(log_complements);
+      rc = CLASSIFIER_FAIL;
+    } else {
+      int i = 0;
+      Word_t bytes;
+      PWord_t clue_pointer;
+      Word_t index = 0;
+      
+      /* Judy iterates in token id order so the arrays come out sorted */
+      JLF(clue_pointer, clues->list, index);
+      while (clue_pointer) {
+        Clue *clue = (Clue*)(*clue_pointer);
+        token_ids[i] = clue->token_id;
+        probabilities[i] = clue->probability;
+        strengths[i] = clue->strength;
+        log_probabilities[i] = clue->log_probability;
+        log_complements[i] = clue->log_complement;
+        free(clue);
+        i++;
+        JLN(clue_pointer, clues->list, index);
+      }
+      
+      JLFA(bytes, clues->list);
+      debug("Froze clue list of %i clues, freeing %zu bytes", clues->size, (size_t) bytes + clues->size * sizeof(struct CLUE));
+      clues->token_ids = token_ids;
+      clues->probabilities = probabilities;
+      clues->strengths = strengths;
+      clues->log_probabilities = log_probabilities;
+      clues->log_complements = log_complements;
+    }
+  }
+  
+  return rc;
+}
+
+/** Finds the position of the first clue in a frozen list at or after from with a token id of at least token_id.
+ *
+ *  Returns clues->size if there is no such clue. Since an item's tokens are visited
+ *  in increasing order the search for each token can start where the last one ended.
+ *  The search has no data dependent branches, each step is a conditional move.
+ */
+int clue_list_lower_bound(const ClueList * clues, int from, int token_id) {
+  const int *base = clues->token_ids + from;
+  int n = clues->size - from;
+  
+  if (n <= 0) {
+    return clues->size;
+  }
+  
+  while (n > 1) {
+    int half = n >> 1;
+    base = (base[half] < token_id) ? base + half : base;
+    n -= half;
+  }
+  
+  return (base - clues->token_ids) + (*base < token_id);
+}
+
+/* Intersecting an item's tokens with a frozen clue list.
+ *
+ * Both are sorted by token id and an item has far fewer tokens than a tagger
+ * has clues, so for each token the clue list is galloped through to find a
+ * window that has to hold the token if it is there at all. Once the window is
+ * no larger than a block it is compared with the token in one go using SIMD
+ * equality tests rather than finishing the binary search one branch at a time.
+ * The AVX2 and SSE4.2 versions are picked at run time, on other CPUs or
+ * compilers the whole search is done by clue_list_lower_bound.
+ */
+
+/* Finds the window for token_id in ids[from, size), returning its start.
+ *
+ * The token, if it is there, is at or after the start and within block ids of it.
+ */
+static inline int gallop_to_window(const int * ids, int from, int size, int token_id, int block) {
+  int low = from, high, bound = 1;
+  
+  /* ids[low] < token_id all along, high is the first id known to be >= token_id or size */
+  if (ids[from] >= token_id) {
+    return from;
+  }
+  
+  while (from + bound < size && ids[from + bound] < token_id) {
+    low = from + bound;
+    bound <<= 1;
+  }
+  
+  high = from + bound < size ? from + bound : size;
+  
+  while (high - low > block) {
+    int middle = low + ((high - low) >> 1);
+    if (ids[middle] < token_id) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  
+  return low + 1;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SIMD_INTERSECT 1
+#define AVX2_BLOCK 32
+#define SSE_BLOCK 16
+
+/* Returns the offset of token_id in the 32 ids at ids, or -1. */
+__attribute__((target("avx2")))
+static inline int find_in_block_avx2(const int * ids, int token_id) {
+  __m256i token = _mm256_set1_epi32(token_id);
+  unsigned int mask =
+       (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(token, _mm256_loadu_si256((const __m256i*) ids))))
+    | ((unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(token, _mm256_loadu_si256((const __m256i*) (ids + 8))))) << 8)
+    | ((unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(token, _mm256_loadu_si256((const __m256i*) (ids + 16))))) << 16)
+    | ((unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(token, _mm256_loadu_si256((const __m256i*) (ids + 24))))) << 24);
+  
+  return mask ? __builtin_ctz(mask) : -1;
+}
+
+/* Returns the offset of token_id in the 16 ids at ids, or -1. */
+__attribute__((target("sse4.2")))
+static inline int find_in_block_sse(const int * ids, int token_id) {
+  __m128i token = _mm_set1_epi32(token_id);
+  unsigned int mask =
+       (unsigned int) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(token, _mm_loadu_si128((const __m128i*) ids))))
+    | ((unsigned int) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(token, _mm_loadu_si128((const __m128i*) (ids + 4))))) << 4)
+    | ((unsigned int) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(token, _mm_loadu_si128((const __m128i*) (ids + 8))))) << 8)
+    | ((unsigned int) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(token, _mm_loadu_si128((const __m128i*) (ids + 12))))) << 12);
+  
+  return mask ? __builtin_ctz(mask) : -1;
+}
+
+/* The two versions are the same apart from the block size and comparison, which
+ * this fills in so each is compiled with its own instruction set.
+ */
+#define DEFINE_SIMD_INTERSECT(name, target_isa, block, find_in_block)                          \
+__attribute__((target(target_isa)))                                                            \
+static int name(const ClueList * clues, const uint32_t * token_ids, int num_tokens, int * positions) { \
+  const int *ids = clues->token_ids;                                                           \
+  int size = clues->size;                                                                      \
+  int matches = 0, position = 0, i;                                                            \
+                                                                                               \
+  for (i = 0; i < num_tokens && position < size; i++) {                                        \
+    int token_id = (int) token_ids[i];                                                         \
+    position = gallop_to_window(ids, position, size, token_id, block);                         \
+                                                                                               \
+    if (position + block <= size) {                                                            \
+      int offset = find_in_block(ids + position, token_id);                                    \
+      if (offset >= 0) {                                                                       \
+        position += offset;                                                                    \
+        positions[matches++] = position++;                                                     \
+      }                                                                                        \
+    } else {                                                                                   \
+      while (position < size && ids[position] < token_id) {                                    \
+        position++;                                                                            \
+      }                                                                                        \
+      if (position < size && ids[position] == token_id) {                                      \
+        positions[matches++] = position;                                                       \
+      }                                                                                        \
+    }                                                                                          \
+  }                                                                                            \
+                                                                                               \
+  return matches;                                                                              \
+}
+
+DEFINE_SIMD_INTERSECT(intersect_avx2, "avx2",   AVX2_BLOCK, find_in_block_avx2)
+DEFINE_SIMD_INTERSECT(intersect_sse,  "sse4.2", SSE_BLOCK,  find_in_block_sse)
+#endif
+
+static int intersect_scalar(const ClueList * clues, const uint32_t * token_ids, int num_tokens, int * positions) {
+  int matches = 0, position = 0, i;
+  
+  for (i = 0; i < num_tokens; i++) {
+    position = clue_list_lower_bound(clues, position, (int) token_ids[i]);
+    
+    if (position >= clues->size) {
+      break;
+    } else if (clues->token_ids[position] == (int) token_ids[i]) {
+      positions[matches++] = position;
+    }
+  }
+  
+  return matches;
+}
+
+/** Finds the clues in a frozen list for each of the tokens.
+ *
+ *  token_ids must be in increasing order. The position in the clue list of the
+ *  clue for each token that has one is put in positions, which must have room
+ *  for num_tokens positions, in token order.
+ *
+ *  Returns the number of positions found.
+ */
+int clue_list_intersect(const ClueList * clues, const uint32_t * token_ids, int num_tokens, int * positions) {
+#ifdef HAVE_SIMD_INTERSECT
+  if (__builtin_cpu_supports("avx2")) {
+    return intersect_avx2(clues, token_ids, num_tokens, positions);
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    return intersect_sse(clues, token_ids, num_tokens, positions);
+  }
+#endif
+  
+  return intersect_scalar(clues, token_ids, num_tokens, positions);
+}
+
 void free_clue_list(ClueList * clues) {
-  if (clues) {
+  if (clues && clue_list_frozen(clues)) {
+    free(clues->token_ids);
+    free(clues->probabilities);
+    free(clues->strengths);
+    free(clues->log_probabilities);
+    free(clues->log_complements);
+    free(clues);
+  } else if (clues) {
     int size;
     int bytes;
     PWord_t clue_pointer;
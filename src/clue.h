@@ -23,17 +23,30 @@
 #ifndef _CLUE_H_
 #define _CLUE_H_
 
+#include <stdint.h>
 #include <Judy.h>
 
 typedef struct CLUE {
   int token_id;
   double probability;
   double strength;
+  /* log(probability) and log(1 - probability), summed by the classifier */
+  double log_probability;
+  double log_complement;
 } Clue;
 
 typedef struct CLUE_LIST {
   int size;
   Pvoid_t list;
+  
+  /* Once the list is frozen the clues are held in these arrays, sorted
+   * by token id, instead of the Judy array of separately allocated Clues.
+   */
+  int *token_ids;
+  double *probabilities;
+  double *strengths;
+  double *log_probabilities;
+  double *log_complements;
 } ClueList;
 
 Clue * new_clue  (int token_id, double probability);
@@ -42,8 +55,13 @@ void         free_clue (Clue *clue);
 ClueList * new_clue_list();
 Clue *     add_clue(ClueList * clues, int token_id, double probability);
 Clue *     get_clue(const ClueList * clues, int token_id);
+int        freeze_clue_list(ClueList * clues);
+int        clue_list_lower_bound(const ClueList * clues, int from, int token_id);
+int        clue_list_intersect(const ClueList * clues, const uint32_t * token_ids, int num_tokens, int * positions);
 void free_clue_list(ClueList * clues);
 
+#define clue_list_frozen(clues)    (NULL != (clues)->token_ids)
+
 #define clue_token_id(clue)        clue->token_id
 #define clue_probability(clue)     clue->probability
 #define clue_strength(clue)        clue->strength
@@ -0,0 +1,89 @@
+// Copyright (c) 2007-2010 The Kaphan Foundation
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// contact@winnowtag.org
+
+#include <config.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include "logging.h"
+#include "item_cache.h"
+#include "misc.h"
+
+static void print_help() {
+  printf("Winnow token clusterer\n\n");
+  printf("Rewrites catalog.db and tokens.db in an item cache so each entry and its\n");
+  printf("tokens are stored in the order the classifier reads them when it starts,\n");
+  printf("which makes starting with a cold file system cache mostly sequential reads.\n");
+  printf("The classifier should be stopped while this runs.\n\n");
+  printf("Usage: winnow-cluster-tokens <item_cache>\n");
+}
+
+#define SHORT_OPTS "hv"
+
+static ItemCacheOptions item_cache_options;
+
+int main(int argc, char ** argv) {
+  int exit_code = EXIT_SUCCESS;
+  int longindex;
+  int opt;
+  static struct option long_options[] = {
+        {"version", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {0,0,0,0}
+      };
+
+  while (-1 != (opt = getopt_long(argc, argv, SHORT_OPTS, long_options, &longindex))) {
+    switch (opt) {
+    case 'h':
+      print_help();
+      return EXIT_SUCCESS;
+    case 'v':
+      printf("%s\n", PACKAGE_STRING);
+      return EXIT_SUCCESS;
+    default:
+      print_help();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_help();
+    exit_code = EXIT_FAILURE;
+  } else {
+    char *item_cache_dir = argv[optind];
+    ItemCache *item_cache = NULL;
+
+    if (CLASSIFIER_OK != item_cache_create(&item_cache, item_cache_dir, &item_cache_options)) {
+      fprintf(stderr, "Error opening item cache at %s: %s\n", item_cache_dir, item_cache_errmsg(item_cache));
+      exit_code = EXIT_FAILURE;
+    } else if (CLASSIFIER_OK != item_cache_cluster_tokens(item_cache)) {
+      fprintf(stderr, "Error clustering %s: %s\n", item_cache_dir, item_cache_errmsg(item_cache));
+      exit_code = EXIT_FAILURE;
+    } else {
+      printf("Clustered %s\n", item_cache_dir);
+    }
+
+    free_item_cache(item_cache);
+  }
+
+  return exit_code;
+}
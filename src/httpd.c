@@ -168,7 +168,7 @@ static char * extract_job_id(const char * url) {
   return job_id;
 }
 
-static xmlChar * xml_for_about(void) {
+static xmlChar * xml_for_about(ItemCache * item_cache) {
   xmlChar *buffer = NULL;
   int buffersize;
 
@@ -178,6 +178,11 @@ static xmlChar * xml_for_about(void) {
 
   add_element(root, "version", "string", "%s", PACKAGE_VERSION);
 
+  if (item_cache) {
+    add_element(root, "update-queue-depth", "integer", "%i", item_cache_update_queue_size(item_cache));
+    add_element(root, "tokenizer-queue-depth", "integer", "%i", item_cache_tokenizer_queue_size(item_cache));
+  }
+
   xmlDocDumpFormatMemory(doc, &buffer, &buffersize, 1);
   xmlFreeDoc(doc);
 
@@ -232,7 +237,7 @@ static int get_entry_id(const char * path) {
 static int about_handler(const HTTPRequest * request, HTTPResponse * response) {
   response->code = MHD_HTTP_OK;
   response->content_type = CONTENT_TYPE;
-  response->content = (char*) xml_for_about();
+  response->content = (char*) xml_for_about(request->item_cache);
   response->free_content = MHD_YES;
   return 1;
 }
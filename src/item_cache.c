@@ -28,10 +28,18 @@
 #include <stdlib.h>
 #include <sqlite3.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
 #include <errno.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <zlib.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
@@ -50,33 +58,190 @@
 #include "array.h"
 #include "tokenizer.h"
 
-#define CURRENT_USER_VERSION 5
+#define CURRENT_USER_VERSION 7
 #define FETCH_ITEM_SQL "select full_id, id, strftime('%s', updated) from entries where full_id = ?"
-#define FETCH_ALL_ITEMS_SQL "select full_id, id, strftime('%s', updated) from entries where updated > (julianday('now') - ?) order by updated desc"
+/* The + on updated stops SQLite using the updated index so entries and
+ * entry_tokens are both read in key order, which is the order their pages
+ * are in on disk, instead of jumping around them in updated order. */
+#define FETCH_ALL_ITEMS_SQL "select entries.full_id, entries.id, strftime('%s', entries.updated), entry_tokens.tokens \
+                             from entries join token.entry_tokens on entry_tokens.id = entries.id \
+                             where +entries.updated > (julianday('now') - ?) \
+                             and (entries.num_tokens is null or entries.num_tokens >= ?) order by entries.id"
+#define FETCH_ITEM_KEY_RANGE_SQL "select min(id), max(id) from entries where updated > (julianday('now') - ?)"
+#define FETCH_ITEM_VERSIONS_SQL "select id, strftime('%s', updated), num_tokens from entries \
+                                 where updated > (julianday('now') - ?) and (num_tokens is null or num_tokens >= ?)"
+#define FETCH_ITEMS_IN_KEY_RANGE_SQL "select entries.full_id, entries.id, strftime('%s', entries.updated), entry_tokens.tokens \
+                                      from entries join token.entry_tokens on entry_tokens.id = entries.id \
+                                      where +entries.updated > (julianday('now') - ?) and entries.id >= ? and entries.id <= ? \
+                                      and (entries.num_tokens is null or entries.num_tokens >= ?) order by entries.id"
 #define FETCH_RANDOM_BACKGROUND "select full_id, id from entries where id in (select entry_id from random_backgrounds)"
-#define INSERT_ENTRY_SQL "insert into entries (full_id, updated, created_at) \
-                          VALUES (:full_id, julianday(:updated, 'unixepoch'), julianday(:created_at, 'unixepoch'))"
-#define UPDATE_ENTRY_SQL "update entries set updated = julianday(?, 'unixepoch') where full_id = ?"
+#define INSERT_ENTRY_SQL "insert into entries (full_id, updated, created_at, content_hash) \
+                          VALUES (:full_id, julianday(:updated, 'unixepoch'), julianday(:created_at, 'unixepoch'), :content_hash)"
+#define UPDATE_ENTRY_SQL "update entries set updated = julianday(?, 'unixepoch'), content_hash = ? where full_id = ?"
+/* An entry is unchanged if its atom has the same hash and its tokens have been saved. */
+#define FETCH_ENTRY_STATE_SQL "select id, content_hash = ? and num_tokens is not null from entries where full_id = ?"
 #define DELETE_ENTRY_SQL "delete from entries where id = ?"
+#define LOAD_ATOMS_SQL "select id, token from tokens"
+#define INSERT_ATOM_SQL "insert or ignore into tokens (id, token) values (?, ?)"
 #define FIND_ATOM_SQL "select id from tokens where token = ?"
-#define INSERT_ATOM_SQL "insert into tokens (token) values (?)"
-#define FIND_TOKEN_SQL "select token from tokens where id = ?"
+#define MAX_ATOM_SQL "select max(id) from tokens"
 #define CORRUPT_TOKEN_FILE "Token file %s did not have a multiple of %i bytes, it has %i bytes and is possibly corrupt."
-#define INSERT_ATOM_XML_SQL "insert into atom.entry_atom values (?, ?)"
+#define INSERT_ATOM_XML_SQL "insert or replace into atom.entry_atom (id, atom) values (?, ?)"
 #define DELETE_ATOM_XML_SQL "delete from atom.entry_atom where id = ?"
+#define FETCH_ATOM_XML_SQL "select atom from atom.entry_atom where id = ?"
+#define FETCH_UNTOKENIZED_ENTRIES_SQL "select entries.id, entries.full_id, strftime('%s', entries.updated), \
+                                       strftime('%s', entries.created_at), entry_atom.atom \
+                                       from entries join atom.entry_atom on entry_atom.id = entries.id \
+                                       where +entries.updated > (julianday('now') - ?) and entries.num_tokens is null \
+                                       and entries.id not in (select id from token.entry_tokens)"
+#define SELECT_ATOMS_TO_COMPRESS "select id, atom from atom.entry_atom where id > ? order by id limit ?"
+#define UPDATE_ATOM_XML_SQL "update atom.entry_atom set atom = ? where id = ?"
+#define ATOM_ZLIB_HEADER_BYTES 6
 #define FETCH_ENTRY_TOKENS  "select tokens from token.entry_tokens where id = ?"
-#define INSERT_ENTRY_TOKENS "insert into token.entry_tokens values (?, ?)"
+#define INSERT_ENTRY_TOKENS "insert or replace into token.entry_tokens values (?, ?)"
 #define DELETE_ENTRY_TOKENS "delete from token.entry_tokens where id = ?"
-#define TOUCH_ITEM_SQL "update entries set last_used_at = julianday('now') where full_id = ?"
+#define SELECT_TOKENS_TO_MIGRATE "select id, tokens from token.entry_tokens where id > ? order by id limit ?"
+#define UPDATE_ENTRY_TOKENS "update token.entry_tokens set tokens = ? where id = ?"
+#define REWRITE_BATCH_SIZE 500
+#define UPDATE_TOKEN_COUNT_SQL "update entries set num_tokens = ? where id = ?"
+#define SELECT_TOKENS_TO_COUNT "select entries.id, entry_tokens.tokens from entries join token.entry_tokens on entry_tokens.id = entries.id \
+                                where entries.num_tokens is null and entries.id > ? order by entries.id limit ?"
+#define SELECT_EXPIRED_ENTRIES_SQL "select id from entries where updated < (julianday('now') - ?) \
+                                      and (last_used_at is null or last_used_at < (julianday('now') - ?)) \
+                                      and id not in (select entry_id from random_backgrounds) \
+                                      and id > ? order by id limit ?"
+#define SELECT_ATOMS_TO_SWEEP_SQL "select id from tokens where id > ? and id < ? order by id limit ?"
+#define DELETE_ATOM_SQL "delete from tokens where id = ?"
+#define DROP_STALE_TOKENS_TRIGGER_SQL "drop trigger if exists entry_tokens_token_id"
+#define GC_BATCH_SIZE 200
+#define SELECT_ALL_FULL_IDS_SQL "select full_id from entries"
+#define COUNT_ENTRIES_SQL "select count(*), max(id) from entries"
+#define MAX_ENTRY_KEY_SQL "select max(id) from entries"
+#define SELECT_NEW_FULL_IDS_SQL "select id, full_id from entries where id > ? order by id"
+#define PRESENCE_BITS_PER_ID 10
+#define PRESENCE_HASHES 7
+#define PRESENCE_MIN_CAPACITY 65536
+#define GC_BATCH_PAUSE 20000
+#define TOUCH_ITEM_SQL "update entries set last_used_at = julianday(?, 'unixepoch') where full_id = ?"
+#define MAX_TOUCH_ID_LENGTH 1024
 #define TOKEN_BYTES 6
+#define TOKEN_FORMAT_DELTA_VARINT 0x81
 #define PROCESSING_LIMIT 200
+#define UNINDEX_BATCH_SIZE 1000
 
-typedef struct ORDERED_ITEM_LIST OrderedItemList;
-struct ORDERED_ITEM_LIST {
-  Item *item;
-  OrderedItemList *next;
+/* Number of item pointers held in each chunk of an ItemTimeline. */
+#define ITEM_TIMELINE_CHUNK_SIZE 1024
+
+/* Length of the time period covered by each ItemSegment, in seconds. */
+#define ITEM_SEGMENT_SECONDS (60 * 60 * 24)
+
+typedef struct ITEM_TIMELINE_CHUNK ItemTimelineChunk;
+typedef struct ITEM_TIMELINE ItemTimeline;
+typedef struct ITEM_SEGMENT ItemSegment;
+typedef struct ITEM_VIEW ItemView;
+typedef struct ITEM_ARENA ItemArena;
+typedef struct READ_CONNECTION ReadConnection;
+
+/* A contiguous run of items in descending order of time. */
+struct ITEM_TIMELINE_CHUNK {
+  int size;
+  Item *items[ITEM_TIMELINE_CHUNK_SIZE];
+};
+
+/* Items in descending order of time, stored as a directory of fixed size chunks.
+ *
+ * The newest item is the first item of the first chunk, the oldest is the
+ * last item of the last chunk. Every chunk except the last is non-empty.
+ * Since the oldest item in each chunk is its last item the directory can
+ * be binary searched on time, so finding the position of an item is
+ * O(log n) and scans walk contiguous arrays instead of chasing pointers.
+ */
+struct ITEM_TIMELINE {
+  ItemTimelineChunk **chunks;
+  int num_chunks;
+  int chunks_capacity;
+  int num_items;
+};
+
+/* Position within an ItemTimeline. */
+typedef struct ITEM_TIMELINE_CURSOR {
+  int chunk;
+  int position;
+} ItemTimelineCursor;
+
+/* A period of time's worth of the in-memory cache.
+ *
+ * The cache is partitioned by item time into segments that each own their
+ * items, so purging old items is mostly a matter of unlinking whole segments
+ * from the cache.
+ */
+struct ITEM_SEGMENT {
+  /* Items in the segment have start <= time < start + ITEM_SEGMENT_SECONDS */
+  time_t start;
+
+  /* The items in the segment in descending time order.
+   *
+   * Segments don't index their items, lookups by key or full_id go
+   * through the cache's items_by_key and keys_by_id for every segment.
+   */
+  ItemTimeline *timeline;
+};
+
+/* A slot in an ItemIdMap, key is 0 for an empty slot. */
+typedef struct ITEM_ID_SLOT {
+  uint64_t hash;
+  int key;
+} ItemIdSlot;
+
+/* Linear probing hash table from the hash of an item's full_id to its key.
+ *
+ * Only the hash of the full_id is kept so a match has to be confirmed
+ * by comparing the full_id of the item with that key.
+ */
+typedef struct ITEM_ID_MAP {
+  ItemIdSlot *slots;
+  /* Always a power of 2 */
+  int capacity;
+  int size;
+} ItemIdMap;
+
+/* Bloom filter of the full_id of every entry in the catalog.
+ *
+ * Bits are only ever set so readers don't need a lock, writers set them
+ * with an atomic or.
+ */
+typedef struct PRESENCE_FILTER {
+  uint64_t *words;
+  /* Number of bits - 1, the number of bits is always a power of 2 */
+  uint64_t mask;
+  /* Number of full_ids the filter was sized for and the number added */
+  int capacity;
+  int size;
+  /* Highest entry key added, entries past it are added by presence_filter_catch_up */
+  sqlite3_int64 max_key;
+} PresenceFilter;
+
+typedef enum PRESENCE {
+  PRESENCE_ABSENT,
+  PRESENCE_UNKNOWN,
+  PRESENCE_PRESENT
+} Presence;
+
+/* An immutable copy of the list of cached items, in descending time order. */
+struct ITEM_VIEW {
+  /* The ItemCache's view_generation when this was built */
+  long generation;
+  int num_items;
+  Item *items[];
 };
 
+/* An object that is freed once no reader can be using it. */
+typedef struct RETIRED_OBJECT {
+  long epoch;
+  void *object;
+  void (*free_object) (void *object);
+} RetiredObject;
+
 struct ITEM {
   /* The ID of the item */
   unsigned char * id;
@@ -89,8 +254,63 @@ struct ITEM {
    * it will be the time the item was added to the cache.
    */
   time_t time;
-  /* The tokens of the item. This is a Judy array of token_id -> frequency. */
+  /* The tokens of the item. This is a Judy array of token_id -> frequency.
+   *
+   * Only used for items that are built up a token at a time, items loaded
+   * in bulk into the in-memory cache store their tokens in an ItemArena.
+   */
   Pvoid_t tokens;
+  /* The arena this item lives in, NULL if the item was created with create_item. */
+  ItemArena *arena;
+  /* This item's run of token ids within the arena, in ascending order. */
+  const uint32_t *packed_ids;
+  /* The frequencies matching each of packed_ids. */
+  const uint16_t *packed_frequencies;
+  /* The length of the packed_ids and packed_frequencies runs. */
+  int num_packed_tokens;
+};
+
+/* A packed store of items loaded from the database.
+ *
+ * Rather than malloc'ing each loaded item, strdup'ing its id and giving it
+ * a Judy array of tokens, the items loaded by item_cache_load are kept in
+ * a single arena.  The Item headers are one contiguous array, ids are kept
+ * in one string pool and tokens are stored as one contiguous sorted run per
+ * item in parallel token id and frequency arrays.  The item headers point
+ * into these runs, so reading an item's tokens is a linear scan of memory
+ * instead of a walk over a Judy tree.
+ *
+ * The arena is freed when the last item in it has been freed, usually
+ * when the item cache is freed or the items have all been purged.
+ */
+struct ITEM_ARENA {
+  /* The item headers, one per item */
+  Item *items;
+  int num_items;
+  int items_capacity;
+
+  /* Parallel arrays of token id and frequency for every item. */
+  uint32_t *token_ids;
+  uint16_t *token_frequencies;
+  size_t num_tokens;
+  size_t tokens_capacity;
+
+  /* All the item ids, each NULL terminated. */
+  char *id_pool;
+  size_t id_pool_size;
+  size_t id_pool_capacity;
+
+  /* Offsets of each item's tokens and id, used while the arena is built
+   * since the token arrays and id pool move as they grow. */
+  size_t *token_offsets;
+  size_t *id_offsets;
+
+  /* The number of items in the arena that haven't been freed. */
+  int live_items;
+
+  /* The snapshot file the token arrays and id pool are mapped from, if any. */
+  void *mapping;
+  size_t mapping_size;
 };
 
 typedef enum UPDATE_TYPE {
@@ -109,6 +329,7 @@ struct ITEM_CACHE_ENTRY {
   time_t updated;
   time_t created_at;
   char * atom;
+  sqlite3_int64 content_hash; /* Hash of the atom, 0 if there isn't one */
 };
 
 /** This is the opaque type for the Item Cache */
@@ -119,6 +340,21 @@ struct ITEM_CACHE {
   int cache_update_wait_time;
   int load_items_since;
   int min_tokens;
+  int load_threads;
+  char *snapshot_file;
+  int write_batch_size;
+  int write_batch_wait;
+  int async_writes;
+  int touch_flush_interval;
+  int compress_atoms;
+  int tokenizer_threads;
+  int tokenizer_queue_size;
+  int gc_interval;
+  int gc_expire_days;
+  int prefetch;
+  char *journal_mode;
+  char *synchronous;
+  int cache_size;
 
   sqlite3 *db;
   sqlite3_stmt *fetch_item_stmt;
@@ -126,16 +362,18 @@ struct ITEM_CACHE {
   sqlite3_stmt *random_background_stmt;
   sqlite3_stmt *insert_entry_stmt;
   sqlite3_stmt *update_entry_stmt;
+  sqlite3_stmt *fetch_entry_state_stmt;
   sqlite3_stmt *delete_entry_stmt;
   sqlite3_stmt *insert_atom_xml_stmt;
   sqlite3_stmt *delete_atom_xml_stmt;
-  sqlite3_stmt *find_token_stmt;
-  sqlite3_stmt *find_atom_stmt;
+  sqlite3_stmt *fetch_atom_xml_stmt;
   sqlite3_stmt *insert_atom_stmt;
+  sqlite3_stmt *find_atom_stmt;
   sqlite3_stmt *insert_tokens_stmt;
   sqlite3_stmt *fetch_tokens_stmt;
   sqlite3_stmt *delete_tokens_stmt;
   sqlite3_stmt *touch_item_stmt;
+  sqlite3_stmt *update_token_count_stmt;
 
   /* Mutex for database access.
    *
@@ -155,23 +393,67 @@ struct ITEM_CACHE {
   /* Flag for whether the item cache has been loaded. */
   int loaded;
 
-  /* The Judy Array that stores each item keyed by their id. */
-  Pvoid_t items_by_id;
+  /* The cached items partitioned by time, in descending order of segment start. */
+  ItemSegment **segments;
+  int num_segments;
+  int segments_capacity;
 
-  /* Number of items in the array */
-  int cached_size;
+  /* JudyL array of key -> Item* for every item in the segments */
+  Pvoid_t items_by_key;
 
-  /* A linked list of item ids in descending order of updated time. */
-  OrderedItemList *items_in_order;
+  /* Map of full_id to key for every item in the segments */
+  ItemIdMap keys_by_id;
+
+  /* Keys given out to items added without a database key, counting down from -1 */
+  int next_local_key;
+
+  /* Bloom filter of every full_id in the catalog, NULL until the cache is loaded */
+  PresenceFilter *presence;
+
+  /* Number of items in the segments */
+  int cached_size;
 
   /* The Random Background pool. */
   Pool *random_background;
 
+  /************************************
+   *  Item view members
+   *
+   *  item_cache_each_item iterates over an ItemView, an immutable copy of the
+   *  list of cached items, so it doesn't hold cache_lock while the iterator
+   *  runs.  Changes to the segments increment view_generation and a reader
+   *  that finds the current view out of date builds a new one and publishes
+   *  it with a compare and swap.
+   *
+   *  Replaced views and purged segments might still be in use by readers so
+   *  they are retired instead of freed. Readers register in the current epoch
+   *  while they use a view and retired objects are freed by reclaim_retired
+   *  once every reader that could have seen them has finished.
+   */
+
+  /* The last published view, NULL until the first iteration. */
+  ItemView * volatile view;
+
+  /* Incremented whenever the items in the segments change. */
+  volatile long view_generation;
+
+  /* The current epoch, only advanced by reclaim_retired. */
+  volatile long epoch;
+
+  /* Number of readers registered in even and odd epochs. */
+  volatile int epoch_readers[2];
+
+  /* Objects waiting to be freed, protected by retire_mutex. */
+  RetiredObject *retired;
+  int num_retired;
+  int retired_capacity;
+  pthread_mutex_t retire_mutex;
+
   /************************************
    *  In-memory cache updating members
    */
 
-  /* Queue for items to get added to the items_by_id and items_in_order lists. */
+  /* Queue for items to get added to the cache's segments. */
   Queue *update_queue;
 
   /* Thread which handles the cache updating */
@@ -197,7 +479,198 @@ struct ITEM_CACHE {
   /* Cache purging interval in seconds */
   int purge_interval;
 
+  /* Thread that migrates token blobs to the compact format */
+  pthread_t *token_migration_thread;
+
   int shutting_down;
+
+  /************************************
+   *  Tokenizer pool members
+   *
+   *  When tokenizer_threads is greater than 0 item_cache_add_entry stores the
+   *  entry and puts a copy of it on the tokenizer queue instead of tokenizing
+   *  it on the calling thread. The queue is a ring buffer of tokenizer_queue_size
+   *  entries, add_entry blocks while it is full. All of these are protected
+   *  by tokenizer_mutex.
+   */
+
+  /* The tokenizer threads, NULL if entries are tokenized by add_entry. */
+  pthread_t *tokenizers;
+
+  /* Entries waiting to be tokenized. */
+  ItemCacheEntry **tokenizer_queue;
+  int tokenizer_queue_head;
+  int tokenizer_queue_length;
+
+  /* JudySL set of the full_ids of entries on the queue or being tokenized,
+   * so an entry added by concurrent requests is only queued once.
+   */
+  Pvoid_t tokenizer_pending;
+
+  pthread_mutex_t tokenizer_mutex;
+
+  /* Signalled when an entry is queued or the cache is shutting down. */
+  pthread_cond_t tokenizer_not_empty;
+
+  /* Signalled when an entry is taken off the queue or the cache is shutting down. */
+  pthread_cond_t tokenizer_not_full;
+
+  /************************************
+   *  Garbage collection members
+   *
+   *  These are protected by db_access_mutex.
+   */
+
+  /* Thread that runs a garbage collection pass every gc_interval seconds. */
+  pthread_t *gc_thread;
+
+  /* Flag for whether a pass is marking the atoms in use. */
+  int gc_marking;
+
+  /* JudyL array of the atoms marked as in use by the current pass. */
+  Pvoid_t gc_used_atoms;
+
+  /* JudyL array of the atoms deleted from the tokens table by the last pass.
+   *
+   * They are hidden from new tokens but kept in the dictionary until the next
+   * pass starts, so items tokenized before they were deleted can restore them.
+   */
+  Pvoid_t gc_deleted_atoms;
+
+  /************************************
+   *  Token dictionary members
+   */
+
+  /* R/W lock for the token dictionary.
+   *
+   * If db_access_mutex is also needed it must be locked first.
+   */
+  pthread_rwlock_t atoms_lock;
+
+  /* Flag for whether the tokens table has been read into the dictionary. */
+  int atoms_loaded;
+
+  /* JudySL array mapping each token to its atom. */
+  Pvoid_t atoms_by_token;
+
+  /* Each token indexed by its atom, NULL for unused atoms. */
+  char **tokens_by_atom;
+  int tokens_by_atom_capacity;
+
+  /* The atom that will be given to the next new token. */
+  int next_atom;
+
+  /* Atoms created since the dictionary was last saved to the tokens table. */
+  int *unsaved_atoms;
+  int num_unsaved_atoms;
+  int unsaved_atoms_capacity;
+
+  /* JudyL array mapping atoms that couldn't be saved with their own id to
+   * the id their token has in the tokens table. Items are rewritten with
+   * the saved ids before their tokens are written, see save_item.
+   */
+  Pvoid_t atom_aliases;
+
+  /************************************
+   *  Write batching members
+   *
+   *  Writes to the database join an open transaction, the write batch, which
+   *  is committed once write_batch_size entries have been written to it or
+   *  it has been open for write_batch_wait milliseconds. All of these are
+   *  protected by db_access_mutex.
+   */
+
+  /* Thread that commits batches that have been open too long, NULL if batching is off. */
+  pthread_t *write_batch_thread;
+
+  /* Signalled when a batch is opened or the cache is shutting down. */
+  pthread_cond_t write_batch_cond;
+
+  /* Broadcast whenever a batch is committed. */
+  pthread_cond_t write_committed_cond;
+
+  /* Flag for whether there is an open batch. */
+  int write_batch_open;
+
+  /* Number of entries written in the open batch. */
+  int write_batch_entries;
+
+  /* When the open batch was started. */
+  struct timeval write_batch_started;
+
+  /* Numbers of the most recent, most recently committed and most recently failed batches. */
+  long write_batch_number;
+  long write_batch_committed;
+  long write_batch_failed;
+
+  /* JudySL set of the ids of items whose tokens were saved in the open batch.
+   *
+   * Read connections can't see these until the batch commits so cache misses
+   * for them are fetched through db. Protected by write_batch_ids_mutex, which
+   * may be locked while holding db_access_mutex but not the other way around.
+   */
+  Pvoid_t write_batch_ids;
+  pthread_mutex_t write_batch_ids_mutex;
+
+  /* Atoms saved to the tokens table in the open batch, they are put back
+   * on unsaved_atoms if the batch fails so nothing refers to missing rows.
+   */
+  int *write_batch_atoms;
+  int num_write_batch_atoms;
+  int write_batch_atoms_capacity;
+
+  /* Items whose tokens were saved in the open batch, they are queued to be
+   * added to the cache once the batch commits and freed if it fails.
+   */
+  Item **write_batch_items;
+  int num_write_batch_items;
+  int write_batch_items_capacity;
+
+  /************************************
+   *  Read connection pool members
+   *
+   *  Read-only connections used to fetch items that aren't in memory so that
+   *  cache misses don't have to wait for db_access_mutex. A thread takes a
+   *  connection for the duration of a fetch, new connections are opened when
+   *  none are idle so there are at most as many as concurrent readers.
+   */
+
+  /* Stack of connections not in use by any thread. */
+  ReadConnection **idle_read_connections;
+  int num_idle_read_connections;
+  int idle_read_connections_capacity;
+
+  /* Protects the idle stack. */
+  pthread_mutex_t read_pool_mutex;
+
+  /************************************
+   *  Deferred touch members
+   *
+   *  When touch_flush_interval is greater than 0 fetching an item only records
+   *  the time in pending_touches, the last_used_at column is updated for all
+   *  of them in one transaction every touch_flush_interval seconds.
+   */
+
+  /* JudySL array of full_id -> time it was last fetched, since the last flush. */
+  Pvoid_t pending_touches;
+
+  /* Protects pending_touches, touch_cond waits on this. */
+  pthread_mutex_t touch_mutex;
+
+  /* Signalled when the cache is shutting down. */
+  pthread_cond_t touch_cond;
+
+  /* Thread that flushes pending touches, NULL if touches aren't deferred. */
+  pthread_t *touch_flush_thread;
+};
+
+/* A read-only connection with its own copies of the statements used to fetch an item. */
+struct READ_CONNECTION {
+  sqlite3 *db;
+  sqlite3_stmt *fetch_item_stmt;
+  sqlite3_stmt *fetch_tokens_stmt;
+  sqlite3_stmt *max_entry_key_stmt;
+  sqlite3_stmt *new_full_ids_stmt;
 };
 
 /******************************************************************************
@@ -227,6 +700,22 @@ static UpdateJob * create_add_job(Item * item) {
   free(s);                      \
 }
 
+/* FNV-1a hash of an entry's atom, used to spot entries that are posted again unchanged. */
+static sqlite3_int64 atom_content_hash(const char * atom) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  if (!atom) {
+    return 0;
+  }
+
+  while (*atom) {
+    hash ^= (unsigned char) *atom++;
+    hash *= 1099511628211ULL;
+  }
+
+  return (sqlite3_int64) hash;
+}
+
 /* Creates an item cache entry.
  *
  * This maps to the entries table in the database.
@@ -243,6 +732,7 @@ ItemCacheEntry * create_item_cache_entry( const char * full_id,
     entry->created_at = created_at;
     COPY_STRING(entry->full_id, full_id);
     COPY_STRING(entry->atom, atom);
+    entry->content_hash = atom_content_hash(entry->atom);
   } else {
     fatal("Malloc failed in create_item_cache_entry");
   }
@@ -271,6 +761,7 @@ ItemCacheEntry * create_entry_from_atom_xml(const char * xml) {
     entry->full_id = get_element_value(ctx, "/atom:entry/atom:id/text()");
     entry->updated = get_element_value_time(ctx, "/atom:entry/atom:updated/text()");
     entry->atom = strdup(xml);
+    entry->content_hash = atom_content_hash(entry->atom);
 
     xmlXPathFreeContext(ctx);
     xmlFreeDoc(doc);
@@ -373,15 +864,17 @@ static int create_prepared_statements(ItemCache *item_cache) {
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_RANDOM_BACKGROUND,    -1, &item_cache->random_background_stmt,     NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ENTRY_SQL,           -1, &item_cache->insert_entry_stmt,          NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, UPDATE_ENTRY_SQL,           -1, &item_cache->update_entry_stmt,          NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_ENTRY_STATE_SQL,      -1, &item_cache->fetch_entry_state_stmt,     NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, DELETE_ENTRY_SQL,           -1, &item_cache->delete_entry_stmt,          NULL) ||
-      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FIND_TOKEN_SQL,             -1, &item_cache->find_token_stmt,            NULL) ||
-      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FIND_ATOM_SQL,              -1, &item_cache->find_atom_stmt,             NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ATOM_SQL,            -1, &item_cache->insert_atom_stmt,           NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FIND_ATOM_SQL,              -1, &item_cache->find_atom_stmt,             NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ATOM_XML_SQL,        -1, &item_cache->insert_atom_xml_stmt,       NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, DELETE_ATOM_XML_SQL,        -1, &item_cache->delete_atom_xml_stmt,       NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_ATOM_XML_SQL,         -1, &item_cache->fetch_atom_xml_stmt,        NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, INSERT_ENTRY_TOKENS,        -1, &item_cache->insert_tokens_stmt,         NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, FETCH_ENTRY_TOKENS,        -1, &item_cache->fetch_tokens_stmt,         NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, DELETE_ENTRY_TOKENS,        -1, &item_cache->delete_tokens_stmt,         NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2( item_cache->db, UPDATE_TOKEN_COUNT_SQL,     -1, &item_cache->update_token_count_stmt,    NULL) ||
       SQLITE_OK != sqlite3_prepare_v2( item_cache->db, TOUCH_ITEM_SQL,						 -1, &item_cache->touch_item_stmt,            NULL)) {
     fatal("Unable to prepare statment: \"%s\"", item_cache_errmsg(item_cache));
     rc = CLASSIFIER_FAIL;
@@ -408,7 +901,7 @@ static int attach_database(sqlite3 *db, const char * path, const char * alias) {
   int rc = CLASSIFIER_OK;
   char sql[MAXPATHLEN];
 
-  if (MAXPATHLEN < snprintf(sql, MAXPATHLEN, "ATTACH DATABASE '%s' as %s", path, alias)) {
+  if (MAXPATHLEN <= snprintf(sql, MAXPATHLEN, "ATTACH DATABASE '%s' as %s", path, alias)) {
     fatal("Path name too long: %s", path);
     exit(1);
   }
@@ -420,23 +913,75 @@ static int attach_database(sqlite3 *db, const char * path, const char * alias) {
   return rc;
 }
 
+/* Sets pragma to value on the catalog and each of the attached databases.
+ *
+ * value is put into the statement as is so it may only contain letters,
+ * digits and '-'.
+ */
+static int set_pragma(sqlite3 *db, const char * pragma, const char * value) {
+  static const char *schemas[] = {"main", "atom", "token"};
+  int rc = CLASSIFIER_OK;
+  const char *c;
+  char sql[256];
+  int i;
+
+  for (c = value; *c; c++) {
+    if (!isalnum(*c) && *c != '-') {
+      error("Invalid value for %s pragma: %s", pragma, value);
+      return CLASSIFIER_FAIL;
+    }
+  }
+
+  for (i = 0; i < sizeof(schemas) / sizeof(schemas[0]); i++) {
+    snprintf(sql, sizeof(sql), "PRAGMA %s.%s = %s", schemas[i], pragma, value);
+    if (SQLITE_OK != sqlite3_exec(db, sql, NULL, NULL, NULL)) {
+      error("Unable to set %s: %s", sql, sqlite3_errmsg(db));
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  return rc;
+}
+
+static int set_pragmas(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache->journal_mode && CLASSIFIER_OK != set_pragma(item_cache->db, "journal_mode", item_cache->journal_mode)) {
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (item_cache->synchronous && CLASSIFIER_OK != set_pragma(item_cache->db, "synchronous", item_cache->synchronous)) {
+    rc = CLASSIFIER_FAIL;
+  }
+
+  if (item_cache->cache_size) {
+    char cache_size[32];
+    snprintf(cache_size, sizeof(cache_size), "%i", item_cache->cache_size);
+    if (CLASSIFIER_OK != set_pragma(item_cache->db, "cache_size", cache_size)) {
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  return rc;
+}
+
 static int item_cache_open_database(ItemCache *item_cache) {
   int rc = CLASSIFIER_OK;
   char path[MAXPATHLEN];
   char atom_path[MAXPATHLEN];
   char token_path[MAXPATHLEN];
 
-  if (MAXPATHLEN < snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache->cache_directory)) {
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache->cache_directory)) {
     fatal("Path to catalog.db too long: %s", item_cache->cache_directory);
     exit(1);
   }
 
-  if (MAXPATHLEN < snprintf(atom_path, MAXPATHLEN, "%s/atom.db", item_cache->cache_directory)) {
+  if (MAXPATHLEN <= snprintf(atom_path, MAXPATHLEN, "%s/atom.db", item_cache->cache_directory)) {
     fatal("Path to atom.db too long: %s", item_cache->cache_directory);
     exit(1);
   }
 
-  if (MAXPATHLEN < snprintf(token_path, MAXPATHLEN, "%s/tokens.db", item_cache->cache_directory)) {
+  if (MAXPATHLEN <= snprintf(token_path, MAXPATHLEN, "%s/tokens.db", item_cache->cache_directory)) {
     fatal("Path to tokens.db too long: %s", item_cache->cache_directory);
     exit(1);
   }
@@ -447,7 +992,8 @@ static int item_cache_open_database(ItemCache *item_cache) {
   } else {
     if (CLASSIFIER_OK == (rc = check_user_version(item_cache)) &&
         CLASSIFIER_OK == (rc = attach_database(item_cache->db, atom_path, "atom")) &&
-        CLASSIFIER_OK == (rc = attach_database(item_cache->db, token_path, "token"))) {
+        CLASSIFIER_OK == (rc = attach_database(item_cache->db, token_path, "token")) &&
+        CLASSIFIER_OK == (rc = set_pragmas(item_cache))) {
 
       rc = create_prepared_statements(item_cache);
       sqlite3_busy_timeout(item_cache->db, 1000);
@@ -457,141 +1003,348 @@ static int item_cache_open_database(ItemCache *item_cache) {
   return rc;
 }
 
-static int serialize_tokens(Item * item, int *size, char ** token_data) {
-  int rc = CLASSIFIER_OK;
-  int num_tokens = item_get_num_tokens(item);
-  *size = num_tokens * 6;
+/* Asks the kernel to start reading a database file into the page cache.
+ *
+ * The loader reads the catalog and the token blobs in key order, which is
+ * the order they are stored in once winnow-cluster-tokens has been run, so
+ * the read ahead is sequential and the loader mostly finds its pages cached.
+ */
+static void prefetch_database_file(ItemCache * item_cache, const char * name) {
+#if HAVE_POSIX_FADVISE
+  char path[MAXPATHLEN];
+  int fd;
 
-  if (NULL == (*token_data = calloc(num_tokens, 6))) {
-    fatal("Could not allocate data for token array");
-    rc = CLASSIFIER_FAIL;
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/%s", item_cache->cache_directory, name)) {
+    error("Path to %s too long: %s", name, item_cache->cache_directory);
+  } else if (0 > (fd = open(path, O_RDONLY))) {
+    error("Could not open %s to prefetch it: %s", path, strerror(errno));
   } else {
-    int token = 0;
-    short frequency = 0;
-    char * position = token_data[0];
-
-    while (item_next_token(item, &token, &frequency)) {
-      /* Always write the tokens out in network byte order. */
-      int out_token = htonl(token);
-      short out_frequency = htons(frequency);
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)) {
+      error("Could not prefetch %s", path);
+    } else {
+      debug("Prefetching %s", path);
+    }
 
-      // Make sure we haven't overflowed
-      if (position - token_data[0] > *size) {
-        error("Error allocating enough memory for tokens.");
-        free(*token_data);
-        rc = CLASSIFIER_FAIL;
-        break;
-      }
+    close(fd);
+  }
+#endif
+}
 
-      memcpy(position, &out_token, 4);     position += 4;
-      memcpy(position, &out_frequency, 2); position += 2;
-    }
+/*****
+ * Token blob functions
+ *
+ * An item's tokens are stored in token.entry_tokens in one of two formats:
+ *
+ *  - The original fixed format, 6 bytes per token: a 4 byte token id followed
+ *    by a 2 byte frequency, both in network byte order.
+ *
+ *  - The compact format, a TOKEN_FORMAT_DELTA_VARINT tag byte followed by a
+ *    varint count of the tokens and then, for each token in ascending id order,
+ *    a varint of the difference from the previous token id and a varint frequency.
+ *
+ * Token ids are positive 31 bit integers so the first byte of a fixed format
+ * blob is always less than 0x80, which is what tells the two formats apart.
+ *****/
+
+static void put_varint(unsigned char ** position, uint32_t value) {
+  while (value >= 0x80) {
+    *(*position)++ = (unsigned char) (value | 0x80);
+    value >>= 7;
   }
 
-  return rc;
+  *(*position)++ = (unsigned char) value;
 }
 
-static int save_tokens(ItemCache *item_cache, int entry_id, const char * token_data, int size) {
-  int rc = CLASSIFIER_OK;
+/* Reads a varint, @returns false if it runs past end or is too long to be a uint32_t. */
+static int get_varint(const unsigned char ** position, const unsigned char * end, uint32_t * value) {
+  uint32_t result = 0;
+  int shift;
 
-  if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_tokens_stmt, 1, entry_id)) {
-    error("Error binding entry id to %s", INSERT_ENTRY_TOKENS);
-    rc = CLASSIFIER_FAIL;
-  } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_tokens_stmt, 2, token_data, size, SQLITE_TRANSIENT)) {
-    error("Error binding blob to %s", INSERT_ENTRY_TOKENS);
-    rc = CLASSIFIER_FAIL;
-  } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_tokens_stmt)) {
-    error("Error inserting token data for item %i: %s", entry_id, item_cache_errmsg(item_cache));
-    rc = CLASSIFIER_FAIL;
+  for (shift = 0; shift < 35 && *position < end; shift += 7) {
+    unsigned char byte = *(*position)++;
+    result |= (uint32_t) (byte & 0x7f) << shift;
+
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
   }
 
-  sqlite3_clear_bindings(item_cache->insert_tokens_stmt);
-  sqlite3_reset(item_cache->insert_tokens_stmt);
+  return false;
+}
 
-  return rc;
+static int is_compact_token_blob(const char * token_data, int size) {
+  return size > 0 && TOKEN_FORMAT_DELTA_VARINT == (unsigned char) token_data[0];
 }
 
-/* Fetches the tokens for the given item.
+/* Gets the number of tokens in a token blob without decoding it.
  *
- * @returns the number of tokens fetched for the the item.
+ * @returns the number of tokens or -1 if the blob is corrupt.
  */
-static int read_tokens(const char * token_data, int size, Item * item) {
-  int tokens_read = 0;
+static int token_blob_count(const char * token_data, int size) {
+  if (is_compact_token_blob(token_data, size)) {
+    const unsigned char *position = (const unsigned char *) token_data + 1;
+    uint32_t num_tokens;
 
-  if (!token_data) {
-    error("No token data for item");
-    tokens_read = -1;
+    if (!get_varint(&position, (const unsigned char *) token_data + size, &num_tokens) || num_tokens > INT_MAX) {
+      return -1;
+    }
+
+    return (int) num_tokens;
   } else if (0 != (size % TOKEN_BYTES)) {
-    error("Token data is corrupt for item $i (size = %i)", item->key, size);
-    tokens_read = -1;
+    return -1;
+  } else {
+    return size / TOKEN_BYTES;
+  }
+}
+
+/* Decodes a token blob of either format into ids and frequencies which must
+ * have room for token_blob_count tokens.
+ *
+ * @returns the number of tokens decoded or -1 if the blob is corrupt.
+ */
+static int token_blob_decode(const char * token_data, int size, uint32_t * ids, uint16_t * frequencies) {
+  int i, num_tokens = token_blob_count(token_data, size);
+
+  if (num_tokens < 0) {
+    return -1;
+  } else if (is_compact_token_blob(token_data, size)) {
+    const unsigned char *position = (const unsigned char *) token_data + 1;
+    const unsigned char *end = (const unsigned char *) token_data + size;
+    uint32_t token = 0, value;
+
+    /* Skip the count, token_blob_count has already read it. */
+    get_varint(&position, end, &value);
+
+    for (i = 0; i < num_tokens; i++) {
+      if (!get_varint(&position, end, &value)) {
+        return -1;
+      }
+
+      token += value;
+      ids[i] = token;
+
+      if (!get_varint(&position, end, &value)) {
+        return -1;
+      }
+
+      frequencies[i] = (uint16_t) value;
+    }
+
+    if (position != end) {
+      return -1;
+    }
   } else {
-    int i, num_tokens = size / TOKEN_BYTES;
     const char *token_p = token_data;
 
     for (i = 0; i < num_tokens; i++) {
-      int token;
-      short frequency;
+      uint32_t token;
+      uint16_t frequency;
       memcpy(&token,     token_p, 4); token_p += 4;
       memcpy(&frequency, token_p, 2); token_p += 2;
       /* Tokens are stored in network byte order so switch them to host byte order */
-      item_add_token(item, ntohl(token), ntohs(frequency));
-      tokens_read++;
+      ids[i] = ntohl(token);
+      frequencies[i] = ntohs(frequency);
     }
   }
 
-  return tokens_read;
+  return num_tokens;
 }
 
-static int fetch_tokens_for(ItemCache * item_cache, Item * item) {
-  int tokens_loaded = 0;
+/* Encodes tokens into a compact format blob, ids must be in ascending order.
+ *
+ * The caller must free *token_data.
+ */
+static int token_blob_encode(const uint32_t * ids, const uint16_t * frequencies, int num_tokens,
+                             int * size, char ** token_data) {
+  /* Each token is at most a 5 byte delta and a 3 byte frequency. */
+  unsigned char *data = malloc(1 + 5 + num_tokens * 8);
+  int i;
 
-  if (item_cache && item) {
-    if (SQLITE_OK != sqlite3_bind_int(item_cache->fetch_tokens_stmt, 1, item->key)) {
-      error("Could not bind item->key to stmt: %s", item_cache_errmsg(item_cache));
-      tokens_loaded = -1;
-    } else if (SQLITE_ROW != sqlite3_step(item_cache->fetch_tokens_stmt)) {
-      tokens_loaded = -1;
-    } else {
-      int blob_size = sqlite3_column_bytes(item_cache->fetch_tokens_stmt, 0);
-      const char *token_data = (char*) sqlite3_column_blob(item_cache->fetch_tokens_stmt, 0);
-      tokens_loaded = read_tokens(token_data, blob_size, item);
-    }
+  if (!data) {
+    fatal("Could not allocate data for token array");
+    return CLASSIFIER_FAIL;
+  }
 
-    sqlite3_clear_bindings(item_cache->fetch_tokens_stmt);
-    sqlite3_reset(item_cache->fetch_tokens_stmt);
+  unsigned char *position = data;
+  *position++ = TOKEN_FORMAT_DELTA_VARINT;
+  put_varint(&position, num_tokens);
+
+  for (i = 0; i < num_tokens; i++) {
+    put_varint(&position, i > 0 ? ids[i] - ids[i - 1] : ids[i]);
+    put_varint(&position, frequencies[i]);
   }
 
-  return tokens_loaded;
+  *size = position - data;
+  *token_data = (char *) data;
+
+  return CLASSIFIER_OK;
 }
 
-/* Fetches the item metadata from the catalog database.
- *
- * Caller must hold the db_access_mutex.
- */
-static Item * fetch_item_from_catalog(ItemCache * item_cache, const char * id) {
-	Item *item = NULL;
-	trace("thread(%p) has locked db_access_mutex to fetch %s", pthread_self(), id);
+static int serialize_tokens(Item * item, int *size, char ** token_data) {
+  int rc = CLASSIFIER_OK;
+  int num_tokens = item_get_num_tokens(item);
+  uint32_t *ids = malloc(num_tokens * sizeof(uint32_t) + 1);
+  uint16_t *frequencies = malloc(num_tokens * sizeof(uint16_t) + 1);
 
-	int sqlite3_rc = sqlite3_bind_text(item_cache->fetch_item_stmt, 1, id, -1, NULL);
+  if (!ids || !frequencies) {
+    fatal("Could not allocate data for token array");
+    rc = CLASSIFIER_FAIL;
+  } else {
+    int token = 0, i = 0, position = 0;
+    short frequency = 0;
+
+    /* item_next_token_from returns the tokens in ascending order. */
+    while (i < num_tokens && item_next_token_from(item, &position, &token, &frequency)) {
+      ids[i] = token;
+      frequencies[i] = frequency;
+      i++;
+    }
+
+    rc = token_blob_encode(ids, frequencies, i, size, token_data);
+  }
+
+  free(ids);
+  free(frequencies);
+  return rc;
+}
+
+static int save_tokens(ItemCache *item_cache, int entry_id, const char * token_data, int size) {
+  int rc = CLASSIFIER_OK;
+
+  if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_tokens_stmt, 1, entry_id)) {
+    error("Error binding entry id to %s", INSERT_ENTRY_TOKENS);
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_tokens_stmt, 2, token_data, size, SQLITE_TRANSIENT)) {
+    error("Error binding blob to %s", INSERT_ENTRY_TOKENS);
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_tokens_stmt)) {
+    error("Error inserting token data for item %i: %s", entry_id, item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  sqlite3_clear_bindings(item_cache->insert_tokens_stmt);
+  sqlite3_reset(item_cache->insert_tokens_stmt);
+
+  return rc;
+}
+
+/* Records the number of tokens an entry has so loading can skip it without reading its tokens. */
+static int save_token_count(ItemCache *item_cache, int entry_id, int num_tokens) {
+  int rc = CLASSIFIER_OK;
+
+  if (SQLITE_OK != sqlite3_bind_int(item_cache->update_token_count_stmt, 1, num_tokens) ||
+      SQLITE_OK != sqlite3_bind_int(item_cache->update_token_count_stmt, 2, entry_id) ||
+      SQLITE_DONE != sqlite3_step(item_cache->update_token_count_stmt)) {
+    error("Error saving token count for item %i: %s", entry_id, item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  }
+
+  sqlite3_clear_bindings(item_cache->update_token_count_stmt);
+  sqlite3_reset(item_cache->update_token_count_stmt);
+
+  return rc;
+}
+
+/* Fetches the tokens for the given item.
+ *
+ * @returns the number of tokens fetched for the the item.
+ */
+static int read_tokens(const char * token_data, int size, Item * item) {
+  int tokens_read = 0;
+  int num_tokens = token_data ? token_blob_count(token_data, size) : -1;
+
+  if (!token_data) {
+    error("No token data for item");
+    tokens_read = -1;
+  } else if (num_tokens < 0) {
+    error("Token data is corrupt for item %i (size = %i)", item->key, size);
+    tokens_read = -1;
+  } else {
+    uint32_t *ids = malloc(num_tokens * sizeof(uint32_t) + 1);
+    uint16_t *frequencies = malloc(num_tokens * sizeof(uint16_t) + 1);
+
+    if (!ids || !frequencies) {
+      fatal("Could not allocate tokens for item %i", item->key);
+      tokens_read = -1;
+    } else if (num_tokens != token_blob_decode(token_data, size, ids, frequencies)) {
+      error("Token data is corrupt for item %i (size = %i)", item->key, size);
+      tokens_read = -1;
+    } else {
+      int i;
+      for (i = 0; i < num_tokens; i++) {
+        item_add_token(item, ids[i], (short) frequencies[i]);
+        tokens_read++;
+      }
+    }
+
+    free(ids);
+    free(frequencies);
+  }
+
+  return tokens_read;
+}
+
+/* Reads an item's tokens using fetch_tokens_stmt, which can belong to any connection. */
+static int fetch_tokens_with(sqlite3_stmt * fetch_tokens_stmt, Item * item) {
+  int tokens_loaded = 0;
+
+  if (SQLITE_OK != sqlite3_bind_int(fetch_tokens_stmt, 1, item->key)) {
+    error("Could not bind item->key to stmt: %s", sqlite3_errmsg(sqlite3_db_handle(fetch_tokens_stmt)));
+    tokens_loaded = -1;
+  } else if (SQLITE_ROW != sqlite3_step(fetch_tokens_stmt)) {
+    tokens_loaded = -1;
+  } else {
+    int blob_size = sqlite3_column_bytes(fetch_tokens_stmt, 0);
+    const char *token_data = (char*) sqlite3_column_blob(fetch_tokens_stmt, 0);
+    tokens_loaded = read_tokens(token_data, blob_size, item);
+  }
+
+  sqlite3_clear_bindings(fetch_tokens_stmt);
+  sqlite3_reset(fetch_tokens_stmt);
+
+  return tokens_loaded;
+}
+
+static int fetch_tokens_for(ItemCache * item_cache, Item * item) {
+  int tokens_loaded = 0;
+
+  if (item_cache && item) {
+    tokens_loaded = fetch_tokens_with(item_cache->fetch_tokens_stmt, item);
+  }
+
+  return tokens_loaded;
+}
+
+/* Fetches the item metadata from the catalog database using fetch_item_stmt,
+ * which can belong to any connection.
+ *
+ * Caller must hold whatever lock protects the statement's connection.
+ */
+static Item * fetch_item_from_catalog(sqlite3_stmt * fetch_item_stmt, const char * id) {
+	Item *item = NULL;
+	trace("thread(%p) is fetching %s", pthread_self(), id);
+
+	int sqlite3_rc = sqlite3_bind_text(fetch_item_stmt, 1, id, -1, NULL);
 	if (SQLITE_OK != sqlite3_rc) {
-		fatal("fetch_item_stmt bind error = %s", item_cache_errmsg(item_cache));
+		fatal("fetch_item_stmt bind error = %s", sqlite3_errmsg(sqlite3_db_handle(fetch_item_stmt)));
 		item = NULL;
 	} else {
-		sqlite3_rc = sqlite3_step(item_cache->fetch_item_stmt);
+		sqlite3_rc = sqlite3_step(fetch_item_stmt);
 
 		if (SQLITE_ROW == sqlite3_rc) {
-			item = create_item(sqlite3_column_text(item_cache->fetch_item_stmt, 0),
-                         sqlite3_column_int(item_cache->fetch_item_stmt, 1),
-                         sqlite3_column_int64(item_cache->fetch_item_stmt, 2));
+			item = create_item(sqlite3_column_text(fetch_item_stmt, 0),
+                         sqlite3_column_int(fetch_item_stmt, 1),
+                         sqlite3_column_int64(fetch_item_stmt, 2));
 		} else if (SQLITE_DONE != sqlite3_rc) {
-			error("Error fetching item %d: %s", id, item_cache_errmsg(item_cache));
+			error("Error fetching item %s: %s", id, sqlite3_errmsg(sqlite3_db_handle(fetch_item_stmt)));
 		}
 	}
 
-	sqlite3_clear_bindings(item_cache->fetch_item_stmt);
-	sqlite3_reset(item_cache->fetch_item_stmt);
+	sqlite3_clear_bindings(fetch_item_stmt);
+	sqlite3_reset(fetch_item_stmt);
 
-	trace("thread(%p) has unlocked db_access_mutex after fetching %s", pthread_self(), id);
+	trace("thread(%p) has fetched %s", pthread_self(), id);
 
 	return item;
 }
@@ -615,21 +1368,97 @@ static int get_entry_key(ItemCache * item_cache, const char * entry_id) {
   return entry_key;
 }
 
-/* This will also update the entry's id. But side-effecty I guess */
-static int _is_new_entry(ItemCache * item_cache, ItemCacheEntry * entry) {
+/* This will also update the entry's id. But side-effecty I guess
+ *
+ * unchanged is set if the entry is stored with the same atom and its tokens.
+ */
+static int _is_new_entry(ItemCache * item_cache, ItemCacheEntry * entry, int * unchanged) {
   int is_new_entry = true;
 
-  sqlite3_bind_text(item_cache->fetch_item_stmt, 1, entry->full_id, -1, NULL);
-  if (SQLITE_ROW == sqlite3_step(item_cache->fetch_item_stmt)) {
+  if (entry->content_hash) {
+    sqlite3_bind_int64(item_cache->fetch_entry_state_stmt, 1, entry->content_hash);
+  }
+
+  sqlite3_bind_text(item_cache->fetch_entry_state_stmt, 2, entry->full_id, -1, NULL);
+  if (SQLITE_ROW == sqlite3_step(item_cache->fetch_entry_state_stmt)) {
     is_new_entry = false;
-    entry->id = sqlite3_column_int(item_cache->fetch_item_stmt, 1);
+    entry->id = sqlite3_column_int(item_cache->fetch_entry_state_stmt, 0);
+    *unchanged = sqlite3_column_int(item_cache->fetch_entry_state_stmt, 1);
   }
 
-  sqlite3_clear_bindings(item_cache->fetch_item_stmt);
-  sqlite3_reset(item_cache->fetch_item_stmt);
+  sqlite3_clear_bindings(item_cache->fetch_entry_state_stmt);
+  sqlite3_reset(item_cache->fetch_entry_state_stmt);
   return is_new_entry;
 }
 
+/* Compressed atoms start with a NUL byte, which can't start an XML document,
+ * and a 'z', followed by the uncompressed size as a 4 byte network order
+ * integer and then the zlib stream.
+ */
+static int is_compressed_atom(const char * data, int size) {
+  return size >= ATOM_ZLIB_HEADER_BYTES && '\0' == data[0] && 'z' == data[1];
+}
+
+/* Compresses atom XML, the caller must free *data. */
+static int compress_atom(const char * xml, int size, char ** data, int * data_size) {
+  uLongf compressed_size = compressBound(size);
+  uint32_t out_size = htonl(size);
+
+  if (NULL == (*data = malloc(ATOM_ZLIB_HEADER_BYTES + compressed_size))) {
+    fatal("Could not allocate compressed atom");
+    return CLASSIFIER_FAIL;
+  }
+
+  if (Z_OK != compress2((Bytef*) *data + ATOM_ZLIB_HEADER_BYTES, &compressed_size, (const Bytef*) xml, size, Z_DEFAULT_COMPRESSION)) {
+    error("Could not compress atom");
+    free(*data);
+    *data = NULL;
+    return CLASSIFIER_FAIL;
+  }
+
+  (*data)[0] = '\0';
+  (*data)[1] = 'z';
+  memcpy(*data + 2, &out_size, 4);
+  *data_size = ATOM_ZLIB_HEADER_BYTES + compressed_size;
+
+  return CLASSIFIER_OK;
+}
+
+/* Gets a NUL terminated copy of atom XML, decompressing it if required.
+ *
+ * @returns the XML, which the caller must free, or NULL if it couldn't be decompressed.
+ */
+static char * decompress_atom(const char * data, int size) {
+  char *xml = NULL;
+
+  if (!is_compressed_atom(data, size)) {
+    if ((xml = malloc(size + 1))) {
+      memcpy(xml, data, size);
+      xml[size] = '\0';
+    }
+  } else {
+    uint32_t xml_size;
+    uLongf uncompressed_size;
+
+    memcpy(&xml_size, data + 2, 4);
+    uncompressed_size = xml_size = ntohl(xml_size);
+
+    if (NULL == (xml = malloc(xml_size + 1))) {
+      fatal("Could not allocate atom");
+    } else if (Z_OK != uncompress((Bytef*) xml, &uncompressed_size,
+                                  (const Bytef*) data + ATOM_ZLIB_HEADER_BYTES, size - ATOM_ZLIB_HEADER_BYTES) ||
+               uncompressed_size != xml_size) {
+      error("Compressed atom is corrupt");
+      free(xml);
+      xml = NULL;
+    } else {
+      xml[xml_size] = '\0';
+    }
+  }
+
+  return xml;
+}
+
 static int save_entry_xml(ItemCache *item_cache, ItemCacheEntry *entry) {
   int rc = CLASSIFIER_OK;
 
@@ -638,19 +1467,31 @@ static int save_entry_xml(ItemCache *item_cache, ItemCacheEntry *entry) {
     rc = CLASSIFIER_FAIL;
   } else {
     int size = strlen(entry->atom);
-    if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_stmt, 1, entry->id)) {
+    const char *data = entry->atom;
+    char *compressed = NULL;
+
+    if (item_cache->compress_atoms && CLASSIFIER_OK == compress_atom(entry->atom, size, &compressed, &size)) {
+      data = compressed;
+    }
+
+    /* The atom is keyed by the entry's id, item_cache_fetch_entry_atom looks it up by that id */
+    if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_xml_stmt, 1, entry->id)) {
       error("Unable to bind atom id: %s", item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
-    } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_atom_xml_stmt, 2, entry->atom, size, SQLITE_TRANSIENT)) {
+    } else if (SQLITE_OK != sqlite3_bind_blob(item_cache->insert_atom_xml_stmt, 2, data, size, SQLITE_TRANSIENT)) {
       error("Unable to bind atom xml: %s", item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
     } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_xml_stmt)) {
       error("Unable to insert atom xml: %s", item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
+    } else if (entry->id != sqlite3_last_insert_rowid(item_cache->db)) {
+      error("Atom xml for entry %i was stored as %lli", entry->id, sqlite3_last_insert_rowid(item_cache->db));
+      rc = CLASSIFIER_FAIL;
     }
 
     sqlite3_clear_bindings(item_cache->insert_atom_xml_stmt);
     sqlite3_reset(item_cache->insert_atom_xml_stmt);
+    free(compressed);
   }
 
   return rc;
@@ -666,6 +1507,10 @@ static int insert_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
     sqlite3_bind_double(item_cache->insert_entry_stmt, 2, entry->updated);
     sqlite3_bind_double(item_cache->insert_entry_stmt, 3, entry->created_at);
 
+    if (entry->content_hash) {
+      sqlite3_bind_int64(item_cache->insert_entry_stmt, 4, entry->content_hash);
+    }
+
     if (SQLITE_DONE != sqlite3_step(item_cache->insert_entry_stmt)) {
       error("Error inserting item %s: %s", entry->full_id, item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
@@ -682,7 +1527,12 @@ static int insert_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
 static int update_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
   int rc = CLASSIFIER_OK;
   sqlite3_bind_double(item_cache->update_entry_stmt, 1, entry->updated);
-  sqlite3_bind_text(item_cache->update_entry_stmt, 2, entry->full_id, -1, NULL);
+
+  if (entry->content_hash) {
+    sqlite3_bind_int64(item_cache->update_entry_stmt, 2, entry->content_hash);
+  }
+
+  sqlite3_bind_text(item_cache->update_entry_stmt, 3, entry->full_id, -1, NULL);
 
   if (SQLITE_DONE != sqlite3_step(item_cache->update_entry_stmt)) {
     error("Error update item %s: %s", entry->full_id, item_cache_errmsg(item_cache));
@@ -723,6 +1573,8 @@ static void * item_cache_purge_thread_func(void *memo) {
   while (!item_cache->shutting_down) {
     sleep(item_cache->purge_interval);
     item_cache_purge_old_items(item_cache);
+    /* Keep the snapshot reasonably fresh in case we don't get shutdown cleanly. */
+    item_cache_save_snapshot(item_cache);
   }
 
   return NULL;
@@ -815,259 +1667,4138 @@ static void * cache_updating_func(void *memo) {
   return NULL;
 }
 
-/* Insert an item in the items by id cache.
+/******************************************************************************
+ * Savepoint functions
+ ******************************************************************************/
+
+/* Starts a savepoint so a group of writes can be applied or undone together.
  *
- * Caller must hold a write lock on the cache.
+ * A savepoint nests inside the write batch if one is open and otherwise
+ * starts its own transaction which is committed when it is released, so
+ * callers don't need to know whether they are running inside a batch.
+ *
+ * Caller must hold db_access_mutex.
  */
-static int items_by_id_insert(ItemCache * item_cache, Item * item) {
-  int rc = CLASSIFIER_OK;
+static int savepoint_begin(ItemCache * item_cache, const char * name) {
+  char sql[64];
 
-  PWord_t item_pointer;
-  JSLI(item_pointer, item_cache->items_by_id, item->id);
-  if (NULL != item_pointer) {
-    *item_pointer = (Word_t) item;
-    item_cache->cached_size++;
-  } else {
-    fatal("Error malloc'ing item by id");
-    rc = CLASSIFIER_FAIL;
+  snprintf(sql, sizeof(sql), "savepoint %s", name);
+  if (SQLITE_OK != sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL)) {
+    error("Unable to start savepoint %s: %s", name, item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
   }
 
-  return rc;
+  return CLASSIFIER_OK;
 }
 
-static Item * items_by_id_get(ItemCache * item_cache, const unsigned char * id) {
-	Item *item = NULL;
+/* Releases the savepoint, undoing its writes first unless rc is CLASSIFIER_OK.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static void savepoint_end(ItemCache * item_cache, const char * name, int rc) {
+  char sql[64];
 
-	PWord_t item_pointer;
-	JSLG(item_pointer, item_cache->items_by_id, id);
-	if (NULL != item_pointer) {
-		item = (Item*)(*item_pointer);
-	}
+  if (CLASSIFIER_OK != rc) {
+    snprintf(sql, sizeof(sql), "rollback to %s", name);
+    sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL);
+  }
 
-	return item;
+  snprintf(sql, sizeof(sql), "release %s", name);
+  sqlite3_exec(item_cache->db, sql, NULL, NULL, NULL);
 }
 
-static int items_by_id_remove(ItemCache * item_cache, Item * item) {
-  int judyrc;
+/******************************************************************************
+ * Token dictionary functions
+ ******************************************************************************/
+
+/* Adds token to the dictionary as atom.
+ *
+ * Caller must hold a write lock on atoms_lock.
+ */
+static int token_dictionary_add(ItemCache * item_cache, int atom, const char * token) {
+  PWord_t atom_pointer;
 
-  JSLD(judyrc, item_cache->items_by_id, item->id);
-  if (judyrc) {
-    item_cache->cached_size--;
+  if (atom < 0) {
+    return CLASSIFIER_FAIL;
   }
 
-  return judyrc == 1 ? CLASSIFIER_OK : CLASSIFIER_FAIL;
-}
+  if (atom >= item_cache->tokens_by_atom_capacity) {
+    int capacity = item_cache->tokens_by_atom_capacity ? item_cache->tokens_by_atom_capacity : 1024;
+    while (capacity <= atom) {
+      capacity *= 2;
+    }
 
+    char **tokens = realloc(item_cache->tokens_by_atom, capacity * sizeof(char*));
+    if (!tokens) {
+      fatal("Could not realloc token dictionary");
+      return CLASSIFIER_FAIL;
+    }
 
-static OrderedItemList * ordered_item_list_insert_after(OrderedItemList * insert_after, Item * item) {
-  OrderedItemList * new = malloc(sizeof(OrderedItemList));
-  if (!new) {
-    fatal("Could not malloc OrderedItemList");
-  } else {
-    new->item = item;
-    new->next = NULL;
+    memset(&tokens[item_cache->tokens_by_atom_capacity], 0,
+           (capacity - item_cache->tokens_by_atom_capacity) * sizeof(char*));
+    item_cache->tokens_by_atom = tokens;
+    item_cache->tokens_by_atom_capacity = capacity;
+  }
 
-    if (insert_after) {
-      new->next = insert_after->next;
-      insert_after->next = new;
-    }
+  if (NULL == (item_cache->tokens_by_atom[atom] = strdup(token))) {
+    fatal("Could not copy token %s", token);
+    return CLASSIFIER_FAIL;
+  }
+
+  JSLI(atom_pointer, item_cache->atoms_by_token, (const uint8_t*) token);
+  if (atom_pointer == PJERR) {
+    fatal("Could not insert %s into the token dictionary", token);
+    return CLASSIFIER_FAIL;
+  }
+
+  *atom_pointer = atom;
+
+  if (atom >= item_cache->next_atom) {
+    item_cache->next_atom = atom + 1;
   }
 
-  return new;
+  return CLASSIFIER_OK;
 }
 
-/* Inserts item in list and returns the head of the list.
+/* Records that an atom needs to be saved to the tokens table.
  *
- * Order is descending item time.
+ * Caller must hold a write lock on atoms_lock.
  */
-static OrderedItemList * ordered_item_list_insert_in_order(OrderedItemList * list, Item * item) {
-  OrderedItemList *head = list;
-  OrderedItemList *new_node = calloc(1, sizeof(struct ORDERED_ITEM_LIST));
+static int token_dictionary_add_unsaved(ItemCache * item_cache, int atom) {
+  if (item_cache->num_unsaved_atoms == item_cache->unsaved_atoms_capacity) {
+    int capacity = item_cache->unsaved_atoms_capacity + 256;
+    int *unsaved_atoms = realloc(item_cache->unsaved_atoms, capacity * sizeof(int));
+
+    if (!unsaved_atoms) {
+      fatal("Could not realloc unsaved atoms");
+      return CLASSIFIER_FAIL;
+    }
 
-  if (new_node) {
-    new_node->item = item;
-    new_node->next = NULL;
+    item_cache->unsaved_atoms = unsaved_atoms;
+    item_cache->unsaved_atoms_capacity = capacity;
+  }
 
-    if (head == NULL) {
-      head = new_node;
-    } else if (head->item->time < new_node->item->time) {
-      new_node->next = head;
-      head = new_node;
-    } else {
-      OrderedItemList *current = head;
+  item_cache->unsaved_atoms[item_cache->num_unsaved_atoms++] = atom;
+  return CLASSIFIER_OK;
+}
 
-      while (current->next != NULL) {
-        if (current->next->item->time < item->time) {
-          new_node->next = current->next;
-          current->next = new_node;
-          break;
-        } else {
-          current = current->next;
-        }
-      }
+/* Records that atoms need to be saved to the tokens table, skipping any
+ * that have since been removed from the dictionary.
+ *
+ * Caller must hold a write lock on atoms_lock.
+ */
+static int token_dictionary_add_all_unsaved(ItemCache * item_cache, const int * atoms, int num_atoms) {
+  int rc = CLASSIFIER_OK;
+  int i;
 
-      if (current->next == NULL) {
-        current->next = new_node;
-      }
+  for (i = 0; CLASSIFIER_OK == rc && i < num_atoms; i++) {
+    if (atoms[i] < item_cache->tokens_by_atom_capacity && item_cache->tokens_by_atom[atoms[i]]) {
+      rc = token_dictionary_add_unsaved(item_cache, atoms[i]);
     }
   }
 
-  return head;
+  if (CLASSIFIER_OK != rc) {
+    fatal("Could not realloc unsaved atoms, %i tokens will not be saved", num_atoms - i + 1);
+  }
+
+  return rc;
 }
 
-static OrderedItemList * ordered_item_list_split(OrderedItemList * list, time_t split_time) {
-  OrderedItemList *leftovers = NULL;
-  OrderedItemList *current = list;
-  OrderedItemList *previous = NULL;
+/* Stops giving atom to new tokens once its row in the tokens table is deleted.
+ *
+ * The token stays in tokens_by_atom so an item that already has the atom
+ * can still restore it, see token_dictionary_restore.
+ *
+ * Caller must hold a write lock on atoms_lock.
+ */
+static void token_dictionary_hide(ItemCache * item_cache, int atom) {
+  PWord_t atom_pointer;
+  int judyrc;
 
-  /* Find the point in the list where items are older than purge_time and remove them. */
-  for ( ; current != NULL; previous = current, current = current->next) {
-    if (current->item->time < split_time) {
-      if (previous) {
-        previous->next = NULL;
-      }
+  if (atom < item_cache->tokens_by_atom_capacity && item_cache->tokens_by_atom[atom]) {
+    JSLG(atom_pointer, item_cache->atoms_by_token, (const uint8_t*) item_cache->tokens_by_atom[atom]);
+    if (atom_pointer && *atom_pointer == atom) {
+      JSLD(judyrc, item_cache->atoms_by_token, (const uint8_t*) item_cache->tokens_by_atom[atom]);
+    }
+  }
+}
 
-      leftovers = current;
-      break;
+/* Gives a hidden atom back to its token and queues it to be saved again.
+ *
+ * Caller must hold a write lock on atoms_lock.
+ */
+static int token_dictionary_restore(ItemCache * item_cache, int atom) {
+  PWord_t atom_pointer;
+
+  if (atom < item_cache->tokens_by_atom_capacity && item_cache->tokens_by_atom[atom]) {
+    JSLI(atom_pointer, item_cache->atoms_by_token, (const uint8_t*) item_cache->tokens_by_atom[atom]);
+    if (PJERR == atom_pointer) {
+      fatal("Could not insert %s into the token dictionary", item_cache->tokens_by_atom[atom]);
+      return CLASSIFIER_FAIL;
+    }
+
+    /* The token could have been given a new atom since it was hidden */
+    if (!*atom_pointer) {
+      *atom_pointer = atom;
     }
   }
 
-  return leftovers;
+  return token_dictionary_add_unsaved(item_cache, atom);
 }
 
-/* Loads all the items into the cache.
+/* Removes a hidden atom's token from the dictionary.
  *
- * Caller must hold the db_access mutex and a write lock on the cache.
+ * Caller must hold a write lock on atoms_lock and db_access_mutex, since
+ * token_dictionary_save reads tokens_by_atom without holding atoms_lock.
+ */
+static void token_dictionary_remove(ItemCache * item_cache, int atom) {
+  token_dictionary_hide(item_cache, atom);
+
+  if (atom < item_cache->tokens_by_atom_capacity) {
+    free(item_cache->tokens_by_atom[atom]);
+    item_cache->tokens_by_atom[atom] = NULL;
+  }
+}
+
+/* Reads the tokens table into the dictionary if it hasn't been read yet.
+ *
+ * This is done on first use instead of when the cache is created so tools
+ * that never atomize anything don't pay for it.
+ *
+ * Caller must not hold db_access_mutex or atoms_lock.
  */
-static int load_all_items(ItemCache * item_cache) {
+static int token_dictionary_load(ItemCache * item_cache) {
   int rc = CLASSIFIER_OK;
-  OrderedItemList * last = item_cache->items_in_order;
 
-  sqlite3_bind_int(item_cache->fetch_all_items_stmt, 1, item_cache->load_items_since);
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  pthread_rwlock_wrlock(&item_cache->atoms_lock);
 
-  /* Load the item ids and timestamp indexing and order them by each. */
-  while (SQLITE_ROW == sqlite3_step(item_cache->fetch_all_items_stmt)) {
-    const unsigned char * id = sqlite3_column_text(item_cache->fetch_all_items_stmt, 0);
-    int key = sqlite3_column_int(item_cache->fetch_all_items_stmt, 1);
-    time_t item_time = sqlite3_column_int64(item_cache->fetch_all_items_stmt, 2);
+  if (!item_cache->atoms_loaded) {
+    sqlite3_stmt *stmt;
 
-    Item *item = create_item(id, key, item_time);
-    if (NULL == item) {
+    if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, LOAD_ATOMS_SQL, -1, &stmt, NULL)) {
+      error("Unable to prepare %s: %s", LOAD_ATOMS_SQL, item_cache_errmsg(item_cache));
       rc = CLASSIFIER_FAIL;
-      break;
-    }
+    } else {
+      int sqlite_rc;
+      int count = 0;
 
-    if (item_cache->min_tokens > fetch_tokens_for(item_cache, item)) {
-      free_item(item);
-      continue;
-    }
+      item_cache->next_atom = 1;
 
-    if (items_by_id_insert(item_cache, item)) {
-      rc = CLASSIFIER_FAIL;
-      free_item(item);
-      break;
-    }
+      while (SQLITE_ROW == (sqlite_rc = sqlite3_step(stmt))) {
+        const char *token = (const char*) sqlite3_column_text(stmt, 1);
+        if (token && CLASSIFIER_OK != token_dictionary_add(item_cache, sqlite3_column_int(stmt, 0), token)) {
+          rc = CLASSIFIER_FAIL;
+          break;
+        }
+        count++;
+      }
 
-    if (NULL == (last = ordered_item_list_insert_after(last, item))) {
-      free_item(item);
-      break;
-    }
+      if (CLASSIFIER_OK == rc && SQLITE_DONE != sqlite_rc) {
+        error("Error loading tokens: %s", item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      }
+
+      sqlite3_finalize(stmt);
 
-    if (!item_cache->items_in_order) {
-      item_cache->items_in_order = last;
+      if (CLASSIFIER_OK == rc) {
+        item_cache->atoms_loaded = true;
+        info("Loaded %i tokens into the token dictionary", count);
+      }
     }
   }
 
-  sqlite3_clear_bindings(item_cache->fetch_all_items_stmt);
-  sqlite3_reset(item_cache->fetch_all_items_stmt);
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
 
   return rc;
 }
 
-static int load_random_background(ItemCache * item_cache) {
-  int rndbg_item_count = 0;
-  item_cache->random_background = new_pool();
+/* Loads the dictionary unless it has already been loaded.
+ *
+ * Caller must not hold db_access_mutex or atoms_lock.
+ */
+static int token_dictionary_ready(ItemCache * item_cache) {
+  int loaded;
 
-  while (SQLITE_ROW == sqlite3_step(item_cache->random_background_stmt)) {
-    const unsigned char * id = sqlite3_column_text(item_cache->random_background_stmt, 0);
-    int key = sqlite3_column_int(item_cache->random_background_stmt, 1);
-    Item *item = create_item(id, key, -1);
+  pthread_rwlock_rdlock(&item_cache->atoms_lock);
+  loaded = item_cache->atoms_loaded;
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
 
-    if (item) {
-      if (fetch_tokens_for(item_cache, item)) {
-        pool_add_item(item_cache->random_background, item);
-      }
+  return loaded ? CLASSIFIER_OK : token_dictionary_load(item_cache);
+}
 
-      free_item(item);
-      rndbg_item_count++;
-    } else {
-      error("Could not create item: %s (%i)", id, key);
+/* Records that atom's token was saved as saved_atom.
+ *
+ * New tokens are given saved_atom from now on unless it is already the
+ * atom for some other token in this cache, in which case the token keeps
+ * its old atom in memory and is only translated when items are saved.
+ *
+ * Caller must hold a write lock on atoms_lock.
+ */
+static int token_dictionary_alias(ItemCache * item_cache, int atom, int saved_atom, const char * token) {
+  PWord_t atom_pointer;
+
+  JLI(atom_pointer, item_cache->atom_aliases, (Word_t) atom);
+  if (PJERR == atom_pointer) {
+    fatal("Could not malloc atom alias");
+    return CLASSIFIER_FAIL;
+  }
+
+  *atom_pointer = saved_atom;
+
+  if (saved_atom >= item_cache->tokens_by_atom_capacity || !item_cache->tokens_by_atom[saved_atom]) {
+    /* Also saved next time in case the insert that found saved_atom is rolled back. */
+    if (CLASSIFIER_OK != token_dictionary_add(item_cache, saved_atom, token)) {
+      return CLASSIFIER_FAIL;
     }
+    return token_dictionary_add_unsaved(item_cache, saved_atom);
+  } else if (strcmp(token, item_cache->tokens_by_atom[saved_atom])) {
+    error("Token %s was saved as atom %i which is %s in this cache", token, saved_atom, item_cache->tokens_by_atom[saved_atom]);
+    return CLASSIFIER_OK;
+  }
+
+  JSLI(atom_pointer, item_cache->atoms_by_token, (const uint8_t*) token);
+  if (PJERR == atom_pointer) {
+    fatal("Could not insert %s into the token dictionary", token);
+    return CLASSIFIER_FAIL;
   }
-  sqlite3_reset(item_cache->random_background_stmt);
-  info("Randombackground contains %i items", rndbg_item_count);
 
+  *atom_pointer = saved_atom;
   return CLASSIFIER_OK;
 }
 
-/*****************************************************************************
- * External API functions for the item cache.
+/* Finds the id of a token whose atom was ignored by the tokens table.
+ *
+ * That happens when something other than this cache wrote to the tokens
+ * table after the dictionary was loaded, either the token is already there
+ * with another id or the atom's id was taken by another token. In the
+ * second case the token is inserted with an id past both the table's and
+ * the dictionary's, so it can't clash with any atom this cache gave out.
+ *
+ * Caller must hold db_access_mutex and must not hold atoms_lock.
+ */
+static int token_dictionary_resolve(ItemCache * item_cache, int atom, const char * token) {
+  int rc = CLASSIFIER_OK;
+  int saved_atom = 0;
+
+  while (CLASSIFIER_OK == rc && !saved_atom) {
+    sqlite3_bind_text(item_cache->find_atom_stmt, 1, token, -1, SQLITE_STATIC);
+    if (SQLITE_ROW == sqlite3_step(item_cache->find_atom_stmt)) {
+      saved_atom = sqlite3_column_int(item_cache->find_atom_stmt, 0);
+    }
+    sqlite3_clear_bindings(item_cache->find_atom_stmt);
+    sqlite3_reset(item_cache->find_atom_stmt);
+
+    if (!saved_atom) {
+      sqlite3_stmt *max_stmt;
+      int new_atom = 0;
+
+      if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, MAX_ATOM_SQL, -1, &max_stmt, NULL)) {
+        if (SQLITE_ROW == sqlite3_step(max_stmt)) {
+          new_atom = sqlite3_column_int(max_stmt, 0) + 1;
+        }
+        sqlite3_finalize(max_stmt);
+      }
+
+      pthread_rwlock_wrlock(&item_cache->atoms_lock);
+      if (new_atom < item_cache->next_atom) {
+        new_atom = item_cache->next_atom;
+      }
+      item_cache->next_atom = new_atom + 1;
+      pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+      if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_stmt, 1, new_atom) ||
+          SQLITE_OK != sqlite3_bind_text(item_cache->insert_atom_stmt, 2, token, -1, SQLITE_STATIC) ||
+          SQLITE_DONE != sqlite3_step(item_cache->insert_atom_stmt)) {
+        error("Error inserting token %s: %s", token, item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      }
+
+      sqlite3_clear_bindings(item_cache->insert_atom_stmt);
+      sqlite3_reset(item_cache->insert_atom_stmt);
+    }
+  }
+
+  if (CLASSIFIER_OK == rc && saved_atom != atom) {
+    info("Token %s was saved as atom %i instead of %i", token, saved_atom, atom);
+    pthread_rwlock_wrlock(&item_cache->atoms_lock);
+    rc = token_dictionary_alias(item_cache, atom, saved_atom, token);
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
+  }
+
+  return rc;
+}
+
+/* Rewrites the item's aliased atoms with the ids their tokens were saved as.
+ *
+ * @returns true if any of the item's tokens were rewritten.
+ */
+static int item_apply_atom_aliases(ItemCache * item_cache, Item * item) {
+  int rewritten = false;
+
+  /* Packed items are only built from tokens read from the database. */
+  if (!item->arena) {
+    int i, num_aliased = 0;
+    Word_t atom = 0;
+    Word_t *aliased = NULL;
+    PWord_t frequency = NULL, saved_atom;
+
+    pthread_rwlock_rdlock(&item_cache->atoms_lock);
+    if (item_cache->atom_aliases) {
+      if (NULL == (aliased = malloc(3 * item_get_num_tokens(item) * sizeof(Word_t) + 1))) {
+        fatal("Could not malloc aliased atoms");
+      } else {
+        JLF(frequency, item->tokens, atom);
+      }
+    }
+
+    while (frequency) {
+      JLG(saved_atom, item_cache->atom_aliases, atom);
+      if (saved_atom) {
+        aliased[3 * num_aliased] = atom;
+        aliased[3 * num_aliased + 1] = *saved_atom;
+        aliased[3 * num_aliased + 2] = *frequency;
+        num_aliased++;
+      }
+      JLN(frequency, item->tokens, atom);
+    }
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+    /* Rewrite after the scan so a saved id can't be mistaken for an alias. */
+    for (i = 0; i < num_aliased; i++) {
+      int judyrc;
+      JLD(judyrc, item->tokens, aliased[3 * i]);
+    }
+
+    for (i = 0; i < num_aliased; i++) {
+      JLI(frequency, item->tokens, aliased[3 * i + 1]);
+      if (PJERR == frequency) {
+        fatal("Could not malloc memory for token array");
+        break;
+      }
+      *frequency += aliased[3 * i + 2];
+      rewritten = true;
+    }
+
+    free(aliased);
+  }
+
+  return rewritten;
+}
+
+/* Saves atoms created since the last save to the tokens table in a single transaction.
+ *
+ * Atoms are given out in memory so this must be called before anything that
+ * refers to them is written to the database, when there is a write batch open
+ * the atoms join it.
+ *
+ * Caller must hold db_access_mutex and must not hold atoms_lock.
+ */
+static int token_dictionary_save(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+  int *unsaved_atoms;
+  int num_unsaved_atoms;
+  int i;
+
+  pthread_rwlock_wrlock(&item_cache->atoms_lock);
+  unsaved_atoms = item_cache->unsaved_atoms;
+  num_unsaved_atoms = item_cache->num_unsaved_atoms;
+  item_cache->unsaved_atoms = NULL;
+  item_cache->num_unsaved_atoms = 0;
+  item_cache->unsaved_atoms_capacity = 0;
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+  if (num_unsaved_atoms > 0) {
+    rc = savepoint_begin(item_cache, "save_atoms");
+
+    for (i = 0; i < num_unsaved_atoms && CLASSIFIER_OK == rc; i++) {
+      const char *token;
+
+      /* Tokens are only removed from the dictionary while holding db_access_mutex, like we are,
+       * so this pointer stays valid after unlocking.
+       */
+      pthread_rwlock_rdlock(&item_cache->atoms_lock);
+      token = item_cache->tokens_by_atom[unsaved_atoms[i]];
+      pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+      int inserted = 0;
+
+      if (SQLITE_OK != sqlite3_bind_int(item_cache->insert_atom_stmt, 1, unsaved_atoms[i]) ||
+          SQLITE_OK != sqlite3_bind_text(item_cache->insert_atom_stmt, 2, token, -1, SQLITE_STATIC)) {
+        error("Error binding atom %i: %s", unsaved_atoms[i], item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_stmt)) {
+        error("Error executing atom insertion: %s", item_cache_errmsg(item_cache));
+        rc = CLASSIFIER_FAIL;
+      } else {
+        inserted = sqlite3_changes(item_cache->db);
+      }
+
+      sqlite3_clear_bindings(item_cache->insert_atom_stmt);
+      sqlite3_reset(item_cache->insert_atom_stmt);
+
+      /* The insert is ignored if the id or the token is already in the table. */
+      if (CLASSIFIER_OK == rc && !inserted) {
+        rc = token_dictionary_resolve(item_cache, unsaved_atoms[i], token);
+      }
+    }
+
+    savepoint_end(item_cache, "save_atoms", rc);
+
+    if (CLASSIFIER_OK == rc) {
+      debug("Saved %i new tokens", num_unsaved_atoms);
+
+      /* Remember them until the batch commits in case it is rolled back */
+      if (item_cache->write_batch_open) {
+        int needed = item_cache->num_write_batch_atoms + num_unsaved_atoms;
+        if (needed > item_cache->write_batch_atoms_capacity) {
+          int *batch_atoms = realloc(item_cache->write_batch_atoms, needed * 2 * sizeof(int));
+          if (batch_atoms) {
+            item_cache->write_batch_atoms = batch_atoms;
+            item_cache->write_batch_atoms_capacity = needed * 2;
+          }
+        }
+
+        if (needed <= item_cache->write_batch_atoms_capacity) {
+          memcpy(&item_cache->write_batch_atoms[item_cache->num_write_batch_atoms], unsaved_atoms, num_unsaved_atoms * sizeof(int));
+          item_cache->num_write_batch_atoms = needed;
+        } else {
+          fatal("Could not realloc write batch atoms, %i tokens will be lost if the batch fails", num_unsaved_atoms);
+        }
+      }
+    } else {
+      /* Put them back so they are saved next time */
+      pthread_rwlock_wrlock(&item_cache->atoms_lock);
+      token_dictionary_add_all_unsaved(item_cache, unsaved_atoms, num_unsaved_atoms);
+      pthread_rwlock_unlock(&item_cache->atoms_lock);
+    }
+  }
+
+  free(unsaved_atoms);
+  return rc;
+}
+
+static void free_token_dictionary(ItemCache * item_cache) {
+  Word_t freed_bytes;
+  int i;
+
+  for (i = 0; i < item_cache->tokens_by_atom_capacity; i++) {
+    free(item_cache->tokens_by_atom[i]);
+  }
+
+  free(item_cache->tokens_by_atom);
+  free(item_cache->unsaved_atoms);
+  free(item_cache->write_batch_atoms);
+  JSLFA(freed_bytes, item_cache->atoms_by_token);
+  JLFA(freed_bytes, item_cache->atom_aliases);
+}
+
+/******************************************************************************
+ * Write batch functions
+ ******************************************************************************/
+
+/* Opens a write batch if there isn't one open so the caller's writes join it.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static int write_batch_begin(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (!item_cache->write_batch_open) {
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, "begin", NULL, NULL, NULL)) {
+      error("Unable to begin write batch: %s", item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    } else {
+      item_cache->write_batch_open = true;
+      item_cache->write_batch_entries = 0;
+      item_cache->write_batch_number++;
+      gettimeofday(&item_cache->write_batch_started, NULL);
+      pthread_cond_signal(&item_cache->write_batch_cond);
+    }
+  }
+
+  return rc;
+}
+
+/* Queues the items saved in the open batch to be added to the cache, or frees
+ * them and puts the batch's atoms back on the unsaved list if it failed.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static void write_batch_finish(ItemCache * item_cache, int committed) {
+  int i;
+
+  for (i = 0; i < item_cache->num_write_batch_items; i++) {
+    if (committed) {
+      q_enqueue(item_cache->update_queue, create_add_job(item_cache->write_batch_items[i]));
+    } else {
+      free_item(item_cache->write_batch_items[i]);
+    }
+  }
+
+  if (!committed && item_cache->num_write_batch_atoms > 0) {
+    info("Saving the %i tokens from write batch %li again", item_cache->num_write_batch_atoms, item_cache->write_batch_number);
+    pthread_rwlock_wrlock(&item_cache->atoms_lock);
+    token_dictionary_add_all_unsaved(item_cache, item_cache->write_batch_atoms, item_cache->num_write_batch_atoms);
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
+  }
+
+  item_cache->num_write_batch_items = 0;
+  item_cache->num_write_batch_atoms = 0;
+}
+
+/* Commits the open write batch and wakes anyone waiting for it.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static int write_batch_commit(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+  Word_t freed_bytes;
+
+  if (item_cache->write_batch_open) {
+    if (sqlite3_get_autocommit(item_cache->db)) {
+      error("Write batch %li was rolled back", item_cache->write_batch_number);
+      item_cache->write_batch_failed = item_cache->write_batch_number;
+      rc = CLASSIFIER_FAIL;
+    } else if (SQLITE_OK != sqlite3_exec(item_cache->db, "commit", NULL, NULL, NULL)) {
+      error("Unable to commit write batch %li: %s", item_cache->write_batch_number, item_cache_errmsg(item_cache));
+      sqlite3_exec(item_cache->db, "rollback", NULL, NULL, NULL);
+      item_cache->write_batch_failed = item_cache->write_batch_number;
+      rc = CLASSIFIER_FAIL;
+    } else {
+      debug("Committed write batch %li with %i entries", item_cache->write_batch_number, item_cache->write_batch_entries);
+    }
+
+    write_batch_finish(item_cache, CLASSIFIER_OK == rc);
+
+    pthread_mutex_lock(&item_cache->write_batch_ids_mutex);
+    JSLFA(freed_bytes, item_cache->write_batch_ids);
+    pthread_mutex_unlock(&item_cache->write_batch_ids_mutex);
+
+    item_cache->write_batch_open = false;
+    item_cache->write_batch_committed = item_cache->write_batch_number;
+    pthread_cond_broadcast(&item_cache->write_committed_cond);
+  }
+
+  return rc;
+}
+
+/* Records that an entry's writes are done.
+ *
+ * The batch is committed straight away if it is full or batching is off.
+ *
+ * Caller must hold db_access_mutex.
+ *
+ * @return The number of the batch the writes are part of, to pass to write_batch_wait.
+ */
+static long write_batch_end(ItemCache * item_cache) {
+  long batch = item_cache->write_batch_number;
+
+  if (item_cache->write_batch_open &&
+      (++item_cache->write_batch_entries >= item_cache->write_batch_size || !item_cache->write_batch_thread)) {
+    write_batch_commit(item_cache);
+  }
+
+  return batch;
+}
+
+/* Waits until batch has been committed.
+ *
+ * Caller must hold db_access_mutex, it is released while waiting.
+ *
+ * @return CLASSIFIER_OK if the batch was committed or CLASSIFIER_FAIL if it failed.
+ */
+static int write_batch_wait(ItemCache * item_cache, long batch) {
+  while (item_cache->write_batch_committed < batch) {
+    pthread_cond_wait(&item_cache->write_committed_cond, &item_cache->db_access_mutex);
+  }
+
+  return item_cache->write_batch_failed == batch ? CLASSIFIER_FAIL : CLASSIFIER_OK;
+}
+
+/* Commits write batches once they have been open for write_batch_wait milliseconds. */
+static void * write_batch_thread_func(void *memo) {
+  ItemCache *item_cache = (ItemCache*) memo;
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+
+  while (!item_cache->shutting_down) {
+    if (item_cache->write_batch_open) {
+      struct timespec deadline;
+      long usec = item_cache->write_batch_started.tv_usec + item_cache->write_batch_wait * 1000L;
+      deadline.tv_sec = item_cache->write_batch_started.tv_sec + usec / 1000000;
+      deadline.tv_nsec = (usec % 1000000) * 1000;
+
+      if (ETIMEDOUT == pthread_cond_timedwait(&item_cache->write_batch_cond, &item_cache->db_access_mutex, &deadline) &&
+          item_cache->write_batch_open) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        /* Only commit if the batch that timed out is still the open one */
+        long elapsed = (now.tv_sec - item_cache->write_batch_started.tv_sec) * 1000L +
+                       (now.tv_usec - item_cache->write_batch_started.tv_usec) / 1000L;
+        if (elapsed >= item_cache->write_batch_wait) {
+          write_batch_commit(item_cache);
+        }
+      }
+    } else {
+      pthread_cond_wait(&item_cache->write_batch_cond, &item_cache->db_access_mutex);
+    }
+  }
+
+  write_batch_commit(item_cache);
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  return NULL;
+}
+
+/******************************************************************************
+ * Deferred touch functions
+ ******************************************************************************/
+
+/* Sets last_used_at for the entry.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static void touch_item_at(ItemCache * item_cache, const unsigned char * id, time_t touched_at) {
+  sqlite3_bind_int64(item_cache->touch_item_stmt, 1, touched_at);
+  sqlite3_bind_text(item_cache->touch_item_stmt, 2, (const char*) id, -1, NULL);
+
+  if (SQLITE_DONE != sqlite3_step(item_cache->touch_item_stmt)) {
+    error("Unable to touch %s: %s", id, item_cache_errmsg(item_cache));
+  }
+
+  sqlite3_clear_bindings(item_cache->touch_item_stmt);
+  sqlite3_reset(item_cache->touch_item_stmt);
+}
+
+/* Writes all pending touches to the database in one transaction.
+ *
+ * Caller must not hold db_access_mutex or touch_mutex.
+ */
+static int flush_touches(ItemCache * item_cache) {
+  Pvoid_t touches;
+
+  pthread_mutex_lock(&item_cache->touch_mutex);
+  touches = item_cache->pending_touches;
+  item_cache->pending_touches = NULL;
+  pthread_mutex_unlock(&item_cache->touch_mutex);
+
+  if (touches) {
+    uint8_t id[MAX_TOUCH_ID_LENGTH];
+    PWord_t touched_at;
+    Word_t freed_bytes;
+    int count = 0;
+
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    savepoint_begin(item_cache, "touch_items");
+
+    id[0] = '\0';
+    JSLF(touched_at, touches, id);
+    while (touched_at) {
+      touch_item_at(item_cache, id, (time_t) *touched_at);
+      count++;
+      JSLN(touched_at, touches, id);
+    }
+
+    savepoint_end(item_cache, "touch_items", CLASSIFIER_OK);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    JSLFA(freed_bytes, touches);
+    debug("Flushed %i touches", count);
+  }
+
+  return CLASSIFIER_OK;
+}
+
+static void * touch_flush_thread_func(void *memo) {
+  ItemCache *item_cache = (ItemCache*) memo;
+
+  pthread_mutex_lock(&item_cache->touch_mutex);
+
+  while (!item_cache->shutting_down) {
+    struct timespec deadline;
+    deadline.tv_sec = time(NULL) + item_cache->touch_flush_interval;
+    deadline.tv_nsec = 0;
+
+    pthread_cond_timedwait(&item_cache->touch_cond, &item_cache->touch_mutex, &deadline);
+
+    if (!item_cache->shutting_down) {
+      pthread_mutex_unlock(&item_cache->touch_mutex);
+      flush_touches(item_cache);
+      pthread_mutex_lock(&item_cache->touch_mutex);
+    }
+  }
+
+  pthread_mutex_unlock(&item_cache->touch_mutex);
+  return NULL;
+}
+
+/******************************************************************************
+ * Item timeline functions
+ ******************************************************************************/
+
+static ItemTimeline * new_item_timeline(void) {
+  ItemTimeline *timeline = calloc(1, sizeof(struct ITEM_TIMELINE));
+  if (!timeline) {
+    fatal("Could not malloc ItemTimeline");
+  }
+
+  return timeline;
+}
+
+static void free_item_timeline(ItemTimeline * timeline) {
+  if (timeline) {
+    int i;
+    for (i = 0; i < timeline->num_chunks; i++) {
+      free(timeline->chunks[i]);
+    }
+
+    free(timeline->chunks);
+    free(timeline);
+  }
+}
+
+/* Adds a new empty chunk to the directory at index.
+ *
+ * Returns the new chunk or NULL if it could not be allocated.
+ */
+static ItemTimelineChunk * item_timeline_insert_chunk(ItemTimeline * timeline, int index) {
+  ItemTimelineChunk *chunk;
+
+  if (timeline->num_chunks == timeline->chunks_capacity) {
+    int capacity = timeline->chunks_capacity ? timeline->chunks_capacity * 2 : 16;
+    ItemTimelineChunk **chunks = realloc(timeline->chunks, capacity * sizeof(ItemTimelineChunk*));
+    if (!chunks) {
+      fatal("Could not realloc ItemTimeline chunk directory");
+      return NULL;
+    }
+
+    timeline->chunks = chunks;
+    timeline->chunks_capacity = capacity;
+  }
+
+  if (NULL == (chunk = malloc(sizeof(struct ITEM_TIMELINE_CHUNK)))) {
+    fatal("Could not malloc ItemTimelineChunk");
+    return NULL;
+  }
+
+  chunk->size = 0;
+  memmove(&timeline->chunks[index + 1], &timeline->chunks[index],
+          (timeline->num_chunks - index) * sizeof(ItemTimelineChunk*));
+  timeline->chunks[index] = chunk;
+  timeline->num_chunks++;
+
+  return chunk;
+}
+
+/* Finds the position of the first item older than time.
+ *
+ * If every item is at least as new as time the cursor points at
+ * the end of the timeline, i.e. chunk == num_chunks.
+ */
+static void item_timeline_find_older(const ItemTimeline * timeline, time_t time, ItemTimelineCursor * cursor) {
+  int low = 0, high = timeline->num_chunks;
+
+  /* First chunk whose oldest item is older than time */
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    const ItemTimelineChunk *chunk = timeline->chunks[mid];
+
+    if (chunk->size > 0 && chunk->items[chunk->size - 1]->time < time) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  cursor->chunk = low;
+  cursor->position = 0;
+
+  if (low < timeline->num_chunks) {
+    const ItemTimelineChunk *chunk = timeline->chunks[low];
+    int lo = 0, hi = chunk->size - 1;
+
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (chunk->items[mid]->time < time) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+
+    cursor->position = lo;
+  }
+}
+
+/* Inserts item into the timeline after any items with the same or a newer time.
+ *
+ * Inserting at either end of the timeline, which is the common case for loading
+ * and for new items, only touches one chunk. Inserting into the middle of a full
+ * chunk splits it.
+ */
+static int item_timeline_insert(ItemTimeline * timeline, Item * item) {
+  ItemTimelineCursor cursor;
+  ItemTimelineChunk *chunk;
+
+  item_timeline_find_older(timeline, item->time, &cursor);
+
+  if (cursor.chunk == timeline->num_chunks) {
+    /* Goes at the end of the timeline */
+    if (timeline->num_chunks == 0 && !item_timeline_insert_chunk(timeline, 0)) {
+      return CLASSIFIER_FAIL;
+    }
+
+    cursor.chunk = timeline->num_chunks - 1;
+    cursor.position = timeline->chunks[cursor.chunk]->size;
+  } else if (cursor.position == 0 && cursor.chunk > 0) {
+    /* The end of the previous chunk is the same place, prefer it if it has room */
+    if (timeline->chunks[cursor.chunk - 1]->size < ITEM_TIMELINE_CHUNK_SIZE) {
+      cursor.chunk--;
+      cursor.position = timeline->chunks[cursor.chunk]->size;
+    }
+  }
+
+  chunk = timeline->chunks[cursor.chunk];
+
+  if (chunk->size == ITEM_TIMELINE_CHUNK_SIZE) {
+    if (cursor.position == 0) {
+      if (NULL == (chunk = item_timeline_insert_chunk(timeline, cursor.chunk))) {
+        return CLASSIFIER_FAIL;
+      }
+    } else if (cursor.position == chunk->size) {
+      if (NULL == (chunk = item_timeline_insert_chunk(timeline, cursor.chunk + 1))) {
+        return CLASSIFIER_FAIL;
+      }
+
+      cursor.position = 0;
+    } else {
+      int half = ITEM_TIMELINE_CHUNK_SIZE / 2;
+      ItemTimelineChunk *upper = item_timeline_insert_chunk(timeline, cursor.chunk + 1);
+
+      if (!upper) {
+        return CLASSIFIER_FAIL;
+      }
+
+      memcpy(upper->items, &chunk->items[half], (chunk->size - half) * sizeof(Item*));
+      upper->size = chunk->size - half;
+      chunk->size = half;
+
+      if (cursor.position > half) {
+        chunk = upper;
+        cursor.position -= half;
+      }
+    }
+  }
+
+  memmove(&chunk->items[cursor.position + 1], &chunk->items[cursor.position],
+          (chunk->size - cursor.position) * sizeof(Item*));
+  chunk->items[cursor.position] = item;
+  chunk->size++;
+  timeline->num_items++;
+
+  return CLASSIFIER_OK;
+}
+
+/* Removes every item older than split_time from the timeline.
+ *
+ * Whole chunks are dropped and only the chunk containing the split point is
+ * trimmed. The removed items are passed to the callback, which can be NULL,
+ * before their chunks are freed.
+ */
+static int item_timeline_split(ItemTimeline * timeline, time_t split_time, void (*removed)(Item*, void*), void *memo) {
+  ItemTimelineCursor cursor;
+  int removed_items = 0;
+  int i, j;
+
+  item_timeline_find_older(timeline, split_time, &cursor);
+
+  for (i = cursor.chunk; i < timeline->num_chunks; i++) {
+    ItemTimelineChunk *chunk = timeline->chunks[i];
+
+    for (j = (i == cursor.chunk ? cursor.position : 0); j < chunk->size; j++) {
+      if (removed) {
+        removed(chunk->items[j], memo);
+      }
+
+      removed_items++;
+    }
+  }
+
+  if (cursor.chunk < timeline->num_chunks) {
+    int first_free = cursor.chunk;
+
+    if (cursor.position > 0) {
+      timeline->chunks[cursor.chunk]->size = cursor.position;
+      first_free++;
+    }
+
+    for (i = first_free; i < timeline->num_chunks; i++) {
+      free(timeline->chunks[i]);
+    }
+
+    timeline->num_chunks = first_free;
+  }
+
+  timeline->num_items -= removed_items;
+  return removed_items;
+}
+
+/* Returns the item at cursor, or NULL at the end of the timeline. */
+static Item * item_timeline_get(const ItemTimeline * timeline, const ItemTimelineCursor * cursor) {
+  if (cursor->chunk < timeline->num_chunks && cursor->position < timeline->chunks[cursor->chunk]->size) {
+    return timeline->chunks[cursor->chunk]->items[cursor->position];
+  }
+
+  return NULL;
+}
+
+/* Returns the newest item and points the cursor at it.
+ *
+ * Use with item_timeline_next to scan the timeline from newest to oldest.
+ */
+static Item * item_timeline_first(const ItemTimeline * timeline, ItemTimelineCursor * cursor) {
+  cursor->chunk = 0;
+  cursor->position = 0;
+  return item_timeline_get(timeline, cursor);
+}
+
+static Item * item_timeline_next(const ItemTimeline * timeline, ItemTimelineCursor * cursor) {
+  if (++cursor->position >= timeline->chunks[cursor->chunk]->size) {
+    cursor->chunk++;
+    cursor->position = 0;
+  }
+
+  return item_timeline_get(timeline, cursor);
+}
+
+/******************************************************************************
+ * Item index functions
+ *
+ * Cached items are indexed by their integer key in a JudyL array. The full_id
+ * strings are only needed at the edges of the API, for fetching an item
+ * requested by id, so instead of a JudySL holding a copy of every full_id
+ * there is a hash table of the 64 bit hash of each full_id to its key.
+ ******************************************************************************/
+
+/* FNV-1a hash of a full_id. */
+static uint64_t item_id_hash(const unsigned char * id) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*id) {
+    hash ^= *id++;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/* Adds a slot to the map, growing it if it is getting full. */
+static int item_id_map_insert(ItemIdMap * map, uint64_t hash, int key) {
+  int i;
+
+  if ((map->size + 1) * 10 > map->capacity * 7) {
+    int capacity = map->capacity ? map->capacity * 2 : 1024;
+    ItemIdSlot *slots = calloc(capacity, sizeof(ItemIdSlot));
+
+    if (!slots) {
+      fatal("Could not malloc item id map");
+      return CLASSIFIER_FAIL;
+    }
+
+    for (i = 0; i < map->capacity; i++) {
+      if (map->slots[i].key) {
+        int j = map->slots[i].hash & (capacity - 1);
+        while (slots[j].key) {
+          j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = map->slots[i];
+      }
+    }
+
+    free(map->slots);
+    map->slots = slots;
+    map->capacity = capacity;
+  }
+
+  i = hash & (map->capacity - 1);
+  while (map->slots[i].key) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+
+  map->slots[i].hash = hash;
+  map->slots[i].key = key;
+  map->size++;
+
+  return CLASSIFIER_OK;
+}
+
+/* Removes the slot for hash and key, shifting back any slots that probed past it. */
+static void item_id_map_remove(ItemIdMap * map, uint64_t hash, int key) {
+  int mask = map->capacity - 1;
+  int i, j;
+
+  if (!map->capacity) {
+    return;
+  }
+
+  for (i = hash & mask; map->slots[i].key; i = (i + 1) & mask) {
+    if (map->slots[i].key == key && map->slots[i].hash == hash) {
+      break;
+    }
+  }
+
+  if (!map->slots[i].key) {
+    return;
+  }
+
+  for (j = (i + 1) & mask; map->slots[j].key; j = (j + 1) & mask) {
+    int home = map->slots[j].hash & mask;
+
+    /* Move j into the hole at i unless its home slot lies cyclically in (i, j] */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      map->slots[i] = map->slots[j];
+      i = j;
+    }
+  }
+
+  map->slots[i].key = 0;
+  map->size--;
+}
+
+/* Finds a cached item by key.
+ *
+ * Caller must hold a read lock on the cache.
+ */
+static Item * item_index_get_by_key(const ItemCache * item_cache, int key) {
+  PWord_t item_pointer;
+
+  JLG(item_pointer, item_cache->items_by_key, key);
+  return item_pointer ? (Item*) *item_pointer : NULL;
+}
+
+/* Finds a cached item by full_id.
+ *
+ * Caller must hold a read lock on the cache.
+ */
+static Item * item_index_get(const ItemCache * item_cache, const unsigned char * id) {
+  const ItemIdMap *map = &item_cache->keys_by_id;
+  uint64_t hash = item_id_hash(id);
+  int i;
+
+  if (!map->capacity) {
+    return NULL;
+  }
+
+  for (i = hash & (map->capacity - 1); map->slots[i].key; i = (i + 1) & (map->capacity - 1)) {
+    if (map->slots[i].hash == hash) {
+      Item *item = item_index_get_by_key(item_cache, map->slots[i].key);
+
+      /* Different full_ids can have the same hash */
+      if (item && !strcmp((const char*) item->id, (const char*) id)) {
+        return item;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* Indexes an item, replacing any item with the same key.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int item_index_add(ItemCache * item_cache, Item * item) {
+  PWord_t item_pointer;
+
+  JLI(item_pointer, item_cache->items_by_key, item->key);
+  if (NULL == item_pointer) {
+    fatal("Error malloc'ing item by key");
+    return CLASSIFIER_FAIL;
+  }
+
+  if (!*item_pointer && CLASSIFIER_OK != item_id_map_insert(&item_cache->keys_by_id, item_id_hash(item->id), item->key)) {
+    int judyrc;
+    JLD(judyrc, item_cache->items_by_key, item->key);
+    return CLASSIFIER_FAIL;
+  }
+
+  *item_pointer = (Word_t) item;
+  return CLASSIFIER_OK;
+}
+
+/* Removes an item from the index, unless it has been replaced by another item with its key.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static void item_index_remove(ItemCache * item_cache, Item * item) {
+  if (item_index_get_by_key(item_cache, item->key) == item) {
+    int judyrc;
+    JLD(judyrc, item_cache->items_by_key, item->key);
+    item_id_map_remove(&item_cache->keys_by_id, item_id_hash(item->id), item->key);
+  }
+}
+
+/******************************************************************************
+ * Presence filter functions
+ *
+ * Looking up a full_id that isn't in the memory cache means a query on the
+ * catalog, which for an id that isn't in the catalog at all finds nothing.
+ * The presence filter is a Bloom filter of every full_id in the catalog, not
+ * just the cached ones, so those lookups can be answered without a query.
+ * Bloom filters have false positives but no false negatives, so an id the
+ * filter doesn't have is definitely not in the catalog. The ids of cached
+ * items are known exactly from the item index.
+ *
+ * Entries added by other writers are caught up with on a miss by reading any
+ * past the highest key the filter has seen, see presence_filter_catch_up.
+ *
+ * The filter is sized for twice the number of entries when it is built, giving
+ * about 1% false positives, and is rebuilt once it has that many ids so the
+ * rate doesn't keep rising as the catalog grows, see presence_filter_rebuild_if_full.
+ ******************************************************************************/
+
+static PresenceFilter * new_presence_filter(int num_ids) {
+  PresenceFilter *filter = calloc(1, sizeof(PresenceFilter));
+  uint64_t bits = 64;
+
+  if (filter) {
+    filter->capacity = num_ids * 2 > PRESENCE_MIN_CAPACITY ? num_ids * 2 : PRESENCE_MIN_CAPACITY;
+
+    while (bits < (uint64_t) filter->capacity * PRESENCE_BITS_PER_ID) {
+      bits <<= 1;
+    }
+
+    filter->mask = bits - 1;
+    filter->words = calloc(bits / 64, sizeof(uint64_t));
+  }
+
+  if (!filter || !filter->words) {
+    fatal("Could not malloc presence filter");
+    free(filter);
+    filter = NULL;
+  }
+
+  return filter;
+}
+
+static void free_presence_filter(PresenceFilter * filter) {
+  if (filter) {
+    free(filter->words);
+    free(filter);
+  }
+}
+
+static void free_retired_presence_filter(void * filter) {
+  free_presence_filter((PresenceFilter*) filter);
+}
+
+/* Each bit is picked by double hashing with the two halves of the full_id's hash. */
+static uint64_t presence_filter_bit(uint64_t hash, int i) {
+  uint32_t h1 = (uint32_t) hash;
+  uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+  return h1 + (uint64_t) i * h2;
+}
+
+static void presence_filter_add(PresenceFilter * filter, const unsigned char * id) {
+  uint64_t hash = item_id_hash(id);
+  int i;
+
+  for (i = 0; i < PRESENCE_HASHES; i++) {
+    uint64_t bit = presence_filter_bit(hash, i) & filter->mask;
+    __sync_fetch_and_or(&filter->words[bit >> 6], 1ULL << (bit & 63));
+  }
+
+  __sync_add_and_fetch(&filter->size, 1);
+}
+
+static int presence_filter_contains(const PresenceFilter * filter, const unsigned char * id) {
+  uint64_t hash = item_id_hash(id);
+  int i;
+
+  for (i = 0; i < PRESENCE_HASHES; i++) {
+    uint64_t bit = presence_filter_bit(hash, i) & filter->mask;
+
+    if (!(filter->words[bit >> 6] & (1ULL << (bit & 63)))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Builds the presence filter from the full_id of every entry in the catalog.
+ *
+ * Caller must hold the db_access mutex.
+ */
+static int load_presence_filter(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+  int num_ids = 0;
+  sqlite3_int64 max_key = 0;
+  sqlite3_stmt *stmt;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, COUNT_ENTRIES_SQL, -1, &stmt, NULL)) {
+    error("Could not count entries: %s", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
+
+  if (SQLITE_ROW == sqlite3_step(stmt)) {
+    num_ids = sqlite3_column_int(stmt, 0);
+    max_key = sqlite3_column_int64(stmt, 1);
+  }
+
+  sqlite3_finalize(stmt);
+
+  PresenceFilter *filter = new_presence_filter(num_ids);
+
+  if (!filter) {
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, SELECT_ALL_FULL_IDS_SQL, -1, &stmt, NULL)) {
+    error("Could not prepare %s: %s", SELECT_ALL_FULL_IDS_SQL, item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else {
+    while (SQLITE_ROW == sqlite3_step(stmt)) {
+      const unsigned char *id = sqlite3_column_text(stmt, 0);
+
+      if (id) {
+        presence_filter_add(filter, id);
+      }
+    }
+
+    sqlite3_finalize(stmt);
+  }
+
+  if (CLASSIFIER_OK == rc) {
+    /* Entries added while the ids were read could be past max_key, catching up with them again is harmless */
+    filter->max_key = max_key;
+    debug("Presence filter has %i of %i full_ids in %llu bits", filter->size, filter->capacity, filter->mask + 1);
+    /* Make sure the filter is complete before other threads can see it */
+    __sync_synchronize();
+    item_cache->presence = filter;
+  } else {
+    free_presence_filter(filter);
+  }
+
+  return rc;
+}
+
+/* Adds the entries other writers have added to the catalog since the filter
+ * last looked, those are the ones past the highest key it has seen.
+ *
+ * @returns true if any entries were added.
+ */
+static int presence_filter_catch_up(PresenceFilter * filter, ReadConnection * connection) {
+  sqlite3_int64 seen = filter->max_key, max_key = seen;
+  int added = false;
+
+  if (SQLITE_ROW == sqlite3_step(connection->max_entry_key_stmt)) {
+    max_key = sqlite3_column_int64(connection->max_entry_key_stmt, 0);
+  }
+  sqlite3_reset(connection->max_entry_key_stmt);
+
+  if (max_key > seen) {
+    sqlite3_bind_int64(connection->new_full_ids_stmt, 1, seen);
+
+    while (SQLITE_ROW == sqlite3_step(connection->new_full_ids_stmt)) {
+      const unsigned char *id = sqlite3_column_text(connection->new_full_ids_stmt, 1);
+
+      /* This cache adds its own entries as it inserts them */
+      if (id && !presence_filter_contains(filter, id)) {
+        presence_filter_add(filter, id);
+        added = true;
+      }
+
+      max_key = sqlite3_column_int64(connection->new_full_ids_stmt, 0);
+    }
+
+    sqlite3_clear_bindings(connection->new_full_ids_stmt);
+    sqlite3_reset(connection->new_full_ids_stmt);
+
+    while (seen < max_key && !__sync_bool_compare_and_swap(&filter->max_key, seen, max_key)) {
+      seen = filter->max_key;
+    }
+  }
+
+  return added;
+}
+
+/******************************************************************************
+ * Item segment functions
+ ******************************************************************************/
+
+/* Rounds time down to the start of its segment. */
+static time_t item_segment_start(time_t time) {
+  time_t offset = time % ITEM_SEGMENT_SECONDS;
+  /* % truncates towards zero for times before the epoch */
+  return time - (offset < 0 ? offset + ITEM_SEGMENT_SECONDS : offset);
+}
+
+static ItemSegment * new_item_segment(time_t start) {
+  ItemSegment *segment = calloc(1, sizeof(struct ITEM_SEGMENT));
+
+  if (!segment) {
+    fatal("Could not malloc ItemSegment");
+  } else if (NULL == (segment->timeline = new_item_timeline())) {
+    free(segment);
+    segment = NULL;
+  } else {
+    segment->start = start;
+  }
+
+  return segment;
+}
+
+/* Frees a segment along with its items.
+ *
+ * @returns the number of items freed.
+ */
+static int free_item_segment(ItemSegment * segment) {
+  int freed_items = 0;
+
+  if (segment) {
+    ItemTimelineCursor cursor;
+    Item *item;
+
+    for (item = item_timeline_first(segment->timeline, &cursor); item;
+         item = item_timeline_next(segment->timeline, &cursor)) {
+      free_item(item);
+      freed_items++;
+    }
+
+    free_item_timeline(segment->timeline);
+    free(segment);
+  }
+
+  return freed_items;
+}
+
+/* Finds the first segment, in the newest first directory, that starts at or before start.
+ *
+ * found is set to whether that segment starts exactly at start.
+ */
+static int item_segments_find(const ItemCache * item_cache, time_t start, int * found) {
+  int low = 0, high = item_cache->num_segments;
+
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (item_cache->segments[mid]->start > start) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  *found = low < item_cache->num_segments && item_cache->segments[low]->start == start;
+  return low;
+}
+
+/* Gets the segment that holds items with the given time, creating it if there isn't one.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static ItemSegment * item_segments_get_or_create(ItemCache * item_cache, time_t time) {
+  time_t start = item_segment_start(time);
+  int found;
+  int index = item_segments_find(item_cache, start, &found);
+  ItemSegment *segment;
+
+  if (found) {
+    return item_cache->segments[index];
+  }
+
+  if (item_cache->num_segments == item_cache->segments_capacity) {
+    int capacity = item_cache->segments_capacity ? item_cache->segments_capacity * 2 : 64;
+    ItemSegment **segments = realloc(item_cache->segments, capacity * sizeof(ItemSegment*));
+    if (!segments) {
+      fatal("Could not realloc ItemSegment directory");
+      return NULL;
+    }
+
+    item_cache->segments = segments;
+    item_cache->segments_capacity = capacity;
+  }
+
+  if (NULL == (segment = new_item_segment(start))) {
+    return NULL;
+  }
+
+  memmove(&item_cache->segments[index + 1], &item_cache->segments[index],
+          (item_cache->num_segments - index) * sizeof(ItemSegment*));
+  item_cache->segments[index] = segment;
+  item_cache->num_segments++;
+
+  return segment;
+}
+
+/* Inserts an item into the index and the timeline of the segment for its time.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int item_segments_insert(ItemCache * item_cache, Item * item) {
+  ItemSegment *segment = item_segments_get_or_create(item_cache, item->time);
+
+  if (!segment) {
+    return CLASSIFIER_FAIL;
+  }
+
+  if (CLASSIFIER_OK != item_timeline_insert(segment->timeline, item)) {
+    return CLASSIFIER_FAIL;
+  }
+
+  if (CLASSIFIER_OK != item_index_add(item_cache, item)) {
+    /* It stays in the timeline, where it will be freed, it just can't be fetched */
+    error("Could not index item %s", item->id);
+  }
+
+  item_cache->cached_size++;
+  __sync_fetch_and_add(&item_cache->view_generation, 1);
+
+  return CLASSIFIER_OK;
+}
+
+/* Moves an item split off a segment's timeline into the expired segment. */
+static void move_expired_item(Item * item, void * memo) {
+  ItemSegment *expired = (ItemSegment*) memo;
+
+  if (CLASSIFIER_OK != item_timeline_insert(expired->timeline, item)) {
+    error("Could not move expired item %s, it won't be freed", item->id);
+  }
+}
+
+/* Unlinks the items older than purge_time from the cache.
+ *
+ * Segments that are entirely older than purge_time are unlinked from the
+ * directory as a whole, only the one segment that spans purge_time has its
+ * older items removed one at a time, and these are moved into a segment of
+ * their own.  The unlinked segments are put in expired, which needs room for
+ * num_segments + 1 segments.
+ *
+ * The items are left in the index, the caller removes them with
+ * item_segments_unindex before retiring the segments.
+ *
+ * Caller must hold a write lock on the cache.
+ *
+ * @returns the number of segments put in expired.
+ */
+static int item_segments_expire(ItemCache * item_cache, time_t purge_time, ItemSegment ** expired) {
+  int found, i, num_expired = 0;
+  int spanning = item_segments_find(item_cache, item_segment_start(purge_time), &found);
+  int first_expired = found ? spanning + 1 : spanning;
+
+  for (i = first_expired; i < item_cache->num_segments; i++) {
+    item_cache->cached_size -= item_cache->segments[i]->timeline->num_items;
+    expired[num_expired++] = item_cache->segments[i];
+  }
+
+  item_cache->num_segments = first_expired;
+  __sync_fetch_and_add(&item_cache->view_generation, 1);
+
+  if (found) {
+    ItemSegment *segment = item_cache->segments[spanning];
+    ItemSegment *moved = new_item_segment(segment->start);
+
+    if (moved) {
+      item_cache->cached_size -= item_timeline_split(segment->timeline, purge_time, move_expired_item, moved);
+      expired[num_expired++] = moved;
+    }
+
+    /* The spanning segment is the oldest left so it can be dropped if it is now empty */
+    if (0 == segment->timeline->num_items) {
+      expired[num_expired++] = segment;
+      item_cache->num_segments--;
+    }
+  }
+
+  return num_expired;
+}
+
+/* Removes the items of segments unlinked by item_segments_expire from the index.
+ *
+ * The cache lock is taken for UNINDEX_BATCH_SIZE items at a time so lookups
+ * and inserts aren't held up for the whole purge.  Until an item is removed
+ * it can still be found by lookups, which is fine since nothing frees it
+ * before the segment is retired.  item_index_remove leaves alone any item
+ * that has replaced it in the index in the meantime.
+ *
+ * Caller must not hold the cache lock and must own the segments.
+ */
+static void item_segments_unindex(ItemCache * item_cache, ItemSegment ** expired, int num_expired) {
+  int i;
+
+  for (i = 0; i < num_expired; i++) {
+    ItemTimeline *timeline = expired[i]->timeline;
+    ItemTimelineCursor cursor;
+    Item *item = item_timeline_first(timeline, &cursor);
+
+    while (item) {
+      int batch;
+
+      pthread_rwlock_wrlock(&item_cache->cache_lock);
+      for (batch = 0; item && batch < UNINDEX_BATCH_SIZE; batch++) {
+        item_index_remove(item_cache, item);
+        item = item_timeline_next(timeline, &cursor);
+      }
+      pthread_rwlock_unlock(&item_cache->cache_lock);
+    }
+  }
+}
+
+/******************************************************************************
+ * Item view functions
+ ******************************************************************************/
+
+/* Registers a reader in the current epoch.
+ *
+ * Nothing retired while a reader is registered is freed until it calls epoch_exit.
+ *
+ * @returns the epoch to pass to epoch_exit.
+ */
+static long epoch_enter(ItemCache * item_cache) {
+  long epoch;
+
+  for (;;) {
+    epoch = item_cache->epoch;
+    __sync_fetch_and_add(&item_cache->epoch_readers[epoch & 1], 1);
+
+    /* If the epoch moved on before we were counted the reclaimer might have missed us, so try again. */
+    if (epoch == item_cache->epoch) {
+      break;
+    }
+
+    __sync_fetch_and_sub(&item_cache->epoch_readers[epoch & 1], 1);
+  }
+
+  return epoch;
+}
+
+static void epoch_exit(ItemCache * item_cache, long epoch) {
+  __sync_fetch_and_sub(&item_cache->epoch_readers[epoch & 1], 1);
+}
+
+/* Queues an object to be freed once no reader can be using it. */
+static void retire(ItemCache * item_cache, void * object, void (*free_object)(void*)) {
+  pthread_mutex_lock(&item_cache->retire_mutex);
+
+  if (item_cache->num_retired == item_cache->retired_capacity) {
+    int capacity = item_cache->retired_capacity ? item_cache->retired_capacity * 2 : 16;
+    RetiredObject *retired = realloc(item_cache->retired, capacity * sizeof(RetiredObject));
+
+    if (!retired) {
+      fatal("Could not realloc retired objects, leaking one");
+      pthread_mutex_unlock(&item_cache->retire_mutex);
+      return;
+    }
+
+    item_cache->retired = retired;
+    item_cache->retired_capacity = capacity;
+  }
+
+  item_cache->retired[item_cache->num_retired].epoch = item_cache->epoch;
+  item_cache->retired[item_cache->num_retired].object = object;
+  item_cache->retired[item_cache->num_retired].free_object = free_object;
+  item_cache->num_retired++;
+
+  pthread_mutex_unlock(&item_cache->retire_mutex);
+}
+
+/* Advances the epoch as far as the registered readers allow and frees the
+ * retired objects that no reader can still be using.
+ *
+ * The epoch can only move from e to e + 1 once there are no readers left in
+ * e - 1, so once it is two past the epoch an object was retired in every reader
+ * that could have seen the object has finished.
+ */
+static void reclaim_retired(ItemCache * item_cache) {
+  int i, kept = 0;
+
+  pthread_mutex_lock(&item_cache->retire_mutex);
+
+  if (item_cache->num_retired > 0) {
+    for (i = 0; i < 2 && 0 == item_cache->epoch_readers[(item_cache->epoch - 1) & 1]; i++) {
+      __sync_fetch_and_add(&item_cache->epoch, 1);
+    }
+
+    for (i = 0; i < item_cache->num_retired; i++) {
+      if (item_cache->retired[i].epoch + 2 <= item_cache->epoch) {
+        item_cache->retired[i].free_object(item_cache->retired[i].object);
+      } else {
+        item_cache->retired[kept++] = item_cache->retired[i];
+      }
+    }
+
+    item_cache->num_retired = kept;
+  }
+
+  pthread_mutex_unlock(&item_cache->retire_mutex);
+}
+
+static void free_retired_segment(void * segment) {
+  free_item_segment((ItemSegment*) segment);
+}
+
+/* Copies the cached items into a new view.
+ *
+ * Caller must hold a read lock on the cache.
+ */
+static ItemView * new_item_view(const ItemCache * item_cache) {
+  ItemView *view;
+  int i, j, num_items = 0;
+
+  for (i = 0; i < item_cache->num_segments; i++) {
+    num_items += item_cache->segments[i]->timeline->num_items;
+  }
+
+  if (NULL == (view = malloc(sizeof(struct ITEM_VIEW) + num_items * sizeof(Item*)))) {
+    fatal("Could not malloc ItemView for %i items", num_items);
+    return NULL;
+  }
+
+  view->generation = item_cache->view_generation;
+  view->num_items = 0;
+
+  for (i = 0; i < item_cache->num_segments; i++) {
+    const ItemTimeline *timeline = item_cache->segments[i]->timeline;
+
+    for (j = 0; j < timeline->num_chunks; j++) {
+      memcpy(&view->items[view->num_items], timeline->chunks[j]->items, timeline->chunks[j]->size * sizeof(Item*));
+      view->num_items += timeline->chunks[j]->size;
+    }
+  }
+
+  return view;
+}
+
+/* Gets a view of the cached items, publishing a new one if the cache has changed since the last one was built.
+ *
+ * The cache lock is only held while a new view is copied out of the segments.
+ * The caller must be registered in an epoch until it is finished with the view.
+ *
+ * @returns the view or NULL if there isn't one and one couldn't be built.
+ */
+static ItemView * acquire_item_view(ItemCache * item_cache) {
+  ItemView *view = item_cache->view;
+
+  if (!view || view->generation != item_cache->view_generation) {
+    ItemView *new_view;
+
+    pthread_rwlock_rdlock(&item_cache->cache_lock);
+    new_view = new_item_view(item_cache);
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+
+    if (new_view) {
+      if (__sync_bool_compare_and_swap(&item_cache->view, view, new_view)) {
+        if (view) {
+          retire(item_cache, view, free);
+        }
+      } else {
+        /* Another reader published a view first, nobody else can see this one. */
+        retire(item_cache, new_view, free);
+      }
+
+      view = new_view;
+    }
+  }
+
+  return view;
+}
+
+/******************************************************************************
+ * Packed item arena functions
+ ******************************************************************************/
+
+static ItemArena * new_item_arena(void) {
+  ItemArena *arena = calloc(1, sizeof(struct ITEM_ARENA));
+  if (!arena) {
+    fatal("Could not malloc ItemArena");
+  }
+
+  return arena;
+}
+
+static void free_item_arena(ItemArena * arena) {
+  if (arena) {
+    free(arena->items);
+    if (arena->mapping) {
+      munmap(arena->mapping, arena->mapping_size);
+    } else {
+      free(arena->token_ids);
+      free(arena->token_frequencies);
+      free(arena->id_pool);
+    }
+    free(arena->token_offsets);
+    free(arena->id_offsets);
+    free(arena);
+  }
+}
+
+/* Makes sure there is room for another item with num_tokens tokens and an id of id_length in the arena. */
+static int item_arena_reserve(ItemArena * arena, size_t num_tokens, size_t id_length) {
+  if (arena->num_items == arena->items_capacity) {
+    int capacity = arena->items_capacity ? arena->items_capacity * 2 : 1024;
+    Item *items = realloc(arena->items, capacity * sizeof(Item));
+    size_t *token_offsets = realloc(arena->token_offsets, capacity * sizeof(size_t));
+    size_t *id_offsets = token_offsets ? realloc(arena->id_offsets, capacity * sizeof(size_t)) : NULL;
+
+    if (items) arena->items = items;
+    if (token_offsets) arena->token_offsets = token_offsets;
+    if (id_offsets) arena->id_offsets = id_offsets;
+    if (!items || !token_offsets || !id_offsets) goto malloc_error;
+    arena->items_capacity = capacity;
+  }
+
+  if (arena->num_tokens + num_tokens > arena->tokens_capacity) {
+    size_t capacity = arena->tokens_capacity ? arena->tokens_capacity * 2 : 65536;
+    while (capacity < arena->num_tokens + num_tokens) capacity *= 2;
+    uint32_t *token_ids = realloc(arena->token_ids, capacity * sizeof(uint32_t));
+    uint16_t *token_frequencies = token_ids ? realloc(arena->token_frequencies, capacity * sizeof(uint16_t)) : NULL;
+
+    if (token_ids) arena->token_ids = token_ids;
+    if (token_frequencies) arena->token_frequencies = token_frequencies;
+    if (!token_ids || !token_frequencies) goto malloc_error;
+    arena->tokens_capacity = capacity;
+  }
+
+  if (arena->id_pool_size + id_length + 1 > arena->id_pool_capacity) {
+    size_t capacity = arena->id_pool_capacity ? arena->id_pool_capacity * 2 : 65536;
+    while (capacity < arena->id_pool_size + id_length + 1) capacity *= 2;
+    char *id_pool = realloc(arena->id_pool, capacity);
+    if (!id_pool) goto malloc_error;
+    arena->id_pool = id_pool;
+    arena->id_pool_capacity = capacity;
+  }
+
+  return CLASSIFIER_OK;
+
+malloc_error:
+  fatal("Could not grow ItemArena");
+  return CLASSIFIER_FAIL;
+}
+
+typedef struct ARENA_TOKEN {
+  uint32_t id;
+  uint16_t frequency;
+  int position;
+} ArenaToken;
+
+static int compare_arena_tokens(const void * a, const void * b) {
+  const ArenaToken *ta = (const ArenaToken*) a;
+  const ArenaToken *tb = (const ArenaToken*) b;
+
+  if (ta->id != tb->id) {
+    return ta->id < tb->id ? -1 : 1;
+  }
+
+  return ta->position - tb->position;
+}
+
+/* Sorts an item's run of tokens in place.
+ *
+ * Token blobs are written in ascending token order so this should never
+ * really be required, but if a blob is out of order we sort it and, like
+ * item_add_token would, let the last frequency for a duplicate token win.
+ *
+ * @returns the number of tokens left in the run.
+ */
+static size_t item_arena_sort_run(uint32_t * ids, uint16_t * frequencies, size_t num_tokens) {
+  size_t i, out = 0;
+  ArenaToken *tokens = malloc(num_tokens * sizeof(ArenaToken));
+
+  if (!tokens) {
+    fatal("Could not malloc tokens to sort");
+    return 0;
+  }
+
+  for (i = 0; i < num_tokens; i++) {
+    tokens[i].id = ids[i];
+    tokens[i].frequency = frequencies[i];
+    tokens[i].position = i;
+  }
+
+  qsort(tokens, num_tokens, sizeof(ArenaToken), compare_arena_tokens);
+
+  for (i = 0; i < num_tokens; i++) {
+    if (out > 0 && ids[out - 1] == tokens[i].id) {
+      frequencies[out - 1] = tokens[i].frequency;
+    } else {
+      ids[out] = tokens[i].id;
+      frequencies[out] = tokens[i].frequency;
+      out++;
+    }
+  }
+
+  free(tokens);
+  return out;
+}
+
+/* Adds an item and its serialized tokens to the arena.
+ *
+ * @returns the number of tokens in the token data or -1 if the data is corrupt.
+ */
+static int item_arena_add(ItemArena * arena, const unsigned char * id, int key, time_t item_time,
+                          const char * token_data, int size) {
+  int count = token_data ? token_blob_count(token_data, size) : -1;
+
+  if (!token_data) {
+    error("No token data for item");
+    return -1;
+  } else if (count < 0) {
+    error("Token data is corrupt for item %i (size = %i)", key, size);
+    return -1;
+  }
+
+  size_t i, num_tokens = count;
+  size_t id_length = strlen((char*) id);
+
+  if (item_arena_reserve(arena, num_tokens, id_length)) {
+    return -1;
+  }
+
+  uint32_t *ids = arena->token_ids + arena->num_tokens;
+  uint16_t *frequencies = arena->token_frequencies + arena->num_tokens;
+  int total_tokens = 0;
+  int sorted = true;
+
+  if (count != token_blob_decode(token_data, size, ids, frequencies)) {
+    error("Token data is corrupt for item %i (size = %i)", key, size);
+    return -1;
+  }
+
+  for (i = 0; i < num_tokens; i++) {
+    total_tokens += (short) frequencies[i];
+
+    if (i > 0 && ids[i] <= ids[i - 1]) {
+      sorted = false;
+    }
+  }
+
+  size_t run_length = sorted ? num_tokens : item_arena_sort_run(ids, frequencies, num_tokens);
+
+  Item *item = &arena->items[arena->num_items];
+  memset(item, 0, sizeof(Item));
+  item->key = key;
+  item->time = item_time;
+  item->total_tokens = total_tokens;
+  item->arena = arena;
+  item->num_packed_tokens = run_length;
+
+  arena->token_offsets[arena->num_items] = arena->num_tokens;
+  arena->id_offsets[arena->num_items] = arena->id_pool_size;
+  memcpy(arena->id_pool + arena->id_pool_size, id, id_length + 1);
+  arena->id_pool_size += id_length + 1;
+  arena->num_tokens += run_length;
+  arena->num_items++;
+
+  return (int) num_tokens;
+}
+
+/* Adds an entry to the arena, decoding its token blob straight into the arena's token arrays.
+ *
+ * @returns the number of tokens the entry has.
+ */
+static int add_tokens_to_arena(ItemArena * arena, const unsigned char * id, int key, time_t item_time,
+                               const char * token_data, int blob_size, int min_tokens) {
+  int num_tokens = token_data ? token_blob_count(token_data, blob_size) : -1;
+
+  /* Check the count first so we don't copy the tokens of items that are too small. */
+  if (num_tokens >= 0 && num_tokens < min_tokens) {
+    return num_tokens;
+  }
+
+  return item_arena_add(arena, id, key, item_time, token_data, blob_size);
+}
+
+typedef struct ARENA_POSITION {
+  time_t time;
+  int key;
+  int position;
+} ArenaPosition;
+
+static int compare_arena_positions(const void * a, const void * b) {
+  const ArenaPosition *pa = (const ArenaPosition*) a;
+  const ArenaPosition *pb = (const ArenaPosition*) b;
+
+  if (pa->time != pb->time) {
+    return pa->time > pb->time ? -1 : 1;
+  }
+
+  return pb->key - pa->key;
+}
+
+/* Sorts the items in an arena that is still being built from newest to oldest.
+ *
+ * Entries are read in key order, which is mostly but not always the order
+ * they were updated in, and add_arena_items_to_cache needs each arena in
+ * time order.  Only the item headers and their offsets move, the tokens and
+ * ids stay where they are.
+ */
+static int item_arena_sort_by_time(ItemArena * arena) {
+  int i, sorted = true;
+
+  for (i = 1; sorted && i < arena->num_items; i++) {
+    if (arena->items[i].time > arena->items[i - 1].time) {
+      sorted = false;
+    }
+  }
+
+  if (sorted) {
+    return CLASSIFIER_OK;
+  }
+
+  ArenaPosition *positions = malloc(arena->num_items * sizeof(ArenaPosition));
+  Item *items = malloc(arena->items_capacity * sizeof(Item));
+  size_t *token_offsets = malloc(arena->items_capacity * sizeof(size_t));
+  size_t *id_offsets = malloc(arena->items_capacity * sizeof(size_t));
+
+  if (!positions || !items || !token_offsets || !id_offsets) {
+    fatal("Could not malloc space to sort the item arena");
+    free(positions);
+    free(items);
+    free(token_offsets);
+    free(id_offsets);
+    return CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; i < arena->num_items; i++) {
+    positions[i].time = arena->items[i].time;
+    positions[i].key = arena->items[i].key;
+    positions[i].position = i;
+  }
+
+  qsort(positions, arena->num_items, sizeof(ArenaPosition), compare_arena_positions);
+
+  for (i = 0; i < arena->num_items; i++) {
+    items[i] = arena->items[positions[i].position];
+    token_offsets[i] = arena->token_offsets[positions[i].position];
+    id_offsets[i] = arena->id_offsets[positions[i].position];
+  }
+
+  free(arena->items);
+  free(arena->token_offsets);
+  free(arena->id_offsets);
+  free(positions);
+  arena->items = items;
+  arena->token_offsets = token_offsets;
+  arena->id_offsets = id_offsets;
+
+  return CLASSIFIER_OK;
+}
+
+/* Finishes building the arena.
+ *
+ * This trims the arena's storage to size and points each of the item
+ * headers at its id and token run.  Once this is called the arena's
+ * storage doesn't move so the items can be handed out.
+ */
+static int item_arena_finish(ItemArena * arena) {
+  int i;
+
+  if (arena->num_items > 0) {
+    Item *items = realloc(arena->items, arena->num_items * sizeof(Item));
+    size_t tokens_size = arena->num_tokens > 0 ? arena->num_tokens : 1;
+    uint32_t *token_ids = realloc(arena->token_ids, tokens_size * sizeof(uint32_t));
+    uint16_t *token_frequencies = realloc(arena->token_frequencies, tokens_size * sizeof(uint16_t));
+    char *id_pool = realloc(arena->id_pool, arena->id_pool_size);
+
+    /* Shrinking realloc can only fail by leaving the old block in place. */
+    if (items) arena->items = items;
+    if (token_ids) arena->token_ids = token_ids;
+    if (token_frequencies) arena->token_frequencies = token_frequencies;
+    if (id_pool) arena->id_pool = id_pool;
+    arena->items_capacity = arena->num_items;
+    arena->tokens_capacity = arena->num_tokens;
+    arena->id_pool_capacity = arena->id_pool_size;
+  }
+
+  for (i = 0; i < arena->num_items; i++) {
+    Item *item = &arena->items[i];
+    item->id = (unsigned char*) arena->id_pool + arena->id_offsets[i];
+    item->packed_ids = arena->token_ids + arena->token_offsets[i];
+    item->packed_frequencies = arena->token_frequencies + arena->token_offsets[i];
+  }
+
+  free(arena->token_offsets);
+  free(arena->id_offsets);
+  arena->token_offsets = NULL;
+  arena->id_offsets = NULL;
+  arena->live_items = arena->num_items;
+
+  return CLASSIFIER_OK;
+}
+
+/* Releases an item in the arena, freeing the arena when no items are left. */
+static void item_arena_release(ItemArena * arena) {
+  if (arena && --arena->live_items <= 0) {
+    free_item_arena(arena);
+  }
+}
+
+/* Finds the position of the first token in a packed run greater than or equal to token_id. */
+static int packed_lower_bound(const Item * item, uint32_t token_id) {
+  int low = 0, high = item->num_packed_tokens;
+
+  while (low < high) {
+    int mid = (low + high) >> 1;
+    if (item->packed_ids[mid] < token_id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+/* Reads each item returned by items_stmt, along with its tokens, into the arena.
+ *
+ * items_stmt must return full_id, id, updated time and the token blob for
+ * each item and should already have its parameters bound.  The blob is
+ * decoded from SQLite's copy of the row so it is never copied on its own.
+ */
+static int load_items_into_arena(sqlite3_stmt * items_stmt, ItemArena * arena, int min_tokens) {
+  int rc = CLASSIFIER_OK;
+
+  while (SQLITE_ROW == sqlite3_step(items_stmt)) {
+    const unsigned char * id = sqlite3_column_text(items_stmt, 0);
+    int key = sqlite3_column_int(items_stmt, 1);
+    time_t item_time = sqlite3_column_int64(items_stmt, 2);
+    const char *token_data = sqlite3_column_blob(items_stmt, 3);
+    int blob_size = sqlite3_column_bytes(items_stmt, 3);
+
+    /* Items with less than min_tokens are not added to the arena. */
+    add_tokens_to_arena(arena, id, key, item_time, token_data, blob_size, min_tokens);
+  }
+
+  sqlite3_clear_bindings(items_stmt);
+  sqlite3_reset(items_stmt);
+
+  if (CLASSIFIER_OK == (rc = item_arena_sort_by_time(arena))) {
+    rc = item_arena_finish(arena);
+  }
+
+  return rc;
+}
+
+/* Opens a read-only connection to the catalog with the token database attached.
+ *
+ * This is used by threads that need to read from the database without
+ * holding the db_access_mutex.
+ */
+static int open_read_only_database(ItemCache * item_cache, sqlite3 ** db) {
+  int rc = CLASSIFIER_OK;
+  char path[MAXPATHLEN];
+  char token_path[MAXPATHLEN];
+
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/catalog.db", item_cache->cache_directory) ||
+      MAXPATHLEN <= snprintf(token_path, MAXPATHLEN, "%s/tokens.db", item_cache->cache_directory)) {
+    fatal("Path to item cache too long: %s", item_cache->cache_directory);
+    exit(1);
+  }
+
+  if (SQLITE_OK != sqlite3_open_v2(path, db, SQLITE_OPEN_READONLY, NULL)) {
+    error("Could not open read-only connection to %s: %s", path, sqlite3_errmsg(*db));
+    rc = CLASSIFIER_FAIL;
+  } else if (CLASSIFIER_OK != attach_database(*db, token_path, "token")) {
+    error("Could not attach %s to read-only connection: %s", token_path, sqlite3_errmsg(*db));
+    rc = CLASSIFIER_FAIL;
+  } else {
+    sqlite3_busy_timeout(*db, 1000);
+  }
+
+  if (CLASSIFIER_OK != rc) {
+    sqlite3_close(*db);
+    *db = NULL;
+  }
+
+  return rc;
+}
+
+/******************************************************************************
+ * Read connection pool functions
+ ******************************************************************************/
+
+static void free_read_connection(ReadConnection * connection) {
+  if (connection) {
+    sqlite3_finalize(connection->fetch_item_stmt);
+    sqlite3_finalize(connection->fetch_tokens_stmt);
+    sqlite3_finalize(connection->max_entry_key_stmt);
+    sqlite3_finalize(connection->new_full_ids_stmt);
+    sqlite3_close(connection->db);
+    free(connection);
+  }
+}
+
+static ReadConnection * open_read_connection(ItemCache * item_cache) {
+  ReadConnection *connection = calloc(1, sizeof(struct READ_CONNECTION));
+
+  if (!connection) {
+    fatal("Could not malloc ReadConnection");
+  } else if (CLASSIFIER_OK != open_read_only_database(item_cache, &connection->db)) {
+    free(connection);
+    connection = NULL;
+  } else if (SQLITE_OK != sqlite3_prepare_v2(connection->db, FETCH_ITEM_SQL,          -1, &connection->fetch_item_stmt,    NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(connection->db, FETCH_ENTRY_TOKENS,      -1, &connection->fetch_tokens_stmt,  NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(connection->db, MAX_ENTRY_KEY_SQL,       -1, &connection->max_entry_key_stmt, NULL) ||
+             SQLITE_OK != sqlite3_prepare_v2(connection->db, SELECT_NEW_FULL_IDS_SQL, -1, &connection->new_full_ids_stmt,  NULL)) {
+    error("Unable to prepare read connection statements: %s", sqlite3_errmsg(connection->db));
+    free_read_connection(connection);
+    connection = NULL;
+  }
+
+  return connection;
+}
+
+/* Takes an idle read connection from the pool, or opens a new one if none are idle.
+ *
+ * The connection must be given back with release_read_connection.
+ *
+ * @return The connection or NULL if one could not be opened.
+ */
+static ReadConnection * acquire_read_connection(ItemCache * item_cache) {
+  ReadConnection *connection = NULL;
+
+  pthread_mutex_lock(&item_cache->read_pool_mutex);
+  if (item_cache->num_idle_read_connections > 0) {
+    connection = item_cache->idle_read_connections[--item_cache->num_idle_read_connections];
+  }
+  pthread_mutex_unlock(&item_cache->read_pool_mutex);
+
+  if (!connection) {
+    connection = open_read_connection(item_cache);
+  }
+
+  return connection;
+}
+
+static void release_read_connection(ItemCache * item_cache, ReadConnection * connection) {
+  pthread_mutex_lock(&item_cache->read_pool_mutex);
+
+  if (item_cache->num_idle_read_connections == item_cache->idle_read_connections_capacity) {
+    int capacity = item_cache->idle_read_connections_capacity ? item_cache->idle_read_connections_capacity * 2 : 8;
+    ReadConnection **connections = realloc(item_cache->idle_read_connections, capacity * sizeof(ReadConnection*));
+
+    if (connections) {
+      item_cache->idle_read_connections = connections;
+      item_cache->idle_read_connections_capacity = capacity;
+    }
+  }
+
+  if (item_cache->num_idle_read_connections < item_cache->idle_read_connections_capacity) {
+    item_cache->idle_read_connections[item_cache->num_idle_read_connections++] = connection;
+    connection = NULL;
+  }
+
+  pthread_mutex_unlock(&item_cache->read_pool_mutex);
+
+  /* Couldn't grow the stack so just close it */
+  free_read_connection(connection);
+}
+
+static void free_read_connections(ItemCache * item_cache) {
+  int i;
+
+  for (i = 0; i < item_cache->num_idle_read_connections; i++) {
+    free_read_connection(item_cache->idle_read_connections[i]);
+  }
+
+  free(item_cache->idle_read_connections);
+  item_cache->idle_read_connections = NULL;
+  item_cache->num_idle_read_connections = 0;
+}
+
+/* A single thread's share of a parallel item cache load. */
+typedef struct ITEM_LOADER {
+  ItemCache *item_cache;
+  pthread_t thread;
+  /* The range of item keys, inclusive, loaded by this loader */
+  sqlite3_int64 first_key;
+  sqlite3_int64 last_key;
+  /* The items loaded by this loader, in descending time order */
+  ItemArena *arena;
+  int rc;
+} ItemLoader;
+
+static void * item_loader_thread_func(void *memo) {
+  ItemLoader *loader = (ItemLoader*) memo;
+  ItemCache *item_cache = loader->item_cache;
+  sqlite3 *db = NULL;
+  sqlite3_stmt *items_stmt = NULL;
+
+  loader->rc = CLASSIFIER_FAIL;
+
+  if (CLASSIFIER_OK != open_read_only_database(item_cache, &db)) {
+    return NULL;
+  }
+
+  if (SQLITE_OK != sqlite3_prepare_v2(db, FETCH_ITEMS_IN_KEY_RANGE_SQL, -1, &items_stmt, NULL)) {
+    error("Unable to prepare item loader statement: \"%s\"", sqlite3_errmsg(db));
+  } else {
+    sqlite3_bind_int(items_stmt, 1, item_cache->load_items_since);
+    sqlite3_bind_int64(items_stmt, 2, loader->first_key);
+    sqlite3_bind_int64(items_stmt, 3, loader->last_key);
+    sqlite3_bind_int(items_stmt, 4, item_cache->min_tokens);
+    loader->rc = load_items_into_arena(items_stmt, loader->arena, item_cache->min_tokens);
+    debug("Loaded %i items with keys %lli to %lli", loader->arena->num_items, loader->first_key, loader->last_key);
+  }
+
+  sqlite3_finalize(items_stmt);
+  sqlite3_close(db);
+
+  return NULL;
+}
+
+/* Loads the items into one arena per loader, splitting the range of keys between the loaders.
+ *
+ * Caller must hold the db_access mutex.
+ *
+ * @param started Set to the number of loaders that were run, their arenas must be freed by the caller.
+ */
+static int load_items_in_parallel(ItemCache * item_cache, ItemLoader * loaders, int num_loaders, int * started) {
+  int i;
+  int rc = CLASSIFIER_OK;
+  sqlite3_int64 min_key = 0, max_key = -1;
+  sqlite3_stmt *key_range_stmt;
+
+  *started = 0;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_ITEM_KEY_RANGE_SQL, -1, &key_range_stmt, NULL)) {
+    error("Unable to prepare statement: \"%s\"", item_cache_errmsg(item_cache));
+    return CLASSIFIER_FAIL;
+  }
+
+  sqlite3_bind_int(key_range_stmt, 1, item_cache->load_items_since);
+  if (SQLITE_ROW == sqlite3_step(key_range_stmt) && SQLITE_NULL != sqlite3_column_type(key_range_stmt, 0)) {
+    min_key = sqlite3_column_int64(key_range_stmt, 0);
+    max_key = sqlite3_column_int64(key_range_stmt, 1);
+  }
+  sqlite3_finalize(key_range_stmt);
+
+  if (max_key < min_key) {
+    return CLASSIFIER_OK;
+  }
+
+  sqlite3_int64 range = (max_key - min_key) / num_loaders + 1;
+
+  for (i = 0; i < num_loaders; i++) {
+    loaders[i].item_cache = item_cache;
+    loaders[i].first_key = min_key + i * range;
+    loaders[i].last_key = (i == num_loaders - 1) ? max_key : min_key + (i + 1) * range - 1;
+    loaders[i].rc = CLASSIFIER_FAIL;
+
+    if (NULL == (loaders[i].arena = new_item_arena())) {
+      rc = CLASSIFIER_FAIL;
+      break;
+    }
+
+    if (pthread_create(&loaders[i].thread, NULL, item_loader_thread_func, &loaders[i])) {
+      error("Could not start item loader thread");
+      free_item_arena(loaders[i].arena);
+      loaders[i].arena = NULL;
+      rc = CLASSIFIER_FAIL;
+      break;
+    }
+
+    (*started)++;
+  }
+
+  for (i = 0; i < *started; i++) {
+    pthread_join(loaders[i].thread, NULL);
+    if (CLASSIFIER_OK != loaders[i].rc) {
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  return rc;
+}
+
+/* Adds the items in each arena to the in-memory cache.
+ *
+ * Each arena's items are in descending time order so they are merged
+ * into the segments by repeatedly taking the newest item at the head
+ * of any of the arenas, this means each insert appends to a segment's timeline.  If an item can't be added to the cache it is
+ * released from its arena.
+ *
+ * Caller must hold a write lock on the cache.
+ */
+static int add_arena_items_to_cache(ItemCache * item_cache, ItemArena ** arenas, int num_arenas) {
+  int rc = CLASSIFIER_OK;
+  int i;
+  int *next = calloc(num_arenas, sizeof(int));
+  int *skipped = calloc(num_arenas, sizeof(int));
+
+  if (!next || !skipped) {
+    fatal("Could not malloc arena positions");
+    free(next);
+    free(skipped);
+    return CLASSIFIER_FAIL;
+  }
+
+  while (CLASSIFIER_OK == rc) {
+    int newest = -1;
+
+    for (i = 0; i < num_arenas; i++) {
+      if (arenas[i] && next[i] < arenas[i]->num_items &&
+          (newest < 0 || arenas[i]->items[next[i]].time > arenas[newest]->items[next[newest]].time)) {
+        newest = i;
+      }
+    }
+
+    if (newest < 0) {
+      break;
+    }
+
+    Item *item = &arenas[newest]->items[next[newest]];
+
+    if (item_index_get(item_cache, item->id)) {
+      /* Already have it, from a snapshot and the database for example. */
+      next[newest]++;
+      skipped[newest]++;
+    } else if (item_segments_insert(item_cache, item)) {
+      rc = CLASSIFIER_FAIL;
+    } else {
+      next[newest]++;
+    }
+  }
+
+  /* Release any items that didn't make it into the cache, empty arenas have no items to free them. */
+  for (i = 0; i < num_arenas; i++) {
+    if (arenas[i] && arenas[i]->num_items == 0) {
+      free_item_arena(arenas[i]);
+    } else if (arenas[i]) {
+      int unused = arenas[i]->num_items - next[i] + skipped[i];
+      while (unused-- > 0) {
+        item_arena_release(arenas[i]);
+      }
+    }
+  }
+
+  free(next);
+  free(skipped);
+  return rc;
+}
+
+/* Brings the items loaded from a snapshot up to date with the catalog.
+ *
+ * Entries added before the snapshot was saved can still have been tokenized,
+ * updated or deleted after it, so rather than only reading entries with keys
+ * the snapshot hasn't seen, every entry in the load window is compared with
+ * the snapshot's copy by its updated time and token count. Snapshot items that
+ * are out of date or no longer in the catalog are dropped from snapshot_arena
+ * and the current version of each new or changed entry is read into arena.
+ * This only reads the catalog rows, the token blobs are only read for the
+ * entries that changed.
+ *
+ * Caller must hold the db_access mutex.
+ */
+static int load_snapshot_changes(ItemCache * item_cache, ItemArena * snapshot_arena, ItemArena * arena) {
+  int rc = CLASSIFIER_OK;
+  int i, kept = 0, num_changed = 0;
+  sqlite3_int64 min_changed = 0, max_changed = 0;
+  Pvoid_t positions = NULL, changed = NULL;
+  PWord_t position, changed_key;
+  Word_t bytes;
+  sqlite3_stmt *versions_stmt = NULL, *items_stmt = NULL;
+  char *current = calloc(snapshot_arena->num_items + 1, sizeof(char));
+
+  if (!current) {
+    fatal("Could not malloc snapshot item flags");
+    return CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; i < snapshot_arena->num_items; i++) {
+    JLI(position, positions, (Word_t) snapshot_arena->items[i].key);
+    if (PJERR == position) {
+      rc = CLASSIFIER_FAIL;
+      break;
+    }
+    *position = i;
+  }
+
+  if (CLASSIFIER_OK != rc ||
+      SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_ITEM_VERSIONS_SQL, -1, &versions_stmt, NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_ITEMS_IN_KEY_RANGE_SQL, -1, &items_stmt, NULL)) {
+    error("Unable to compare the snapshot with the catalog: \"%s\"", item_cache_errmsg(item_cache));
+    rc = CLASSIFIER_FAIL;
+  } else {
+    sqlite3_bind_int(versions_stmt, 1, item_cache->load_items_since);
+    sqlite3_bind_int(versions_stmt, 2, item_cache->min_tokens);
+
+    while (CLASSIFIER_OK == rc && SQLITE_ROW == sqlite3_step(versions_stmt)) {
+      sqlite3_int64 key = sqlite3_column_int64(versions_stmt, 0);
+      time_t updated = sqlite3_column_int64(versions_stmt, 1);
+      int counted = SQLITE_NULL != sqlite3_column_type(versions_stmt, 2);
+      int num_tokens = sqlite3_column_int(versions_stmt, 2);
+
+      JLG(position, positions, (Word_t) key);
+      if (position) {
+        const Item *item = &snapshot_arena->items[*position];
+        if (item->time == updated && (!counted || item->num_packed_tokens == num_tokens)) {
+          current[*position] = true;
+          continue;
+        }
+      }
+
+      JLI(changed_key, changed, (Word_t) key);
+      if (PJERR == changed_key) {
+        fatal("Could not malloc changed snapshot keys");
+        rc = CLASSIFIER_FAIL;
+        break;
+      }
+
+      if (!num_changed || key < min_changed) min_changed = key;
+      if (!num_changed || key > max_changed) max_changed = key;
+      num_changed++;
+    }
+
+    /* Read the changed items in one pass over the key range they span,
+     * changes are mostly to recent items so the range is usually short. */
+    if (CLASSIFIER_OK == rc && num_changed) {
+      sqlite3_bind_int(items_stmt, 1, item_cache->load_items_since);
+      sqlite3_bind_int64(items_stmt, 2, min_changed);
+      sqlite3_bind_int64(items_stmt, 3, max_changed);
+      sqlite3_bind_int(items_stmt, 4, item_cache->min_tokens);
+
+      while (SQLITE_ROW == sqlite3_step(items_stmt)) {
+        JLG(changed_key, changed, (Word_t) sqlite3_column_int64(items_stmt, 1));
+        if (changed_key) {
+          add_tokens_to_arena(arena, sqlite3_column_text(items_stmt, 0), sqlite3_column_int(items_stmt, 1),
+                              sqlite3_column_int64(items_stmt, 2), sqlite3_column_blob(items_stmt, 3),
+                              sqlite3_column_bytes(items_stmt, 3), item_cache->min_tokens);
+        }
+      }
+    }
+
+    if (CLASSIFIER_OK == rc && CLASSIFIER_OK == (rc = item_arena_sort_by_time(arena))) {
+      rc = item_arena_finish(arena);
+    }
+  }
+
+  if (CLASSIFIER_OK == rc) {
+    /* Drop the snapshot items that are out of date, keeping the rest in time order. */
+    for (i = 0; i < snapshot_arena->num_items; i++) {
+      if (current[i]) {
+        snapshot_arena->items[kept++] = snapshot_arena->items[i];
+      }
+    }
+
+    info("Read %i entries changed since the snapshot, dropped %i out of date snapshot items",
+         num_changed, snapshot_arena->num_items - kept);
+    snapshot_arena->live_items -= snapshot_arena->num_items - kept;
+    snapshot_arena->num_items = kept;
+  }
+
+  sqlite3_finalize(versions_stmt);
+  sqlite3_finalize(items_stmt);
+  JLFA(bytes, positions);
+  JLFA(bytes, changed);
+  free(current);
+  return rc;
+}
+
+/* Loads all the items into the cache.
+ *
+ * The items are loaded into ItemArenas, see struct ITEM_ARENA. When
+ * load_threads is more than one the catalog is split into key ranges
+ * and each range is loaded by its own thread with its own read-only
+ * connection, the results are merged into the cache at the end.
+ *
+ * If the items were loaded from a snapshot, snapshot_arena holds them
+ * and only entries that have changed since the snapshot was saved are
+ * read from the database, see load_snapshot_changes. The snapshot's
+ * items are merged in with the rest.
+ *
+ * Caller must hold the db_access mutex and a write lock on the cache.
+ */
+static int load_all_items(ItemCache * item_cache, ItemArena * snapshot_arena) {
+  int rc = CLASSIFIER_OK;
+  int i, num_arenas = 1;
+  ItemArena **arenas = calloc(item_cache->load_threads + 1, sizeof(ItemArena*));
+
+  if (!arenas) {
+    fatal("Could not malloc item arenas");
+    free_item_arena(snapshot_arena);
+    return CLASSIFIER_FAIL;
+  }
+
+  arenas[0] = snapshot_arena;
+
+  if (snapshot_arena) {
+    if (NULL == (arenas[num_arenas++] = new_item_arena())) {
+      rc = CLASSIFIER_FAIL;
+    } else {
+      rc = load_snapshot_changes(item_cache, snapshot_arena, arenas[1]);
+    }
+  } else if (item_cache->load_threads > 1) {
+    ItemLoader *loaders = calloc(item_cache->load_threads, sizeof(ItemLoader));
+    int num_loaders = 0;
+
+    if (!loaders) {
+      fatal("Could not malloc item loaders");
+      rc = CLASSIFIER_FAIL;
+    } else {
+      info("Loading items with %i threads", item_cache->load_threads);
+      rc = load_items_in_parallel(item_cache, loaders, item_cache->load_threads, &num_loaders);
+    }
+
+    for (i = 0; i < num_loaders; i++) {
+      arenas[num_arenas++] = loaders[i].arena;
+    }
+
+    free(loaders);
+  } else if (NULL == (arenas[num_arenas] = new_item_arena())) {
+    rc = CLASSIFIER_FAIL;
+  } else {
+    sqlite3_bind_int(item_cache->fetch_all_items_stmt, 1, item_cache->load_items_since);
+    sqlite3_bind_int(item_cache->fetch_all_items_stmt, 2, item_cache->min_tokens);
+    load_items_into_arena(item_cache->fetch_all_items_stmt, arenas[num_arenas], item_cache->min_tokens);
+    num_arenas++;
+  }
+
+  if (CLASSIFIER_OK == rc) {
+    rc = add_arena_items_to_cache(item_cache, arenas, num_arenas);
+  } else {
+    for (i = 0; i < num_arenas; i++) {
+      free_item_arena(arenas[i]);
+    }
+  }
+
+  free(arenas);
+  return rc;
+}
+
+static int load_random_background(ItemCache * item_cache) {
+  int rndbg_item_count = 0;
+  item_cache->random_background = new_pool();
+
+  while (SQLITE_ROW == sqlite3_step(item_cache->random_background_stmt)) {
+    const unsigned char * id = sqlite3_column_text(item_cache->random_background_stmt, 0);
+    int key = sqlite3_column_int(item_cache->random_background_stmt, 1);
+    Item *item = create_item(id, key, -1);
+
+    if (item) {
+      if (fetch_tokens_for(item_cache, item)) {
+        pool_add_item(item_cache->random_background, item);
+      }
+
+      free_item(item);
+      rndbg_item_count++;
+    } else {
+      error("Could not create item: %s (%i)", id, key);
+    }
+  }
+  sqlite3_reset(item_cache->random_background_stmt);
+  info("Randombackground contains %i items", rndbg_item_count);
+
+  return CLASSIFIER_OK;
+}
+
+/******************************************************************************
+ * Presence lookup functions
+ *
+ * Readers use the presence filter inside an epoch since a full filter is
+ * replaced by a bigger one and retired.
+ ******************************************************************************/
+
+/* Checks the presence filter for a full_id, catching up with the catalog on a miss.
+ *
+ * @returns false if there is definitely no entry with the full_id in the catalog.
+ */
+static int presence_filter_might_contain(ItemCache * item_cache, const unsigned char * id) {
+  long epoch = epoch_enter(item_cache);
+  PresenceFilter *filter = item_cache->presence;
+  int contains = !filter || presence_filter_contains(filter, id);
+
+  if (!contains) {
+    ReadConnection *connection = acquire_read_connection(item_cache);
+
+    if (!connection) {
+      /* Can't tell without the catalog */
+      contains = true;
+    } else {
+      if (presence_filter_catch_up(filter, connection)) {
+        contains = presence_filter_contains(filter, id);
+      }
+
+      release_read_connection(item_cache, connection);
+    }
+  }
+
+  epoch_exit(item_cache, epoch);
+  return contains;
+}
+
+/* Replaces the presence filter with one sized for the catalog as it is now
+ * once it holds as many ids as it was sized for.
+ *
+ * Caller must hold the db_access mutex.
+ */
+static void presence_filter_rebuild_if_full(ItemCache * item_cache) {
+  PresenceFilter *full = item_cache->presence;
+
+  if (full && full->size >= full->capacity) {
+    info("Rebuilding the presence filter, it has %i of the %i full_ids it was sized for", full->size, full->capacity);
+
+    if (CLASSIFIER_OK == load_presence_filter(item_cache)) {
+      retire(item_cache, full, free_retired_presence_filter);
+    } else {
+      error("Could not rebuild the presence filter, it will have more false positives");
+    }
+  }
+}
+
+/* Finds out whether an entry with the full_id is in the catalog without querying it.
+ *
+ * @returns PRESENCE_PRESENT if the entry is cached, PRESENCE_ABSENT if it is definitely
+ *          not in the catalog and PRESENCE_UNKNOWN if the catalog has to be checked.
+ */
+static Presence item_cache_presence(ItemCache * item_cache, const unsigned char * id) {
+  Presence presence = PRESENCE_UNKNOWN;
+  Item *item;
+
+  pthread_rwlock_rdlock(&item_cache->cache_lock);
+  if ((item = item_index_get(item_cache, id)) && item->key > 0) {
+    presence = PRESENCE_PRESENT;
+  }
+  pthread_rwlock_unlock(&item_cache->cache_lock);
+
+  if (PRESENCE_UNKNOWN == presence && !presence_filter_might_contain(item_cache, id)) {
+    presence = PRESENCE_ABSENT;
+  }
+
+  return presence;
+}
+
+/******************************************************************************
+ * Snapshot functions
+ *
+ * A snapshot is a binary image of the loaded in-memory cache that lets
+ * item_cache_load skip decoding every token blob in the database.
+ *
+ * The file is a SnapshotHeader followed by these sections, each padded
+ * to a multiple of 8 bytes:
+ *
+ *   SnapshotItem   items[num_items]             in descending time order
+ *   uint32_t       token_ids[num_tokens]        each item's run is sorted
+ *   uint16_t       token_frequencies[num_tokens]
+ *   char           id_pool[id_pool_size]        NULL terminated ids
+ *   uint32_t       background_ids[num_background_tokens]
+ *   uint32_t       background_frequencies[num_background_tokens]
+ *
+ * Everything is in host byte order, a snapshot from a machine with a
+ * different byte order is rejected by the byte_order check.  The checksum
+ * covers everything after the header.  When loaded, the token and id
+ * sections are used directly from the mmap'd file.
+ ******************************************************************************/
+#define SNAPSHOT_MAGIC "WNWSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define SNAPSHOT_PAD(size) (((size) + 7) & ~((size_t) 7))
+#define FETCH_BACKGROUND_SIGNATURE_SQL "select count(*), max(entry_id) from random_backgrounds"
+
+typedef struct SNAPSHOT_HEADER {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  int64_t  created_at;
+  /* The largest entry key in the snapshot, rows with larger keys are loaded from the database. */
+  int64_t  max_key;
+  /* The item cache options the snapshot was built with */
+  int32_t  min_tokens;
+  int32_t  load_items_since;
+  /* The size and largest entry of random_backgrounds when the background was saved */
+  int64_t  background_entries;
+  int64_t  background_max_entry;
+  uint64_t num_items;
+  uint64_t num_tokens;
+  uint64_t id_pool_size;
+  uint64_t num_background_tokens;
+  uint64_t checksum;
+} SnapshotHeader;
+
+typedef struct SNAPSHOT_ITEM {
+  int64_t  key;
+  int64_t  time;
+  int64_t  total_tokens;
+  uint64_t token_offset;
+  uint64_t num_tokens;
+  uint64_t id_offset;
+} SnapshotItem;
+
+/* The parts of a loaded snapshot needed by item_cache_load. */
+typedef struct SNAPSHOT {
+  ItemArena *arena;
+  int64_t background_entries;
+  int64_t background_max_entry;
+  const uint32_t *background_ids;
+  const uint32_t *background_frequencies;
+  uint64_t num_background_tokens;
+} Snapshot;
+
+typedef struct SNAPSHOT_WRITER {
+  FILE *file;
+  uint64_t checksum;
+  /* Bytes waiting to be added to the checksum as a whole word */
+  unsigned char partial[8];
+  int partial_size;
+  int failed;
+} SnapshotWriter;
+
+static uint64_t snapshot_checksum_word(uint64_t checksum, uint64_t word) {
+  return (checksum ^ word) * 0x100000001b3ULL;
+}
+
+static uint64_t snapshot_checksum(const void * data, size_t size) {
+  uint64_t checksum = 0xcbf29ce484222325ULL;
+  const unsigned char *p = data;
+  size_t i;
+
+  for (i = 0; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    checksum = snapshot_checksum_word(checksum, word);
+  }
+
+  return checksum;
+}
+
+static void snapshot_write(SnapshotWriter * writer, const void * data, size_t size) {
+  const unsigned char *p = data;
+
+  if (writer->failed || size == 0) {
+    return;
+  }
+
+  if (1 != fwrite(data, size, 1, writer->file)) {
+    writer->failed = true;
+    return;
+  }
+
+  while (size > 0) {
+    if (writer->partial_size == 0 && size >= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      writer->checksum = snapshot_checksum_word(writer->checksum, word);
+      p += 8;
+      size -= 8;
+    } else {
+      writer->partial[writer->partial_size++] = *p++;
+      size--;
+
+      if (writer->partial_size == 8) {
+        uint64_t word;
+        memcpy(&word, writer->partial, 8);
+        writer->checksum = snapshot_checksum_word(writer->checksum, word);
+        writer->partial_size = 0;
+      }
+    }
+  }
+}
+
+static void snapshot_write_padding(SnapshotWriter * writer, size_t size) {
+  static const char zeros[8] = {0};
+  snapshot_write(writer, zeros, SNAPSHOT_PAD(size) - size);
+}
+
+/* Gets the number of entries in the random background and the largest of their ids.
+ *
+ * Caller must hold the db_access_mutex.
+ */
+static void get_background_signature(ItemCache * item_cache, int64_t * entries, int64_t * max_entry) {
+  sqlite3_stmt *stmt;
+  *entries = -1;
+  *max_entry = -1;
+
+  if (SQLITE_OK == sqlite3_prepare_v2(item_cache->db, FETCH_BACKGROUND_SIGNATURE_SQL, -1, &stmt, NULL)) {
+    if (SQLITE_ROW == sqlite3_step(stmt)) {
+      *entries = sqlite3_column_int64(stmt, 0);
+      *max_entry = sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+  }
+}
+
+/* Writes the items in the view and the random background to the snapshot.
+ *
+ * The view is a copy of the cache so no lock is held while the file is
+ * written, the caller must stay registered in an epoch until this returns.
+ */
+static int write_snapshot(ItemCache * item_cache, const ItemView * view, SnapshotWriter * writer, SnapshotHeader * header,
+                          int64_t background_entries, int64_t background_max_entry) {
+  const Item *item;
+  int i;
+  uint64_t token_offset = 0, id_offset = 0;
+  Token token = {0, 0};
+
+  memset(header, 0, sizeof(SnapshotHeader));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->byte_order = SNAPSHOT_BYTE_ORDER;
+  header->created_at = time(NULL);
+  header->min_tokens = item_cache->min_tokens;
+  header->load_items_since = item_cache->load_items_since;
+  header->background_entries = background_entries;
+  header->background_max_entry = background_max_entry;
+
+  for (i = 0; i < view->num_items; i++) {
+    item = view->items[i];
+    header->num_items++;
+    header->num_tokens += item_get_num_tokens(item);
+    header->id_pool_size += strlen((char*) item->id) + 1;
+    if (item->key > header->max_key) {
+      header->max_key = item->key;
+    }
+  }
+
+  /* Reserve space for the header, it is rewritten once the checksum is known. */
+  if (1 != fwrite(header, sizeof(SnapshotHeader), 1, writer->file)) {
+    return CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; i < view->num_items; i++) {
+    item = view->items[i];
+    SnapshotItem record;
+    record.key = item->key;
+    record.time = item->time;
+    record.total_tokens = item->total_tokens;
+    record.token_offset = token_offset;
+    record.num_tokens = item_get_num_tokens(item);
+    record.id_offset = id_offset;
+    snapshot_write(writer, &record, sizeof(record));
+
+    token_offset += record.num_tokens;
+    id_offset += strlen((char*) item->id) + 1;
+  }
+
+  for (i = 0; i < view->num_items; i++) {
+    item = view->items[i];
+    if (item->arena) {
+      snapshot_write(writer, item->packed_ids, item->num_packed_tokens * sizeof(uint32_t));
+    } else {
+      int token_id = 0, position = 0;
+      short frequency = 0;
+      while (item_next_token_from(item, &position, &token_id, &frequency)) {
+        uint32_t id = token_id;
+        snapshot_write(writer, &id, sizeof(id));
+      }
+    }
+  }
+  snapshot_write_padding(writer, header->num_tokens * sizeof(uint32_t));
+
+  for (i = 0; i < view->num_items; i++) {
+    item = view->items[i];
+    if (item->arena) {
+      snapshot_write(writer, item->packed_frequencies, item->num_packed_tokens * sizeof(uint16_t));
+    } else {
+      int token_id = 0, position = 0;
+      short frequency = 0;
+      while (item_next_token_from(item, &position, &token_id, &frequency)) {
+        uint16_t out_frequency = frequency;
+        snapshot_write(writer, &out_frequency, sizeof(out_frequency));
+      }
+    }
+  }
+  snapshot_write_padding(writer, header->num_tokens * sizeof(uint16_t));
+
+  for (i = 0; i < view->num_items; i++) {
+    item = view->items[i];
+    snapshot_write(writer, item->id, strlen((char*) item->id) + 1);
+  }
+  snapshot_write_padding(writer, header->id_pool_size);
+
+  header->num_background_tokens = pool_num_tokens(item_cache->random_background);
+
+  while (pool_next_token(item_cache->random_background, &token)) {
+    uint32_t id = token.id;
+    snapshot_write(writer, &id, sizeof(id));
+  }
+  snapshot_write_padding(writer, header->num_background_tokens * sizeof(uint32_t));
+
+  token.id = 0;
+  while (pool_next_token(item_cache->random_background, &token)) {
+    /* Token frequencies are shorts so get the full frequency from the pool. */
+    uint32_t frequency = pool_token_frequency(item_cache->random_background, token.id);
+    snapshot_write(writer, &frequency, sizeof(frequency));
+  }
+  snapshot_write_padding(writer, header->num_background_tokens * sizeof(uint32_t));
+
+  header->checksum = writer->checksum;
+
+  return writer->failed ? CLASSIFIER_FAIL : CLASSIFIER_OK;
+}
+
+/* Maps a snapshot file and builds an arena for the items in it that are inside the load window.
+ *
+ * @returns CLASSIFIER_FAIL if there is no snapshot or it can't be used.
+ */
+static int load_snapshot(ItemCache * item_cache, Snapshot * snapshot) {
+  int fd;
+  struct stat st;
+  const char *file = item_cache->snapshot_file;
+  const unsigned char *base;
+
+  memset(snapshot, 0, sizeof(Snapshot));
+
+  if (-1 == (fd = open(file, O_RDONLY))) {
+    info("No item cache snapshot at %s", file);
+    return CLASSIFIER_FAIL;
+  }
+
+  if (-1 == fstat(fd, &st) || st.st_size < sizeof(SnapshotHeader)) {
+    error("Item cache snapshot %s is too short", file);
+    close(fd);
+    return CLASSIFIER_FAIL;
+  }
+
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (MAP_FAILED == base) {
+    error("Could not mmap item cache snapshot %s: %s", file, strerror(errno));
+    return CLASSIFIER_FAIL;
+  }
+
+  const SnapshotHeader *header = (const SnapshotHeader*) base;
+  size_t items_size = header->num_items * sizeof(SnapshotItem);
+  size_t ids_size = SNAPSHOT_PAD(header->num_tokens * sizeof(uint32_t));
+  size_t frequencies_size = SNAPSHOT_PAD(header->num_tokens * sizeof(uint16_t));
+  size_t id_pool_size = SNAPSHOT_PAD(header->id_pool_size);
+  size_t background_size = SNAPSHOT_PAD(header->num_background_tokens * sizeof(uint32_t));
+  size_t payload_size = items_size + ids_size + frequencies_size + id_pool_size + 2 * background_size;
+
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER) {
+    error("%s is not a version %i item cache snapshot", file, SNAPSHOT_VERSION);
+  } else if (sizeof(SnapshotHeader) + payload_size != st.st_size) {
+    error("Item cache snapshot %s is the wrong size, it is possibly corrupt", file);
+  } else if (header->checksum != snapshot_checksum(base + sizeof(SnapshotHeader), payload_size)) {
+    error("Item cache snapshot %s has a bad checksum, it is possibly corrupt", file);
+  } else if (header->min_tokens != item_cache->min_tokens || header->load_items_since != item_cache->load_items_since) {
+    info("Item cache snapshot %s was created with different options, ignoring it", file);
+  } else if (NULL != (snapshot->arena = new_item_arena())) {
+    const SnapshotItem *records = (const SnapshotItem*) (base + sizeof(SnapshotHeader));
+    const unsigned char *ids_section = (const unsigned char*) records + items_size;
+    const unsigned char *frequencies_section = ids_section + ids_size;
+    const unsigned char *id_pool_section = frequencies_section + frequencies_size;
+    const unsigned char *background_section = id_pool_section + id_pool_size;
+    ItemArena *arena = snapshot->arena;
+    time_t cutoff = time(NULL) - (time_t) item_cache->load_items_since * 24 * 60 * 60;
+    uint64_t i;
+
+    arena->mapping = (void*) base;
+    arena->mapping_size = st.st_size;
+    arena->token_ids = (uint32_t*) ids_section;
+    arena->token_frequencies = (uint16_t*) frequencies_section;
+    arena->id_pool = (char*) id_pool_section;
+    arena->num_tokens = header->num_tokens;
+    arena->id_pool_size = header->id_pool_size;
+
+    if (header->num_items > 0 && NULL == (arena->items = calloc(header->num_items, sizeof(Item)))) {
+      fatal("Could not malloc snapshot items");
+      free_item_arena(arena);
+      snapshot->arena = NULL;
+      return CLASSIFIER_FAIL;
+    }
+
+    for (i = 0; i < header->num_items; i++) {
+      const SnapshotItem *record = &records[i];
+
+      if (record->token_offset + record->num_tokens > header->num_tokens ||
+          record->id_offset >= header->id_pool_size ||
+          NULL == memchr(arena->id_pool + record->id_offset, '\0', header->id_pool_size - record->id_offset)) {
+        error("Item cache snapshot %s has a corrupt item, ignoring it", file);
+        free_item_arena(arena);
+        snapshot->arena = NULL;
+        return CLASSIFIER_FAIL;
+      }
+
+      /* Only include items that are still inside the load window. */
+      if (record->time > cutoff) {
+        Item *item = &arena->items[arena->num_items++];
+        item->id = (unsigned char*) arena->id_pool + record->id_offset;
+        item->key = record->key;
+        item->time = record->time;
+        item->total_tokens = record->total_tokens;
+        item->arena = arena;
+        item->packed_ids = arena->token_ids + record->token_offset;
+        item->packed_frequencies = arena->token_frequencies + record->token_offset;
+        item->num_packed_tokens = record->num_tokens;
+      }
+    }
+
+    arena->items_capacity = header->num_items;
+    arena->live_items = arena->num_items;
+    snapshot->background_entries = header->background_entries;
+    snapshot->background_max_entry = header->background_max_entry;
+    snapshot->background_ids = (const uint32_t*) background_section;
+    snapshot->background_frequencies = (const uint32_t*) (background_section + background_size);
+    snapshot->num_background_tokens = header->num_background_tokens;
+
+    info("Loaded %i items from item cache snapshot %s created at %lli", arena->num_items, file, (long long) header->created_at);
+    return CLASSIFIER_OK;
+  }
+
+  munmap((void*) base, st.st_size);
+  return CLASSIFIER_FAIL;
+}
+
+/* Builds the random background from the snapshot if the random_backgrounds table hasn't changed.
+ *
+ * Caller must hold the db_access_mutex.
+ */
+static int load_random_background_from_snapshot(ItemCache * item_cache, const Snapshot * snapshot) {
+  int64_t entries, max_entry;
+  uint64_t i;
+
+  get_background_signature(item_cache, &entries, &max_entry);
+  if (entries != snapshot->background_entries || max_entry != snapshot->background_max_entry) {
+    info("Random background has changed since the snapshot was created");
+    return CLASSIFIER_FAIL;
+  }
+
+  item_cache->random_background = new_pool();
+  for (i = 0; i < snapshot->num_background_tokens; i++) {
+    pool_add_token(item_cache->random_background, snapshot->background_ids[i], snapshot->background_frequencies[i]);
+  }
+
+  info("Randombackground loaded from snapshot with %i tokens", pool_num_tokens(item_cache->random_background));
+  return CLASSIFIER_OK;
+}
+
+/*****
+ * Blob rewriting functions
+ *
+ * These rewrite the blobs in a table in place, a batch at a time, for
+ * changes to the storage format of tokens and atom XML.
+ *****/
+
+/* Rewrites a blob, leaving *new_data NULL if the blob doesn't need rewriting.
+ *
+ * The caller frees *new_data.
+ */
+typedef int (*BlobRewriter) (sqlite3_int64 id, const char * data, int size, char ** new_data, int * new_size);
+
+/* Rewrites the next batch of blobs after *last_id.
+ *
+ * select_sql must select the id and blob of rows with an id greater than its first
+ * parameter in id order, limited by its second parameter.  update_sql must set the
+ * blob to its first parameter for the row with the id in its second parameter.
+ *
+ * The caller must hold the db_access_mutex.
+ *
+ * @returns the number of rows looked at, 0 once there are none left, -1 on error.
+ */
+static int rewrite_blob_batch(ItemCache * item_cache, const char * select_sql, const char * update_sql,
+                              BlobRewriter rewriter, sqlite3_int64 * last_id, int * rewritten) {
+  sqlite3_int64 ids_to_update[REWRITE_BATCH_SIZE];
+  char *blobs[REWRITE_BATCH_SIZE];
+  int sizes[REWRITE_BATCH_SIZE];
+  sqlite3_stmt *select_stmt = NULL;
+  sqlite3_stmt *update_stmt = NULL;
+  int i, num_blobs = 0, rows = 0;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, select_sql, -1, &select_stmt, NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2(item_cache->db, update_sql, -1, &update_stmt, NULL)) {
+    error("Could not prepare blob rewriting statements: %s", item_cache_errmsg(item_cache));
+    rows = -1;
+  } else {
+    sqlite3_bind_int64(select_stmt, 1, *last_id);
+    sqlite3_bind_int(select_stmt, 2, REWRITE_BATCH_SIZE);
+
+    /* Rewrite the whole batch before updating anything so the select isn't reading rows as they change. */
+    while (rows >= 0 && SQLITE_ROW == sqlite3_step(select_stmt)) {
+      sqlite3_int64 id = sqlite3_column_int64(select_stmt, 0);
+      const char *data = sqlite3_column_blob(select_stmt, 1);
+      int size = sqlite3_column_bytes(select_stmt, 1);
+
+      *last_id = id;
+      rows++;
+      blobs[num_blobs] = NULL;
+
+      if (!data) {
+        error("No data to rewrite for %lli", id);
+      } else if (CLASSIFIER_OK != rewriter(id, data, size, &blobs[num_blobs], &sizes[num_blobs])) {
+        rows = -1;
+      } else if (blobs[num_blobs]) {
+        ids_to_update[num_blobs++] = id;
+      }
+    }
+
+    sqlite3_finalize(select_stmt);
+    select_stmt = NULL;
+
+    if (CLASSIFIER_OK != savepoint_begin(item_cache, "rewrite_blobs")) {
+      rows = -1;
+    }
+
+    for (i = 0; rows >= 0 && i < num_blobs; i++) {
+      if (SQLITE_OK != sqlite3_bind_blob(update_stmt, 1, blobs[i], sizes[i], SQLITE_STATIC) ||
+          SQLITE_OK != sqlite3_bind_int64(update_stmt, 2, ids_to_update[i]) ||
+          SQLITE_DONE != sqlite3_step(update_stmt)) {
+        error("Error rewriting blob for %lli: %s", ids_to_update[i], item_cache_errmsg(item_cache));
+        rows = -1;
+      }
+
+      sqlite3_clear_bindings(update_stmt);
+      sqlite3_reset(update_stmt);
+    }
+
+    savepoint_end(item_cache, "rewrite_blobs", rows < 0 ? CLASSIFIER_FAIL : CLASSIFIER_OK);
+
+    if (rows >= 0) {
+      *rewritten += num_blobs;
+    }
+  }
+
+  for (i = 0; i < num_blobs; i++) {
+    free(blobs[i]);
+  }
+
+  sqlite3_finalize(select_stmt);
+  sqlite3_finalize(update_stmt);
+
+  return rows;
+}
+
+/* Rewrites every blob selected by select_sql, releasing the database between
+ * batches and stopping early if the item cache is shutting down.
+ *
+ * @returns the number of blobs rewritten or -1 on error.
+ */
+static int rewrite_blobs(ItemCache * item_cache, const char * select_sql, const char * update_sql, BlobRewriter rewriter) {
+  sqlite3_int64 last_id = 0;
+  int rewritten = 0;
+  int rows = 1;
+
+  while (rows > 0 && !item_cache->shutting_down) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    rows = rewrite_blob_batch(item_cache, select_sql, update_sql, rewriter, &last_id, &rewritten);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    if (rows > 0) {
+      /* Give other writers a chance at the database */
+      usleep(10000);
+    }
+  }
+
+  return rows < 0 ? -1 : rewritten;
+}
+
+/* Rewrites a fixed format token blob in the compact format. */
+static int migrate_token_blob(sqlite3_int64 id, const char * data, int size, char ** new_data, int * new_size) {
+  int rc = CLASSIFIER_OK;
+  int num_tokens = token_blob_count(data, size);
+
+  if (num_tokens < 0) {
+    error("Token data is corrupt for item %lli (size = %i), not migrating it", id, size);
+  } else if (!is_compact_token_blob(data, size)) {
+    uint32_t *ids = malloc(num_tokens * sizeof(uint32_t) + 1);
+    uint16_t *frequencies = malloc(num_tokens * sizeof(uint16_t) + 1);
+
+    if (!ids || !frequencies) {
+      fatal("Could not allocate tokens to migrate");
+      rc = CLASSIFIER_FAIL;
+    } else if (num_tokens == token_blob_decode(data, size, ids, frequencies)) {
+      rc = token_blob_encode(ids, frequencies, item_arena_sort_run(ids, frequencies, num_tokens), new_size, new_data);
+    }
+
+    free(ids);
+    free(frequencies);
+  }
+
+  return rc;
+}
+
+/* Compresses an uncompressed atom, leaving it alone if compression doesn't make it smaller. */
+static int compress_atom_blob(sqlite3_int64 id, const char * data, int size, char ** new_data, int * new_size) {
+  int rc = CLASSIFIER_OK;
+
+  if (!is_compressed_atom(data, size)) {
+    rc = compress_atom(data, size, new_data, new_size);
+
+    if (CLASSIFIER_OK == rc && *new_size >= size) {
+      free(*new_data);
+      *new_data = NULL;
+    }
+  }
+
+  return rc;
+}
+
+/* Records the token counts of a batch of entries that don't have one.
+ *
+ * Caller must hold the db_access mutex.
+ *
+ * @returns the number of rows looked at, 0 once there are none left, -1 on error.
+ */
+static int count_token_batch(ItemCache * item_cache, sqlite3_int64 * last_id, int * counted) {
+  sqlite3_int64 ids[REWRITE_BATCH_SIZE];
+  int counts[REWRITE_BATCH_SIZE];
+  sqlite3_stmt *stmt;
+  int i, num_counts = 0, rows = 0;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, SELECT_TOKENS_TO_COUNT, -1, &stmt, NULL)) {
+    error("Could not prepare %s: %s", SELECT_TOKENS_TO_COUNT, item_cache_errmsg(item_cache));
+    return -1;
+  }
+
+  sqlite3_bind_int64(stmt, 1, *last_id);
+  sqlite3_bind_int(stmt, 2, REWRITE_BATCH_SIZE);
+
+  /* Read the whole batch before updating anything so the select isn't reading rows as they change. */
+  while (SQLITE_ROW == sqlite3_step(stmt)) {
+    const char *data = sqlite3_column_blob(stmt, 1);
+    int size = sqlite3_column_bytes(stmt, 1);
+    int num_tokens = data ? token_blob_count(data, size) : -1;
+
+    *last_id = sqlite3_column_int64(stmt, 0);
+    rows++;
+
+    if (num_tokens < 0) {
+      /* Left without a count so it is still read and checked when loading */
+      error("Token data is corrupt for item %lli (size = %i), not counting it", *last_id, size);
+    } else {
+      ids[num_counts] = *last_id;
+      counts[num_counts++] = num_tokens;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+
+  if (num_counts > 0) {
+    if (CLASSIFIER_OK != savepoint_begin(item_cache, "count_tokens")) {
+      rows = -1;
+    }
+
+    for (i = 0; rows >= 0 && i < num_counts; i++) {
+      if (CLASSIFIER_OK != save_token_count(item_cache, ids[i], counts[i])) {
+        rows = -1;
+      }
+    }
+
+    savepoint_end(item_cache, "count_tokens", rows < 0 ? CLASSIFIER_FAIL : CLASSIFIER_OK);
+
+    if (rows >= 0) {
+      *counted += num_counts;
+    }
+  }
+
+  return rows;
+}
+
+static void * token_migration_thread_func(void *memo) {
+  item_cache_migrate_tokens((ItemCache*) memo);
+  item_cache_count_tokens((ItemCache*) memo);
+  return NULL;
+}
+
+/*****
+ * Garbage collection functions
+ *
+ * A garbage collection pass first deletes the entries that haven't been
+ * updated or used for gc_expire_days, then scans every token blob to mark
+ * the atoms that are still in use and deletes the rows in the tokens table
+ * for the rest.  All of this is done GC_BATCH_SIZE rows at a time, releasing
+ * db_access_mutex between batches, so it can run alongside new entries being
+ * added.
+ *
+ * While the scan is running save_item marks the atoms of the items it saves
+ * so they aren't deleted, and if an item uses an atom that has already been
+ * deleted it is put back on the unsaved list to be written again.
+ *****/
+
+/* Marks the atoms of an item as used and restores any that have been deleted.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static void gc_mark_item(ItemCache * item_cache, Item * item) {
+  if (item_cache->gc_marking || item_cache->gc_deleted_atoms) {
+    int token = 0, position = 0, judyrc;
+    short frequency;
+    PWord_t PValue;
+
+    while (item_next_token_from(item, &position, &token, &frequency)) {
+      if (item_cache->gc_marking) {
+        JLI(PValue, item_cache->gc_used_atoms, token);
+      }
+
+      JLG(PValue, item_cache->gc_deleted_atoms, token);
+      if (PValue) {
+        debug("Restoring garbage collected atom %i", token);
+        JLD(judyrc, item_cache->gc_deleted_atoms, token);
+        pthread_rwlock_wrlock(&item_cache->atoms_lock);
+        token_dictionary_restore(item_cache, token);
+        pthread_rwlock_unlock(&item_cache->atoms_lock);
+      }
+    }
+  }
+}
+
+/* Deletes the next batch of expired entries after *last_id, along with their atom and tokens.
+ *
+ * Caller must hold db_access_mutex.
+ *
+ * @returns the number of entries deleted, 0 once there are none left, -1 on error.
+ */
+static int gc_expire_entry_batch(ItemCache * item_cache, int expire_days, sqlite3_int64 * last_id) {
+  sqlite3_int64 ids[GC_BATCH_SIZE];
+  sqlite3_stmt *stmt;
+  int i, num_ids = 0, rc = CLASSIFIER_OK;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, SELECT_EXPIRED_ENTRIES_SQL, -1, &stmt, NULL)) {
+    error("Could not prepare %s: %s", SELECT_EXPIRED_ENTRIES_SQL, item_cache_errmsg(item_cache));
+    return -1;
+  }
+
+  sqlite3_bind_int(stmt, 1, expire_days);
+  sqlite3_bind_int(stmt, 2, expire_days);
+  sqlite3_bind_int64(stmt, 3, *last_id);
+  sqlite3_bind_int(stmt, 4, GC_BATCH_SIZE);
+
+  while (num_ids < GC_BATCH_SIZE && SQLITE_ROW == sqlite3_step(stmt)) {
+    ids[num_ids++] = sqlite3_column_int64(stmt, 0);
+  }
+
+  sqlite3_finalize(stmt);
+
+  /* Deletes can hit the random background trigger, so keep them out of other writers' batch */
+  write_batch_commit(item_cache);
+  rc = savepoint_begin(item_cache, "gc_entries");
+
+  for (i = 0; CLASSIFIER_OK == rc && i < num_ids; i++) {
+    *last_id = ids[i];
+
+    sqlite3_bind_int64(item_cache->delete_entry_stmt, 1, ids[i]);
+    sqlite3_bind_int64(item_cache->delete_atom_xml_stmt, 1, ids[i]);
+    sqlite3_bind_int64(item_cache->delete_tokens_stmt, 1, ids[i]);
+
+    if (SQLITE_DONE != sqlite3_step(item_cache->delete_entry_stmt) ||
+        SQLITE_DONE != sqlite3_step(item_cache->delete_atom_xml_stmt) ||
+        SQLITE_DONE != sqlite3_step(item_cache->delete_tokens_stmt)) {
+      error("Error deleting expired entry %lli: %s", ids[i], item_cache_errmsg(item_cache));
+      rc = CLASSIFIER_FAIL;
+    }
+
+    sqlite3_reset(item_cache->delete_entry_stmt);
+    sqlite3_reset(item_cache->delete_atom_xml_stmt);
+    sqlite3_reset(item_cache->delete_tokens_stmt);
+  }
+
+  savepoint_end(item_cache, "gc_entries", rc);
+
+  return CLASSIFIER_OK == rc ? num_ids : -1;
+}
+
+/* Marks the atoms used by the next batch of token blobs after *last_id.
+ *
+ * Caller must hold db_access_mutex.
+ *
+ * @returns the number of blobs scanned, 0 once there are none left, -1 on error.
+ */
+static int gc_mark_token_batch(ItemCache * item_cache, sqlite3_int64 * last_id,
+                               uint32_t ** ids, uint16_t ** frequencies, int * capacity) {
+  sqlite3_stmt *stmt;
+  PWord_t PValue;
+  int i, rows = 0;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, SELECT_TOKENS_TO_MIGRATE, -1, &stmt, NULL)) {
+    error("Could not prepare %s: %s", SELECT_TOKENS_TO_MIGRATE, item_cache_errmsg(item_cache));
+    return -1;
+  }
+
+  sqlite3_bind_int64(stmt, 1, *last_id);
+  sqlite3_bind_int(stmt, 2, GC_BATCH_SIZE);
+
+  while (rows >= 0 && SQLITE_ROW == sqlite3_step(stmt)) {
+    const char *data = sqlite3_column_blob(stmt, 1);
+    int size = sqlite3_column_bytes(stmt, 1);
+    int num_tokens = token_blob_count(data, size);
+
+    *last_id = sqlite3_column_int64(stmt, 0);
+
+    if (num_tokens > *capacity) {
+      uint32_t *new_ids = realloc(*ids, num_tokens * sizeof(uint32_t));
+      uint16_t *new_frequencies = new_ids ? realloc(*frequencies, num_tokens * sizeof(uint16_t)) : NULL;
+
+      if (new_ids) {
+        *ids = new_ids;
+      }
+
+      if (!new_frequencies) {
+        fatal("Could not allocate tokens to mark");
+        rows = -1;
+        break;
+      }
+
+      *frequencies = new_frequencies;
+      *capacity = num_tokens;
+    }
+
+    if (num_tokens < 0 || num_tokens != token_blob_decode(data, size, *ids, *frequencies)) {
+      /* We can't tell which atoms a corrupt blob uses, so nothing can be deleted */
+      error("Token data is corrupt for item %lli (size = %i), not collecting tokens", *last_id, size);
+      rows = -1;
+    } else {
+      for (i = 0; i < num_tokens; i++) {
+        JLI(PValue, item_cache->gc_used_atoms, (*ids)[i]);
+      }
+
+      rows++;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+
+  return rows;
+}
+
+/* Deletes the next batch of unmarked rows in the tokens table after *last_atom, up to limit.
+ *
+ * Caller must hold db_access_mutex.
+ *
+ * @returns the number of rows looked at, 0 once there are none left, -1 on error.
+ */
+static int gc_sweep_token_batch(ItemCache * item_cache, int * last_atom, int limit, int * deleted) {
+  int atoms[GC_BATCH_SIZE];
+  sqlite3_stmt *select_stmt = NULL;
+  sqlite3_stmt *delete_stmt = NULL;
+  PWord_t PValue;
+  int i, rows = 0;
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, SELECT_ATOMS_TO_SWEEP_SQL, -1, &select_stmt, NULL) ||
+      SQLITE_OK != sqlite3_prepare_v2(item_cache->db, DELETE_ATOM_SQL, -1, &delete_stmt, NULL)) {
+    error("Could not prepare token sweeping statements: %s", item_cache_errmsg(item_cache));
+    rows = -1;
+  } else {
+    sqlite3_bind_int(select_stmt, 1, *last_atom);
+    sqlite3_bind_int(select_stmt, 2, limit);
+    sqlite3_bind_int(select_stmt, 3, GC_BATCH_SIZE);
+
+    while (rows < GC_BATCH_SIZE && SQLITE_ROW == sqlite3_step(select_stmt)) {
+      atoms[rows++] = sqlite3_column_int(select_stmt, 0);
+    }
+
+    sqlite3_finalize(select_stmt);
+    select_stmt = NULL;
+
+    if (CLASSIFIER_OK != savepoint_begin(item_cache, "gc_tokens")) {
+      rows = -1;
+    }
+
+    for (i = 0; rows >= 0 && i < rows; i++) {
+      *last_atom = atoms[i];
+      JLG(PValue, item_cache->gc_used_atoms, atoms[i]);
+
+      if (!PValue) {
+        sqlite3_bind_int(delete_stmt, 1, atoms[i]);
+        if (SQLITE_DONE != sqlite3_step(delete_stmt)) {
+          error("Error deleting token %i: %s", atoms[i], item_cache_errmsg(item_cache));
+          rows = -1;
+        } else {
+          (*deleted)++;
+        }
+
+        sqlite3_reset(delete_stmt);
+      }
+    }
+
+    savepoint_end(item_cache, "gc_tokens", rows < 0 ? CLASSIFIER_FAIL : CLASSIFIER_OK);
+
+    if (rows > 0) {
+      pthread_rwlock_wrlock(&item_cache->atoms_lock);
+
+      for (i = 0; i < rows; i++) {
+        JLG(PValue, item_cache->gc_used_atoms, atoms[i]);
+
+        if (!PValue) {
+          JLI(PValue, item_cache->gc_deleted_atoms, atoms[i]);
+          token_dictionary_hide(item_cache, atoms[i]);
+        }
+      }
+
+      pthread_rwlock_unlock(&item_cache->atoms_lock);
+    }
+  }
+
+  sqlite3_finalize(select_stmt);
+  sqlite3_finalize(delete_stmt);
+
+  return rows;
+}
+
+/* Deletes the expired entries. */
+static int gc_expire_entries(ItemCache * item_cache) {
+  sqlite3_int64 last_id = 0;
+  int expired = 0;
+  int rows = 1;
+
+  /* Never expire entries that could be in the in-memory cache */
+  int expire_days = item_cache->gc_expire_days > item_cache->load_items_since ?
+                      item_cache->gc_expire_days : item_cache->load_items_since;
+
+  /* Make sure recent uses of entries are in the database before looking at them */
+  flush_touches(item_cache);
+
+  while (rows > 0 && !item_cache->shutting_down) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    rows = gc_expire_entry_batch(item_cache, expire_days, &last_id);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    if (rows > 0) {
+      expired += rows;
+      usleep(GC_BATCH_PAUSE);
+    }
+  }
+
+  return rows < 0 ? -1 : expired;
+}
+
+/* Deletes the rows in the tokens table that no token blob uses. */
+static int gc_collect_tokens(ItemCache * item_cache) {
+  sqlite3_int64 last_id = 0;
+  uint32_t *ids = NULL;
+  uint16_t *frequencies = NULL;
+  int capacity = 0;
+  int last_atom = 0, limit, deleted = 0;
+  int rows = 1;
+  Word_t freed_bytes;
+
+  if (CLASSIFIER_OK != token_dictionary_ready(item_cache)) {
+    return -1;
+  }
+
+  /* Atoms created after the scan starts are left alone */
+  pthread_rwlock_rdlock(&item_cache->atoms_lock);
+  limit = item_cache->next_atom;
+  pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  item_cache->gc_marking = true;
+
+  /* Anything that could still restore the last pass's atoms has been saved by now */
+  if (item_cache->gc_deleted_atoms) {
+    Word_t atom = 0;
+    PWord_t PValue;
+
+    pthread_rwlock_wrlock(&item_cache->atoms_lock);
+    JLF(PValue, item_cache->gc_deleted_atoms, atom);
+    while (PValue) {
+      token_dictionary_remove(item_cache, (int) atom);
+      JLN(PValue, item_cache->gc_deleted_atoms, atom);
+    }
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
+
+    JLFA(freed_bytes, item_cache->gc_deleted_atoms);
+  }
+
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  while (rows > 0 && !item_cache->shutting_down) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    rows = gc_mark_token_batch(item_cache, &last_id, &ids, &frequencies, &capacity);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    if (rows > 0) {
+      usleep(GC_BATCH_PAUSE);
+    }
+  }
+
+  free(ids);
+  free(frequencies);
+
+  /* Only sweep after a complete scan, anything else could delete used tokens */
+  if (rows == 0 && !item_cache->shutting_down) {
+    rows = 1;
+
+    /* Item caches from before entry_tokens moved to tokens.db have a trigger
+     * on tokens that refers to the old table and makes every delete fail.
+     */
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    if (SQLITE_OK != sqlite3_exec(item_cache->db, DROP_STALE_TOKENS_TRIGGER_SQL, NULL, NULL, NULL)) {
+      error("Could not drop the entry_tokens_token_id trigger: %s", item_cache_errmsg(item_cache));
+      rows = -1;
+    }
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    while (rows > 0 && !item_cache->shutting_down) {
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      rows = gc_sweep_token_batch(item_cache, &last_atom, limit, &deleted);
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+      if (rows > 0) {
+        usleep(GC_BATCH_PAUSE);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+  item_cache->gc_marking = false;
+  JLFA(freed_bytes, item_cache->gc_used_atoms);
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  return rows < 0 ? -1 : deleted;
+}
+
+static void * gc_thread_func(void *memo) {
+  ItemCache *item_cache = (ItemCache*) memo;
+  int i;
+
+  while (!item_cache->shutting_down) {
+    for (i = 0; i < item_cache->gc_interval && !item_cache->shutting_down; i++) {
+      sleep(1);
+    }
+
+    if (!item_cache->shutting_down) {
+      item_cache_collect_garbage(item_cache);
+    }
+  }
+
+  return NULL;
+}
+
+/*****************************************************************************
+ * External API functions for the item cache.
  *****************************************************************************/
 
-/** Initialize an SQLite database with the ItemCache schema.
+/** Initialize an SQLite database with the ItemCache schema.
+ *
+ * @param db_file File to initialize.
+ * @param error Any error message is stored here.
+ */
+int item_cache_initialize(const char *db_file, char * error) {
+  int rc = CLASSIFIER_OK;
+  sqlite3 *db;
+  FILE *file;
+
+  if (NULL != (file = fopen(db_file, "r"))) {
+    snprintf(error, 512, "Database file %s already exists, no action taken.", db_file);
+    fclose(file);
+    rc = CLASSIFIER_FAIL;
+  } else if (SQLITE_OK != sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) {
+    snprintf(error, 512, "Error creating database file %s: %s.", db_file, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    rc = CLASSIFIER_FAIL;
+  } else {
+    FILE *schema_file;
+    char *schema;
+    char schema_file_name[512];
+    snprintf(schema_file_name, 512, "%s/%s/%s", DATADIR, PACKAGE,"initial_schema.sql");
+
+    if (NULL != (schema_file = fopen(schema_file_name, "r"))) {
+      fseek(schema_file, 0, SEEK_END);
+      int size = ftell(schema_file);
+      schema = malloc(size + 1);
+      fseek(schema_file, 0, SEEK_SET);
+
+      if (size != fread(schema, sizeof(char), size, schema_file)) {
+        rc = CLASSIFIER_FAIL;
+        snprintf(error, 512, "Error reading schema file %s: %s", schema_file_name, strerror(errno));
+      } else {
+        schema[size] = 0;
+        if (SQLITE_OK != sqlite3_exec(db, schema, NULL, NULL, NULL)) {
+          snprintf(error, 512, "Error loading schema into database file: %s", sqlite3_errmsg(db));
+          rc = CLASSIFIER_FAIL;
+        }
+      }
+
+      free(schema);
+      fclose(schema_file);
+    } else {
+      snprintf(error, 512, "Could not find the database schema file at %s. Perhaps it is missing from the install.", schema_file_name);
+      rc = CLASSIFIER_FAIL;
+    }
+
+    sqlite3_close(db);
+  }
+
+  return rc;
+}
+
+#include <sys/time.h>
+#include <time.h>
+
+static float tdiff(struct timeval from, struct timeval to) {
+  double from_d = from.tv_sec + (from.tv_usec / 1000000.0);
+  double to_d = to.tv_sec + (to.tv_usec / 1000000.0);
+  return to_d - from_d;
+}
+
+/* Saves the item's tokens, and any new atoms, in the database.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static int save_item(ItemCache * item_cache, Item *item) {
+  int rc = CLASSIFIER_OK;
+
+  debug("Saving item %s", item->id);
+  int entry_key = get_entry_key(item_cache, (char*) item->id);
+
+  /* Keep the item's atoms from being garbage collected */
+  gc_mark_item(item_cache, item);
+
+  if (entry_key <= 0) {
+    rc = CLASSIFIER_FAIL;
+  } else if (CLASSIFIER_OK != token_dictionary_save(item_cache)) {
+    /* Don't save tokens that refer to atoms that aren't in the database */
+    rc = CLASSIFIER_FAIL;
+  } else {
+    int size;
+
+    if (item_apply_atom_aliases(item_cache, item)) {
+      gc_mark_item(item_cache, item);
+    }
+
+    char *token_data;
+    if (CLASSIFIER_OK == (rc = serialize_tokens(item, &size, &token_data))) {
+      if (CLASSIFIER_OK == (rc = save_tokens(item_cache, entry_key, token_data, size))) {
+        rc = save_token_count(item_cache, entry_key, token_blob_count(token_data, size));
+      }
+
+      if (CLASSIFIER_OK == rc && item_cache->write_batch_open) {
+        PWord_t in_batch;
+        pthread_mutex_lock(&item_cache->write_batch_ids_mutex);
+        JSLI(in_batch, item_cache->write_batch_ids, item->id);
+        pthread_mutex_unlock(&item_cache->write_batch_ids_mutex);
+      }
+      free(token_data);
+    }
+  }
+
+  return rc;
+}
+
+/*****
+ * Tokenizer pool functions
+ *****/
+
+/* Tokenizes an entry's atom and atomizes its tokens.
+ *
+ * Nothing is written to the database so this can run without db_access_mutex.
+ *
+ * @returns the tokenized item or NULL if the entry has no tokens.
+ */
+static Item * tokenize_entry_item(ItemCache * item_cache, const ItemCacheEntry * entry) {
+  Item *item = NULL;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+
+  debug("tokenizing entry %s", entry->full_id);
+  if (entry->atom) {
+    Pvoid_t features = atom_tokenize(entry->atom);
+    if (features) {
+      item = create_item((unsigned char*) entry->full_id, entry->id, entry->updated);
+      item->tokens = NULL;
+
+      struct timeval tokenized;
+      gettimeofday(&tokenized, NULL);
+      debug("tokenized %.7fs", tdiff(start, tokenized));
+
+      PWord_t PValue;
+      uint8_t token[512];
+      token[0] = '\0';
+
+      JSLF(PValue, features, token);
+      while (PValue != NULL) {
+        int atomizedId = item_cache_atomize(item_cache, token);
+        item_add_token(item, atomizedId, *PValue);
+        JSLN(PValue, features, token);
+      }
+
+      struct timeval atomized;
+      gettimeofday(&atomized, NULL);
+      debug("atomized %.7fs", tdiff(tokenized, atomized));
+
+      Word_t freed_bytes;
+      JSLFA(freed_bytes, features);
+    }
+  }
+
+  return item;
+}
+
+/* Saves a tokenized item's tokens and holds it to be added to the cache
+ * once the write batch commits, see write_batch_finish.
+ *
+ * The item is freed if it can't be saved. The token writes join the open
+ * write batch, the caller must call write_batch_end.
+ *
+ * Caller must hold db_access_mutex.
+ */
+static int save_tokenized_item(ItemCache * item_cache, Item * item) {
+  int rc = write_batch_begin(item_cache) || save_item(item_cache, item);
+
+  if (CLASSIFIER_OK == rc && item_cache->num_write_batch_items == item_cache->write_batch_items_capacity) {
+    int capacity = item_cache->write_batch_items_capacity + 64;
+    Item **items = realloc(item_cache->write_batch_items, capacity * sizeof(Item*));
+
+    if (items) {
+      item_cache->write_batch_items = items;
+      item_cache->write_batch_items_capacity = capacity;
+    } else {
+      fatal("Could not realloc write batch items");
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  if (CLASSIFIER_OK == rc) {
+    item_cache->write_batch_items[item_cache->num_write_batch_items++] = item;
+  } else {
+    free_item(item);
+  }
+
+  return rc;
+}
+
+/* Tokenizes an entry that is already in the catalog, saves its tokens and
+ * queues the item to be added to the cache.
  *
- * @param db_file File to initialize.
- * @param error Any error message is stored here.
+ * The token writes join the open write batch, the caller must call write_batch_end.
  */
-int item_cache_initialize(const char *db_file, char * error) {
+static int tokenize_entry(ItemCache * item_cache, ItemCacheEntry * entry) {
   int rc = CLASSIFIER_OK;
-  sqlite3 *db;
-  FILE *file;
+  Item *item = tokenize_entry_item(item_cache, entry);
 
-  if (NULL != (file = fopen(db_file, "r"))) {
-    snprintf(error, 512, "Database file %s already exists, no action taken.", db_file);
-    fclose(file);
-    rc = CLASSIFIER_FAIL;
-  } else if (SQLITE_OK != sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)) {
-    snprintf(error, 512, "Error creating database file %s: %s.", db_file, sqlite3_errmsg(db));
-    sqlite3_close(db);
+  if (item) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    rc = save_tokenized_item(item_cache, item);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+  }
+
+  return rc;
+}
+
+/* Queues a copy of an entry for the tokenizer threads, waiting for room if the queue is full.
+ *
+ * An entry that is already queued or being tokenized is not queued again.
+ */
+static int tokenizer_enqueue(ItemCache * item_cache, const ItemCacheEntry * entry) {
+  PWord_t pending;
+  ItemCacheEntry *copy = create_item_cache_entry(entry->full_id, entry->updated, entry->created_at, entry->atom);
+
+  if (!copy) {
+    return CLASSIFIER_FAIL;
+  }
+
+  copy->id = entry->id;
+  pthread_mutex_lock(&item_cache->tokenizer_mutex);
+
+  JSLG(pending, item_cache->tokenizer_pending, (uint8_t*) copy->full_id);
+  if (pending) {
+    pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+    debug("entry %s is already queued for tokenizing", copy->full_id);
+    free_entry(copy);
+    return CLASSIFIER_OK;
+  }
+
+  while (item_cache->tokenizer_queue_length == item_cache->tokenizer_queue_size && !item_cache->shutting_down) {
+    pthread_cond_wait(&item_cache->tokenizer_not_full, &item_cache->tokenizer_mutex);
+  }
+
+  if (item_cache->shutting_down) {
+    pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+    free_entry(copy);
+    return CLASSIFIER_FAIL;
+  }
+
+  JSLI(pending, item_cache->tokenizer_pending, (uint8_t*) copy->full_id);
+  if (pending == PJERR) {
+    pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+    fatal("Could not malloc the pending tokenizer entries");
+    free_entry(copy);
+    return CLASSIFIER_FAIL;
+  }
+
+  int tail = (item_cache->tokenizer_queue_head + item_cache->tokenizer_queue_length) % item_cache->tokenizer_queue_size;
+  item_cache->tokenizer_queue[tail] = copy;
+  item_cache->tokenizer_queue_length++;
+  pthread_cond_signal(&item_cache->tokenizer_not_empty);
+  pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+
+  return CLASSIFIER_OK;
+}
+
+/* Takes the next entry off the tokenizer queue, waiting for one if it is empty.
+ *
+ * @returns the entry, which the caller frees, or NULL once the cache is
+ *          shutting down and the queue has been emptied.
+ */
+static ItemCacheEntry * tokenizer_dequeue(ItemCache * item_cache) {
+  ItemCacheEntry *entry = NULL;
+
+  pthread_mutex_lock(&item_cache->tokenizer_mutex);
+
+  while (item_cache->tokenizer_queue_length == 0 && !item_cache->shutting_down) {
+    pthread_cond_wait(&item_cache->tokenizer_not_empty, &item_cache->tokenizer_mutex);
+  }
+
+  if (item_cache->tokenizer_queue_length > 0) {
+    entry = item_cache->tokenizer_queue[item_cache->tokenizer_queue_head];
+    item_cache->tokenizer_queue_head = (item_cache->tokenizer_queue_head + 1) % item_cache->tokenizer_queue_size;
+    item_cache->tokenizer_queue_length--;
+    pthread_cond_signal(&item_cache->tokenizer_not_full);
+  }
+
+  pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+
+  return entry;
+}
+
+/* Marks a dequeued entry as done so it can be queued again. */
+static void tokenizer_done(ItemCache * item_cache, const ItemCacheEntry * entry) {
+  int judyrc;
+
+  pthread_mutex_lock(&item_cache->tokenizer_mutex);
+  JSLD(judyrc, item_cache->tokenizer_pending, (uint8_t*) entry->full_id);
+  pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+}
+
+static void * tokenizer_thread_func(void *memo) {
+  ItemCache *item_cache = (ItemCache*) memo;
+  ItemCacheEntry *entry;
+
+  while (NULL != (entry = tokenizer_dequeue(item_cache))) {
+    if (CLASSIFIER_OK != tokenize_entry(item_cache, entry)) {
+      error("Could not tokenize entry %s", entry->full_id);
+    }
+
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    write_batch_end(item_cache);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    tokenizer_done(item_cache, entry);
+    free_entry(entry);
+  }
+
+  return NULL;
+}
+
+/* Queues entries that were stored without ever having their tokens saved.
+ *
+ * With a tokenizer pool an entry is written when it is added but its tokens
+ * are written later by a tokenizer thread, usually in a later write batch,
+ * so a crash in between leaves the entry without tokens. They are picked
+ * up again here when the pool starts.
+ */
+static int queue_untokenized_entries(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+  int i, num_entries = 0, capacity = 0;
+  ItemCacheEntry **entries = NULL;
+  sqlite3_stmt *stmt;
+
+  pthread_mutex_lock(&item_cache->db_access_mutex);
+
+  if (SQLITE_OK != sqlite3_prepare_v2(item_cache->db, FETCH_UNTOKENIZED_ENTRIES_SQL, -1, &stmt, NULL)) {
+    error("Unable to prepare %s: %s", FETCH_UNTOKENIZED_ENTRIES_SQL, item_cache_errmsg(item_cache));
     rc = CLASSIFIER_FAIL;
   } else {
-    FILE *schema_file;
-    char *schema;
-    char schema_file_name[512];
-    snprintf(schema_file_name, 512, "%s/%s/%s", DATADIR, PACKAGE,"initial_schema.sql");
+    sqlite3_bind_int(stmt, 1, item_cache->load_items_since);
 
-    if (NULL != (schema_file = fopen(schema_file_name, "r"))) {
-      fseek(schema_file, 0, SEEK_END);
-      int size = ftell(schema_file);
-      schema = malloc(size + 1);
-      fseek(schema_file, 0, SEEK_SET);
+    while (CLASSIFIER_OK == rc && SQLITE_ROW == sqlite3_step(stmt)) {
+      ItemCacheEntry *entry;
+      char *atom = decompress_atom(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
 
-      if (size != fread(schema, sizeof(char), size, schema_file)) {
-        rc = CLASSIFIER_FAIL;
-        snprintf(error, 512, "Error reading schema file %s: %s", schema_file_name, strerror(errno));
-      } else {
-        schema[size] = 0;
-        if (SQLITE_OK != sqlite3_exec(db, schema, NULL, NULL, NULL)) {
-          snprintf(error, 512, "Error loading schema into database file: %s", sqlite3_errmsg(db));
+      if (!atom) {
+        continue;
+      }
+
+      if (num_entries == capacity) {
+        ItemCacheEntry **new_entries;
+        capacity = capacity ? capacity * 2 : 64;
+        if (NULL == (new_entries = realloc(entries, capacity * sizeof(ItemCacheEntry*)))) {
+          fatal("Could not malloc untokenized entries");
+          free(atom);
           rc = CLASSIFIER_FAIL;
+          break;
         }
+        entries = new_entries;
       }
 
-      free(schema);
-      fclose(schema_file);
-    } else {
-      snprintf(error, 512, "Could not find the database schema file at %s. Perhaps it is missing from the install.", schema_file_name);
-      rc = CLASSIFIER_FAIL;
+      entry = create_item_cache_entry((const char*) sqlite3_column_text(stmt, 1), sqlite3_column_int64(stmt, 2),
+                                      sqlite3_column_int64(stmt, 3), atom);
+      free(atom);
+
+      if (entry) {
+        entry->id = sqlite3_column_int(stmt, 0);
+        entries[num_entries++] = entry;
+      }
     }
 
-    sqlite3_close(db);
+    sqlite3_finalize(stmt);
   }
 
+  pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+  if (num_entries > 0) {
+    info("Queueing %i entries that are missing their tokens", num_entries);
+  }
+
+  /* Queued without holding db_access_mutex since the tokenizers need it to empty the queue. */
+  for (i = 0; i < num_entries; i++) {
+    tokenizer_enqueue(item_cache, entries[i]);
+    free_entry(entries[i]);
+  }
+
+  free(entries);
   return rc;
 }
 
+/* Starts the tokenizer threads, if there are to be any. */
+static int start_tokenizers(ItemCache * item_cache) {
+  int i;
+
+  if (item_cache->tokenizer_threads <= 0) {
+    return CLASSIFIER_OK;
+  }
+
+  if (item_cache->tokenizer_queue_size <= 0) {
+    item_cache->tokenizer_queue_size = DEFAULT_TOKENIZER_QUEUE_SIZE;
+  }
+
+  item_cache->tokenizer_queue = calloc(item_cache->tokenizer_queue_size, sizeof(ItemCacheEntry*));
+  item_cache->tokenizers = calloc(item_cache->tokenizer_threads, sizeof(pthread_t));
+
+  if (!item_cache->tokenizer_queue || !item_cache->tokenizers) {
+    fatal("Could not malloc the tokenizer pool");
+    return CLASSIFIER_FAIL;
+  }
+
+  for (i = 0; i < item_cache->tokenizer_threads; i++) {
+    if (pthread_create(&item_cache->tokenizers[i], NULL, tokenizer_thread_func, item_cache)) {
+      fatal("Could not start tokenizer thread %i", i);
+      item_cache->tokenizer_threads = i;
+      return CLASSIFIER_FAIL;
+    }
+  }
+
+  info("Started %i tokenizer threads", item_cache->tokenizer_threads);
+  return queue_untokenized_entries(item_cache);
+}
+
+/* Stops the tokenizer threads once they have emptied the queue. */
+static void stop_tokenizers(ItemCache * item_cache) {
+  Word_t freed_bytes;
+  int i;
+
+  if (item_cache->tokenizers) {
+    info("Stopping tokenizer threads");
+    pthread_mutex_lock(&item_cache->tokenizer_mutex);
+    pthread_cond_broadcast(&item_cache->tokenizer_not_empty);
+    pthread_cond_broadcast(&item_cache->tokenizer_not_full);
+    pthread_mutex_unlock(&item_cache->tokenizer_mutex);
+
+    for (i = 0; i < item_cache->tokenizer_threads; i++) {
+      pthread_join(item_cache->tokenizers[i], NULL);
+    }
+
+    free(item_cache->tokenizers);
+    item_cache->tokenizers = NULL;
+  }
+
+  free(item_cache->tokenizer_queue);
+  item_cache->tokenizer_queue = NULL;
+  JSLFA(freed_bytes, item_cache->tokenizer_pending);
+}
+
 /** Create an SQLite ItemCache.
  *
  * @param item_cache A pointer to an pointer to an SQLiteItemSource. This
@@ -1088,9 +5819,24 @@ int item_cache_create(ItemCache **item_cache, const char * cache_directory, cons
   (*item_cache)->cache_update_wait_time = options->cache_update_wait_time;
   (*item_cache)->load_items_since = options->load_items_since;
   (*item_cache)->min_tokens = options->min_tokens;
+  (*item_cache)->load_threads = options->load_threads > 0 ? options->load_threads : 1;
+  (*item_cache)->snapshot_file = options->snapshot_file ? strdup(options->snapshot_file) : NULL;
+  (*item_cache)->write_batch_size = options->write_batch_size;
+  (*item_cache)->write_batch_wait = options->write_batch_wait > 0 ? options->write_batch_wait : 1000;
+  (*item_cache)->async_writes = options->async_writes;
+  (*item_cache)->touch_flush_interval = options->touch_flush_interval;
+  (*item_cache)->compress_atoms = options->compress_atoms;
+  (*item_cache)->tokenizer_threads = options->tokenizer_threads;
+  (*item_cache)->tokenizer_queue_size = options->tokenizer_queue_size;
+  (*item_cache)->gc_interval = options->gc_interval;
+  (*item_cache)->gc_expire_days = options->gc_expire_days;
+  (*item_cache)->prefetch = options->prefetch;
+  (*item_cache)->journal_mode = options->journal_mode ? strdup(options->journal_mode) : NULL;
+  (*item_cache)->synchronous = options->synchronous ? strdup(options->synchronous) : NULL;
+  (*item_cache)->cache_size = options->cache_size;
   (*item_cache)->version_mismatch = 0;
-  (*item_cache)->items_by_id = NULL;
-  (*item_cache)->items_in_order = NULL;
+  (*item_cache)->segments = NULL;
+  (*item_cache)->num_segments = 0;
   (*item_cache)->random_background = NULL;
   (*item_cache)->loaded = false;
   (*item_cache)->update_queue = new_queue();
@@ -1110,6 +5856,59 @@ int item_cache_create(ItemCache **item_cache, const char * cache_directory, cons
     *item_cache = NULL;
   }
 
+  if (*item_cache && pthread_rwlock_init(&(*item_cache)->atoms_lock, NULL)) {
+    fatal("pthread_rwlock_init error for atoms_lock");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache && (pthread_mutex_init(&(*item_cache)->touch_mutex, NULL) ||
+                      pthread_cond_init(&(*item_cache)->touch_cond, NULL))) {
+    fatal("pthread init error for deferred touches");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache && pthread_mutex_init(&(*item_cache)->write_batch_ids_mutex, NULL)) {
+    fatal("pthread_mutex_init error for write_batch_ids_mutex");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache && pthread_mutex_init(&(*item_cache)->retire_mutex, NULL)) {
+    fatal("pthread_mutex_init error for retire_mutex");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache && pthread_mutex_init(&(*item_cache)->read_pool_mutex, NULL)) {
+    fatal("pthread_mutex_init error for read_pool_mutex");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache && (pthread_cond_init(&(*item_cache)->write_batch_cond, NULL) ||
+                      pthread_cond_init(&(*item_cache)->write_committed_cond, NULL))) {
+    fatal("pthread_cond_init error for write batch conditions");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
+  if (*item_cache && (pthread_mutex_init(&(*item_cache)->tokenizer_mutex, NULL) ||
+                      pthread_cond_init(&(*item_cache)->tokenizer_not_empty, NULL) ||
+                      pthread_cond_init(&(*item_cache)->tokenizer_not_full, NULL))) {
+    fatal("pthread init error for the tokenizer pool");
+    rc = CLASSIFIER_FAIL;
+    free(*item_cache);
+    *item_cache = NULL;
+  }
+
   if (*item_cache == NULL) {
     fatal("Unable to allocate memory for Item Cache");
     rc = CLASSIFIER_FAIL;
@@ -1117,6 +5916,36 @@ int item_cache_create(ItemCache **item_cache, const char * cache_directory, cons
     rc = item_cache_open_database(*item_cache);
   }
 
+  if (CLASSIFIER_OK == rc && (*item_cache)->write_batch_size > 1) {
+    (*item_cache)->write_batch_thread = malloc(sizeof(pthread_t));
+    if (!(*item_cache)->write_batch_thread) {
+      fatal("Could not malloc write_batch_thread");
+      rc = CLASSIFIER_FAIL;
+    } else if (pthread_create((*item_cache)->write_batch_thread, NULL, write_batch_thread_func, *item_cache)) {
+      fatal("Could not start write batch thread");
+      free((*item_cache)->write_batch_thread);
+      (*item_cache)->write_batch_thread = NULL;
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  if (CLASSIFIER_OK == rc && (*item_cache)->touch_flush_interval > 0) {
+    (*item_cache)->touch_flush_thread = malloc(sizeof(pthread_t));
+    if (!(*item_cache)->touch_flush_thread) {
+      fatal("Could not malloc touch_flush_thread");
+      rc = CLASSIFIER_FAIL;
+    } else if (pthread_create((*item_cache)->touch_flush_thread, NULL, touch_flush_thread_func, *item_cache)) {
+      fatal("Could not start touch flush thread");
+      free((*item_cache)->touch_flush_thread);
+      (*item_cache)->touch_flush_thread = NULL;
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  if (CLASSIFIER_OK == rc) {
+    rc = start_tokenizers(*item_cache);
+  }
+
   return rc;
 }
 
@@ -1127,6 +5956,9 @@ void free_item_cache(ItemCache *item_cache) {
   if (item_cache) {
     item_cache->shutting_down = 1;
 
+    /* Stopped before the cache updater is cancelled since they enqueue update jobs. */
+    stop_tokenizers(item_cache);
+
     if (item_cache->cache_updating_thread) {
       info("Stopping cache updater");
       pthread_detach(*item_cache->cache_updating_thread);
@@ -1141,55 +5973,111 @@ void free_item_cache(ItemCache *item_cache) {
       free(item_cache->purge_thread);
     }
 
+    if (item_cache->token_migration_thread) {
+      info("Stopping token migration");
+      pthread_join(*item_cache->token_migration_thread, NULL);
+      free(item_cache->token_migration_thread);
+    }
+
+    if (item_cache->gc_thread) {
+      info("Stopping garbage collector");
+      pthread_join(*item_cache->gc_thread, NULL);
+      free(item_cache->gc_thread);
+    }
+
+    if (item_cache->touch_flush_thread) {
+      info("Stopping touch flush thread");
+      pthread_mutex_lock(&item_cache->touch_mutex);
+      pthread_cond_signal(&item_cache->touch_cond);
+      pthread_mutex_unlock(&item_cache->touch_mutex);
+      pthread_join(*item_cache->touch_flush_thread, NULL);
+      free(item_cache->touch_flush_thread);
+    }
+
+    if (item_cache->write_batch_thread) {
+      info("Stopping write batch thread");
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      pthread_cond_signal(&item_cache->write_batch_cond);
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+      pthread_join(*item_cache->write_batch_thread, NULL);
+      free(item_cache->write_batch_thread);
+    }
+
+    free_read_connections(item_cache);
+
     if (item_cache->db) {
+      flush_touches(item_cache);
+
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      token_dictionary_save(item_cache);
+      write_batch_commit(item_cache);
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+
       sqlite3_finalize(item_cache->fetch_item_stmt);
       sqlite3_finalize(item_cache->fetch_all_items_stmt);
       sqlite3_finalize(item_cache->random_background_stmt);
       sqlite3_finalize(item_cache->insert_entry_stmt);
       sqlite3_finalize(item_cache->update_entry_stmt);
+      sqlite3_finalize(item_cache->fetch_entry_state_stmt);
       sqlite3_finalize(item_cache->delete_entry_stmt);
-      sqlite3_finalize(item_cache->find_token_stmt);
-      sqlite3_finalize(item_cache->find_atom_stmt);
       sqlite3_finalize(item_cache->insert_atom_stmt);
+      sqlite3_finalize(item_cache->find_atom_stmt);
       sqlite3_finalize(item_cache->insert_atom_xml_stmt);
       sqlite3_finalize(item_cache->delete_atom_xml_stmt);
+      sqlite3_finalize(item_cache->fetch_atom_xml_stmt);
       sqlite3_finalize(item_cache->delete_tokens_stmt);
       sqlite3_finalize(item_cache->insert_tokens_stmt);
       sqlite3_finalize(item_cache->touch_item_stmt);
+      sqlite3_finalize(item_cache->update_token_count_stmt);
       sqlite3_finalize(item_cache->fetch_tokens_stmt);
       sqlite3_close(item_cache->db);
     }
 
-    if (item_cache->items_in_order) {
-      int freed_bytes;
-      uint8_t index[256];
-      index[0] = '\0';
-      PWord_t item_pointer;
+    int i;
+    for (i = 0; i < item_cache->num_retired; i++) {
+      item_cache->retired[i].free_object(item_cache->retired[i].object);
+    }
+    free(item_cache->retired);
+    free(item_cache->view);
 
-      JSLF(item_pointer, item_cache->items_by_id, index);
-      while (NULL != item_pointer) {
-        free_item((Item*) (*item_pointer));
-        JSLN(item_pointer, item_cache->items_by_id, index);
-      }
-      JSLFA(freed_bytes, item_cache->items_by_id);
+    Word_t freed_bytes;
+    JLFA(freed_bytes, item_cache->gc_used_atoms);
+    JLFA(freed_bytes, item_cache->gc_deleted_atoms);
 
-      OrderedItemList *current = item_cache->items_in_order;
-      while (current) {
-        OrderedItemList *to_free = current;
-        current = current->next;
-        free(to_free);
-      }
+    for (i = 0; i < item_cache->num_segments; i++) {
+      free_item_segment(item_cache->segments[i]);
+    }
+    free(item_cache->segments);
+    JLFA(freed_bytes, item_cache->items_by_key);
+    free(item_cache->keys_by_id.slots);
+    free_presence_filter(item_cache->presence);
 
-      if (item_cache->random_background) {
-        free_pool(item_cache->random_background);
-      }
+    if (item_cache->random_background) {
+      free_pool(item_cache->random_background);
     }
 
+    free_token_dictionary(item_cache);
+    free(item_cache->write_batch_items);
+
     pthread_mutex_destroy(&item_cache->db_access_mutex);
     pthread_rwlock_destroy(&item_cache->cache_lock);
+    pthread_rwlock_destroy(&item_cache->atoms_lock);
+    pthread_mutex_destroy(&item_cache->read_pool_mutex);
+    pthread_mutex_destroy(&item_cache->touch_mutex);
+    pthread_mutex_destroy(&item_cache->write_batch_ids_mutex);
+    pthread_mutex_destroy(&item_cache->retire_mutex);
+    pthread_cond_destroy(&item_cache->touch_cond);
+    pthread_cond_destroy(&item_cache->write_batch_cond);
+    pthread_cond_destroy(&item_cache->write_committed_cond);
+    pthread_mutex_destroy(&item_cache->tokenizer_mutex);
+    pthread_cond_destroy(&item_cache->tokenizer_not_empty);
+    pthread_cond_destroy(&item_cache->tokenizer_not_full);
     free_queue(item_cache->update_queue);
 
     free(item_cache->cache_directory);
+    free(item_cache->snapshot_file);
+    free(item_cache->journal_mode);
+    free(item_cache->synchronous);
     memset(item_cache, 0, sizeof(struct ITEM_CACHE));
     free(item_cache);
   }
@@ -1227,14 +6115,37 @@ int item_cache_load(ItemCache *item_cache) {
 
   info("item_cache_load from %i days ago", item_cache->load_items_since);
   time_t start_time = time(NULL);
+  Snapshot snapshot;
+  int rc, snapshot_items = 0, snapshot_is_current = false;
+
+  if (item_cache->prefetch) {
+    prefetch_database_file(item_cache, "catalog.db");
+    prefetch_database_file(item_cache, "tokens.db");
+  }
 
   pthread_rwlock_wrlock(&item_cache->cache_lock);
   pthread_mutex_lock(&item_cache->db_access_mutex);
 
-  int rc = load_all_items(item_cache);
+  if (item_cache->snapshot_file && CLASSIFIER_OK == load_snapshot(item_cache, &snapshot)) {
+    snapshot_items = snapshot.arena->num_items;
+    /* This must be done before the snapshot's arena is merged into the cache since that can free it. */
+    snapshot_is_current = CLASSIFIER_OK == load_random_background_from_snapshot(item_cache, &snapshot);
+    rc = load_all_items(item_cache, snapshot.arena);
 
-  if (CLASSIFIER_OK == rc) {
-    rc = load_random_background(item_cache);
+    if (CLASSIFIER_OK == rc && !snapshot_is_current) {
+      rc = load_random_background(item_cache);
+    }
+  } else {
+    rc = load_all_items(item_cache, NULL);
+
+    if (CLASSIFIER_OK == rc) {
+      rc = load_random_background(item_cache);
+    }
+  }
+
+  /* Without the presence filter every lookup just goes to the catalog */
+  if (CLASSIFIER_OK == rc && !item_cache->presence && CLASSIFIER_OK != load_presence_filter(item_cache)) {
+    error("Could not load the presence filter, lookups of uncached items will query the catalog");
   }
 
   item_cache->loaded = true;
@@ -1243,6 +6154,90 @@ int item_cache_load(ItemCache *item_cache) {
   time_t end_time = time(NULL);
 
   info("loaded %i items in %i seconds", item_cache_cached_size(item_cache), end_time - start_time);
+
+  if (CLASSIFIER_OK == rc && item_cache->snapshot_file &&
+      (!snapshot_is_current || item_cache_cached_size(item_cache) != snapshot_items)) {
+    item_cache_save_snapshot(item_cache);
+  }
+
+  return rc;
+}
+
+/** Saves a snapshot of the in-memory cache to the snapshot file.
+ *
+ *  The next time the item cache is loaded it will load the items in the
+ *  snapshot from the file and only load entries added, tokenized or updated
+ *  since the snapshot from the database. Snapshot items whose entries have
+ *  been removed from the database are dropped when it is loaded.
+ *
+ *  The snapshot is written to a temporary file and renamed over the
+ *  old snapshot, so a running cache that has mapped the old snapshot
+ *  is unaffected.
+ *
+ *  This does nothing if the item cache was created without a snapshot
+ *  file or hasn't been loaded.
+ */
+int item_cache_save_snapshot(ItemCache *item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache && item_cache->snapshot_file && item_cache->loaded) {
+    char path[MAXPATHLEN];
+    int64_t background_entries, background_max_entry;
+    SnapshotHeader header;
+    SnapshotWriter writer;
+    ItemView *view;
+    long epoch;
+    time_t start_time = time(NULL);
+
+    if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s.tmp", item_cache->snapshot_file)) {
+      error("Path to snapshot too long: %s", item_cache->snapshot_file);
+      return CLASSIFIER_FAIL;
+    }
+
+    memset(&writer, 0, sizeof(writer));
+    writer.checksum = 0xcbf29ce484222325ULL;
+
+    if (NULL == (writer.file = fopen(path, "wb"))) {
+      error("Could not open %s to write the item cache snapshot: %s", path, strerror(errno));
+      return CLASSIFIER_FAIL;
+    }
+
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    get_background_signature(item_cache, &background_entries, &background_max_entry);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+    /* Write from a view so adding and purging items isn't blocked on the file write. */
+    epoch = epoch_enter(item_cache);
+    view = acquire_item_view(item_cache);
+    rc = view ? write_snapshot(item_cache, view, &writer, &header, background_entries, background_max_entry) : CLASSIFIER_FAIL;
+    epoch_exit(item_cache, epoch);
+    reclaim_retired(item_cache);
+
+    if (CLASSIFIER_OK == rc &&
+        (0 != fseek(writer.file, 0, SEEK_SET) ||
+         1 != fwrite(&header, sizeof(header), 1, writer.file) ||
+         0 != fflush(writer.file) ||
+         0 != fsync(fileno(writer.file)))) {
+      rc = CLASSIFIER_FAIL;
+    }
+
+    if (0 != fclose(writer.file)) {
+      rc = CLASSIFIER_FAIL;
+    }
+
+    if (CLASSIFIER_OK == rc && 0 != rename(path, item_cache->snapshot_file)) {
+      rc = CLASSIFIER_FAIL;
+    }
+
+    if (CLASSIFIER_OK == rc) {
+      info("Saved %lli items to item cache snapshot %s in %i seconds", (long long) header.num_items,
+           item_cache->snapshot_file, time(NULL) - start_time);
+    } else {
+      error("Error writing item cache snapshot %s: %s", item_cache->snapshot_file, strerror(errno));
+      unlink(path);
+    }
+  }
+
   return rc;
 }
 
@@ -1263,13 +6258,28 @@ int item_cache_loaded(const ItemCache *item_cache) {
   return item_cache->loaded;
 }
 
+/* Records that the item was used.
+ *
+ * If touches are deferred this just notes the time, otherwise last_used_at
+ * is updated straight away.
+ */
 void touch_item(ItemCache *item_cache, const unsigned char * id) {
 	if (item_cache && id) {
-		pthread_mutex_lock(&item_cache->db_access_mutex);
-		sqlite3_bind_text(item_cache->touch_item_stmt, 1, id, -1, NULL);
-		sqlite3_step(item_cache->touch_item_stmt);
-		sqlite3_reset(item_cache->touch_item_stmt);
-		pthread_mutex_unlock(&item_cache->db_access_mutex);
+		if (item_cache->touch_flush_thread && strlen((const char*) id) < MAX_TOUCH_ID_LENGTH) {
+			PWord_t touched_at;
+			pthread_mutex_lock(&item_cache->touch_mutex);
+			JSLI(touched_at, item_cache->pending_touches, id);
+			if (touched_at == PJERR) {
+				fatal("Could not insert %s into pending touches", id);
+			} else {
+				*touched_at = time(NULL);
+			}
+			pthread_mutex_unlock(&item_cache->touch_mutex);
+		} else {
+			pthread_mutex_lock(&item_cache->db_access_mutex);
+			touch_item_at(item_cache, id, time(NULL));
+			pthread_mutex_unlock(&item_cache->db_access_mutex);
+		}
 	}
 }
 
@@ -1292,21 +6302,50 @@ Item * item_cache_fetch_item(ItemCache *item_cache, const unsigned char * id, in
   }
 
   pthread_rwlock_rdlock(&item_cache->cache_lock);
-  item = items_by_id_get(item_cache, id);
+  item = item_index_get(item_cache, id);
   pthread_rwlock_unlock(&item_cache->cache_lock);
 
+  if (NULL == item && !presence_filter_might_contain(item_cache, id)) {
+    /* Definitely not in the catalog, there is nothing to fetch or touch */
+    return NULL;
+  }
+
   if (NULL == item) {
+    ReadConnection *connection = NULL;
+    PWord_t in_batch;
     *free_when_done = true;
-    pthread_mutex_lock(&item_cache->db_access_mutex);
-    item = fetch_item_from_catalog(item_cache, (char *) id);
 
-    if (item && fetch_tokens_for(item_cache, item) <= 0) {
-      // TODO No tokens for the item, should probably add it to the tokenizer queue
-    	free_item(item);
-    	item = NULL;
+    /* Its tokens might only be in the open write batch, which read connections can't see.
+     * This is checked first since the batch could commit, and forget the id, while a read
+     * connection is looking for it.
+     */
+    pthread_mutex_lock(&item_cache->write_batch_ids_mutex);
+    JSLG(in_batch, item_cache->write_batch_ids, id);
+    pthread_mutex_unlock(&item_cache->write_batch_ids_mutex);
+
+    if (!in_batch && (connection = acquire_read_connection(item_cache))) {
+      item = fetch_item_from_catalog(connection->fetch_item_stmt, (char *) id);
+
+      if (item && fetch_tokens_with(connection->fetch_tokens_stmt, item) <= 0) {
+        free_item(item);
+        item = NULL;
+      }
+
+      release_read_connection(item_cache, connection);
     }
 
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
+    if (NULL == item && !connection) {
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      item = fetch_item_from_catalog(item_cache->fetch_item_stmt, (char *) id);
+
+      if (item && fetch_tokens_for(item_cache, item) <= 0) {
+        // TODO No tokens for the item, should probably add it to the tokenizer queue
+        free_item(item);
+        item = NULL;
+      }
+
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+    }
   }
 
   touch_item(item_cache, id);
@@ -1316,21 +6355,63 @@ Item * item_cache_fetch_item(ItemCache *item_cache, const unsigned char * id, in
 
 /** Iterates over each item.
  *
+ *  Items are visited in descending order of time.  The iteration is over a
+ *  snapshot of the cache taken when it starts so items can be added to, or
+ *  purged from, the cache while it runs.
  */
 int item_cache_each_item(ItemCache *item_cache, ItemIterator iterator, void *memo) {
   if (item_cache->loaded) {
-    pthread_rwlock_rdlock(&item_cache->cache_lock);
-    OrderedItemList *current = item_cache->items_in_order;
+    long epoch = epoch_enter(item_cache);
+    ItemView *view = acquire_item_view(item_cache);
+    int i;
 
-    while (current) {
-      Item *item = current->item;
-      if (CLASSIFIER_OK != iterator(item, memo)) {
+    for (i = 0; view && i < view->num_items; i++) {
+      if (CLASSIFIER_OK != iterator(view->items[i], memo)) {
         break;
       }
-      current = current->next;
     }
 
-    pthread_rwlock_unlock(&item_cache->cache_lock);
+    epoch_exit(item_cache, epoch);
+    reclaim_retired(item_cache);
+  }
+  return 0;
+}
+
+/** Iterates over each item with a time on or after since.
+ *
+ *  Items are visited in descending order of time, the same as item_cache_each_item,
+ *  but the end of the range is found by binary search so no items older than
+ *  since are touched.
+ *
+ * @param item_cache The item cache to iterate over.
+ * @param since Only items with a time on or after this are passed to the iterator.
+ * @param iterator The function to call for each item, iteration stops if it doesn't return CLASSIFIER_OK.
+ * @param memo Passed to the iterator.
+ */
+int item_cache_each_item_since(ItemCache *item_cache, time_t since, ItemIterator iterator, void *memo) {
+  if (item_cache->loaded) {
+    long epoch = epoch_enter(item_cache);
+    ItemView *view = acquire_item_view(item_cache);
+    int i, low = 0, high = view ? view->num_items : 0;
+
+    /* First item older than since */
+    while (low < high) {
+      int mid = low + (high - low) / 2;
+      if (view->items[mid]->time < since) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
+    }
+
+    for (i = 0; i < low; i++) {
+      if (CLASSIFIER_OK != iterator(view->items[i], memo)) {
+        break;
+      }
+    }
+
+    epoch_exit(item_cache, epoch);
+    reclaim_retired(item_cache);
   }
   return 0;
 }
@@ -1359,18 +6440,19 @@ const Pool * item_cache_random_background(ItemCache * item_cache)  {
   return random_background;
 }
 
-#include <sys/time.h>
-#include <time.h>
-
-static float tdiff(struct timeval from, struct timeval to) {
-  double from_d = from.tv_sec + (from.tv_usec / 1000000.0);
-  double to_d = to.tv_sec + (to.tv_usec / 1000000.0);
-  return to_d - from_d;
-}
-
 /** Adds an entry to the item cache.
  *
- * This immediately stores the item in the database.
+ * This immediately stores the entry in the database. The writes join the
+ * current write batch, unless the cache was created with async_writes this
+ * waits for the batch to be committed before returning.
+ *
+ * If the cache has tokenizer threads the entry is queued for them to tokenize
+ * and this returns once the entry itself is stored, otherwise it is tokenized
+ * first and its tokens are saved in the same write batch as the entry. Entries
+ * whose tokens were lost to a crash are queued again when the threads start.
+ *
+ * An entry that is already stored with the same atom and its tokens is left
+ * alone, nothing is written and this returns CLASSIFIER_OK straight away.
  *
  * TODO Add SQLITE_BUSY handling for add_entry
  */
@@ -1380,77 +6462,126 @@ int item_cache_add_entry(ItemCache *item_cache, ItemCacheEntry *entry) {
   struct timeval start;
   gettimeofday(&start, NULL);
   if (item_cache && entry) {
+	Presence presence = item_cache_presence(item_cache, (unsigned char*) entry->full_id);
+	Item *item = NULL;
+
 	pthread_mutex_lock(&item_cache->db_access_mutex);
-	int is_new_entry = _is_new_entry(item_cache, entry);
 
-	if (is_new_entry) {
-	  insert_entry(item_cache, entry);
-	} else {
-	  update_entry(item_cache, entry);
+	/* Another request could have added it since we looked */
+	if (PRESENCE_ABSENT == presence && presence_filter_contains(item_cache->presence, (unsigned char*) entry->full_id)) {
+	  presence = PRESENCE_UNKNOWN;
+	}
+
+	int unchanged = false;
+	int is_new_entry = PRESENCE_ABSENT == presence || _is_new_entry(item_cache, entry, &unchanged);
+
+	if (unchanged) {
+	  /* Crawlers post the same entries over and over, there is nothing to write or tokenize */
+	  pthread_mutex_unlock(&item_cache->db_access_mutex);
+	  debug("entry %s is unchanged", entry->full_id);
+	  return CLASSIFIER_OK;
+	}
+
+	// We don't want to extract features for items we already have.
+	// TODO Handle updates to features for items somehow?
+	int needs_tokens = is_new_entry || (PRESENCE_PRESENT != presence && !entry_has_tokens(item_cache, entry));
+
+	if (needs_tokens && !item_cache->tokenizers) {
+	  /* Tokenize before writing anything so the entry and its tokens go in the same write batch,
+	   * without keeping a transaction open while the lock is released.
+	   */
+	  pthread_mutex_unlock(&item_cache->db_access_mutex);
+	  item = tokenize_entry_item(item_cache, entry);
+	  pthread_mutex_lock(&item_cache->db_access_mutex);
 	}
 
-	if (save_entry_xml(item_cache, entry)) {
+	if (write_batch_begin(item_cache)) {
 	  rc = CLASSIFIER_FAIL;
+	} else {
+	  if (!is_new_entry) {
+	    update_entry(item_cache, entry);
+	  } else if (CLASSIFIER_OK == insert_entry(item_cache, entry)) {
+	    if (item_cache->presence) {
+	      presence_filter_add(item_cache->presence, (unsigned char*) entry->full_id);
+	      presence_filter_rebuild_if_full(item_cache);
+	    }
+	  } else if (!_is_new_entry(item_cache, entry, &unchanged)) {
+	    /* Something other than this request added it to the catalog */
+	    is_new_entry = false;
+	    update_entry(item_cache, entry);
+	    needs_tokens = !entry_has_tokens(item_cache, entry);
+	  }
+
+	  if (save_entry_xml(item_cache, entry)) {
+	    rc = CLASSIFIER_FAIL;
+	  }
+
+	  if (item && CLASSIFIER_OK == rc && needs_tokens) {
+	    item->key = entry->id;
+	    rc = save_tokenized_item(item_cache, item);
+	    item = NULL;
+	  }
 	}
 
+	free_item(item);
 	pthread_mutex_unlock(&item_cache->db_access_mutex);
 
 	struct timeval inserted;
 	gettimeofday(&inserted, NULL);
 	debug("insertion: %.7fs", tdiff(start, inserted));
 
-	// We don't want to extract features for items we already have.
-	// TODO Handle updates to features for items somehow?
+	if (rc == CLASSIFIER_OK && needs_tokens && item_cache->tokenizers) {
+	  if (tokenizer_enqueue(item_cache, entry)) {
+	    error("Could not queue entry %s for tokenizing", entry->full_id);
+	  }
+	}
 
-	if (rc == CLASSIFIER_OK && (is_new_entry || !entry_has_tokens(item_cache, entry))) {
-		debug("tokenizing entry %s", entry->full_id);
-		if (entry->atom) {
-			Pvoid_t features = atom_tokenize(entry->atom);
-			if (features) {
-				Item *item = create_item(entry->full_id, entry->id, entry->updated);
-				item->tokens = NULL;
-
-				struct timeval tokenized;
-				gettimeofday(&tokenized, NULL);
-				debug("tokenized %.7fs", tdiff(inserted, tokenized));
-
-				PWord_t PValue;
-				uint8_t token[512];
-				token[0] = '\0';
-
-				JSLF(PValue, features, token);
-				while (PValue != NULL) {
-					int atomizedId = item_cache_atomize(item_cache, token);
-					item_add_token(item, atomizedId, *PValue);
-					JSLN(PValue, features, token);
-				}
+	pthread_mutex_lock(&item_cache->db_access_mutex);
+	long batch = write_batch_end(item_cache);
+	if (!item_cache->async_writes && CLASSIFIER_OK != write_batch_wait(item_cache, batch)) {
+	  rc = CLASSIFIER_FAIL;
+	}
+	pthread_mutex_unlock(&item_cache->db_access_mutex);
+  }
 
-				struct timeval atomized;
-				gettimeofday(&atomized, NULL);
-				debug("atomized %.7fs", tdiff(tokenized, atomized));
-				     
-				Word_t rc;
-				JSLFA(rc, features);
-
-				if (CLASSIFIER_OK == item_cache_save_item(item_cache, item)) {
-					UpdateJob *job = create_add_job(item);
-					q_enqueue(item_cache->update_queue, job);
-					debug("Added to update queue");
-				}
+  return rc;
+}
 
-				struct timeval complete;
-				gettimeofday(&complete, NULL);
-				debug("complete %.7fs", tdiff(atomized, complete));
-			}
-		}
-	}
+/** Fetches the atom XML stored for an entry, decompressing it if it was compressed.
+ *
+ *  @returns a NUL terminated copy of the XML which the caller must free,
+ *           or NULL if there is no XML for the entry.
+ */
+char * item_cache_fetch_entry_atom(ItemCache * item_cache, int entry_id) {
+  char *xml = NULL;
+
+  if (item_cache) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
 
+    if (SQLITE_OK != sqlite3_bind_int(item_cache->fetch_atom_xml_stmt, 1, entry_id)) {
+      error("Could not bind entry id to %s: %s", FETCH_ATOM_XML_SQL, item_cache_errmsg(item_cache));
+    } else if (SQLITE_ROW == sqlite3_step(item_cache->fetch_atom_xml_stmt)) {
+      const char *data = sqlite3_column_blob(item_cache->fetch_atom_xml_stmt, 0);
+      int size = sqlite3_column_bytes(item_cache->fetch_atom_xml_stmt, 0);
+
+      if (data && NULL == (xml = decompress_atom(data, size))) {
+        error("Could not read atom for entry %i", entry_id);
+      }
+    }
+
+    sqlite3_clear_bindings(item_cache->fetch_atom_xml_stmt);
+    sqlite3_reset(item_cache->fetch_atom_xml_stmt);
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
   }
 
-  return rc;
+  return xml;
 }
 
 /** Removes an entry from the item cache.
+ *
+ * The delete isn't batched, removing an entry in the random background
+ * causes the trigger to roll back the whole transaction, so any open write
+ * batch is committed first.
  *
  * TODO Add SQLITE_BUSY handling to remove_entry.
  * TODO Queue up job to remove entry from in-memory queues.
@@ -1460,6 +6591,8 @@ int item_cache_remove_entry(ItemCache *item_cache, int entry_id) {
 
   if (item_cache) {
     pthread_mutex_lock(&item_cache->db_access_mutex);
+    write_batch_commit(item_cache);
+
     int sqlite3_rc;
     sqlite3_bind_int(item_cache->delete_entry_stmt, 1, entry_id);
     sqlite3_rc = sqlite3_step(item_cache->delete_entry_stmt);
@@ -1506,10 +6639,13 @@ int item_cache_add_item(ItemCache *item_cache, Item *item) {
     } else {
       pthread_rwlock_wrlock(&item_cache->cache_lock);
 
-      if (CLASSIFIER_OK == items_by_id_insert(item_cache, item)) {
-        item_cache->items_in_order = ordered_item_list_insert_in_order(item_cache->items_in_order, item);
-      } else {
-        fatal("Malloc error inserting into items_by_id");
+      /* Items that aren't from the database still need a key of their own in the index */
+      if (item->key <= 0) {
+        item->key = --item_cache->next_local_key;
+      }
+
+      if (CLASSIFIER_OK != item_segments_insert(item_cache, item)) {
+        fatal("Malloc error inserting item into the cache");
         rc = CLASSIFIER_FAIL;
       }
 
@@ -1532,18 +6668,15 @@ int item_cache_save_item(ItemCache * item_cache, Item *item) {
   int rc = CLASSIFIER_OK;
 
   if (item_cache && item) {
-    debug("Saving item %s", item->id);
     pthread_mutex_lock(&item_cache->db_access_mutex);
-    int entry_key = get_entry_key(item_cache, (char*) item->id);
 
-    if (entry_key <= 0) {
+    if (write_batch_begin(item_cache)) {
       rc = CLASSIFIER_FAIL;
     } else {
-      int size;
-      char *token_data;
-      if (CLASSIFIER_OK == (rc = serialize_tokens(item, &size, &token_data))) {
-        rc = save_tokens(item_cache, entry_key, token_data, size);
-        free(token_data);
+      rc = save_item(item_cache, item);
+      long batch = write_batch_end(item_cache);
+      if (!item_cache->async_writes && CLASSIFIER_OK != write_batch_wait(item_cache, batch)) {
+        rc = CLASSIFIER_FAIL;
       }
     }
 
@@ -1553,30 +6686,44 @@ int item_cache_save_item(ItemCache * item_cache, Item *item) {
   return rc;
 }
 
+/** Removes items older than load_items_since days from the in-memory cache.
+ *
+ *  The expired segments are unlinked from the cache while holding the cache
+ *  lock.  That takes time in proportion to the number of segments, plus the
+ *  items of the one segment that spans the purge time, which are moved out of
+ *  it one at a time.  The expired items are then removed from the index a
+ *  batch at a time, each batch taking the lock again, and are freed once no
+ *  iteration can be using them.
+ */
 int item_cache_purge_old_items(ItemCache *item_cache) {
   info("Starting purge_old_items");
   int rc = CLASSIFIER_OK;
 
   if (item_cache) {
-    int number_purged = 0;
-    pthread_rwlock_wrlock(&item_cache->cache_lock);
+    int i, number_purged = 0, num_expired = 0;
+    ItemSegment **expired;
 
-    OrderedItemList *purge_list = ordered_item_list_split(item_cache->items_in_order, get_purge_time(item_cache->load_items_since));
+    pthread_rwlock_wrlock(&item_cache->cache_lock);
 
-    if (purge_list == item_cache->items_in_order) {
-      item_cache->items_in_order = NULL;
+    if (NULL == (expired = malloc((item_cache->num_segments + 1) * sizeof(ItemSegment*)))) {
+      fatal("Could not malloc expired segments");
+      rc = CLASSIFIER_FAIL;
+    } else {
+      num_expired = item_segments_expire(item_cache, get_purge_time(item_cache->load_items_since), expired);
     }
 
-    while (purge_list) {
-      OrderedItemList *next = purge_list->next;
-      items_by_id_remove(item_cache, purge_list->item);
-      free_item(purge_list->item);
-      free(purge_list);
-      purge_list = next;
-      number_purged++;
+    pthread_rwlock_unlock(&item_cache->cache_lock);
+
+    item_segments_unindex(item_cache, expired, num_expired);
+
+    /* Iterations that started before the purge can still be using the expired items */
+    for (i = 0; i < num_expired; i++) {
+      number_purged += expired[i]->timeline->num_items;
+      retire(item_cache, expired[i], free_retired_segment);
     }
 
-    pthread_rwlock_unlock(&item_cache->cache_lock);
+    free(expired);
+    reclaim_retired(item_cache);
     info("Purged %i items", number_purged);
   }
 
@@ -1603,6 +6750,223 @@ int item_cache_start_purger(ItemCache * item_cache, int purge_interval) {
   return rc;
 }
 
+/** Runs a garbage collection pass over the item cache database.
+ *
+ *  This deletes entries, with their atom and tokens, that haven't been
+ *  updated or used for gc_expire_days days, if it is set, and then the rows
+ *  of the tokens table that aren't used by any entry.  Entries in the random
+ *  background and entries within load_items_since days are never deleted.
+ *
+ *  The database is only locked for a batch of rows at a time so this can run
+ *  alongside normal operation, it stops early if the item cache is shutting down.
+ *
+ *  @returns the number of entries and tokens deleted or -1 on error.
+ */
+int item_cache_collect_garbage(ItemCache * item_cache) {
+  int expired = 0, collected = 0;
+
+  if (item_cache) {
+    info("Collecting garbage in the item cache");
+
+    if (item_cache->gc_expire_days > 0) {
+      expired = gc_expire_entries(item_cache);
+    }
+
+    if (expired >= 0) {
+      collected = gc_collect_tokens(item_cache);
+    }
+
+    if (expired < 0 || collected < 0) {
+      error("Garbage collection failed");
+      return -1;
+    }
+
+    info("Garbage collection deleted %i expired entries and %i unused tokens", expired, collected);
+  }
+
+  return expired + collected;
+}
+
+/** Starts a thread that runs item_cache_collect_garbage every gc_interval seconds.
+ *
+ *  Does nothing if gc_interval isn't set.
+ */
+int item_cache_start_garbage_collector(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache && item_cache->gc_interval > 0 && !item_cache->gc_thread) {
+    item_cache->gc_thread = malloc(sizeof(pthread_t));
+    if (item_cache->gc_thread == NULL) {
+      fatal("Could not malloc gc_thread");
+      rc = CLASSIFIER_FAIL;
+    } else if (pthread_create(item_cache->gc_thread, NULL, gc_thread_func, item_cache)) {
+      fatal("Could not start garbage collection thread");
+      free(item_cache->gc_thread);
+      item_cache->gc_thread = NULL;
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  return rc;
+}
+
+/** Rewrites any token blobs still in the original fixed format in the compact format.
+ *
+ *  This works through token.entry_tokens in batches, releasing the database
+ *  between each batch so it can run alongside normal operation, and stops
+ *  early if the item cache is shutting down.  Blobs in either format can be
+ *  read so it is safe to interrupt.
+ *
+ *  @returns the number of blobs migrated or -1 on error.
+ */
+int item_cache_migrate_tokens(ItemCache * item_cache) {
+  int migrated = 0;
+
+  if (item_cache) {
+    info("Migrating token blobs to the compact format");
+    migrated = rewrite_blobs(item_cache, SELECT_TOKENS_TO_MIGRATE, UPDATE_ENTRY_TOKENS, migrate_token_blob);
+    info("Migrated %i token blobs to the compact format", migrated);
+  }
+
+  return migrated;
+}
+
+/** Records the number of tokens of every entry that doesn't have one yet.
+ *
+ *  Entries saved before entries.num_tokens was added have a null count and
+ *  are always read when loading. This fills in their counts from their token
+ *  blobs in batches like item_cache_migrate_tokens, so later loads can skip
+ *  the entries with fewer than min_tokens tokens without reading their blobs.
+ *
+ *  @returns the number of entries counted or -1 on error.
+ */
+int item_cache_count_tokens(ItemCache * item_cache) {
+  sqlite3_int64 last_id = 0;
+  int counted = 0;
+  int rows = 1;
+
+  if (item_cache) {
+    info("Counting the tokens of entries without a token count");
+
+    while (rows > 0 && !item_cache->shutting_down) {
+      pthread_mutex_lock(&item_cache->db_access_mutex);
+      rows = count_token_batch(item_cache, &last_id, &counted);
+      pthread_mutex_unlock(&item_cache->db_access_mutex);
+
+      if (rows > 0) {
+        /* Give other writers a chance at the database */
+        usleep(10000);
+      }
+    }
+
+    info("Counted the tokens of %i entries", counted);
+  }
+
+  return rows < 0 ? -1 : counted;
+}
+
+/** Compresses any atom XML in atom.entry_atom that isn't already compressed.
+ *
+ *  This works through atom.entry_atom in batches like item_cache_migrate_tokens.
+ *  The space freed in atom.db isn't returned to the file system until it is vacuumed.
+ *
+ *  @returns the number of atoms compressed or -1 on error.
+ */
+int item_cache_recompress_atoms(ItemCache * item_cache) {
+  int compressed = 0;
+
+  if (item_cache) {
+    info("Compressing atom XML");
+    compressed = rewrite_blobs(item_cache, SELECT_ATOMS_TO_COMPRESS, UPDATE_ATOM_XML_SQL, compress_atom_blob);
+    info("Compressed %i atoms", compressed);
+  }
+
+  return compressed;
+}
+
+/* Vacuums one of the item cache's database files through a connection of its own.
+ *
+ * Vacuuming an attached database by name needs SQLite 3.15, a plain vacuum
+ * on a connection to the file works with every version we build against.
+ */
+static int vacuum_database_file(ItemCache * item_cache, const char * name) {
+  int rc = CLASSIFIER_OK;
+  char path[MAXPATHLEN];
+  sqlite3 *db = NULL;
+
+  if (MAXPATHLEN <= snprintf(path, MAXPATHLEN, "%s/%s", item_cache->cache_directory, name)) {
+    error("Path to %s too long: %s", name, item_cache->cache_directory);
+    return CLASSIFIER_FAIL;
+  }
+
+  if (SQLITE_OK != sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL)) {
+    error("Could not open %s to vacuum it: %s", path, sqlite3_errmsg(db));
+    rc = CLASSIFIER_FAIL;
+  } else {
+    sqlite3_busy_timeout(db, 1000);
+
+    if (SQLITE_OK != sqlite3_exec(db, "vacuum", NULL, NULL, NULL)) {
+      error("Error vacuuming %s: %s", path, sqlite3_errmsg(db));
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  sqlite3_close(db);
+  return rc;
+}
+
+/** Rewrites the catalog and token databases with their rows stored in key order.
+ *
+ *  The loader reads entries and their token blobs in key order. Rows are
+ *  added in that order but deleting, migrating and garbage collecting rows
+ *  leaves them scattered through the files, so over time a cold start reads
+ *  pages from all over both files. Vacuuming copies each table in rowid order
+ *  into a new file, after which loading reads them from start to end.
+ *
+ *  This locks the database for as long as it takes, which can be minutes for
+ *  a large item cache, so it should only be run while the classifier is stopped.
+ */
+int item_cache_cluster_tokens(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    pthread_mutex_lock(&item_cache->db_access_mutex);
+    /* Vacuum can't run inside a transaction */
+    write_batch_commit(item_cache);
+
+    info("Clustering the catalog and token databases");
+    if (CLASSIFIER_OK != vacuum_database_file(item_cache, "catalog.db") ||
+        CLASSIFIER_OK != vacuum_database_file(item_cache, "tokens.db")) {
+      error("Error clustering the item cache");
+      rc = CLASSIFIER_FAIL;
+    }
+
+    pthread_mutex_unlock(&item_cache->db_access_mutex);
+  }
+
+  return rc;
+}
+
+/** Starts a thread that runs item_cache_migrate_tokens and then item_cache_count_tokens in the background. */
+int item_cache_start_token_migration(ItemCache * item_cache) {
+  int rc = CLASSIFIER_OK;
+
+  if (item_cache) {
+    item_cache->token_migration_thread = malloc(sizeof(pthread_t));
+    if (item_cache->token_migration_thread == NULL) {
+      fatal("Could not malloc token_migration_thread");
+      rc = CLASSIFIER_FAIL;
+    } else if (pthread_create(item_cache->token_migration_thread, NULL, token_migration_thread_func, item_cache)) {
+      fatal("Could not start token migration thread");
+      free(item_cache->token_migration_thread);
+      item_cache->token_migration_thread = NULL;
+      rc = CLASSIFIER_FAIL;
+    }
+  }
+
+  return rc;
+}
+
 /** Gets the number of updates to in-memory cache waiting in the update queue. */
 int item_cache_update_queue_size(const ItemCache * item_cache) {
   int size = -1;
@@ -1612,6 +6976,17 @@ int item_cache_update_queue_size(const ItemCache * item_cache) {
   return size;
 }
 
+/** Gets the number of entries waiting for a tokenizer thread, 0 if the cache has no tokenizer threads. */
+int item_cache_tokenizer_queue_size(const ItemCache * item_cache) {
+  int size = -1;
+  if (item_cache) {
+    pthread_mutex_lock((pthread_mutex_t*) &item_cache->tokenizer_mutex);
+    size = item_cache->tokenizer_queue_length;
+    pthread_mutex_unlock((pthread_mutex_t*) &item_cache->tokenizer_mutex);
+  }
+  return size;
+}
+
 int item_cache_start_cache_updater(ItemCache * item_cache) {
   int rc = CLASSIFIER_OK;
 
@@ -1645,41 +7020,41 @@ int item_cache_set_update_callback(ItemCache *item_cache, UpdateCallback callbac
 
 /** Converts a string token into it's atomized form.
  *
- *  If no atom for the string exists this will create one.
+ *  If no atom for the string exists this will create one. New atoms are
+ *  only given out in memory, they are written to the tokens table the next
+ *  time an item is saved or when the item cache is freed.
  *
  *  @return The integer atom for the token or -1 if it failed.
  */
 int item_cache_atomize(ItemCache * item_cache, const char * s) {
   int atom = -1;
 
-  if (item_cache && s) {
-    pthread_mutex_lock(&item_cache->db_access_mutex);
+  if (item_cache && s && CLASSIFIER_OK == token_dictionary_ready(item_cache)) {
+    PWord_t atom_pointer;
 
-    if (SQLITE_OK != sqlite3_bind_text(item_cache->find_atom_stmt, 1, s, -1, NULL)) {
-      error("Error binding %s to parameter 1", s);
-    } else {
+    pthread_rwlock_rdlock(&item_cache->atoms_lock);
+    JSLG(atom_pointer, item_cache->atoms_by_token, (const uint8_t*) s);
+    if (atom_pointer) {
+      atom = (int) *atom_pointer;
+    }
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
 
-      if (SQLITE_ROW == sqlite3_step(item_cache->find_atom_stmt)) {
-        atom = sqlite3_column_int(item_cache->find_atom_stmt, 0);
+    if (atom < 0) {
+      pthread_rwlock_wrlock(&item_cache->atoms_lock);
+
+      /* Another thread could have added it while we weren't holding the lock */
+      JSLG(atom_pointer, item_cache->atoms_by_token, (const uint8_t*) s);
+      if (atom_pointer) {
+        atom = (int) *atom_pointer;
       } else {
-        if (SQLITE_OK != sqlite3_bind_text(item_cache->insert_atom_stmt, 1, s, -1, NULL)) {
-          error("Error bind %s to parameter 1", s);
-        } else if (SQLITE_DONE != sqlite3_step(item_cache->insert_atom_stmt)) {
-          error("Error executing atom insertion: %s", item_cache_errmsg(item_cache));
-        } else {
-          atom = sqlite3_last_insert_rowid(item_cache->db);
+        if (CLASSIFIER_OK == token_dictionary_add(item_cache, item_cache->next_atom, s) &&
+            CLASSIFIER_OK == token_dictionary_add_unsaved(item_cache, item_cache->next_atom - 1)) {
+          atom = item_cache->next_atom - 1;
         }
-
-        sqlite3_clear_bindings(item_cache->insert_atom_stmt);
-        sqlite3_reset(item_cache->insert_atom_stmt);
       }
 
-      sqlite3_clear_bindings(item_cache->find_atom_stmt);
-      sqlite3_reset(item_cache->find_atom_stmt);
+      pthread_rwlock_unlock(&item_cache->atoms_lock);
     }
-
-
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
   }
 
   return atom;
@@ -1688,21 +7063,14 @@ int item_cache_atomize(ItemCache * item_cache, const char * s) {
 char * item_cache_globalize(ItemCache * item_cache, int atom) {
   char * s = NULL;
 
-  if (item_cache) {
-    pthread_mutex_lock(&item_cache->db_access_mutex);
+  if (item_cache && CLASSIFIER_OK == token_dictionary_ready(item_cache)) {
+    pthread_rwlock_rdlock(&item_cache->atoms_lock);
 
-    sqlite3_bind_int(item_cache->find_token_stmt, 1, atom);
-
-    if (SQLITE_ROW == sqlite3_step(item_cache->find_token_stmt)) {
-      const char *token = (char*) sqlite3_column_text(item_cache->find_token_stmt, 0);
-      if (token) {
-        s = strdup(token);
-      }
+    if (atom >= 0 && atom < item_cache->tokens_by_atom_capacity && item_cache->tokens_by_atom[atom]) {
+      s = strdup(item_cache->tokens_by_atom[atom]);
     }
 
-    sqlite3_clear_bindings(item_cache->find_token_stmt);
-    sqlite3_reset(item_cache->find_token_stmt);
-    pthread_mutex_unlock(&item_cache->db_access_mutex);
+    pthread_rwlock_unlock(&item_cache->atoms_lock);
   }
   return s;
 }
@@ -1745,6 +7113,10 @@ Item * create_item(const unsigned char *id, int key, time_t item_time) {
     item->time = item_time;
     item->key = key;
     item->tokens = NULL;
+    item->arena = NULL;
+    item->packed_ids = NULL;
+    item->packed_frequencies = NULL;
+    item->num_packed_tokens = 0;
   } else {
     fatal("Malloc Error allocating item %d", id);
   }
@@ -1804,6 +7176,10 @@ time_t item_get_time(const Item * item) {
 }
 
 int item_get_num_tokens(const Item * item) {
+  if (item->arena) {
+    return item->num_packed_tokens;
+  }
+
   Word_t count;
   JLC(count, item->tokens, 0, -1);
   return (int) count;
@@ -1814,6 +7190,15 @@ int item_get_total_tokens(const Item * item) {
 }
 
 short item_get_token_frequency(const Item * item, int token_id) {
+  if (item->arena) {
+    int position = packed_lower_bound(item, token_id);
+    if (position < item->num_packed_tokens && item->packed_ids[position] == (uint32_t) token_id) {
+      return (short) item->packed_frequencies[position];
+    }
+
+    return 0;
+  }
+
   short return_frequency;
   Word_t * frequency;
   JLG(frequency, item->tokens, token_id);
@@ -1832,7 +7217,19 @@ int item_next_token(const Item * item, int * token_id, short * token_frequency)
   PWord_t frequency = NULL;
   Word_t index = (Word_t) *token_id;
 
-  if (NULL != item) {
+  if (NULL != item && item->arena) {
+    /* Packed tokens are sorted so the next token is the first one after token_id. */
+    int position = packed_lower_bound(item, (uint32_t) *token_id + 1);
+
+    if (*token_id < 0 || position >= item->num_packed_tokens) {
+      *token_frequency = 0;
+      return false;
+    }
+
+    *token_id = item->packed_ids[position];
+    *token_frequency = (short) item->packed_frequencies[position];
+    return true;
+  } else if (NULL != item) {
     if (0 == token_id) {
       JLF(frequency, item->tokens, index);
     } else {
@@ -1851,8 +7248,76 @@ int item_next_token(const Item * item, int * token_id, short * token_frequency)
   return success;
 }
 
+/** Gets the item's next token, keeping its place in position.
+ *
+ *  This returns the same tokens as item_next_token, but each step is O(1)
+ *  instead of a search for the token after token_id. position must be 0
+ *  before the first call and is only meaningful to this function.
+ */
+int item_next_token_from(const Item * item, int * position, int * token_id, short * token_frequency) {
+  if (NULL != item && item->arena) {
+    int next = *position;
+
+    /* item_next_token never returns token 0 */
+    if (0 == next && item->num_packed_tokens > 0 && 0 == item->packed_ids[0]) {
+      next = 1;
+    }
+
+    if (next >= item->num_packed_tokens) {
+      *token_frequency = 0;
+      return false;
+    }
+
+    *token_id = item->packed_ids[next];
+    *token_frequency = (short) item->packed_frequencies[next];
+    *position = next + 1;
+    return true;
+  } else if (NULL != item) {
+    PWord_t frequency;
+    Word_t index = *position ? (Word_t) *token_id : 0;
+
+    JLN(frequency, item->tokens, index);
+    if (NULL != frequency) {
+      *token_id = index;
+      *token_frequency = *frequency;
+      *position = 1;
+      return true;
+    }
+  }
+
+  *token_frequency = 0;
+  return false;
+}
+
+/** Gets the ids of the item's tokens in increasing order.
+ *
+ *  Items in an arena already hold them in an array, which is returned
+ *  directly. Otherwise they are copied into buffer, which must have room
+ *  for item_get_num_tokens ids, and buffer is returned.
+ */
+const uint32_t * item_get_token_ids(const Item * item, uint32_t * buffer) {
+  if (item->arena) {
+    return item->packed_ids;
+  } else {
+    int i = 0;
+    PWord_t frequency;
+    Word_t index = 0;
+
+    JLF(frequency, item->tokens, index);
+    while (NULL != frequency) {
+      buffer[i++] = (uint32_t) index;
+      JLN(frequency, item->tokens, index);
+    }
+
+    return buffer;
+  }
+}
+
 void free_item(Item *item) {
-  if (NULL != item) {
+  if (NULL != item && item->arena) {
+    /* Items in an arena are freed along with the arena. */
+    item_arena_release(item->arena);
+  } else if (NULL != item) {
     free(item->id);
     int freed_bytes;
     if (item->tokens) {
@@ -1868,6 +7333,11 @@ int item_add_token(Item *item, int id, short token_frequency) {
   Word_t token_id;
   Word_t * token_frequency_p;
 
+  if (item->arena) {
+    error("Can't add tokens to a packed item");
+    return ERR;
+  }
+
   item->total_tokens += token_frequency;
   token_id = (Word_t) id;
 
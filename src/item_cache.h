@@ -27,10 +27,14 @@
 #define SQLITE_ITEM_SOURCE_H_
 
 #include <time.h>
+#include <stdint.h>
 #include <libxml/tree.h>
 
 #define ITEM_CACHE_ENTRY_PROTECTED 2
 
+/* Used when ItemCacheOptions.tokenizer_queue_size is not positive. */
+#define DEFAULT_TOKENIZER_QUEUE_SIZE 1000
+
 typedef struct TOKEN {
   int id;
   short frequency;
@@ -40,6 +44,21 @@ typedef struct ITEM_CACHE_OPTIONS {
   int cache_update_wait_time;
   int load_items_since;
   int min_tokens;
+  int load_threads;
+  const char *snapshot_file;
+  int write_batch_size;
+  int write_batch_wait;
+  int async_writes;
+  const char *journal_mode;
+  const char *synchronous;
+  int cache_size;
+  int touch_flush_interval;
+  int compress_atoms;
+  int tokenizer_threads;
+  int tokenizer_queue_size;
+  int gc_interval;
+  int gc_expire_days;
+  int prefetch;
 } ItemCacheOptions;
 
 typedef struct ITEM Item;
@@ -54,10 +73,12 @@ extern int          item_cache_initialize         (const char *dbfile, char *err
 extern int          item_cache_create             (ItemCache **is, const char *db_file, const ItemCacheOptions * options);
 extern int          item_cache_load               (ItemCache *item_cache);
 extern int          item_cache_loaded             (const ItemCache *item_cache);
+extern int          item_cache_save_snapshot      (ItemCache *item_cache);
 extern int          item_cache_cached_size        (ItemCache *item_cache);
 extern Item *       item_cache_fetch_item         (ItemCache *item_cache,  const unsigned char * item_id, int * free_when_done);  
 extern const char * item_cache_errmsg             (const ItemCache *is);
 extern int          item_cache_each_item          (ItemCache *item_cache, ItemIterator iterator, void *memo);
+extern int          item_cache_each_item_since    (ItemCache *item_cache, time_t since, ItemIterator iterator, void *memo);
 extern const Pool * item_cache_random_background  (ItemCache *item_cache);
 extern int          item_cache_add_entry          (ItemCache *item_cache, ItemCacheEntry *entry);
 extern int          item_cache_remove_entry       (ItemCache *item_cache, int entry_id);
@@ -65,8 +86,17 @@ extern int          item_cache_add_item           (ItemCache *item_cache, Item *
 extern int          item_cache_save_item          (ItemCache *item_cache, Item *item);
 extern int          item_cache_start_purger       (ItemCache *item_cache, int purge_interval);
 extern int          item_cache_purge_old_items    (ItemCache *item_cache);
+extern int          item_cache_migrate_tokens     (ItemCache *item_cache);
+extern int          item_cache_start_token_migration (ItemCache *item_cache);
+extern int          item_cache_count_tokens       (ItemCache *item_cache);
+extern int          item_cache_recompress_atoms   (ItemCache *item_cache);
+extern int          item_cache_cluster_tokens     (ItemCache *item_cache);
+extern int          item_cache_collect_garbage    (ItemCache *item_cache);
+extern int          item_cache_start_garbage_collector (ItemCache *item_cache);
+extern char *       item_cache_fetch_entry_atom   (ItemCache *item_cache, int entry_id);
 extern int          item_cache_start_cache_updater     (ItemCache *item_cache);
 extern int          item_cache_update_queue_size  (const ItemCache * item_cache);
+extern int          item_cache_tokenizer_queue_size (const ItemCache * item_cache);
 extern int          item_cache_set_update_callback(ItemCache *item_cache, UpdateCallback callback, void *memo);
 extern int          item_cache_atomize            (ItemCache *item_cache, const char *s);
 extern char *       item_cache_globalize          (ItemCache *item_cache, int atom);
@@ -93,6 +123,8 @@ extern int    item_get_num_tokens     (const Item *item);
 extern time_t item_get_time           (const Item *item);
 extern short  item_get_token_frequency(const Item *item, int token_id);
 extern int    item_next_token         (const Item *item, int * token_id, short * token_frequency);
+extern int    item_next_token_from    (const Item *item, int * position, int * token_id, short * token_frequency);
+extern const uint32_t * item_get_token_ids (const Item *item, uint32_t * buffer);
 extern void   free_item               (Item *item);
 /* This should only be called by item loaders */
 extern int    item_add_token          (Item *item, int id, short frequency);
@@ -100,6 +132,7 @@ extern int    item_add_token          (Item *item, int id, short frequency);
 /* Prototypes for pools */
 extern Pool * new_pool               (void);
 extern int    pool_add_item          (Pool *pool, const Item *item);
+extern int    pool_add_token         (Pool *pool, int token_id, int frequency);
 extern int    pool_add_items         (Pool *pool, const int items[], int size, const ItemCache *is);
 extern int    pool_num_tokens        (const Pool *pool);
 extern int    pool_total_tokens      (const Pool *pool);
@@ -45,6 +45,14 @@
 #define DEFAULT_CACHE_UPDATE_WAIT_TIME 60
 #define DEFAULT_LOAD_ITEMS_SINCE 30
 #define DEFAULT_MIN_TOKENS 50
+#define DEFAULT_LOAD_THREADS 1
+#define DEFAULT_WRITE_BATCH_SIZE 50
+#define DEFAULT_WRITE_BATCH_WAIT 200
+#define DEFAULT_JOURNAL_MODE "wal"
+#define DEFAULT_SYNCHRONOUS "normal"
+#define DEFAULT_TOUCH_FLUSH_INTERVAL 60
+#define DEFAULT_TOKENIZER_THREADS 2
+#define DEFAULT_GC_INTERVAL (60 * 60 * 6)
 
 #define PID_VAL 512
 #define DB_VAL  513
@@ -54,6 +62,21 @@
 #define MIN_TOKENS_VAL 517
 #define PERFORMANCE_LOG_FILE_VAL 519
 #define TAG_INDEX_VAL 520
+#define LOAD_THREADS_VAL 521
+#define SNAPSHOT_VAL 522
+#define WRITE_BATCH_SIZE_VAL 523
+#define WRITE_BATCH_WAIT_VAL 524
+#define ASYNC_WRITES_VAL 525
+#define JOURNAL_MODE_VAL 526
+#define SYNCHRONOUS_VAL 527
+#define CACHE_SIZE_VAL 528
+#define TOUCH_FLUSH_INTERVAL_VAL 529
+#define COMPRESS_ATOMS_VAL 530
+#define TOKENIZER_THREADS_VAL 531
+#define TOKENIZER_QUEUE_SIZE_VAL 532
+#define GC_INTERVAL_VAL 533
+#define GC_EXPIRE_DAYS_VAL 534
+#define NO_PREFETCH_VAL 535
 
 #define SHORT_OPTS "hvdo:t:n:p:a:c:"
 #define USAGE "Usage: classifier [-dvh] [-o LOGFILE] [--db DATABASE_FILE] [--pid PIDFILE]  [--create-db]\n"
@@ -145,7 +168,62 @@ static void printHelp(void) {
   printf("                     Default: %i days\n", DEFAULT_LOAD_ITEMS_SINCE);
   printf("        --min-tokens N\n");
   printf("                     the minimum number of tokens an item requires to be\n");
-  printf("                     classified\n\n");
+  printf("                     classified\n");
+  printf("        --load-threads N\n");
+  printf("                     number of threads used to load the item cache at startup,\n");
+  printf("                     usually the number of cores\n");
+  printf("                     Default: %i\n", DEFAULT_LOAD_THREADS);
+  printf("        --snapshot FILE\n");
+  printf("                     location of a snapshot of the loaded item cache, if the\n");
+  printf("                     snapshot exists only items added since it was written are\n");
+  printf("                     loaded from the database. It is rewritten on shutdown.\n");
+  printf("        --write-batch-size N\n");
+  printf("                     number of new entries written to the item cache in\n");
+  printf("                     each transaction, 1 commits every entry on its own\n");
+  printf("                     Default: %i\n", DEFAULT_WRITE_BATCH_SIZE);
+  printf("        --write-batch-wait N\n");
+  printf("                     longest number of milliseconds a write waits to be\n");
+  printf("                     committed when the batch isn't full\n");
+  printf("                     Default: %i\n", DEFAULT_WRITE_BATCH_WAIT);
+  printf("        --async-writes\n");
+  printf("                     respond to new entries once they are written instead of\n");
+  printf("                     waiting for their batch to be committed\n");
+  printf("        --journal-mode MODE\n");
+  printf("                     SQLite journal_mode for the item cache databases\n");
+  printf("                     Default: %s\n", DEFAULT_JOURNAL_MODE);
+  printf("        --synchronous MODE\n");
+  printf("                     SQLite synchronous setting for the item cache databases\n");
+  printf("                     Default: %s\n", DEFAULT_SYNCHRONOUS);
+  printf("        --cache-size N\n");
+  printf("                     SQLite cache_size for each item cache database\n");
+  printf("                     Default: SQLite's default\n");
+  printf("        --touch-flush-interval N\n");
+  printf("                     number of seconds between writing the last used time\n");
+  printf("                     of fetched items to the item cache, 0 writes it on\n");
+  printf("                     every fetch\n");
+  printf("                     Default: %i seconds\n", DEFAULT_TOUCH_FLUSH_INTERVAL);
+  printf("        --compress-atoms\n");
+  printf("                     compress the atom XML of new entries with zlib, use\n");
+  printf("                     winnow-recompress-atoms to compress existing entries\n");
+  printf("        --tokenizer-threads N\n");
+  printf("                     number of threads that tokenize new entries, 0 tokenizes\n");
+  printf("                     them on the thread handling the request\n");
+  printf("                     Default: %i\n", DEFAULT_TOKENIZER_THREADS);
+  printf("        --tokenizer-queue-size N\n");
+  printf("                     number of new entries that can wait for a tokenizer\n");
+  printf("                     thread before adding an entry blocks\n");
+  printf("                     Default: %i\n", DEFAULT_TOKENIZER_QUEUE_SIZE);
+  printf("        --gc-interval N\n");
+  printf("                     number of seconds between deleting unused tokens\n");
+  printf("                     and expired entries from the item cache, 0 disables it\n");
+  printf("                     Default: %i seconds\n", DEFAULT_GC_INTERVAL);
+  printf("        --gc-expire-days N\n");
+  printf("                     delete entries not updated or used for N days,\n");
+  printf("                     never less than --load-items-since\n");
+  printf("                     Default: entries are kept forever\n");
+  printf("        --no-prefetch\n");
+  printf("                     don't ask the OS to read the item cache databases into\n");
+  printf("                     memory ahead of loading them at startup\n\n");
 
   printf(" HTTP Options:\n");
   printf("    -p, --port N     the port to run the HTTP server on\n");
@@ -180,6 +258,8 @@ void termination_handler(int sig) {
     }
 
     if (item_cache) {
+      fprintf(stderr, "\tSaving item cache snapshot.\n");
+      item_cache_save_snapshot(item_cache);
       fprintf(stderr, "\tClosing database.\n");
       free_item_cache(item_cache);
     }
@@ -234,6 +314,8 @@ static int start_classifier(const char * db_file) {
     item_cache_load(item_cache);
     item_cache_start_cache_updater(item_cache);
     item_cache_start_purger(item_cache, 60 * 60 * 24);
+    item_cache_start_token_migration(item_cache);
+    item_cache_start_garbage_collector(item_cache);
 
     tagger_cache = create_tagger_cache(item_cache, &tagger_cache_options);
     tagger_cache->tag_retriever = &fetch_url;
@@ -264,12 +346,24 @@ int main(int argc, char **argv) {
   char *pid_file = DEFAULT_PID_FILE;
   char *db_file = DEFAULT_DB_FILE;
   char *credentials_file = NULL;
+  char *snapshot_file = NULL;
   char real_log_file[MAXPATHLEN];
   char real_db_file[MAXPATHLEN];
   char real_credentials_file[MAXPATHLEN];
+  char real_snapshot_file[MAXPATHLEN];
   item_cache_options.cache_update_wait_time = DEFAULT_CACHE_UPDATE_WAIT_TIME;
   item_cache_options.load_items_since = DEFAULT_LOAD_ITEMS_SINCE;
   item_cache_options.min_tokens = DEFAULT_MIN_TOKENS;
+  item_cache_options.load_threads = DEFAULT_LOAD_THREADS;
+  item_cache_options.write_batch_size = DEFAULT_WRITE_BATCH_SIZE;
+  item_cache_options.write_batch_wait = DEFAULT_WRITE_BATCH_WAIT;
+  item_cache_options.journal_mode = DEFAULT_JOURNAL_MODE;
+  item_cache_options.synchronous = DEFAULT_SYNCHRONOUS;
+  item_cache_options.touch_flush_interval = DEFAULT_TOUCH_FLUSH_INTERVAL;
+  item_cache_options.tokenizer_threads = DEFAULT_TOKENIZER_THREADS;
+  item_cache_options.tokenizer_queue_size = DEFAULT_TOKENIZER_QUEUE_SIZE;
+  item_cache_options.gc_interval = DEFAULT_GC_INTERVAL;
+  item_cache_options.prefetch = true;
 
   int longindex;
   int opt;
@@ -285,6 +379,21 @@ int main(int argc, char **argv) {
       {"cache-update-wait-time", required_argument, 0, CACHE_UPDATE_WAIT_TIME_VAL},
       {"load-items-since", required_argument, 0, LOAD_ITEMS_SINCE_VAL},
       {"min-tokens", required_argument, 0, MIN_TOKENS_VAL},
+      {"load-threads", required_argument, 0, LOAD_THREADS_VAL},
+      {"snapshot", required_argument, 0, SNAPSHOT_VAL},
+      {"write-batch-size", required_argument, 0, WRITE_BATCH_SIZE_VAL},
+      {"write-batch-wait", required_argument, 0, WRITE_BATCH_WAIT_VAL},
+      {"async-writes", no_argument, 0, ASYNC_WRITES_VAL},
+      {"journal-mode", required_argument, 0, JOURNAL_MODE_VAL},
+      {"synchronous", required_argument, 0, SYNCHRONOUS_VAL},
+      {"cache-size", required_argument, 0, CACHE_SIZE_VAL},
+      {"touch-flush-interval", required_argument, 0, TOUCH_FLUSH_INTERVAL_VAL},
+      {"compress-atoms", no_argument, 0, COMPRESS_ATOMS_VAL},
+      {"tokenizer-threads", required_argument, 0, TOKENIZER_THREADS_VAL},
+      {"tokenizer-queue-size", required_argument, 0, TOKENIZER_QUEUE_SIZE_VAL},
+      {"gc-interval", required_argument, 0, GC_INTERVAL_VAL},
+      {"gc-expire-days", required_argument, 0, GC_EXPIRE_DAYS_VAL},
+      {"no-prefetch", no_argument, 0, NO_PREFETCH_VAL},
 
       {"worker-threads", required_argument, 0, 'n'},
       {"positive-threshold", required_argument, 0, 't'},
@@ -328,6 +437,51 @@ int main(int argc, char **argv) {
       case MIN_TOKENS_VAL:
         item_cache_options.min_tokens = strtol(optarg, NULL, 10);
         break;
+      case LOAD_THREADS_VAL:
+        item_cache_options.load_threads = strtol(optarg, NULL, 10);
+        break;
+      case SNAPSHOT_VAL:
+        snapshot_file = optarg;
+        break;
+      case WRITE_BATCH_SIZE_VAL:
+        item_cache_options.write_batch_size = strtol(optarg, NULL, 10);
+        break;
+      case WRITE_BATCH_WAIT_VAL:
+        item_cache_options.write_batch_wait = strtol(optarg, NULL, 10);
+        break;
+      case ASYNC_WRITES_VAL:
+        item_cache_options.async_writes = 1;
+        break;
+      case JOURNAL_MODE_VAL:
+        item_cache_options.journal_mode = optarg;
+        break;
+      case SYNCHRONOUS_VAL:
+        item_cache_options.synchronous = optarg;
+        break;
+      case CACHE_SIZE_VAL:
+        item_cache_options.cache_size = strtol(optarg, NULL, 10);
+        break;
+      case TOUCH_FLUSH_INTERVAL_VAL:
+        item_cache_options.touch_flush_interval = strtol(optarg, NULL, 10);
+        break;
+      case COMPRESS_ATOMS_VAL:
+        item_cache_options.compress_atoms = 1;
+        break;
+      case TOKENIZER_THREADS_VAL:
+        item_cache_options.tokenizer_threads = strtol(optarg, NULL, 10);
+        break;
+      case TOKENIZER_QUEUE_SIZE_VAL:
+        item_cache_options.tokenizer_queue_size = strtol(optarg, NULL, 10);
+        break;
+      case GC_INTERVAL_VAL:
+        item_cache_options.gc_interval = strtol(optarg, NULL, 10);
+        break;
+      case GC_EXPIRE_DAYS_VAL:
+        item_cache_options.gc_expire_days = strtol(optarg, NULL, 10);
+        break;
+      case NO_PREFETCH_VAL:
+        item_cache_options.prefetch = false;
+        break;
 
       /* Classification Engine Options */
       case 'n': /* Number of worker threads */
@@ -403,6 +557,21 @@ int main(int argc, char **argv) {
       fprintf(stderr, "Could not find %s: %s\n", real_credentials_file, strerror(errno));
       exit(EXIT_FAILURE);
     }
+
+    /* The snapshot might not exist yet so it can't go through realpath. */
+    if (snapshot_file) {
+      char cwd[MAXPATHLEN];
+      if ('/' == snapshot_file[0]) {
+        strncpy(real_snapshot_file, snapshot_file, MAXPATHLEN - 1);
+        real_snapshot_file[MAXPATHLEN - 1] = '\0';
+      } else if (NULL == getcwd(cwd, MAXPATHLEN) ||
+                 MAXPATHLEN <= snprintf(real_snapshot_file, MAXPATHLEN, "%s/%s", cwd, snapshot_file)) {
+        fprintf(stderr, "Could not find %s: %s\n", snapshot_file, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+
+      item_cache_options.snapshot_file = real_snapshot_file;
+    }
     
     if (daemonize) {
       _daemonize(pid_file);
@@ -55,9 +55,10 @@ void free_pool(Pool *pool) {
 int pool_add_item(Pool *pool, const Item *item) {
   int success = true;
   int token_id = 0;
+  int position = 0;
   short frequency = 0;
   
-  while (item_next_token(item, &token_id, &frequency)) {
+  while (item_next_token_from(item, &position, &token_id, &frequency)) {
     PWord_t pool_frequency;
     JLG(pool_frequency, pool->tokens, token_id);
     
@@ -78,6 +79,20 @@ int pool_add_item(Pool *pool, const Item *item) {
     return false;    
 }
 
+/** Adds frequency occurrences of a token to the pool. Not Re-entrant */
+int pool_add_token(Pool *pool, int token_id, int frequency) {
+  PWord_t pool_frequency;
+  JLI(pool_frequency, pool->tokens, token_id);
+  if (PJERR == pool_frequency) {
+    error("Error allocating memory for Judy Array");
+    return false;
+  }
+
+  *pool_frequency = *pool_frequency + frequency;
+  pool->total_tokens += frequency;
+  return true;
+}
+
 // /** Not Re-entrant */
 // int pool_add_items(Pool *pool, const int items[], int size, const ItemCache *item_cache) {
 //   int success = true;
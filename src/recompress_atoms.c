@@ -0,0 +1,120 @@
+// Copyright (c) 2007-2010 The Kaphan Foundation
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// contact@winnowtag.org
+
+#include <config.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <sqlite3.h>
+#include "logging.h"
+#include "item_cache.h"
+#include "misc.h"
+
+static void print_help() {
+  printf("Winnow atom recompressor\n\n");
+  printf("Compresses the atom XML of every entry in an item cache that isn't\n");
+  printf("already compressed and then vacuums atom.db to reclaim the space.\n");
+  printf("The classifier should be stopped while this runs.\n\n");
+  printf("Usage: winnow-recompress-atoms [--no-vacuum] <item_cache>\n");
+}
+
+#define SHORT_OPTS "hv"
+#define NO_VACUUM_VAL 256
+
+static ItemCacheOptions item_cache_options;
+
+static int vacuum_atoms(const char * item_cache_dir) {
+  int rc = EXIT_SUCCESS;
+  char path[MAXPATHLEN];
+  sqlite3 *db;
+
+  snprintf(path, MAXPATHLEN, "%s/atom.db", item_cache_dir);
+
+  if (SQLITE_OK != sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL) ||
+      SQLITE_OK != sqlite3_exec(db, "vacuum", NULL, NULL, NULL)) {
+    fprintf(stderr, "Error vacuuming %s: %s\n", path, sqlite3_errmsg(db));
+    rc = EXIT_FAILURE;
+  }
+
+  sqlite3_close(db);
+  return rc;
+}
+
+int main(int argc, char ** argv) {
+  int exit_code = EXIT_SUCCESS;
+  int vacuum = true;
+  int longindex;
+  int opt;
+  static struct option long_options[] = {
+        {"version", no_argument, 0, 'v'},
+        {"help", no_argument, 0, 'h'},
+        {"no-vacuum", no_argument, 0, NO_VACUUM_VAL},
+        {0,0,0,0}
+      };
+
+  while (-1 != (opt = getopt_long(argc, argv, SHORT_OPTS, long_options, &longindex))) {
+    switch (opt) {
+    case 'h':
+      print_help();
+      return EXIT_SUCCESS;
+    case 'v':
+      printf("%s\n", PACKAGE_STRING);
+      return EXIT_SUCCESS;
+    case NO_VACUUM_VAL:
+      vacuum = false;
+      break;
+    default:
+      print_help();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_help();
+    exit_code = EXIT_FAILURE;
+  } else {
+    char *item_cache_dir = argv[optind];
+    ItemCache *item_cache = NULL;
+
+    if (CLASSIFIER_OK != item_cache_create(&item_cache, item_cache_dir, &item_cache_options)) {
+      fprintf(stderr, "Error opening item cache at %s: %s\n", item_cache_dir, item_cache_errmsg(item_cache));
+      exit_code = EXIT_FAILURE;
+    } else {
+      int compressed = item_cache_recompress_atoms(item_cache);
+
+      if (compressed < 0) {
+        fprintf(stderr, "Error compressing atoms in %s\n", item_cache_dir);
+        exit_code = EXIT_FAILURE;
+      } else {
+        printf("Compressed %i atoms\n", compressed);
+      }
+    }
+
+    free_item_cache(item_cache);
+
+    if (EXIT_SUCCESS == exit_code && vacuum) {
+      exit_code = vacuum_atoms(item_cache_dir);
+    }
+  }
+
+  return exit_code;
+}
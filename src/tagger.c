@@ -34,6 +34,7 @@
 #include <curl/curl.h>
 #include "xml.h"
 #include "logging.h"
+#include "misc.h"
 #include "hmac_sign.h"
 
 
@@ -290,9 +291,9 @@ TaggerState train_tagger(Tagger * tagger, ItemCache * item_cache) {
  *  tokens in all the pools in the tagger.  It uses the tagger's probability
  *  function to generate the probability for each token.
  *
- *  Once complete the tagger will be in the PRECOMPUTED state, the positive
- *  and negative pools will have been free'd and set to NULL and the tagger
- *  can be used to classify items.
+ *  Once complete the tagger will be in the PRECOMPUTED state, the clue list
+ *  will have been frozen, the positive and negative pools will have been
+ *  free'd and set to NULL and the tagger can be used to classify items.
  */
 TaggerState precompute_tagger(Tagger * tagger, const Pool * random_background) {
   TaggerState state = TAGGER_SEQUENCE_ERROR;
@@ -324,6 +325,7 @@ TaggerState precompute_tagger(Tagger * tagger, const Pool * random_background) {
       }
     }
     
+    freeze_clue_list(tagger->clues);
     free_pool(tagger->positive_pool);
     free_pool(tagger->negative_pool);
     tagger->positive_pool = NULL;
@@ -344,6 +346,50 @@ int classify_item(const Tagger *tagger, const Item *item, double * probability)
   return rc;
 }
 
+static int can_classify_many(const Tagger *tagger) {
+  return tagger && tagger->state == TAGGER_PRECOMPUTED && tagger->classify_many_function != NULL;
+}
+
+/** Classifies the item with each of the taggers.
+ *
+ *  probabilities[i] is set to the probability classify_item gives for taggers[i].
+ *  Consecutive taggers that share a classify_many_function are classified together
+ *  so the item's tokens are read once for all of them instead of once per tagger.
+ *
+ *  Returns TAGGER_OK or TAGGER_SEQUENCE_ERROR if any of the taggers can't classify
+ *  items, the probabilities for the rest are still set.
+ */
+int classify_item_with_taggers(Tagger * const * taggers, int num_taggers, const Item *item, double *probabilities) {
+  const ClueList *clue_lists[CLASSIFY_MANY_BATCH_SIZE];
+  int rc = TAGGER_OK;
+  int i = 0;
+  
+  if (NULL == probabilities) {
+    return TAGGER_SEQUENCE_ERROR;
+  }
+  
+  while (i < num_taggers) {
+    int n = 0;
+    
+    while (i + n < num_taggers && n < CLASSIFY_MANY_BATCH_SIZE && can_classify_many(taggers[i + n]) &&
+           taggers[i + n]->classify_many_function == taggers[i]->classify_many_function) {
+      clue_lists[n] = taggers[i + n]->clues;
+      n++;
+    }
+    
+    if (n > 0 && CLASSIFIER_OK == taggers[i]->classify_many_function(clue_lists, n, item, probabilities + i)) {
+      i += n;
+    } else {
+      if (TAGGER_OK != classify_item(taggers[i], item, &probabilities[i])) {
+        rc = TAGGER_SEQUENCE_ERROR;
+      }
+      i++;
+    }
+  }
+  
+  return rc;
+}
+
 Clue ** get_clues(const Tagger *tagger, const Item *item, int *num) {
   Clue **clues = NULL;
   
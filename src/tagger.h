@@ -47,6 +47,11 @@ typedef enum TAGGER_STATE {
 #define TAG_NOT_MODIFIED 2
 #define TAGGER_CHECKED_OUT 4
 
+/* The most taggers classify_item_with_taggers reads an item's tokens once for,
+ * which is also the most classify new items jobs the engine runs as one batch.
+ */
+#define CLASSIFY_MANY_BATCH_SIZE 64
+
 #define ATOM "http://www.w3.org/2005/Atom"
 #define CLASSIFIER "http://peerworks.org/classifier"
 
@@ -93,6 +98,9 @@ typedef struct TAGGER {
   /* The function that is used to classify a item */
   double (*classification_function)(const ClueList *clues, const Item *item);
   
+  /* The function that is used to classify an item with several taggers' clues at once */
+  int (*classify_many_function)(const ClueList **clue_lists, int num_lists, const Item *item, double *probabilities);
+  
   Clue ** (*get_clues_function)(const ClueList *clues, const Item *item, int *num);
   
   /**** Tag examples *****/
@@ -173,6 +181,7 @@ extern TaggerState   train_tagger        (Tagger * tagger, ItemCache * item_cach
 extern TaggerState   precompute_tagger   (Tagger * tagger, const Pool * random_background);
 extern TaggerState   prepare_tagger      (Tagger * tagger, ItemCache * item_cache);
 extern int           classify_item       (const Tagger * tagger, const Item * item, double * probability);
+extern int           classify_item_with_taggers (Tagger * const * taggers, int num_taggers, const Item * item, double * probabilities);
 extern Clue **       get_clues           (const Tagger * tagger, const Item * item, int * num);
 extern int           update_taggings     (const Tagger * tagger, Array *list, const Credentials * credentials, char ** errmsg);
 extern int           replace_taggings    (const Tagger * tagger, Array *list, const Credentials * credentials, char ** errmsg);
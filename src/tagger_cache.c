@@ -74,6 +74,7 @@ TaggerCache * create_tagger_cache(ItemCache * item_cache, TaggerCacheOptions *op
 static void setup_classification_functions(Tagger *tagger) {
   tagger->probability_function    = &naive_bayes_probability;
   tagger->classification_function = &naive_bayes_classify;
+  tagger->classify_many_function  = &naive_bayes_classify_many;
   tagger->get_clues_function      = &select_clues;
 }
 
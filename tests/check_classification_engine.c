@@ -28,6 +28,7 @@
 #include "../src/item_cache.h"
 #include "../src/fetch_url.h"
 #include "fixtures.h"
+#include "read_document.h"
 
 #define TAG_ID "http://localhost:8000/test.atom"
 #define BOGUS_TAG_ID 11111
@@ -146,6 +147,185 @@ START_TEST (remove_classification_job_wont_removes_the_job_from_the_engines_job_
   assert_not_null(j2);
 } END_TEST
 
+/************************************************************************
+ * Batch tests
+ ************************************************************************/
+#define TEMPLATE_TAG_URL "http://trunk.mindloom.org:80/seangeo/tags/a-religion/training.atom"
+static char *template_document;
+
+/* Returns the complete tag with the requested url as its own, and says it hasn't changed once it is cached. */
+static int load_tag_as_url(const char * tag_training_url, time_t last_updated, const Credentials * credentials, char ** tag_document, char ** errmsg) {
+  if (last_updated != -1) {
+    return TAG_NOT_MODIFIED;
+  }
+
+  char *at = strstr(template_document, TEMPLATE_TAG_URL);
+  *tag_document = calloc(strlen(template_document) + strlen(tag_training_url) + 1, sizeof(char));
+  strncpy(*tag_document, template_document, at - template_document);
+  strcat(*tag_document, tag_training_url);
+  strcat(*tag_document, at + strlen(TEMPLATE_TAG_URL));
+  return TAG_OK;
+}
+
+static void setup_batches() {
+  setup_fixture_path();
+  template_document = read_document("fixtures/complete_tag.atom");
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  item_cache_load(item_cache);
+  tagger_cache = create_tagger_cache(item_cache, NULL);
+  tagger_cache->tag_retriever = &load_tag_as_url;
+  ce = create_classification_engine(item_cache, tagger_cache, &opts);
+}
+
+static void teardown_batches() {
+  teardown_fixture_path();
+  free_classification_engine(ce);
+  free_tagger_cache(tagger_cache);
+  free_item_cache(item_cache);
+  free(template_document);
+}
+
+static Array * tag_urls(int size) {
+  Array *urls = create_array(size);
+  int i;
+
+  for (i = 0; i < size; i++) {
+    char *url = calloc(64, sizeof(char));
+    snprintf(url, 64, "http://example.org/tags/%i/training.atom", i);
+    arr_add(urls, url);
+  }
+
+  return urls;
+}
+
+/* Fetches the tagger for url, sets when it was last classified and puts it back in the tagger cache. */
+static void set_last_classified(const char * url, time_t last_classified) {
+  Tagger *tagger;
+  assert_equal(TAGGER_OK, get_tagger(tagger_cache, url, &tagger, NULL));
+  tagger->last_classified = last_classified;
+  release_tagger(tagger_cache, tagger);
+}
+
+static ClassificationJob * add_batched_job(const char * url, ClassificationJob * previous) {
+  ClassificationJob *job = ce_add_classification_job(ce, url);
+  job->item_scope = ITEM_SCOPE_NEW;
+  if (previous) {
+    previous->next_in_batch = job;
+  }
+  return job;
+}
+
+static int count_item(const Item * item, void * memo) {
+  (*(int*) memo)++;
+  return CLASSIFIER_OK;
+}
+
+static int middle_time_cb(const Item * item, void * memo) {
+  time_t *times = (time_t*) memo;
+  times[(int) times[0]++ + 1] = item_get_time(item);
+  return CLASSIFIER_OK;
+}
+
+START_TEST (classify_new_items_jobs_are_batched_to_keep_every_worker_busy) {
+  ClassificationEngineOptions two_workers = opts;
+  two_workers.worker_threads = 2;
+  free_classification_engine(ce);
+  ce = create_classification_engine(item_cache, tagger_cache, &two_workers);
+
+  assert_equal(2, ce_add_classify_new_items_jobs(ce, tag_urls(6)));
+  assert_equal(2, ce_num_waiting_jobs(ce));
+  free_classification_engine(ce);
+  ce = NULL;
+} END_TEST
+
+START_TEST (classify_new_items_batches_are_no_bigger_than_the_classify_many_batch_size) {
+  assert_equal(2, ce_add_classify_new_items_jobs(ce, tag_urls(CLASSIFY_MANY_BATCH_SIZE * 2)));
+} END_TEST
+
+START_TEST (the_last_classify_new_items_batch_gets_the_jobs_left_over) {
+  assert_equal(3, ce_add_classify_new_items_jobs(ce, tag_urls(CLASSIFY_MANY_BATCH_SIZE * 2 + 1)));
+  assert_equal(3, ce_num_waiting_jobs(ce));
+} END_TEST
+
+START_TEST (a_batch_classifies_each_tagger_with_the_items_since_it_was_last_classified) {
+  time_t times[64] = {0};
+  int all_items = 0, recent_items = 0;
+  item_cache_each_item(item_cache, &middle_time_cb, times);
+  time_t middle = times[times[0] / 2 + 1];
+  item_cache_each_item(item_cache, &count_item, &all_items);
+  item_cache_each_item_since(item_cache, middle, &count_item, &recent_items);
+  assert_true(recent_items < all_items);
+
+  set_last_classified("http://example.org/recent/training.atom", middle);
+  set_last_classified("http://example.org/never/training.atom", 0);
+
+  /* The most recently classified first, so the batch has to sort them */
+  ClassificationJob *recent = add_batched_job("http://example.org/recent/training.atom", NULL);
+  ClassificationJob *never = add_batched_job("http://example.org/never/training.atom", recent);
+  ce_run_classification_batch(ce, recent);
+
+  assert_equal(CJOB_STATE_COMPLETE, recent->state);
+  assert_equal(CJOB_STATE_COMPLETE, never->state);
+  assert_equal(recent_items, recent->items_classified);
+  assert_equal(all_items, never->items_classified);
+} END_TEST
+
+START_TEST (cancelled_jobs_in_a_batch_are_removed_and_the_rest_are_run) {
+  char cancelled_id[64];
+  ClassificationJob *first = add_batched_job("http://example.org/first/training.atom", NULL);
+  ClassificationJob *cancelled = add_batched_job("http://example.org/cancelled/training.atom", first);
+  ClassificationJob *last = add_batched_job("http://example.org/last/training.atom", cancelled);
+  strncpy(cancelled_id, cancelled->id, 64);
+  cjob_cancel(cancelled);
+
+  ce_run_classification_batch(ce, first);
+
+  assert_null(ce_fetch_classification_job(ce, cancelled_id));
+  assert_equal(CJOB_STATE_COMPLETE, first->state);
+  assert_equal(CJOB_STATE_COMPLETE, last->state);
+  assert_null(first->next_in_batch);
+  assert_false(is_cached(tagger_cache, "http://example.org/cancelled/training.atom"));
+} END_TEST
+
+START_TEST (a_job_waits_for_a_tagger_checked_out_by_another_job) {
+  Tagger *tagger;
+  assert_equal(TAGGER_OK, get_tagger(tagger_cache, "http://example.org/busy/training.atom", &tagger, NULL));
+  ClassificationJob *job = ce_add_classification_job(ce, "http://example.org/busy/training.atom");
+
+  ce_start(ce);
+  sleep(1);
+  assert_not_equal(CJOB_STATE_ERROR, job->state);
+  assert_not_equal(CJOB_STATE_COMPLETE, job->state);
+
+  release_tagger(tagger_cache, tagger);
+  sleep(1);
+  ce_stop(ce);
+  assert_equal(CJOB_STATE_COMPLETE, job->state);
+} END_TEST
+
+START_TEST (a_batched_job_whose_tagger_is_checked_out_is_requeued_on_its_own) {
+  Tagger *tagger;
+  assert_equal(TAGGER_OK, get_tagger(tagger_cache, "http://example.org/busy/training.atom", &tagger, NULL));
+  ClassificationJob *free_job = add_batched_job("http://example.org/free/training.atom", NULL);
+  ClassificationJob *busy = add_batched_job("http://example.org/busy/training.atom", free_job);
+  int queued = ce_num_waiting_jobs(ce);
+
+  ce_run_classification_batch(ce, free_job);
+
+  assert_equal(CJOB_STATE_COMPLETE, free_job->state);
+  assert_equal(CJOB_STATE_WAITING, busy->state);
+  assert_null(free_job->next_in_batch);
+  assert_null(busy->next_in_batch);
+  assert_equal(queued + 1, ce_num_waiting_jobs(ce));
+
+  release_tagger(tagger_cache, tagger);
+  ce_start(ce);
+  sleep(1);
+  ce_stop(ce);
+  assert_equal(CJOB_STATE_COMPLETE, busy->state);
+} END_TEST
+
 /************************************************************************
  * Initialization tests.
  ************************************************************************/
@@ -202,8 +382,22 @@ Suite * classification_engine_suite(void) {
   tcase_add_test(tc_jt_case, remove_classification_job_wont_removes_the_job_from_the_engines_job_index_if_job_is_not_complete);
   // END_TESTS
 
+  TCase *tc_batch_case = tcase_create("batches");
+  tcase_add_checked_fixture(tc_batch_case, setup_batches, teardown_batches);
+  tcase_set_timeout(tc_batch_case, 10);
+  // START_TESTS
+  tcase_add_test(tc_batch_case, classify_new_items_jobs_are_batched_to_keep_every_worker_busy);
+  tcase_add_test(tc_batch_case, classify_new_items_batches_are_no_bigger_than_the_classify_many_batch_size);
+  tcase_add_test(tc_batch_case, the_last_classify_new_items_batch_gets_the_jobs_left_over);
+  tcase_add_test(tc_batch_case, a_batch_classifies_each_tagger_with_the_items_since_it_was_last_classified);
+  tcase_add_test(tc_batch_case, cancelled_jobs_in_a_batch_are_removed_and_the_rest_are_run);
+  tcase_add_test(tc_batch_case, a_job_waits_for_a_tagger_checked_out_by_another_job);
+  tcase_add_test(tc_batch_case, a_batched_job_whose_tagger_is_checked_out_is_requeued_on_its_own);
+  // END_TESTS
+
   suite_add_tcase(s, tc_initialization_case);
   suite_add_tcase(s, tc_jt_case);
+  suite_add_tcase(s, tc_batch_case);
   // TODO suite_add_tcase(s, tc_end_to_end);
   return s;
 }
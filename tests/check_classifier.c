@@ -171,6 +171,33 @@ START_TEST (clue_selection_sorted_by_strength) {
   free_item(item);
 } END_TEST
 
+START_TEST (clue_selection_keeps_only_the_strongest_clues) {
+  ClueList *many_clues = new_clue_list();
+  int tokens[400][2];
+  int i, num_clues;
+  
+  // Token t has strength t / 1000, alternating either side of 0.5
+  for (i = 0; i < 400; i++) {
+    int token_id = i + 1;
+    add_clue(many_clues, token_id, token_id % 2 ? 0.5 - token_id / 1000.0 : 0.5 + token_id / 1000.0);
+    tokens[i][0] = token_id;
+    tokens[i][1] = 1;
+  }
+  
+  Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 400);
+  const Clue **selected_clues = select_clues(many_clues, item, &num_clues);
+  
+  assert_not_null(selected_clues);
+  assert_equal(200, num_clues);
+  for (i = 0; i < num_clues; i++) {
+    assert_equal(400 - i, clue_token_id(selected_clues[i]));
+  }
+  
+  free(selected_clues);
+  free_item(item);
+  free_clue_list(many_clues);
+} END_TEST
+
 START_TEST (classify_1) {
   int tokens[][2] = {10, 10};
   Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 1);
@@ -252,6 +279,162 @@ START_TEST (classify_10) {
   free_item(item);
 } END_TEST
 
+/* The same clues frozen into arrays must give the same results */
+static ClueList *frozen_clues;
+
+static void setup_frozen_classifier_test(void) {
+  frozen_clues = new_clue_list();
+  add_clue(frozen_clues, 1, 0.75);
+  add_clue(frozen_clues, 2, 0.51);
+  add_clue(frozen_clues, 3, 0.1);
+  add_clue(frozen_clues, 4, 0.95);
+  freeze_clue_list(frozen_clues);
+}
+
+static void teardown_frozen_classifier_test(void) {
+  free_clue_list(frozen_clues);
+}
+
+START_TEST (frozen_clue_selection_filters_out_weak_clues) {
+  int tokens[][2] = {1, 1, 2, 1};
+  Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 2);
+  int num_clues;
+  const Clue **selected_clues = select_clues(frozen_clues, item, &num_clues);
+  
+  assert_not_null(selected_clues);
+  assert_equal(1, num_clues);
+  assert_equal(1, clue_token_id(selected_clues[0]));
+  assert_equal_f(0.75, clue_probability(selected_clues[0]));
+  free(selected_clues);
+  free_item(item);
+} END_TEST
+
+START_TEST (frozen_clue_selection_sorted_by_strength) {
+  int tokens[][2] = {1, 1, 2, 1, 4, 1, 5, 1};
+  Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 4);
+  int num_clues;
+  const Clue **selected_clues = select_clues(frozen_clues, item, &num_clues);
+  assert_not_null(selected_clues);
+  assert_equal(2, num_clues);
+  assert_equal(4, clue_token_id(selected_clues[0]));
+  assert_equal(1, clue_token_id(selected_clues[1]));
+  free(selected_clues);
+  free_item(item);
+} END_TEST
+
+START_TEST (frozen_classify_3) {
+  int tokens[][2] = {4, 1};
+  Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 1);
+  double prob = naive_bayes_classify(frozen_clues, item);
+  assert_equal_f(0.89947100800, prob);
+  free_item(item);
+} END_TEST
+
+START_TEST (frozen_classification_matches_unfrozen_classification) {
+  ClueList *unfrozen = new_clue_list();
+  ClueList *frozen = new_clue_list();
+  int tokens[500][2];
+  int i, n;
+  
+  srand(42);
+  for (i = 0; i < 2000; i++) {
+    int token_id = rand() % 5000;
+    double probability = (rand() % 1000) / 1000.0;
+    add_clue(unfrozen, token_id, probability);
+    add_clue(frozen, token_id, probability);
+  }
+  
+  freeze_clue_list(frozen);
+  assert_equal(unfrozen->size, frozen->size);
+  
+  for (n = 0; n < 20; n++) {
+    int num_tokens = 1 + rand() % 500;
+    for (i = 0; i < num_tokens; i++) {
+      tokens[i][0] = rand() % 6000;
+      tokens[i][1] = 1;
+    }
+    
+    Item *item = create_item_with_tokens((unsigned char*) "1", tokens, num_tokens);
+    assert_true(naive_bayes_classify(unfrozen, item) == naive_bayes_classify(frozen, item));
+    free_item(item);
+  }
+  
+  free_clue_list(unfrozen);
+  free_clue_list(frozen);
+} END_TEST
+
+START_TEST (classify_many_matches_classifying_with_each_list) {
+  ClueList *unfrozen = new_clue_list();
+  add_clue(unfrozen, 2, 0.2);
+  add_clue(unfrozen, 3, 0.9);
+  const ClueList *lists[] = {frozen_clues, unfrozen, frozen_clues};
+  int tokens[][2] = {1, 1, 2, 1, 3, 1, 4, 1, 5, 1};
+  Item *item = create_item_with_tokens((unsigned char*) "1", tokens, 5);
+  double probs[3];
+  
+  assert_equal(CLASSIFIER_OK, naive_bayes_classify_many(lists, 3, item, probs));
+  assert_true(naive_bayes_classify(frozen_clues, item) == probs[0]);
+  assert_true(naive_bayes_classify(unfrozen, item) == probs[1]);
+  assert_true(probs[0] == probs[2]);
+  assert_true(probs[0] != probs[1]);
+  free_item(item);
+  free_clue_list(unfrozen);
+} END_TEST
+
+/* Combines clues the way chi2_combine did before it summed logs, multiplying the probabilities */
+static double multiply_clues(const Clue **clues, int num_clues) {
+  double h = 1.0, s = 1.0;
+  int hExp = 0, sExp = 0, e, i;
+  
+  for (i = 0; i < num_clues; i++) {
+    s *= 1.0 - clue_probability(clues[i]);
+    h *= clue_probability(clues[i]);
+    if (s < 1e-200) {
+      s = frexp(s, &e);
+      sExp += e;
+    }
+    if (h < 1e-200) {
+      h = frexp(h, &e);
+      hExp += e;
+    }
+  }
+  
+  s = 1.0 - chi2Q(-2.0 * (log(s) + sExp * M_LN2), num_clues * 2);
+  h = 1.0 - chi2Q(-2.0 * (log(h) + hExp * M_LN2), num_clues * 2);
+  return (s - h + 1.0) / 2.0;
+}
+
+START_TEST (classification_matches_multiplying_probabilities) {
+  ClueList *clues = new_clue_list();
+  int tokens[2000][2];
+  int i, n, num_clues;
+  double max_difference = 0.0;
+  
+  srand(24);
+  for (i = 0; i < 4000; i++) {
+    add_clue(clues, rand() % 5000, (1 + rand() % 999) / 1000.0);
+  }
+  freeze_clue_list(clues);
+  
+  for (n = 0; n < 50; n++) {
+    int num_tokens = 1 + rand() % 2000;
+    for (i = 0; i < num_tokens; i++) {
+      tokens[i][0] = rand() % 6000;
+      tokens[i][1] = 1;
+    }
+    
+    Item *item = create_item_with_tokens((unsigned char*) "1", tokens, num_tokens);
+    const Clue **selected_clues = select_clues(clues, item, &num_clues);
+    double difference = fabs(multiply_clues(selected_clues, num_clues) - naive_bayes_classify(clues, item));
+    if (difference > max_difference) max_difference = difference;
+    free(selected_clues);
+    free_item(item);
+  }
+  
+  fail_unless(max_difference < CHI2_COMBINE_TOLERANCE, "probabilities differ by %g", max_difference);
+  free_clue_list(clues);
+} END_TEST
+
 /*************************************************************
  *   Unit tests for chi2q(double, int)
  *
@@ -310,6 +493,7 @@ classifier_suite(void) {
   tcase_add_checked_fixture(tc_classifier, setup_classifier_test, teardown_classifier_test);
   tcase_add_test(tc_classifier, clue_selection_filters_out_weak_clues);
   tcase_add_test(tc_classifier, clue_selection_sorted_by_strength);
+  tcase_add_test(tc_classifier, clue_selection_keeps_only_the_strongest_clues);
   tcase_add_test(tc_classifier, classify_1);
   tcase_add_test(tc_classifier, classify_2);
   tcase_add_test(tc_classifier, classify_3);
@@ -322,6 +506,16 @@ classifier_suite(void) {
   tcase_add_test(tc_classifier, classify_10);
   suite_add_tcase(s, tc_classifier);
   
+  TCase *tc_frozen = tcase_create("Frozen classifier");
+  tcase_add_checked_fixture(tc_frozen, setup_frozen_classifier_test, teardown_frozen_classifier_test);
+  tcase_add_test(tc_frozen, frozen_clue_selection_filters_out_weak_clues);
+  tcase_add_test(tc_frozen, frozen_clue_selection_sorted_by_strength);
+  tcase_add_test(tc_frozen, frozen_classify_3);
+  tcase_add_test(tc_frozen, frozen_classification_matches_unfrozen_classification);
+  tcase_add_test(tc_frozen, classification_matches_multiplying_probabilities);
+  tcase_add_test(tc_frozen, classify_many_matches_classifying_with_each_list);
+  suite_add_tcase(s, tc_frozen);
+  
   return s;
 }
 
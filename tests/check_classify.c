@@ -57,6 +57,18 @@ static double mock_classify(const ClueList *clues, const Item *item) {
   return 0.75;
 }
 
+static int classify_many_lists = 0;
+
+static int mock_classify_many(const ClueList **clue_lists, int num_lists, const Item *item, double *probabilities) {
+  int i;
+  classified_item = item;
+  classify_many_lists = num_lists;
+  for (i = 0; i < num_lists; i++) {
+    probabilities[i] = 0.25;
+  }
+  return CLASSIFIER_OK;
+}
+
 static void setup(void) {
   setup_fixture_path();
   read_document("fixtures/complete_tag.atom");
@@ -72,6 +84,7 @@ static void setup(void) {
   assert_equal(TAGGER_PRECOMPUTED, tagger->state);
 
   classified_item = NULL;
+  classify_many_lists = 0;
   int freeit;
   item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#709254", &freeit);
 }
@@ -122,6 +135,34 @@ START_TEST (test_classify_item_with_no_classification_function_returns_SEQUENCE_
   assert_equal(TAGGER_SEQUENCE_ERROR, state);
 } END_TEST
 
+START_TEST (test_classify_item_with_taggers_without_classify_many_function_uses_the_classification_function) {
+  Tagger *taggers[] = {tagger, tagger};
+  double probs[2] = {0.0, 0.0};
+  assert_equal(TAGGER_OK, classify_item_with_taggers(taggers, 2, item, probs));
+  assert_equal_f(0.75, probs[0]);
+  assert_equal_f(0.75, probs[1]);
+} END_TEST
+
+START_TEST (test_classify_item_with_taggers_classifies_them_together) {
+  Tagger *taggers[] = {tagger, tagger, tagger};
+  double probs[3] = {0.0, 0.0, 0.0};
+  tagger->classify_many_function = &mock_classify_many;
+  assert_equal(TAGGER_OK, classify_item_with_taggers(taggers, 3, item, probs));
+  assert_equal(3, classify_many_lists);
+  assert_equal(item, classified_item);
+  assert_equal_f(0.25, probs[0]);
+  assert_equal_f(0.25, probs[2]);
+} END_TEST
+
+START_TEST (test_classify_item_with_taggers_when_not_in_precompute_state_returns_SEQUENCE_ERROR) {
+  Tagger *taggers[] = {tagger};
+  double prob;
+  tagger->classify_many_function = &mock_classify_many;
+  tagger->state = TAGGER_TRAINED;
+  assert_equal(TAGGER_SEQUENCE_ERROR, classify_item_with_taggers(taggers, 1, item, &prob));
+  assert_equal(0, classify_many_lists);
+} END_TEST
+
 Suite *
 check_classify_suite(void) {
   Suite *s = suite_create("check classify");
@@ -133,6 +174,9 @@ check_classify_suite(void) {
   tcase_add_test(tc_mock_classification, test_classify_item_when_not_in_precompute_state_returns_SEQUENCE_ERROR);
   tcase_add_test(tc_mock_classification, test_classify_passed_item_to_the_classifcation_function);
   tcase_add_test(tc_mock_classification, test_classify_item_with_no_classification_function_returns_SEQUENCE_ERROR);
+  tcase_add_test(tc_mock_classification, test_classify_item_with_taggers_without_classify_many_function_uses_the_classification_function);
+  tcase_add_test(tc_mock_classification, test_classify_item_with_taggers_classifies_them_together);
+  tcase_add_test(tc_mock_classification, test_classify_item_with_taggers_when_not_in_precompute_state_returns_SEQUENCE_ERROR);
 
   suite_add_tcase(s, tc_mock_classification);
   return s;
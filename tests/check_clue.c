@@ -21,8 +21,10 @@
 // contact@winnowtag.org
 
 #include <stdlib.h>
+#include <math.h>
 #include <check.h>
 #include "../src/clue.h"
+#include "../src/misc.h"
 #include "assertions.h"
 
 START_TEST (create_clue_from_token_id_and_prob) {
@@ -31,6 +33,8 @@ START_TEST (create_clue_from_token_id_and_prob) {
   assert_equal(1234, clue_token_id(clue));
   assert_equal_f(0.95, clue_probability(clue));
   assert_equal_f(0.45, clue_strength(clue));
+  assert_equal_f(log(0.95), clue->log_probability);
+  assert_equal_f(log(0.05), clue->log_complement);
   free_clue(clue);
 } END_TEST
 
@@ -67,6 +71,121 @@ START_TEST (test_can_get_clue_by_token_id) {
   assert_equal_f(0.45, clue->strength);
 } END_TEST
 
+START_TEST (test_freezing_keeps_the_size) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  add_clue(clues, 12, 0.2);
+  assert_equal(CLASSIFIER_OK, freeze_clue_list(clues));
+  assert_true(clue_list_frozen(clues));
+  assert_equal(2, clues->size);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_frozen_clues_are_sorted_by_token_id) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  add_clue(clues, 12, 0.2);
+  freeze_clue_list(clues);
+  assert_equal(12, clues->token_ids[0]);
+  assert_equal_f(0.2, clues->probabilities[0]);
+  assert_equal_f(0.3, clues->strengths[0]);
+  assert_equal(1234, clues->token_ids[1]);
+  assert_equal_f(0.95, clues->probabilities[1]);
+  assert_equal_f(0.45, clues->strengths[1]);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_frozen_clues_keep_their_logs) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  add_clue(clues, 12, 0.2);
+  freeze_clue_list(clues);
+  assert_equal_f(log(0.2), clues->log_probabilities[0]);
+  assert_equal_f(log(0.8), clues->log_complements[0]);
+  assert_equal_f(log(0.95), clues->log_probabilities[1]);
+  assert_equal_f(log(0.05), clues->log_complements[1]);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_lower_bound_finds_the_first_clue_at_or_after_the_token) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 10, 0.9);
+  add_clue(clues, 20, 0.9);
+  add_clue(clues, 30, 0.9);
+  freeze_clue_list(clues);
+  assert_equal(0, clue_list_lower_bound(clues, 0, 5));
+  assert_equal(0, clue_list_lower_bound(clues, 0, 10));
+  assert_equal(1, clue_list_lower_bound(clues, 0, 11));
+  assert_equal(2, clue_list_lower_bound(clues, 1, 30));
+  assert_equal(2, clue_list_lower_bound(clues, 2, 10));
+  assert_equal(3, clue_list_lower_bound(clues, 0, 31));
+  assert_equal(3, clue_list_lower_bound(clues, 3, 1));
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_cant_add_a_clue_to_a_frozen_list) {
+  ClueList *clues = new_clue_list();
+  add_clue(clues, 1234, 0.95);
+  freeze_clue_list(clues);
+  assert_null(add_clue(clues, 12, 0.2));
+  assert_equal(1, clues->size);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_intersect_finds_the_position_of_each_token_with_a_clue) {
+  ClueList *clues = new_clue_list();
+  uint32_t tokens[] = {5, 10, 25, 30, 31};
+  int positions[5];
+  add_clue(clues, 10, 0.9);
+  add_clue(clues, 20, 0.9);
+  add_clue(clues, 30, 0.9);
+  freeze_clue_list(clues);
+  
+  assert_equal(2, clue_list_intersect(clues, tokens, 5, positions));
+  assert_equal(0, positions[0]);
+  assert_equal(2, positions[1]);
+  free_clue_list(clues);
+} END_TEST
+
+START_TEST (test_intersect_matches_lower_bound_on_large_lists) {
+  ClueList *clues = new_clue_list();
+  uint32_t tokens[1000];
+  int positions[1000];
+  int i, n;
+  
+  srand(7);
+  for (i = 0; i < 20000; i++) {
+    add_clue(clues, 1 + rand() % 100000, 0.9);
+  }
+  freeze_clue_list(clues);
+  
+  for (n = 0; n < 50; n++) {
+    int num_tokens = 0, matches = 0, expected = 0;
+    int token_id = 0;
+    
+    /* Increasing tokens with gaps of every size, including runs past the last clue */
+    while (num_tokens < 1000 && token_id < 110000) {
+      token_id += 1 + rand() % (n < 25 ? 20 : 2000);
+      tokens[num_tokens++] = token_id;
+    }
+    
+    matches = clue_list_intersect(clues, tokens, num_tokens, positions);
+    
+    for (i = 0; i < num_tokens; i++) {
+      int position = clue_list_lower_bound(clues, 0, tokens[i]);
+      if (position < clues->size && clues->token_ids[position] == (int) tokens[i]) {
+        assert_true(expected < matches);
+        assert_equal(position, positions[expected]);
+        expected++;
+      }
+    }
+    
+    assert_equal(expected, matches);
+  }
+  
+  free_clue_list(clues);
+} END_TEST
+
 Suite *
 clue_suite(void) {
   Suite *s = suite_create("Clues");  
@@ -79,6 +198,13 @@ clue_suite(void) {
   tcase_add_test(tc_clue, test_adding_clue_to_list_increments_size);
   tcase_add_test(tc_clue, test_adding_same_clue_to_list_twice_increments_size_once);
   tcase_add_test(tc_clue, test_can_get_clue_by_token_id);  
+  tcase_add_test(tc_clue, test_freezing_keeps_the_size);
+  tcase_add_test(tc_clue, test_frozen_clues_are_sorted_by_token_id);
+  tcase_add_test(tc_clue, test_frozen_clues_keep_their_logs);
+  tcase_add_test(tc_clue, test_lower_bound_finds_the_first_clue_at_or_after_the_token);
+  tcase_add_test(tc_clue, test_cant_add_a_clue_to_a_frozen_list);
+  tcase_add_test(tc_clue, test_intersect_finds_the_position_of_each_token_with_a_clue);
+  tcase_add_test(tc_clue, test_intersect_matches_lower_bound_on_large_lists);
 // END_TESTS
 
   suite_add_tcase(s, tc_clue);
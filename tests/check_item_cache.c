@@ -26,11 +26,13 @@
 #include <string.h>
 #include "assertions.h"
 #include "read_document.h"
+#include "query_value.h"
 #include "../src/item_cache.h"
 #include "../src/misc.h"
 #include "../src/item_cache.h"
 #include "../src/logging.h"
 #include <sqlite3.h>
+#include <pthread.h>
 
 static ItemCacheOptions item_cache_options = {1, 3650, 2};
 
@@ -124,6 +126,12 @@ START_TEST (test_fetch_item_after_load) {
   assert_not_null(item);
 } END_TEST
 
+START_TEST (test_fetch_item_after_load_returns_null_when_item_doesnt_exist) {
+  item_cache_load(item_cache);
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#111", &free_when_done);
+  assert_null(item);
+} END_TEST
+
 START_TEST (test_free_when_done_is_false_when_the_item_is_in_the_memory_cache) {
   item_cache_load(item_cache);
   Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
@@ -137,6 +145,48 @@ START_TEST (test_fetch_item_after_load_contains_tokens) {
   assert_equal(76, item_get_num_tokens(item));
 } END_TEST
 
+static const char *fixture_ids[] = {
+  "urn:peerworks.org:entry#709254", "urn:peerworks.org:entry#880389", "urn:peerworks.org:entry#888769",
+  "urn:peerworks.org:entry#886643", "urn:peerworks.org:entry#890806", "urn:peerworks.org:entry#802739",
+  "urn:peerworks.org:entry#884409", "urn:peerworks.org:entry#753459", "urn:peerworks.org:entry#878944",
+  "urn:peerworks.org:entry#886294"
+};
+
+static void * fetches_every_item(void *memo) {
+  int *fetched = (int*) memo;
+  int n, j;
+
+  for (n = 0; n < 20; n++) {
+    for (j = 0; j < 10; j++) {
+      int free_item_when_done;
+      Item *item = item_cache_fetch_item(item_cache, (unsigned char*) fixture_ids[j], &free_item_when_done);
+      if (item && !strcmp(fixture_ids[j], (char*) item_get_id(item)) && item_get_num_tokens(item) > 0) {
+        (*fetched)++;
+      }
+      if (item && free_item_when_done) {
+        free_item(item);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+START_TEST (test_fetch_item_from_multiple_threads) {
+  pthread_t threads[4];
+  int fetched[4] = {0, 0, 0, 0};
+  int t;
+
+  for (t = 0; t < 4; t++) {
+    pthread_create(&threads[t], NULL, fetches_every_item, &fetched[t]);
+  }
+
+  for (t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+    assert_equal(200, fetched[t]);
+  }
+} END_TEST
+
 START_TEST (test_fetch_item_should_update_the_last_used_tstamp) {
 	Item * item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
 
@@ -154,6 +204,33 @@ START_TEST (test_fetch_item_should_update_the_last_used_tstamp) {
 	sqlite3_close(db);
 } END_TEST
 
+START_TEST (test_deferred_touch_is_written_when_the_item_cache_is_freed) {
+  ItemCache *deferred_item_cache;
+  ItemCacheOptions options = item_cache_options;
+  options.touch_flush_interval = 3600;
+  item_cache_create(&deferred_item_cache, "/tmp/valid-copy", &options);
+
+  Item *item = item_cache_fetch_item(deferred_item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  free_item(item);
+  assert_true(query_value("/tmp/valid-copy/catalog.db", "select last_used_at from entries where full_id = 'urn:peerworks.org:entry#890806'") <= 0);
+
+  free_item_cache(deferred_item_cache);
+  assert_true(query_value("/tmp/valid-copy/catalog.db", "select last_used_at from entries where full_id = 'urn:peerworks.org:entry#890806'") > 0);
+} END_TEST
+
+START_TEST (test_deferred_touch_is_written_after_the_flush_interval) {
+  ItemCache *deferred_item_cache;
+  ItemCacheOptions options = item_cache_options;
+  options.touch_flush_interval = 1;
+  item_cache_create(&deferred_item_cache, "/tmp/valid-copy", &options);
+
+  Item *item = item_cache_fetch_item(deferred_item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  free_item(item);
+  sleep(3);
+  assert_true(query_value("/tmp/valid-copy/catalog.db", "select last_used_at from entries where full_id = 'urn:peerworks.org:entry#890806'") > 0);
+  free_item_cache(deferred_item_cache);
+} END_TEST
+
 /* Test loading the item cache */
 START_TEST (test_load_loads_the_right_number_of_items) {
   int rc = item_cache_load(item_cache);
@@ -177,6 +254,137 @@ START_TEST (test_load_respects_min_tokens) {
   free_item_cache(min_token_item_cache);
 } END_TEST
 
+START_TEST (test_load_with_prefetch_loads_the_right_number_of_items) {
+  ItemCache *prefetching_item_cache;
+  item_cache_options.prefetch = true;
+  item_cache_create(&prefetching_item_cache, "/tmp/valid-copy", &item_cache_options);
+  int rc = item_cache_load(prefetching_item_cache);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(10, item_cache_cached_size(prefetching_item_cache));
+  free_item_cache(prefetching_item_cache);
+} END_TEST
+
+START_TEST (test_load_with_multiple_threads_loads_the_right_number_of_items) {
+  ItemCache *threaded_item_cache;
+  item_cache_options.load_threads = 3;
+  item_cache_create(&threaded_item_cache, "/tmp/valid-copy", &item_cache_options);
+  int rc = item_cache_load(threaded_item_cache);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(10, item_cache_cached_size(threaded_item_cache));
+  free_item_cache(threaded_item_cache);
+} END_TEST
+
+START_TEST (test_load_with_multiple_threads_respects_min_tokens) {
+  ItemCache *threaded_item_cache;
+  item_cache_options.load_threads = 4;
+  item_cache_options.min_tokens = 80;
+  item_cache_create(&threaded_item_cache, "/tmp/valid-copy", &item_cache_options);
+  int rc = item_cache_load(threaded_item_cache);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(6, item_cache_cached_size(threaded_item_cache));
+  free_item_cache(threaded_item_cache);
+} END_TEST
+
+START_TEST (test_loaded_item_has_the_same_tokens_as_the_fetched_item) {
+  int token_id = 0, loaded_token_id = 0;
+  short frequency = 0, loaded_frequency = 0;
+  Item *fetched = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(fetched);
+  assert_equal(true, free_when_done);
+
+  item_cache_load(item_cache);
+  Item *loaded = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(loaded);
+  assert_equal(false, free_when_done);
+
+  assert_equal(item_get_num_tokens(fetched), item_get_num_tokens(loaded));
+  assert_equal(item_get_total_tokens(fetched), item_get_total_tokens(loaded));
+  assert_equal(item_get_time(fetched), item_get_time(loaded));
+
+  while (item_next_token(fetched, &token_id, &frequency)) {
+    fail_unless(item_next_token(loaded, &loaded_token_id, &loaded_frequency), "loaded item ran out of tokens");
+    assert_equal(token_id, loaded_token_id);
+    assert_equal(frequency, loaded_frequency);
+    assert_equal(frequency, item_get_token_frequency(loaded, token_id));
+  }
+
+  assert_equal(false, item_next_token(loaded, &loaded_token_id, &loaded_frequency));
+  free_item(fetched);
+} END_TEST
+
+START_TEST (test_next_token_from_visits_the_same_tokens_as_next_token) {
+  Item *fetched = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  item_cache_load(item_cache);
+  Item *loaded = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  Item *items[] = {fetched, loaded};
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    int token_id = 0, cursor_token_id = 0, position = 0, count = 0;
+    short frequency = 0, cursor_frequency = 0;
+
+    while (item_next_token(items[i], &token_id, &frequency)) {
+      fail_unless(item_next_token_from(items[i], &position, &cursor_token_id, &cursor_frequency), "cursor ran out of tokens");
+      assert_equal(token_id, cursor_token_id);
+      assert_equal(frequency, cursor_frequency);
+      count++;
+    }
+
+    assert_equal(false, item_next_token_from(items[i], &position, &cursor_token_id, &cursor_frequency));
+    assert_true(count > 0);
+  }
+
+  free_item(fetched);
+} END_TEST
+
+START_TEST (test_migrating_tokens_rewrites_every_blob_in_the_compact_format) {
+  int migrated = item_cache_migrate_tokens(item_cache);
+  assert_true(migrated > 0);
+  assert_equal(0, item_cache_migrate_tokens(item_cache));
+
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "select count(*) from entry_tokens where hex(substr(tokens, 1, 1)) <> '81'", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal(0, sqlite3_column_int(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
+START_TEST (test_migrated_item_has_the_same_tokens_as_before_migration) {
+  int token_id = 0, migrated_token_id = 0;
+  short frequency = 0, migrated_frequency = 0;
+  Item *before = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(before);
+
+  item_cache_migrate_tokens(item_cache);
+  Item *after = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(after);
+  assert_equal(item_get_num_tokens(before), item_get_num_tokens(after));
+  assert_equal(item_get_total_tokens(before), item_get_total_tokens(after));
+
+  while (item_next_token(before, &token_id, &frequency)) {
+    fail_unless(item_next_token(after, &migrated_token_id, &migrated_frequency), "migrated item ran out of tokens");
+    assert_equal(token_id, migrated_token_id);
+    assert_equal(frequency, migrated_frequency);
+  }
+
+  item_cache_load(item_cache);
+  assert_equal(10, item_cache_cached_size(item_cache));
+  free_item(before);
+  free_item(after);
+} END_TEST
+
+START_TEST (test_loaded_item_frequency_of_missing_token_is_zero) {
+  item_cache_load(item_cache);
+  Item *loaded = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(loaded);
+  assert_equal(3, item_get_token_frequency(loaded, 9949));
+  assert_equal(0, item_get_token_frequency(loaded, 99999999));
+  assert_equal(0, item_get_token_frequency(loaded, 0));
+} END_TEST
+
 /* Test iteration */
 void setup_iteration(void) {
   setup_fixture_path();
@@ -249,6 +457,51 @@ START_TEST (test_iteration_happens_in_reverse_updated_order) {
   assert_equal_s("urn:peerworks.org:entry#886294", ids[9]);
 } END_TEST
 
+START_TEST (test_iteration_after_threaded_load_happens_in_reverse_updated_order) {
+  ItemCache *threaded_item_cache;
+  item_cache_options.load_threads = 3;
+  item_cache_create(&threaded_item_cache, "/tmp/valid-copy", &item_cache_options);
+  item_cache_load(threaded_item_cache);
+
+  i = 0;
+  unsigned char *ids[10];
+  item_cache_each_item(threaded_item_cache, stores_ids, ids);
+  assert_equal(10, i);
+  assert_equal_s("urn:peerworks.org:entry#709254", ids[0]);
+  assert_equal_s("urn:peerworks.org:entry#880389", ids[1]);
+  assert_equal_s("urn:peerworks.org:entry#888769", ids[2]);
+  assert_equal_s("urn:peerworks.org:entry#886643", ids[3]);
+  assert_equal_s("urn:peerworks.org:entry#890806", ids[4]);
+  assert_equal_s("urn:peerworks.org:entry#802739", ids[5]);
+  assert_equal_s("urn:peerworks.org:entry#884409", ids[6]);
+  assert_equal_s("urn:peerworks.org:entry#753459", ids[7]);
+  assert_equal_s("urn:peerworks.org:entry#878944", ids[8]);
+  assert_equal_s("urn:peerworks.org:entry#886294", ids[9]);
+  free_item_cache(threaded_item_cache);
+} END_TEST
+
+START_TEST (test_each_item_since_only_iterates_items_on_or_after_the_time) {
+  i = 0;
+  unsigned char *ids[10];
+  Item *fourth = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#886643", &free_when_done);
+  item_cache_each_item_since(item_cache, item_get_time(fourth), stores_ids, ids);
+  assert_equal(4, i);
+  assert_equal_s("urn:peerworks.org:entry#709254", ids[0]);
+  assert_equal_s("urn:peerworks.org:entry#886643", ids[3]);
+} END_TEST
+
+START_TEST (test_each_item_since_the_beginning_iterates_over_all_items) {
+  int iteration_count = 0;
+  item_cache_each_item_since(item_cache, 0, iterates_over_all_items, &iteration_count);
+  assert_equal(10, iteration_count);
+} END_TEST
+
+START_TEST (test_each_item_since_the_future_iterates_over_no_items) {
+  int iteration_count = 0;
+  item_cache_each_item_since(item_cache, time(NULL) + 3600, iterates_over_all_items, &iteration_count);
+  assert_equal(0, iteration_count);
+} END_TEST
+
 /* Test RandomBackground */
 START_TEST (test_random_background_is_empty_pool_before_load) {
   assert_not_null(item_cache_random_background(item_cache));
@@ -542,6 +795,60 @@ START_TEST (test_add_item_puts_it_in_the_right_position_at_end) {
   assert_equal(11, position);
 } END_TEST
 
+static time_t previous_time;
+
+static int checks_descending_time(const Item *iter_item, void *memo) {
+  int *count = (int*) memo;
+  assert_true(previous_time >= item_get_time(iter_item));
+  previous_time = item_get_time(iter_item);
+  (*count)++;
+  return CLASSIFIER_OK;
+}
+
+START_TEST (test_adding_many_items_keeps_them_in_reverse_updated_order) {
+  int n, count = 0;
+  unsigned char id[64];
+
+  for (n = 0; n < 5000; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#many%i", n);
+    /* Scatter the times so items land in the middle of full chunks as well as at the ends */
+    time_t item_time = 1177975519L + ((n * 7919L) % 5000) * 60;
+    assert_equal(CLASSIFIER_OK, item_cache_add_item(item_cache, create_item_with_tokens_and_time(id, tokens, 4, item_time)));
+  }
+
+  previous_time = time(NULL);
+  item_cache_each_item(item_cache, checks_descending_time, &count);
+  assert_equal(5010, count);
+  free_item(item);
+} END_TEST
+
+START_TEST (test_adding_many_items_makes_each_of_them_fetchable) {
+  int n;
+  unsigned char id[64];
+  Item *added[3000];
+
+  for (n = 0; n < 3000; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#many%i", n);
+    added[n] = create_item_with_tokens_and_time(id, tokens, 4, 1177975519L + n * 60);
+    assert_equal(CLASSIFIER_OK, item_cache_add_item(item_cache, added[n]));
+  }
+
+  for (n = 0; n < 3000; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#many%i", n);
+    assert_equal(added[n], item_cache_fetch_item(item_cache, id, &free_when_done));
+  }
+
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#many3000", &free_when_done));
+  free_item(item);
+} END_TEST
+
+static void execute_sql(const char * db_file, const char * sql) {
+  sqlite3 *db;
+  sqlite3_open(db_file, &db);
+  sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_close(db);
+}
+
 static int get_entry_id(char *db_file, char *full_id) {
   int id = -1;
 
@@ -559,6 +866,31 @@ static int get_entry_id(char *db_file, char *full_id) {
   return id;
 }
 
+static int adds_an_item_for_each_item(const Item *iter_item, void *memo) {
+  int *count = (int*) memo;
+  unsigned char id[64];
+
+  snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#during%i", *count);
+  assert_equal(CLASSIFIER_OK, item_cache_add_item(item_cache, create_item_with_tokens_and_time(id, tokens, 4, time(NULL))));
+  (*count)++;
+
+  return CLASSIFIER_OK;
+}
+
+START_TEST (test_adding_items_during_iteration_doesnt_change_the_iteration) {
+  int count = 0;
+
+  item_cache_each_item(item_cache, adds_an_item_for_each_item, &count);
+  assert_equal(10, count);
+  assert_equal(20, item_cache_cached_size(item_cache));
+
+  count = 0;
+  previous_time = time(NULL);
+  item_cache_each_item(item_cache, checks_descending_time, &count);
+  assert_equal(20, count);
+  free_item(item);
+} END_TEST
+
 START_TEST (test_save_item_stores_it_in_the_database) {
   // Need a corresponding entry
   ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
@@ -577,7 +909,9 @@ START_TEST (test_save_item_stores_it_in_the_database) {
   assert_equal(SQLITE_ROW, rc);
   char* tokens = (char*) sqlite3_column_blob(stmt, 0);
   assert_not_null(tokens);
-  assert_equal(8 * 6 /* num tokens * TOKEN_BYTES */, sqlite3_column_bytes(stmt, 0));
+  /* Compact format tag, then fewer bytes than the fixed 6 bytes per token */
+  assert_equal(0x81, (unsigned char) tokens[0]);
+  assert_true(sqlite3_column_bytes(stmt, 0) < 8 * 6);
   sqlite3_finalize(stmt);
   sqlite3_close(db);
 } END_TEST
@@ -608,6 +942,167 @@ START_TEST (test_save_item_without_an_entry_wont_store_it_in_the_database) {
   assert_equal(CLASSIFIER_FAIL, rc);
 } END_TEST
 
+START_TEST (test_adding_an_entry_twice_after_load_does_not_add_a_duplicate) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(1, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries where full_id = 'urn:peerworks.org:entry#1'"));
+} END_TEST
+
+START_TEST (test_adding_an_entry_added_to_the_catalog_since_load_does_not_add_a_duplicate) {
+  sqlite3 *db;
+  sqlite3_open("/tmp/valid-copy/catalog.db", &db);
+  sqlite3_exec(db, "insert into entries (full_id, updated) values ('urn:peerworks.org:entry#1', 2453583.0)", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(1, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries where full_id = 'urn:peerworks.org:entry#1'"));
+  assert_equal(get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1"), item_cache_entry_id(entry));
+} END_TEST
+
+START_TEST (test_item_added_to_the_catalog_since_load_is_fetchable) {
+  execute_sql("/tmp/valid-copy/catalog.db",
+              "insert into entries (id, full_id, updated) values (2000000, 'urn:peerworks.org:entry#2000000', julianday('now'))");
+  execute_sql("/tmp/valid-copy/tokens.db", "insert into entry_tokens select 2000000, tokens from entry_tokens where id = 890806");
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#2000000", &free_when_done);
+  assert_not_null(item);
+  assert_equal(76, item_get_num_tokens(item));
+  free_item(item);
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#2000001", &free_when_done));
+} END_TEST
+
+/* Atom XML compression */
+
+START_TEST (test_compressed_atom_is_stored_compressed) {
+  ItemCache *compressing_item_cache;
+  ItemCacheOptions options = item_cache_options;
+  options.compress_atoms = 1;
+  free_item_cache(item_cache);
+  item_cache_create(&compressing_item_cache, "/tmp/valid-copy", &options);
+  item_cache = compressing_item_cache;
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  int id = get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1");
+
+  assert_true(query_int("/tmp/valid-copy/atom.db", "select length(atom) from entry_atom where id = %i", id) < strlen(entry_document));
+  assert_equal(1, query_int("/tmp/valid-copy/atom.db", "select substr(atom, 1, 1) = x'00' from entry_atom where id = %i", id));
+} END_TEST
+
+START_TEST (test_fetch_entry_atom_decompresses_a_compressed_atom) {
+  ItemCache *compressing_item_cache;
+  ItemCacheOptions options = item_cache_options;
+  options.compress_atoms = 1;
+  free_item_cache(item_cache);
+  item_cache_create(&compressing_item_cache, "/tmp/valid-copy", &options);
+  item_cache = compressing_item_cache;
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  int id = get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1");
+
+  char *xml = item_cache_fetch_entry_atom(item_cache, id);
+  assert_not_null(xml);
+  assert_equal_s(entry_document, xml);
+  free(xml);
+} END_TEST
+
+START_TEST (test_fetch_entry_atom_reads_an_uncompressed_atom) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  int id = get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1");
+  assert_equal(strlen(entry_document), query_int("/tmp/valid-copy/atom.db", "select length(atom) from entry_atom where id = %i", id));
+
+  char *xml = item_cache_fetch_entry_atom(item_cache, id);
+  assert_not_null(xml);
+  assert_equal_s(entry_document, xml);
+  free(xml);
+} END_TEST
+
+START_TEST (test_atom_is_stored_under_the_entry_id_when_atom_ids_are_ahead_of_the_catalog) {
+  execute_sql("/tmp/valid-copy/atom.db", "insert into entry_atom (id, atom) values (999999, 'other')");
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  int id = get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1");
+
+  assert_equal(strlen(entry_document), query_int("/tmp/valid-copy/atom.db", "select length(atom) from entry_atom where id = %i", id));
+  assert_equal(5, query_int("/tmp/valid-copy/atom.db", "select length(atom) from entry_atom where id = 999999"));
+  assert_equal(-1, query_int("/tmp/valid-copy/atom.db", "select length(atom) from entry_atom where id = 1000000"));
+} END_TEST
+
+START_TEST (test_recompressing_atoms_compresses_existing_atoms) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  int id = get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1");
+
+  assert_true(item_cache_recompress_atoms(item_cache) > 0);
+  assert_equal(0, item_cache_recompress_atoms(item_cache));
+  assert_true(query_int("/tmp/valid-copy/atom.db", "select length(atom) from entry_atom where id = %i", id) < strlen(entry_document));
+  assert_equal(1, query_int("/tmp/valid-copy/atom.db", "select substr(atom, 1, 1) = x'00' from entry_atom where id = %i", id));
+
+  char *xml = item_cache_fetch_entry_atom(item_cache, id);
+  assert_not_null(xml);
+  assert_equal_s(entry_document, xml);
+  free(xml);
+} END_TEST
+
+/* Skipping unchanged entries */
+
+static void reset_updated(const char * full_id) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open("/tmp/valid-copy/catalog.db", &db);
+  sqlite3_prepare_v2(db, "update entries set updated = 0 where full_id = ?", -1, &stmt, NULL);
+  sqlite3_bind_text(stmt, 1, full_id, -1, NULL);
+  assert_equal(SQLITE_DONE, sqlite3_step(stmt));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+}
+
+START_TEST (test_adding_an_entry_stores_its_content_hash) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "select content_hash from entries where full_id = 'urn:peerworks.org:entry#1'", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal(SQLITE_INTEGER, sqlite3_column_type(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
+START_TEST (test_adding_an_unchanged_entry_again_doesnt_write_it) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  reset_updated("urn:peerworks.org:entry#1");
+
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal_f(0.0, query_value("/tmp/valid-copy/catalog.db", "select updated from entries where full_id = 'urn:peerworks.org:entry#1'"));
+  assert_equal(get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1"), item_cache_entry_id(entry));
+} END_TEST
+
+START_TEST (test_adding_a_changed_entry_again_writes_it) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  reset_updated("urn:peerworks.org:entry#1");
+
+  char *changed_document = strdup(entry_document);
+  strstr(changed_document, "Entry 1")[6] = '2';
+  ItemCacheEntry *changed = create_entry_from_atom_xml(changed_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, changed));
+  assert_true(query_value("/tmp/valid-copy/catalog.db", "select updated from entries where full_id = 'urn:peerworks.org:entry#1'") > 0);
+
+  char *xml = item_cache_fetch_entry_atom(item_cache, item_cache_entry_id(changed));
+  assert_equal_s(changed_document, xml);
+  free(xml);
+  free(changed_document);
+} END_TEST
+
 /* Cache updating tests */
 static int item_id = 9;
 static char * entry_document2;
@@ -652,6 +1147,21 @@ START_TEST (test_adding_entry_causes_tokens_to_be_added_to_the_db) {
   sqlite3_close(db);
 } END_TEST
 
+START_TEST (test_adding_a_cached_entry_deleted_from_the_catalog_adds_it_again) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  item_cache_add_entry(item_cache, entry);
+  sleep(1);
+
+  sqlite3 *db;
+  sqlite3_open("/tmp/valid-copy/catalog.db", &db);
+  sqlite3_exec(db, "delete from entries where full_id = 'urn:peerworks.org:entry#1'", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(1, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries where full_id = 'urn:peerworks.org:entry#1'"));
+} END_TEST
+
 START_TEST (test_adding_multiple_entries_causes_item_added_to_cache) {
   ItemCacheEntry *entry1 = create_entry_from_atom_xml(entry_document);
   ItemCacheEntry *entry2 = create_entry_from_atom_xml(entry_document2); // TODO create another document
@@ -684,6 +1194,90 @@ START_TEST (test_update_callback) {
 
 
 /* Cache pruning */
+/* Tokenizer pool tests */
+static void setup_tokenizer_pool(void) {
+  ItemCacheOptions options = item_cache_options;
+  options.tokenizer_threads = 2;
+  options.tokenizer_queue_size = 4;
+
+  setup_fixture_path();
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &options);
+  item_cache_load(item_cache);
+  item_cache_start_cache_updater(item_cache);
+
+  entry_document = read_document("fixtures/entry.atom");
+  entry_document2 = read_document("fixtures/entry2.atom");
+}
+
+START_TEST (test_adding_entry_with_tokenizer_threads_causes_item_added_to_cache) {
+  int i;
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+
+  for (i = 0; i < 30 && item_cache_cached_size(item_cache) < 11; i++) {
+    usleep(100000);
+  }
+
+  assert_equal(11, item_cache_cached_size(item_cache));
+  assert_equal(0, item_cache_tokenizer_queue_size(item_cache));
+} END_TEST
+
+START_TEST (test_freeing_with_tokenizer_threads_saves_the_tokens_of_queued_entries) {
+  ItemCacheEntry *entry1 = create_entry_from_atom_xml(entry_document);
+  ItemCacheEntry *entry2 = create_entry_from_atom_xml(entry_document2);
+  item_cache_add_entry(item_cache, entry1);
+  item_cache_add_entry(item_cache, entry2);
+  free_item_cache(item_cache);
+  item_cache = NULL;
+
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_exec(db, "attach '/tmp/valid-copy/catalog.db' as catalog", NULL, NULL, NULL);
+  sqlite3_prepare_v2(db, "select count(*) from entry_tokens where id in "
+                         "(select id from catalog.entries where full_id in "
+                         "('urn:peerworks.org:entry#1', 'urn:peerworks.org:entry#2'))", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal(2, sqlite3_column_int(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
+START_TEST (test_starting_tokenizer_threads_tokenizes_entries_missing_their_tokens) {
+  ItemCacheOptions options = item_cache_options;
+  options.tokenizer_threads = 2;
+  options.tokenizer_queue_size = 4;
+
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  free_entry(entry);
+  free_item_cache(item_cache);
+
+  /* As if the cache crashed before the tokenizer saved its tokens */
+  int entry_id = get_entry_id("/tmp/valid-copy/catalog.db", "urn:peerworks.org:entry#1");
+  char sql[128];
+  snprintf(sql, sizeof(sql), "delete from entry_tokens where id = %i", entry_id);
+  execute_sql("/tmp/valid-copy/tokens.db", sql);
+  execute_sql("/tmp/valid-copy/catalog.db", "update entries set num_tokens = null where full_id = 'urn:peerworks.org:entry#1'");
+
+  item_cache_create(&item_cache, "/tmp/valid-copy", &options);
+  free_item_cache(item_cache);
+  item_cache = NULL;
+
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "select count(*) from entry_tokens where id = ?", -1, &stmt, NULL);
+  sqlite3_bind_int(stmt, 1, entry_id);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal(1, sqlite3_column_int(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
 time_t purge_time;
 
 static void setup_purging(void) {
@@ -784,6 +1378,66 @@ START_TEST (test_purging_half_cache_with_multiple_items_from_thread) {
   assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#24", &free_when_done));
 } END_TEST
 
+START_TEST (test_purging_many_items_only_removes_the_old_ones) {
+  int n;
+  unsigned char id[64];
+
+  for (n = 0; n < 3000; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#many%i", n);
+    time_t item_time = (n % 2) ? purge_time + 1 + n : purge_time - 1 - n;
+    item_cache_add_item(item_cache, create_item_with_tokens_and_time(id, tokens, 4, item_time));
+  }
+
+  assert_equal(3000, item_cache_cached_size(item_cache));
+  item_cache_purge_old_items(item_cache);
+  assert_equal(1500, item_cache_cached_size(item_cache));
+  assert_not_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#many2999", &free_when_done));
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#many2998", &free_when_done));
+} END_TEST
+
+START_TEST (test_purging_unindexes_every_old_item) {
+  int n;
+  unsigned char id[64];
+  int day = 24 * 60 * 60;
+
+  /* Spread over several days so whole segments and the spanning segment are both purged */
+  for (n = 0; n < 3000; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#unindexed%i", n);
+    item_cache_add_item(item_cache, create_item_with_tokens_and_time(id, tokens, 4, purge_time - 2 * day + n * 100));
+  }
+
+  item_cache_purge_old_items(item_cache);
+
+  for (n = 0; n < 3000; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#unindexed%i", n);
+    if (purge_time - 2 * day + n * 100 < purge_time) {
+      assert_null(item_cache_fetch_item(item_cache, id, &free_when_done));
+    } else {
+      assert_not_null(item_cache_fetch_item(item_cache, id, &free_when_done));
+    }
+  }
+} END_TEST
+
+START_TEST (test_purging_removes_whole_days_of_old_items) {
+  int n;
+  unsigned char id[64];
+  int day = 24 * 60 * 60;
+
+  /* One item every 6 hours from 10 days before the purge time to 10 days after it */
+  for (n = 0; n < 80; n++) {
+    snprintf((char*) id, sizeof(id), "urn:peerworks.org:entry#day%i", n);
+    item_cache_add_item(item_cache, create_item_with_tokens_and_time(id, tokens, 4, purge_time - 10 * day + n * day / 4 + 1));
+  }
+
+  assert_equal(80, item_cache_cached_size(item_cache));
+  item_cache_purge_old_items(item_cache);
+  assert_equal(40, item_cache_cached_size(item_cache));
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#day0", &free_when_done));
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#day39", &free_when_done));
+  assert_not_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#day40", &free_when_done));
+  assert_not_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#day79", &free_when_done));
+} END_TEST
+
 START_TEST (test_purge_loaded_cache_doesnt_crash) {
   item_cache_start_purger(item_cache, 1);
   item_cache_load(item_cache);
@@ -820,6 +1474,451 @@ START_TEST (test_globalize_a_new_token) {
   assert_equal_s("new", s);
 } END_TEST
 
+START_TEST (test_atomize_doesnt_need_the_tokens_table_once_loaded) {
+  sqlite3 *db;
+  assert_equal(1, item_cache_atomize(item_cache, "one"));
+  sqlite3_open("/tmp/valid-copy/catalog.db", &db);
+  sqlite3_exec(db, "delete from tokens", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  assert_equal(1, item_cache_atomize(item_cache, "one"));
+  assert_equal_s("one", item_cache_globalize(item_cache, 1));
+} END_TEST
+
+START_TEST (test_new_tokens_are_saved_when_the_item_cache_is_freed) {
+  assert_equal(1247, item_cache_atomize(item_cache, "new"));
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+
+  assert_equal_s("new", item_cache_globalize(item_cache, 1247));
+  assert_equal(1248, item_cache_atomize(item_cache, "newer"));
+} END_TEST
+
+START_TEST (test_new_tokens_are_saved_when_an_item_is_saved) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+
+  assert_equal(1247, item_cache_atomize(item_cache, "new"));
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+
+  sqlite3_open_v2("/tmp/valid-copy/catalog.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "select token from tokens where id = 1247", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal_s("new", (char*) sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_new_token_is_saved_with_another_id_when_its_atom_is_taken) {
+  assert_equal(1247, item_cache_atomize(item_cache, "new"));
+  execute_sql("/tmp/valid-copy/catalog.db", "insert into tokens (id, token) values (1247, 'taken')");
+  execute_sql("/tmp/valid-copy/tokens.db", "delete from entry_tokens where id in (890806, 886294)");
+
+  int tokens[][2] = {{1, 2}, {1247, 3}};
+  Item *item = create_item_with_tokens((unsigned char*) "urn:peerworks.org:entry#890806", tokens, 2);
+  assert_equal(CLASSIFIER_OK, item_cache_save_item(item_cache, item));
+
+  int atom = query_int("/tmp/valid-copy/catalog.db", "select id from tokens where token = 'new'");
+  assert_not_equal(-1, atom);
+  assert_not_equal(1247, atom);
+  assert_equal(3, item_get_token_frequency(item, atom));
+  assert_equal(0, item_get_token_frequency(item, 1247));
+  assert_equal(atom, item_cache_atomize(item_cache, "new"));
+  free_item(item);
+
+  /* Later items are still saved */
+  assert_equal(atom + 1, item_cache_atomize(item_cache, "newer"));
+  int more_tokens[][2] = {{1, 2}, {atom + 1, 1}};
+  item = create_item_with_tokens((unsigned char*) "urn:peerworks.org:entry#886294", more_tokens, 2);
+  assert_equal(CLASSIFIER_OK, item_cache_save_item(item_cache, item));
+  assert_equal(atom + 1, query_int("/tmp/valid-copy/catalog.db", "select id from tokens where token = 'newer'"));
+  free_item(item);
+} END_TEST
+
+START_TEST (test_new_token_uses_the_saved_id_when_its_token_is_already_saved) {
+  assert_equal(1247, item_cache_atomize(item_cache, "new"));
+  execute_sql("/tmp/valid-copy/catalog.db", "insert into tokens (id, token) values (5000, 'new')");
+  execute_sql("/tmp/valid-copy/tokens.db", "delete from entry_tokens where id = 890806");
+
+  int tokens[][2] = {{1, 2}, {1247, 3}};
+  Item *item = create_item_with_tokens((unsigned char*) "urn:peerworks.org:entry#890806", tokens, 2);
+  assert_equal(CLASSIFIER_OK, item_cache_save_item(item_cache, item));
+
+  assert_equal(5000, query_int("/tmp/valid-copy/catalog.db", "select id from tokens where token = 'new'"));
+  assert_equal(3, item_get_token_frequency(item, 5000));
+  assert_equal(5000, item_cache_atomize(item_cache, "new"));
+  free_item(item);
+} END_TEST
+
+/* Write batching */
+static ItemCacheOptions batched_options = {1, 3650, 2, 1, NULL, 10, 60000, 1, "wal", "normal", 500};
+
+static void setup_write_batching(void) {
+  setup_fixture_path();
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &batched_options);
+  entry_document = read_document("fixtures/entry.atom");
+}
+
+static void teardown_write_batching(void) {
+  teardown_fixture_path();
+  if (item_cache) {
+    free_item_cache(item_cache);
+  }
+  free(entry_document);
+}
+
+START_TEST (test_async_write_isnt_visible_until_the_batch_is_committed) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(10, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+
+  free_item_cache(item_cache);
+  item_cache = NULL;
+  assert_equal(11, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_async_write_is_fetchable_from_the_item_cache_before_it_is_committed) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_not_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done));
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_async_write_is_queued_for_the_cache_once_the_batch_is_committed) {
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(0, item_cache_update_queue_size(item_cache));
+
+  /* Removing an entry commits the open batch first */
+  assert_equal(CLASSIFIER_OK, item_cache_remove_entry(item_cache, 753459));
+  assert_equal(1, item_cache_update_queue_size(item_cache));
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_waiting_write_is_committed_when_add_entry_returns) {
+  ItemCacheOptions options = batched_options;
+  options.write_batch_wait = 50;
+  options.async_writes = 0;
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &options);
+
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  assert_equal(11, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+  free_entry(entry);
+} END_TEST
+
+START_TEST (test_journal_mode_is_set) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, "pragma journal_mode", -1, &stmt, NULL);
+  assert_equal(SQLITE_ROW, sqlite3_step(stmt));
+  assert_equal_s("wal", (char*) sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+} END_TEST
+
+START_TEST (test_invalid_pragma_value_fails_create) {
+  ItemCache *bad_item_cache;
+  ItemCacheOptions options = batched_options;
+  options.synchronous = "normal; drop table entries";
+  assert_equal(CLASSIFIER_FAIL, item_cache_create(&bad_item_cache, "/tmp/valid-copy", &options));
+  free_item_cache(bad_item_cache);
+} END_TEST
+
+/* Garbage collection */
+static void setup_garbage_collection(void) {
+  setup_fixture_path();
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  execute_sql("/tmp/valid-copy/catalog.db", "insert into tokens values (20000, 'unused')");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &item_cache_options);
+}
+
+static void teardown_garbage_collection(void) {
+  teardown_fixture_path();
+  free_item_cache(item_cache);
+}
+
+static void recreate_with_gc_expire_days(int days, int load_items_since) {
+  ItemCacheOptions options = item_cache_options;
+  options.gc_expire_days = days;
+  options.load_items_since = load_items_since;
+  free_item_cache(item_cache);
+  item_cache_create(&item_cache, "/tmp/valid-copy", &options);
+}
+
+START_TEST (test_collecting_garbage_deletes_unused_tokens) {
+  assert_equal(1, item_cache_collect_garbage(item_cache));
+  assert_equal(0, query_int("/tmp/valid-copy/catalog.db", "select count(*) from tokens where id = 20000"));
+} END_TEST
+
+START_TEST (test_collecting_garbage_keeps_used_tokens) {
+  item_cache_collect_garbage(item_cache);
+  assert_equal(3, query_int("/tmp/valid-copy/catalog.db", "select count(*) from tokens"));
+} END_TEST
+
+START_TEST (test_collecting_garbage_without_expire_days_keeps_entries) {
+  item_cache_collect_garbage(item_cache);
+  assert_equal(10, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+} END_TEST
+
+START_TEST (test_collecting_garbage_deletes_expired_entries_except_the_random_background) {
+  recreate_with_gc_expire_days(100, 30);
+  assert_equal(8, item_cache_collect_garbage(item_cache));
+  assert_equal(3, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+  assert_equal(0, query_int("/tmp/valid-copy/catalog.db",
+                            "select count(*) from entries where id not in (select entry_id from random_backgrounds)"));
+} END_TEST
+
+START_TEST (test_collecting_garbage_deletes_the_atom_and_tokens_of_expired_entries) {
+  recreate_with_gc_expire_days(100, 30);
+  item_cache_collect_garbage(item_cache);
+  assert_equal(3, query_int("/tmp/valid-copy/atom.db", "select count(*) from entry_atom"));
+  assert_equal(3, query_int("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+} END_TEST
+
+START_TEST (test_collecting_garbage_doesnt_expire_entries_within_load_items_since) {
+  recreate_with_gc_expire_days(1, 3650);
+  item_cache_collect_garbage(item_cache);
+  assert_equal(10, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries"));
+} END_TEST
+
+START_TEST (test_saving_an_item_with_a_collected_token_restores_it) {
+  int collected_tokens[][2] = {{1, 1}, {20000, 3}};
+  item_cache_collect_garbage(item_cache);
+
+  execute_sql("/tmp/valid-copy/catalog.db", "insert into entries (id, full_id, updated) values (1, 'urn:gc', julianday('now'))");
+  Item *collected = create_item_with_tokens_and_time((unsigned char*) "urn:gc", collected_tokens, 2, time(NULL));
+  assert_equal(CLASSIFIER_OK, item_cache_save_item(item_cache, collected));
+  free_item(collected);
+
+  assert_equal(20000, item_cache_atomize(item_cache, "unused"));
+  assert_equal(1, query_int("/tmp/valid-copy/catalog.db", "select count(*) from tokens where id = 20000 and token = 'unused'"));
+} END_TEST
+
+START_TEST (test_a_collected_token_is_given_a_new_atom) {
+  item_cache_collect_garbage(item_cache);
+  int atom = item_cache_atomize(item_cache, "unused");
+  assert_true(atom > 0);
+  assert_not_equal(20000, atom);
+} END_TEST
+
+START_TEST (test_collecting_garbage_again_forgets_the_tokens_collected_by_the_last_pass) {
+  item_cache_collect_garbage(item_cache);
+  char *token = item_cache_globalize(item_cache, 20000);
+  assert_equal_s("unused", token);
+  free(token);
+
+  item_cache_collect_garbage(item_cache);
+  assert_null(item_cache_globalize(item_cache, 20000));
+} END_TEST
+
+/* Token counts */
+static int load_with_min_tokens(int min_tokens, int load_threads) {
+  ItemCache *counted_item_cache;
+  ItemCacheOptions options = item_cache_options;
+  options.min_tokens = min_tokens;
+  options.load_threads = load_threads;
+  item_cache_create(&counted_item_cache, "/tmp/valid-copy", &options);
+  item_cache_load(counted_item_cache);
+  int size = item_cache_cached_size(counted_item_cache);
+  free_item_cache(counted_item_cache);
+  return size;
+}
+
+START_TEST (test_counting_tokens_records_the_token_count_of_every_entry) {
+  assert_equal(10, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries where num_tokens is null"));
+  assert_equal(10, item_cache_count_tokens(item_cache));
+  assert_equal(0, query_int("/tmp/valid-copy/catalog.db", "select count(*) from entries where num_tokens is null"));
+  assert_equal(0, item_cache_count_tokens(item_cache));
+} END_TEST
+
+START_TEST (test_counted_tokens_match_the_tokens_of_the_item) {
+  item_cache_count_tokens(item_cache);
+  Item *fetched = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(fetched);
+  assert_equal(item_get_num_tokens(fetched),
+               query_int("/tmp/valid-copy/catalog.db", "select num_tokens from entries where full_id = 'urn:peerworks.org:entry#890806'"));
+} END_TEST
+
+START_TEST (test_load_respects_min_tokens_after_counting_tokens) {
+  item_cache_count_tokens(item_cache);
+  assert_equal(6, load_with_min_tokens(80, 1));
+  assert_equal(6, load_with_min_tokens(80, 4));
+} END_TEST
+
+START_TEST (test_load_skips_entries_with_a_token_count_below_min_tokens) {
+  /* The count says the item is too small even though its tokens say otherwise, so the tokens were never read */
+  execute_sql("/tmp/valid-copy/catalog.db", "update entries set num_tokens = 1 where full_id = 'urn:peerworks.org:entry#890806'");
+  assert_equal(9, load_with_min_tokens(2, 1));
+  assert_equal(9, load_with_min_tokens(2, 3));
+} END_TEST
+
+START_TEST (test_saving_an_item_records_its_token_count) {
+  int counted_tokens[][2] = {{1, 1}, {371, 3}, {1246, 2}};
+  execute_sql("/tmp/valid-copy/catalog.db", "insert into entries (id, full_id, updated) values (1, 'urn:count', julianday('now'))");
+  Item *counted = create_item_with_tokens_and_time((unsigned char*) "urn:count", counted_tokens, 3, time(NULL));
+  assert_equal(CLASSIFIER_OK, item_cache_save_item(item_cache, counted));
+  free_item(counted);
+
+  assert_equal(3, query_int("/tmp/valid-copy/catalog.db", "select num_tokens from entries where full_id = 'urn:count'"));
+} END_TEST
+
+/* Clustering */
+START_TEST (test_clustering_keeps_every_item) {
+  assert_equal(CLASSIFIER_OK, item_cache_cluster_tokens(item_cache));
+  assert_equal(10, query_int("/tmp/valid-copy/tokens.db", "select count(*) from entry_tokens"));
+  assert_equal(10, load_with_min_tokens(2, 1));
+} END_TEST
+
+START_TEST (test_clustering_frees_the_pages_of_deleted_tokens) {
+  execute_sql("/tmp/valid-copy/tokens.db", "delete from entry_tokens where id in (709254, 753459, 802739)");
+  assert_true(query_int("/tmp/valid-copy/tokens.db", "pragma freelist_count") > 0);
+  assert_equal(CLASSIFIER_OK, item_cache_cluster_tokens(item_cache));
+  assert_equal(0, query_int("/tmp/valid-copy/tokens.db", "pragma freelist_count"));
+  assert_equal(7, load_with_min_tokens(2, 1));
+} END_TEST
+
+/* Snapshots */
+static ItemCacheOptions snapshot_options = {1, 3650, 2, 1, "/tmp/valid-copy/item_cache.snapshot"};
+
+static void setup_snapshot(void) {
+  setup_fixture_path();
+  system("rm -Rf /tmp/valid-copy && cp -R fixtures/valid /tmp/valid-copy && chmod -R 755 /tmp/valid-copy");
+  entry_document = read_document("fixtures/entry.atom");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  free_item_cache(item_cache);
+  item_cache = NULL;
+}
+
+static void teardown_snapshot(void) {
+  teardown_fixture_path();
+  free_item_cache(item_cache);
+  free(entry_document);
+}
+
+static void delete_all_tokens(void) {
+  sqlite3 *db;
+  sqlite3_open_v2("/tmp/valid-copy/tokens.db", &db, SQLITE_OPEN_READWRITE, NULL);
+  sqlite3_exec(db, "delete from entry_tokens", NULL, NULL, NULL);
+  sqlite3_close(db);
+}
+
+START_TEST (test_load_writes_a_snapshot) {
+  assert_equal(0, access("/tmp/valid-copy/item_cache.snapshot", R_OK));
+} END_TEST
+
+START_TEST (test_load_from_snapshot_doesnt_need_the_token_database) {
+  delete_all_tokens();
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  int rc = item_cache_load(item_cache);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(10, item_cache_cached_size(item_cache));
+} END_TEST
+
+START_TEST (test_load_from_snapshot_has_the_same_items) {
+  delete_all_tokens();
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(false, free_when_done);
+  assert_equal(1178551672, item_get_time(item));
+  assert_equal(76, item_get_num_tokens(item));
+  assert_equal(3, item_get_token_frequency(item, 9949));
+
+  i = 0;
+  unsigned char *ids[10];
+  item_cache_each_item(item_cache, stores_ids, ids);
+  assert_equal(10, i);
+  assert_equal_s("urn:peerworks.org:entry#709254", ids[0]);
+  assert_equal_s("urn:peerworks.org:entry#890806", ids[4]);
+  assert_equal_s("urn:peerworks.org:entry#886294", ids[9]);
+} END_TEST
+
+START_TEST (test_load_from_snapshot_has_the_same_random_background) {
+  delete_all_tokens();
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  const Pool *bg = item_cache_random_background(item_cache);
+  assert_equal(750, pool_num_tokens(bg));
+  assert_equal(2, pool_token_frequency(bg, 2515));
+} END_TEST
+
+START_TEST (test_load_from_snapshot_loads_new_items_from_the_database) {
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  ItemCacheEntry *entry = create_entry_from_atom_xml(entry_document);
+  assert_equal(CLASSIFIER_OK, item_cache_add_entry(item_cache, entry));
+  free_entry(entry);
+  free_item_cache(item_cache);
+
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  assert_equal(11, item_cache_cached_size(item_cache));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#1", &free_when_done);
+  assert_not_null(item);
+  assert_equal(false, free_when_done);
+} END_TEST
+
+START_TEST (test_load_from_snapshot_reloads_entries_updated_since_the_snapshot) {
+  execute_sql("/tmp/valid-copy/catalog.db", "update entries set updated = datetime(1178551700, 'unixepoch') where id = 890806");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  assert_equal(10, item_cache_cached_size(item_cache));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_not_null(item);
+  assert_equal(1178551700, item_get_time(item));
+  assert_equal(76, item_get_num_tokens(item));
+} END_TEST
+
+START_TEST (test_load_from_snapshot_reloads_only_the_updated_entries_in_their_key_range) {
+  execute_sql("/tmp/valid-copy/catalog.db", "update entries set updated = datetime(1178551700, 'unixepoch') where id in (753459, 888769)");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  assert_equal(10, item_cache_cached_size(item_cache));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#753459", &free_when_done);
+  assert_not_null(item);
+  assert_equal(1178551700, item_get_time(item));
+  item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#888769", &free_when_done);
+  assert_not_null(item);
+  assert_equal(1178551700, item_get_time(item));
+  item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#880389", &free_when_done);
+  assert_not_null(item);
+  assert_equal(1178722683, item_get_time(item));
+} END_TEST
+
+START_TEST (test_load_from_snapshot_drops_entries_deleted_since_the_snapshot) {
+  execute_sql("/tmp/valid-copy/catalog.db", "delete from entries where id = 886294");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  assert_equal(9, item_cache_cached_size(item_cache));
+  assert_null(item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#886294", &free_when_done));
+} END_TEST
+
+START_TEST (test_corrupt_snapshot_is_ignored) {
+  system("dd if=/dev/zero of=/tmp/valid-copy/item_cache.snapshot bs=8 seek=20 count=1 conv=notrunc 2> /dev/null");
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  int rc = item_cache_load(item_cache);
+  assert_equal(CLASSIFIER_OK, rc);
+  assert_equal(10, item_cache_cached_size(item_cache));
+  Item *item = item_cache_fetch_item(item_cache, (unsigned char*) "urn:peerworks.org:entry#890806", &free_when_done);
+  assert_equal(76, item_get_num_tokens(item));
+} END_TEST
+
+START_TEST (test_snapshot_created_with_different_options_is_ignored) {
+  snapshot_options.min_tokens = 80;
+  item_cache_create(&item_cache, "/tmp/valid-copy", &snapshot_options);
+  item_cache_load(item_cache);
+  assert_equal(6, item_cache_cached_size(item_cache));
+} END_TEST
+
 
 Suite *
 item_cache_suite(void) {
@@ -839,21 +1938,37 @@ item_cache_suite(void) {
    tcase_add_test(fetch_item_case, test_fetch_item_contains_the_right_frequency_for_a_given_token);
    tcase_add_test(fetch_item_case, test_fetch_item_after_load);
    tcase_add_test(fetch_item_case, test_fetch_item_after_load_contains_tokens);
+   tcase_add_test(fetch_item_case, test_fetch_item_after_load_returns_null_when_item_doesnt_exist);
    tcase_add_test(fetch_item_case, test_free_when_done_is_true_when_the_item_is_not_in_the_memory_cache);
    tcase_add_test(fetch_item_case, test_free_when_done_is_false_when_the_item_is_in_the_memory_cache);
    tcase_add_test(fetch_item_case, test_fetch_item_should_update_the_last_used_tstamp);
+   tcase_add_test(fetch_item_case, test_fetch_item_from_multiple_threads);
+   tcase_add_test(fetch_item_case, test_deferred_touch_is_written_when_the_item_cache_is_freed);
+   tcase_add_test(fetch_item_case, test_deferred_touch_is_written_after_the_flush_interval);
    
    TCase *load = tcase_create("load");
    tcase_add_checked_fixture(load, setup_cache, teardown_item_cache);
    tcase_add_test(load, test_load_loads_the_right_number_of_items);
    tcase_add_test(load, test_load_sets_cache_loaded_to_true);
    tcase_add_test(load, test_load_respects_min_tokens);
+   tcase_add_test(load, test_load_with_prefetch_loads_the_right_number_of_items);
+   tcase_add_test(load, test_load_with_multiple_threads_loads_the_right_number_of_items);
+   tcase_add_test(load, test_load_with_multiple_threads_respects_min_tokens);
+   tcase_add_test(load, test_loaded_item_has_the_same_tokens_as_the_fetched_item);
+   tcase_add_test(load, test_next_token_from_visits_the_same_tokens_as_next_token);
+   tcase_add_test(load, test_loaded_item_frequency_of_missing_token_is_zero);
+   tcase_add_test(load, test_migrating_tokens_rewrites_every_blob_in_the_compact_format);
+   tcase_add_test(load, test_migrated_item_has_the_same_tokens_as_before_migration);
    
    TCase *iteration = tcase_create("iteration");
    tcase_add_checked_fixture(iteration, setup_iteration, teardown_iteration);
    tcase_add_test(iteration, test_iterates_over_all_items);
    tcase_add_test(iteration, test_iteration_stops_when_iterator_returns_CLASSIFIER_FAIL);
    tcase_add_test(iteration, test_iteration_happens_in_reverse_updated_order);
+   tcase_add_test(iteration, test_iteration_after_threaded_load_happens_in_reverse_updated_order);
+   tcase_add_test(iteration, test_each_item_since_only_iterates_items_on_or_after_the_time);
+   tcase_add_test(iteration, test_each_item_since_the_beginning_iterates_over_all_items);
+   tcase_add_test(iteration, test_each_item_since_the_future_iterates_over_no_items);
    
    TCase *rndbg = tcase_create("random background");
    tcase_add_checked_fixture(rndbg, setup_cache, teardown_item_cache);
@@ -874,6 +1989,14 @@ item_cache_suite(void) {
    tcase_add_test(modification, test_destroying_an_entry_removes_it_from_the_database_file);
    tcase_add_test(modification, test_cant_delete_an_item_that_is_used_in_the_random_background);
    tcase_add_test(modification, test_failed_deletion_doesnt_delete_tokens);
+   tcase_add_test(modification, test_compressed_atom_is_stored_compressed);
+   tcase_add_test(modification, test_fetch_entry_atom_decompresses_a_compressed_atom);
+   tcase_add_test(modification, test_fetch_entry_atom_reads_an_uncompressed_atom);
+   tcase_add_test(modification, test_atom_is_stored_under_the_entry_id_when_atom_ids_are_ahead_of_the_catalog);
+   tcase_add_test(modification, test_recompressing_atoms_compresses_existing_atoms);
+   tcase_add_test(modification, test_adding_an_entry_stores_its_content_hash);
+   tcase_add_test(modification, test_adding_an_unchanged_entry_again_doesnt_write_it);
+   tcase_add_test(modification, test_adding_a_changed_entry_again_writes_it);
    
    TCase *loaded_modification = tcase_create("loaded modification");
    tcase_add_checked_fixture(loaded_modification, setup_loaded_modification, teardown_loaded_modification);
@@ -886,9 +2009,15 @@ item_cache_suite(void) {
    tcase_add_test(loaded_modification, test_add_item_puts_it_in_the_right_position);
    tcase_add_test(loaded_modification, test_add_item_puts_it_in_the_right_position_at_beginning);
    tcase_add_test(loaded_modification, test_add_item_puts_it_in_the_right_position_at_end);
+   tcase_add_test(loaded_modification, test_adding_many_items_keeps_them_in_reverse_updated_order);
+   tcase_add_test(loaded_modification, test_adding_many_items_makes_each_of_them_fetchable);
+   tcase_add_test(loaded_modification, test_adding_items_during_iteration_doesnt_change_the_iteration);
    tcase_add_test(loaded_modification, test_save_item_stores_it_in_the_database);
    tcase_add_test(loaded_modification, test_save_item_without_an_entry_wont_store_it_in_the_database);
    tcase_add_test(loaded_modification, test_save_item_stores_the_correct_tokens);
+   tcase_add_test(loaded_modification, test_adding_an_entry_twice_after_load_does_not_add_a_duplicate);
+   tcase_add_test(loaded_modification, test_adding_an_entry_added_to_the_catalog_since_load_does_not_add_a_duplicate);
+   tcase_add_test(loaded_modification, test_item_added_to_the_catalog_since_load_is_fetchable);
    
    TCase *full_update = tcase_create("full update");
    tcase_add_checked_fixture(full_update, setup_full_update, teardown_full_update);
@@ -897,6 +2026,14 @@ item_cache_suite(void) {
    tcase_add_test(full_update, test_adding_multiple_entries_causes_item_added_to_cache);
    tcase_add_test(full_update, test_adding_entry_causes_item_added_to_cache);
    tcase_add_test(full_update, test_adding_entry_causes_tokens_to_be_added_to_the_db);
+   tcase_add_test(full_update, test_adding_a_cached_entry_deleted_from_the_catalog_adds_it_again);
+
+  TCase *tokenizer_pool = tcase_create("tokenizer pool");
+  tcase_add_checked_fixture(tokenizer_pool, setup_tokenizer_pool, teardown_full_update);
+  tcase_set_timeout(tokenizer_pool, 5);
+  tcase_add_test(tokenizer_pool, test_adding_entry_with_tokenizer_threads_causes_item_added_to_cache);
+  tcase_add_test(tokenizer_pool, test_freeing_with_tokenizer_threads_saves_the_tokens_of_queued_entries);
+  tcase_add_test(tokenizer_pool, test_starting_tokenizer_threads_tokenizes_entries_missing_their_tokens);
  
   TCase *purging = tcase_create("purging");
   tcase_add_checked_fixture(purging, setup_purging, teardown_purging);
@@ -906,13 +2043,68 @@ item_cache_suite(void) {
   tcase_add_test(purging, test_purging_half_of_the_cache);
   tcase_add_test(purging, test_purging_entire_cache_with_multiple_items);
   tcase_add_test(purging, test_purging_half_cache_with_multiple_items_from_thread);
+  tcase_add_test(purging, test_purging_many_items_only_removes_the_old_ones);
+  tcase_add_test(purging, test_purging_unindexes_every_old_item);
+  tcase_add_test(purging, test_purging_removes_whole_days_of_old_items);
   tcase_add_test(purging, test_purge_loaded_cache_doesnt_crash);
 
+  TCase *snapshot = tcase_create("snapshot");
+  tcase_add_checked_fixture(snapshot, setup_snapshot, teardown_snapshot);
+  tcase_add_test(snapshot, test_load_writes_a_snapshot);
+  tcase_add_test(snapshot, test_load_from_snapshot_doesnt_need_the_token_database);
+  tcase_add_test(snapshot, test_load_from_snapshot_has_the_same_items);
+  tcase_add_test(snapshot, test_load_from_snapshot_has_the_same_random_background);
+  tcase_add_test(snapshot, test_load_from_snapshot_loads_new_items_from_the_database);
+  tcase_add_test(snapshot, test_load_from_snapshot_reloads_entries_updated_since_the_snapshot);
+  tcase_add_test(snapshot, test_load_from_snapshot_reloads_only_the_updated_entries_in_their_key_range);
+  tcase_add_test(snapshot, test_load_from_snapshot_drops_entries_deleted_since_the_snapshot);
+  tcase_add_test(snapshot, test_corrupt_snapshot_is_ignored);
+  tcase_add_test(snapshot, test_snapshot_created_with_different_options_is_ignored);
+
+  TCase *write_batching = tcase_create("write batching");
+  tcase_add_checked_fixture(write_batching, setup_write_batching, teardown_write_batching);
+  tcase_add_test(write_batching, test_async_write_isnt_visible_until_the_batch_is_committed);
+  tcase_add_test(write_batching, test_async_write_is_fetchable_from_the_item_cache_before_it_is_committed);
+  tcase_add_test(write_batching, test_async_write_is_queued_for_the_cache_once_the_batch_is_committed);
+  tcase_add_test(write_batching, test_waiting_write_is_committed_when_add_entry_returns);
+  tcase_add_test(write_batching, test_journal_mode_is_set);
+  tcase_add_test(write_batching, test_invalid_pragma_value_fails_create);
+
+  TCase *garbage_collection = tcase_create("garbage collection");
+  tcase_add_checked_fixture(garbage_collection, setup_garbage_collection, teardown_garbage_collection);
+  tcase_add_test(garbage_collection, test_collecting_garbage_deletes_unused_tokens);
+  tcase_add_test(garbage_collection, test_collecting_garbage_keeps_used_tokens);
+  tcase_add_test(garbage_collection, test_collecting_garbage_without_expire_days_keeps_entries);
+  tcase_add_test(garbage_collection, test_collecting_garbage_deletes_expired_entries_except_the_random_background);
+  tcase_add_test(garbage_collection, test_collecting_garbage_deletes_the_atom_and_tokens_of_expired_entries);
+  tcase_add_test(garbage_collection, test_collecting_garbage_doesnt_expire_entries_within_load_items_since);
+  tcase_add_test(garbage_collection, test_saving_an_item_with_a_collected_token_restores_it);
+  tcase_add_test(garbage_collection, test_a_collected_token_is_given_a_new_atom);
+  tcase_add_test(garbage_collection, test_collecting_garbage_again_forgets_the_tokens_collected_by_the_last_pass);
+
+  TCase *token_counts = tcase_create("token counts");
+  tcase_add_checked_fixture(token_counts, setup_cache, teardown_item_cache);
+  tcase_add_test(token_counts, test_counting_tokens_records_the_token_count_of_every_entry);
+  tcase_add_test(token_counts, test_counted_tokens_match_the_tokens_of_the_item);
+  tcase_add_test(token_counts, test_load_respects_min_tokens_after_counting_tokens);
+  tcase_add_test(token_counts, test_load_skips_entries_with_a_token_count_below_min_tokens);
+  tcase_add_test(token_counts, test_saving_an_item_records_its_token_count);
+
+  TCase *clustering = tcase_create("clustering");
+  tcase_add_checked_fixture(clustering, setup_cache, teardown_item_cache);
+  tcase_add_test(clustering, test_clustering_keeps_every_item);
+  tcase_add_test(clustering, test_clustering_frees_the_pages_of_deleted_tokens);
+
   TCase *atomization = tcase_create("atomization");
   tcase_add_checked_fixture(atomization, setup_modification, teardown_modification);
   tcase_add_test(atomization, test_atomize_a_token);
   tcase_add_test(atomization, test_atomize_a_new_token);
   tcase_add_test(atomization, test_globalize_a_token);
+  tcase_add_test(atomization, test_atomize_doesnt_need_the_tokens_table_once_loaded);
+  tcase_add_test(atomization, test_new_tokens_are_saved_when_the_item_cache_is_freed);
+  tcase_add_test(atomization, test_new_tokens_are_saved_when_an_item_is_saved);
+  tcase_add_test(atomization, test_new_token_is_saved_with_another_id_when_its_atom_is_taken);
+  tcase_add_test(atomization, test_new_token_uses_the_saved_id_when_its_token_is_already_saved);
   tcase_add_test(atomization, test_globalize_a_missing_token_returns_NULL);
   tcase_add_test(atomization, test_globalize_a_new_token);
 
@@ -924,8 +2116,14 @@ item_cache_suite(void) {
   suite_add_tcase(s, modification);
   suite_add_tcase(s, loaded_modification);
   suite_add_tcase(s, full_update);
+  suite_add_tcase(s, tokenizer_pool);
   suite_add_tcase(s, purging);
   suite_add_tcase(s, atomization);
+  suite_add_tcase(s, write_batching);
+  suite_add_tcase(s, garbage_collection);
+  suite_add_tcase(s, token_counts);
+  suite_add_tcase(s, clustering);
+  suite_add_tcase(s, snapshot);
   return s;
 }
 
@@ -0,0 +1,51 @@
+/*
+ * File:   query_value.h
+ *
+ * Reads single values out of the test databases so tests can check what
+ * was written without going through the code under test.
+ */
+
+#ifndef _QUERY_VALUE_H
+#define	_QUERY_VALUE_H
+
+#include <stdarg.h>
+#include <sqlite3.h>
+
+/* Returns the first column of the first row of the query, or -1 if it
+ * returns no rows. The sql is formatted with sqlite3_vmprintf so use %Q
+ * for strings.
+ */
+static double vquery_value(const char * db_file, const char * format, va_list args) {
+  double value = -1;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  char *sql = sqlite3_vmprintf(format, args);
+
+  sqlite3_open_v2(db_file, &db, SQLITE_OPEN_READONLY, NULL);
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (SQLITE_ROW == sqlite3_step(stmt)) {
+    value = sqlite3_column_double(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  sqlite3_free(sql);
+  return value;
+}
+
+static double query_value(const char * db_file, const char * format, ...) {
+  va_list args;
+  va_start(args, format);
+  double value = vquery_value(db_file, format, args);
+  va_end(args);
+  return value;
+}
+
+static int query_int(const char * db_file, const char * format, ...) {
+  va_list args;
+  va_start(args, format);
+  int value = (int) vquery_value(db_file, format, args);
+  va_end(args);
+  return value;
+}
+
+#endif	/* _QUERY_VALUE_H */